@@ -0,0 +1,105 @@
+/*
+ *  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef ADV_HEADER_H
+#define ADV_HEADER_H
+
+#include <stdbool.h>
+
+/* AD types (Core Specification Supplement, part A) */
+#define ADV_TYPE_FLAGS			0x01
+#define ADV_TYPE_UUID16_SOME		0x02
+#define ADV_TYPE_UUID16_ALL		0x03
+#define ADV_TYPE_UUID32_SOME		0x04
+#define ADV_TYPE_UUID32_ALL		0x05
+#define ADV_TYPE_UUID128_SOME		0x06
+#define ADV_TYPE_UUID128_ALL		0x07
+#define ADV_TYPE_NAME_SHORT		0x08
+#define ADV_TYPE_NAME_COMPLETE		0x09
+#define ADV_TYPE_TX_POWER		0x0a
+#define ADV_TYPE_SVC_DATA16		0x16
+#define ADV_TYPE_APPEARANCE		0x19
+#define ADV_TYPE_SVC_DATA32		0x20
+#define ADV_TYPE_SVC_DATA128		0x21
+#define ADV_TYPE_MANUFACTURER		0xff
+
+#define ADV_UUID128_LEN			16
+
+/*
+ * Parsed advertising data, sent along with the raw data in scan results:
+ * [present(le16) | entry...], entry: [kind(u8) | len(u8) | value]
+ *
+ * Entries come in kind order, bit n of present is set when an entry of
+ * kind n follows. Service and manufacturer data may appear several
+ * times; UUID lists of an advertising report and its scan response are
+ * merged, into one entry as long as it stays under 256 bytes.
+ */
+enum adv_rec_kind {
+	ADV_REC_FLAGS = 0,	/* [flags(u8)] */
+	ADV_REC_NAME,		/* complete local name, shortened otherwise */
+	ADV_REC_UUID16,		/* [uuid(le16)]... */
+	ADV_REC_UUID32,		/* [uuid(le32)]... */
+	ADV_REC_UUID128,	/* [uuid(16 bytes, le)]... */
+	ADV_REC_SVC_DATA16,	/* [uuid(le16) | data] */
+	ADV_REC_SVC_DATA32,	/* [uuid(le32) | data] */
+	ADV_REC_SVC_DATA128,	/* [uuid(16 bytes, le) | data] */
+	ADV_REC_MANUFACTURER,	/* [company(le16) | data] */
+	ADV_REC_TX_POWER,	/* [tx power(s8)] */
+	ADV_REC_APPEARANCE,	/* [appearance(le16)] */
+	ADV_REC_MAX,	/* must be last element */
+};
+
+#define ADV_REC_HDR_LEN		2
+/* a record never outgrows the data it comes from */
+#define ADV_REC_LEN(eir_len)	(ADV_REC_HDR_LEN + (eir_len))
+
+/*
+ * Expanding a 16 or 32 bits UUID over the Bluetooth base UUID; 128 bits
+ * UUIDs are copied. Every UUID is little endian, as over the air.
+ *
+ * @uuid: UUID
+ * @len: UUID length (2, 4 or 16)
+ * @out: 128 bits UUID
+ */
+uint8_t adv_uuid_to128(const uint8_t *uuid, uint8_t len,
+		       uint8_t out[ADV_UUID128_LEN]);
+/*
+ * Looking for any of @uuids in the service UUID fields of advertising
+ * data, as the kernel service discovery filter does
+ *
+ * @eir: advertising data
+ * @eir_len: advertising data length
+ * @uuids: 128 bits UUIDs (little endian)
+ * @uuid_count: number of UUIDs
+ */
+bool adv_has_uuid(const uint8_t *eir, uint16_t eir_len,
+		  const uint8_t (*uuids)[ADV_UUID128_LEN],
+		  uint16_t uuid_count);
+/*
+ * Parsing advertising data into a record, cf enum adv_rec_kind; badly
+ * formatted data ends the parsing, fields parsed so far are kept
+ *
+ * @eir: advertising data
+ * @eir_len: advertising data length
+ * @rec: record
+ * @rec_size: record buffer size, ADV_REC_LEN(@eir_len) is enough
+ *
+ * Returns the record length
+ */
+uint16_t adv_parse(const uint8_t *eir, uint16_t eir_len, uint8_t *rec,
+		   uint16_t rec_size);
+
+#endif /* ADV_HEADER_H */
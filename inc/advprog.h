@@ -0,0 +1,107 @@
+/*
+ *  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef ADVPROG_HEADER_H
+#define ADVPROG_HEADER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Advertising data matcher: a small program, BPF alike, run over the AD
+ * structures of each advertising report before it is serialized.
+ *
+ * Registers: A accumulator, X offset of the current field data, L length
+ * of the current field data. Until a field is found, the current field
+ * is the whole advertising data. Loads are bound to the current field; a
+ * load out of it ends the program and drops the report.
+ *
+ * Jumps are forward only and every program ends with ADVPROG_RET, so a
+ * program runs each instruction at most once.
+ *
+ * Wire format of an instruction (8 bytes):
+ * [op(u8) | jt(u8) | jf(u8) | reserved(u8) | k(le32)]
+ */
+enum advprog_op {
+	ADVPROG_RET = 0,	/* return k; 0: drop, forward otherwise */
+	ADVPROG_FIND,		/* first field of AD type k: jt, none: jf */
+	ADVPROG_FIND_NEXT,	/* same, after the current field */
+	ADVPROG_LD_B,		/* A = data[X + k] */
+	ADVPROG_LD_H,		/* A = le16 at data[X + k] */
+	ADVPROG_LD_HBE,		/* A = be16 at data[X + k] */
+	ADVPROG_LD_W,		/* A = le32 at data[X + k] */
+	ADVPROG_LD_LEN,		/* A = L */
+	ADVPROG_AND,		/* A &= k */
+	ADVPROG_RSH,		/* A >>= k, k < 32 */
+	ADVPROG_JA,		/* skip k instructions */
+	ADVPROG_JEQ,		/* A == k: jt, jf otherwise */
+	ADVPROG_JGT,		/* A > k: jt, jf otherwise */
+	ADVPROG_JGE,		/* A >= k: jt, jf otherwise */
+	ADVPROG_JSET,		/* A & k: jt, jf otherwise */
+	ADVPROG_OP_MAX,	/* must be last element */
+};
+
+#define ADVPROG_INSN_LEN	8
+#define ADVPROG_INSN_MAX	64
+
+/*
+ * @op: operation (enum advprog_op)
+ * @jt: instructions skipped when the condition holds
+ * @jf: instructions skipped otherwise
+ * @k: operand
+ */
+struct advprog_insn {
+	uint8_t op;
+	uint8_t jt;
+	uint8_t jf;
+	uint32_t k;
+};
+
+/*
+ * @len: number of instructions, 0: no program
+ * @insn: instructions
+ */
+struct advprog {
+	uint16_t len;
+	struct advprog_insn insn[ADVPROG_INSN_MAX];
+};
+
+/*
+ * Decoding and verifying a program; @prog is left empty when rejected
+ *
+ * Rejected: empty or over ADVPROG_INSN_MAX instructions, unknown
+ * operation, jump out of the program, shift of 32 bits or more, last
+ * instruction not ADVPROG_RET.
+ *
+ * @data: instructions, wire format
+ * @data_len: data length, multiple of ADVPROG_INSN_LEN
+ * @prog: decoded program
+ */
+uint8_t advprog_load(const uint8_t *data, uint16_t data_len,
+		     struct advprog *prog);
+/*
+ * Running a verified program over advertising data
+ *
+ * @prog: program
+ * @eir: advertising data
+ * @eir_len: advertising data length
+ *
+ * Returns true when the report is forwarded
+ */
+bool advprog_run(const struct advprog *prog, const uint8_t *eir,
+		 uint16_t eir_len);
+
+#endif /* ADVPROG_HEADER_H */
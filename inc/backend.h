@@ -0,0 +1,91 @@
+/*
+ *  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef BACKEND_HEADER_H
+#define BACKEND_HEADER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "lib/bluetooth.h"
+
+/*
+ * mgmt command completion, same as mgmt_request_func_t
+ *
+ * @status: MGMT_STATUS_*
+ * @length: response length
+ * @param: response parameters
+ */
+typedef void (*backend_rsp_cb)(uint8_t status, uint16_t length,
+			       const void *param, void *user_data);
+
+/*
+ * Controller access: the kernel (mgmt socket, L2CAP) or a model of it
+ *
+ * mgmt events of the adapters registered are handed to cmd_mgmt_event();
+ * the ATT bearer returned by @att_connect is driven by bt_att and
+ * bt_gatt_client the same way whichever the backend.
+ *
+ * @name: backend name
+ * @init: opening the backend
+ * @close: closing it, pending commands dropped
+ * @mgmt_register: delivering @event of adapter @index
+ * @mgmt_unregister_index: no more events of adapter @index
+ * @mgmt_cancel_index: dropping pending commands of adapter @index
+ * @mgmt_send: queuing a mgmt command, 0 on failure
+ * @devba: address of adapter @index, < 0 on failure
+ * @att_connect: ATT bearer to @dst, < 0 on failure; the connection may
+ *               still be in progress, the bearer becomes writable once
+ *               established (or failed, cf SO_ERROR)
+ */
+struct backend_ops {
+	const char *name;
+	uint8_t (*init)(void);
+	void (*close)(void);
+	bool (*mgmt_register)(uint16_t event, uint16_t index);
+	void (*mgmt_unregister_index)(uint16_t index);
+	void (*mgmt_cancel_index)(uint16_t index);
+	unsigned int (*mgmt_send)(uint16_t opcode, uint16_t index,
+				  uint16_t length, const void *param,
+				  backend_rsp_cb cb, void *user_data);
+	int (*devba)(uint16_t index, bdaddr_t *ba);
+	int (*att_connect)(uint16_t index, const bdaddr_t *dst,
+			   uint8_t dst_type, int sec);
+};
+
+/* kernel backend, used by default */
+extern const struct backend_ops backend_hci;
+
+/*
+ * Selecting the backend, before backend_init()
+ *
+ * @ops: backend
+ */
+uint8_t backend_select(const struct backend_ops *ops);
+uint8_t backend_init(void);
+void backend_close(void);
+
+bool backend_mgmt_register(uint16_t event, uint16_t index);
+void backend_mgmt_unregister_index(uint16_t index);
+void backend_mgmt_cancel_index(uint16_t index);
+unsigned int backend_mgmt_send(uint16_t opcode, uint16_t index,
+			       uint16_t length, const void *param,
+			       backend_rsp_cb cb, void *user_data);
+int backend_devba(uint16_t index, bdaddr_t *ba);
+int backend_att_connect(uint16_t index, const bdaddr_t *dst,
+			uint8_t dst_type, int sec);
+
+#endif /* BACKEND_HEADER_H */
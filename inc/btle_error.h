@@ -29,6 +29,7 @@ enum btle_error {
 	BTLE_ERROR_EMPTY,
 	BTLE_ERROR_MEMORY,
 	BTLE_ERROR_NOT_IMPLEMENTED,
+	BTLE_ERROR_CANCELED,
 };
 
 #endif /* BTLE_ERROR_H */
@@ -17,24 +17,66 @@
 #ifndef BTLOG_HEADER_H
 #define BTLOG_HEADER_H
 
-
+#include <stdint.h>
 #include <stdarg.h>
 
 #ifndef MODULE
-#error "please defined MODULE before #include "bt_log.h""
+#error "please defined MODULE before #include "btlog.h""
+#endif
+
+enum btlog_level {
+	BTLOG_ERR = 0,
+	BTLOG_WARNING,
+	BTLOG_INFO,
+	BTLOG_DBG,
+};
+
+/*
+ * Most verbose level compiled in; calls above it are optimized out.
+ * Set from the Makefile: make BTLOG_LEVEL=BTLOG_DBG
+ */
+#ifndef BTLOG_LEVEL
+#define BTLOG_LEVEL BTLOG_DBG
 #endif
 
+/* most verbose level printed at run time; see bt_log_set_level() */
+extern uint8_t bt_log_level;
 
+/*
+ * Starting the background flusher. Until then, and after bt_log_close(),
+ * lines are printed synchronously.
+ */
 uint8_t bt_log_init(void);
+/*
+ * Printing pending lines and stopping the flusher
+ */
 uint8_t bt_log_close(void);
+/*
+ * Changing the run time level (at most BTLOG_LEVEL takes effect)
+ *
+ * @level: one of @btlog_level
+ */
+uint8_t bt_log_set_level(uint8_t level);
+/*
+ * Queuing a line; formatted in place, timestamped and written to stdout
+ * by the flusher. Must only be called from the main loop thread.
+ *
+ * @level: one of @btlog_level
+ * @module: static string naming the caller
+ * @format: printf format
+ */
+void bt_log(uint8_t level, const char *module, const char *format, ...)
+	__attribute__((format(printf, 3, 4)));
 
-void bt_log(const char *format, ...);
-
-#define BT_LOG(format, ...) 		bt_log("%s " format, MODULE, ##__VA_ARGS__)
+#define BT_LOG(level, format, ...)					\
+	do {								\
+		if ((level) <= BTLOG_LEVEL && (level) <= bt_log_level)	\
+			bt_log(level, MODULE, format, ##__VA_ARGS__);	\
+	} while (0)
 
-#define BT_LOG_INFO(format, ...) 	BT_LOG("%s " format, "[I]", ##__VA_ARGS__)
-#define BT_LOG_ERR(format, ...) 	BT_LOG("%s " format, "[E]", ##__VA_ARGS__)
-#define BT_LOG_WARNING(format, ...) BT_LOG("%s " format, "[W]", ##__VA_ARGS__)
-#define BT_LOG_DBG(format, ...) 	BT_LOG("%s " format, "[D]", ##__VA_ARGS__)
+#define BT_LOG_INFO(format, ...) 	BT_LOG(BTLOG_INFO, format, ##__VA_ARGS__)
+#define BT_LOG_ERR(format, ...) 	BT_LOG(BTLOG_ERR, format, ##__VA_ARGS__)
+#define BT_LOG_WARNING(format, ...) BT_LOG(BTLOG_WARNING, format, ##__VA_ARGS__)
+#define BT_LOG_DBG(format, ...) 	BT_LOG(BTLOG_DBG, format, ##__VA_ARGS__)
 
 #endif /* BTLOG_HEADER_H */
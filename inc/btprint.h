@@ -17,19 +17,14 @@
 #ifndef BT_PRINT_HEADER_H
 #define BT_PRINT_HEADER_H
 
-#include <stdarg.h>
-
 #ifndef MODULE
 #error "please defined MODULE before #include "btprint.h""
 #endif
 
+#include "btlog.h"
 
-void btprint(const char *format, ...);
-
-#define BTPRINT(format, ...) 		btprint("%s " format, MODULE, ##__VA_ARGS__)
-
-#define INFO(format, ...) 			BTPRINT("%s " format, "[I]", ##__VA_ARGS__)
-#define ERR(format, ...) 			BTPRINT("%s " format, "[E]", ##__VA_ARGS__)
-#define BT_PR_WARNING(format, ...) 	BTPRINT("%s " format, "[W]", ##__VA_ARGS__)
-#define DBG(format, ...) 			BTPRINT("%s " format, "[D]", ##__VA_ARGS__)
+#define INFO(format, ...) 			BT_LOG_INFO(format, ##__VA_ARGS__)
+#define ERR(format, ...) 			BT_LOG_ERR(format, ##__VA_ARGS__)
+#define BT_PR_WARNING(format, ...) 	BT_LOG_WARNING(format, ##__VA_ARGS__)
+#define DBG(format, ...) 			BT_LOG_DBG(format, ##__VA_ARGS__)
 #endif /* BT_PRINT_HEADER_H */
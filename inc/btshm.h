@@ -0,0 +1,110 @@
+/*
+ *  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef BTSHM_HEADER_H
+#define BTSHM_HEADER_H
+
+/*
+ * Shared memory event ring
+ *
+ * Single producer (daemon) / single consumer (client) ring living in a
+ * memfd, mapped by both sides. Records are IPC frames
+ * [type(u8) | data_len(le16) | data], each one starting on a 4 bytes
+ * boundary. A frame never wraps: when it does not fit before the end of
+ * the ring, a BTSHM_PAD frame fills the remaining bytes.
+ *
+ * Consumer side:
+ *  - read frames from tail to head (acquire load of head), then release
+ *    store the new tail;
+ *  - before sleeping, store wait = 1, issue a full barrier, check head
+ *    again and only then block on read(eventfd).
+ * The daemon writes to the eventfd only when wait is set.
+ */
+
+#define BTSHM_MAGIC		0x4D485342	/* "BSHM" */
+#define BTSHM_PAD		0xFF		/* frame type of padding */
+#define BTSHM_ALIGN		4
+#define BTSHM_SIZE_MIN		(4 * 1024)
+#define BTSHM_SIZE_MAX		(16 * 1024 * 1024)
+
+/*
+ * Ring header, at offset 0 of the memfd; data follows at BTSHM_DATA_OFFSET
+ *
+ * @magic: BTSHM_MAGIC
+ * @size: data area size in bytes (power of 2)
+ * @head: producer index (free running), written by the daemon
+ * @dropped: frames dropped by the daemon because the ring was full
+ * @tail: consumer index (free running), written by the client
+ * @wait: set by the client before waiting on the eventfd
+ */
+struct btshm_hdr {
+	uint32_t magic;
+	uint32_t size;
+	uint8_t reserved0[56];
+
+	uint32_t head;
+	uint32_t dropped;
+	uint8_t reserved1[56];
+
+	uint32_t tail;
+	uint32_t wait;
+	uint8_t reserved2[120];
+};
+
+#define BTSHM_DATA_OFFSET	(sizeof(struct btshm_hdr))
+
+struct btshm;
+struct iovec;
+
+/*
+ * Creating a ring
+ *
+ * @size: data area size (power of 2, BTSHM_SIZE_MIN..BTSHM_SIZE_MAX)
+ * @shm: filled with the new ring on success
+ */
+uint8_t btshm_new(uint32_t size, struct btshm **shm);
+/*
+ * Descriptors to hand over to the consumer
+ *
+ * @shm: ring
+ * @memfd: filled with the memfd backing the ring
+ * @evtfd: filled with the doorbell eventfd
+ */
+void btshm_get_fds(struct btshm *shm, int *memfd, int *evtfd);
+/*
+ * Closing the memfd once handed over; the mapping is kept
+ *
+ * @shm: ring
+ */
+void btshm_release_memfd(struct btshm *shm);
+/*
+ * Writing one IPC frame, gathered from @iov, into the ring.
+ * BTLE_ERROR_MEMORY: ring full, the frame is dropped;
+ * BTLE_ERROR_INVALID_STATE: the consumer corrupted the ring header
+ *
+ * @shm: ring
+ * @iov: frame pieces
+ * @iovcnt: number of pieces
+ */
+uint8_t btshm_writev(struct btshm *shm, const struct iovec *iov, int iovcnt);
+/*
+ * Unmapping and freeing a ring
+ *
+ * @shm: ring
+ */
+void btshm_free(struct btshm *shm);
+
+#endif /* BTSHM_HEADER_H */
@@ -17,24 +17,57 @@
 #ifndef BTSOCKET_HEADER_H
 #define BTSOCKET_HEADER_H
 
-#define SOCKET_MTU	128
+#define SOCKET_MTU	2048
+
+/* client identifier never given to a connected client */
+#define BTSOCKET_CID_INVALID	0
+/* returned by the reception callback: stream corrupted, closing it */
+#define BTSOCKET_RX_INVALID	0xFFFF
+/* event mask of a newly connected client */
+#define BTSOCKET_MASK_ALL	0xFFFFFFFF
+
+struct iovec;
 
 /*
  * on IPC reception callback
  *
+ * @cid: identifier of the client the data comes from
  * @data: pointer to data received
  * @data_len: data length
+ *
+ * returns the number of bytes consumed; remaining bytes are passed again
+ * once more data has been received. BTSOCKET_RX_INVALID drops the
+ * connection.
  */
-typedef void (*socket_rx_notifier)(uint8_t *data, uint8_t data_len);
+typedef uint16_t (*socket_rx_notifier)(uint16_t cid, uint8_t *data,
+				       uint16_t data_len);
 /*
  * Socket initialization parameters
  *
- * @mtu: Maximum Transmit Unit
+ * @mtu: Maximum Transmit Unit (biggest frame, sent to client on connection)
  * @rx_cb: Rx notifier
+ * @tx_size: per client transmit ring size (power of 2, >= @mtu)
+ * @tx_high_wm: pending bytes above which events are dropped for a client
+ * @tx_low_wm: pending bytes below which events are forwarded again
  */
 struct btsocket_param {
 	uint16_t mtu;
 	socket_rx_notifier rx_cb;
+	uint32_t tx_size;
+	uint32_t tx_high_wm;
+	uint32_t tx_low_wm;
+};
+/*
+ * Per client transmit statistics
+ *
+ * @pending: bytes waiting in the transmit ring
+ * @overflow: frames dropped because the transmit ring was full
+ * @dropped: events dropped while above high watermark
+ */
+struct btsocket_stats {
+	uint32_t pending;
+	uint32_t overflow;
+	uint32_t dropped;
 };
 /*
  * IPC socket initialization
@@ -43,12 +76,70 @@ struct btsocket_param {
  */
 uint8_t btsocket_init(struct btsocket_param *param);
 /*
- * Sending payload over IPC socket
+ * Sending payload to one client over IPC socket
  *
+ * @cid: client identifier
  * @data: pointer to data
  * @data_len: data length
  */
-uint8_t btsocket_send(uint8_t *data, uint8_t data_len);
+uint8_t btsocket_send(uint16_t cid, uint8_t *data, uint16_t data_len);
+/*
+ * Sending a payload gathered from several buffers to one client
+ *
+ * @cid: client identifier
+ * @iov: buffers, sent in order
+ * @iovcnt: number of buffers
+ */
+uint8_t btsocket_sendv(uint16_t cid, const struct iovec *iov, int iovcnt);
+/*
+ * Sending payload to every client whose event mask matches @mask.
+ * Clients owning a shared memory ring get it there instead of the socket.
+ *
+ * @mask: event bit(s) the payload belongs to
+ * @iov: buffers, sent in order
+ * @iovcnt: number of buffers
+ */
+uint8_t btsocket_broadcastv(uint32_t mask, const struct iovec *iov,
+			    int iovcnt);
+/*
+ * Moving event delivery of a client to a shared memory ring. @data is
+ * sent as a regular frame carrying the memfd and eventfd (SCM_RIGHTS).
+ *
+ * @cid: client identifier
+ * @size: ring size (power of 2)
+ * @data: reply frame
+ * @data_len: reply frame length
+ */
+uint8_t btsocket_shm_attach(uint16_t cid, uint32_t size, uint8_t *data,
+			    uint16_t data_len);
+/*
+ * Reading transmit statistics of a client
+ *
+ * @cid: client identifier
+ * @stats: filled on success
+ */
+uint8_t btsocket_get_stats(uint16_t cid, struct btsocket_stats *stats);
+/*
+ * Selecting events forwarded to a client
+ *
+ * @cid: client identifier
+ * @mask: event bits the client is interested in
+ */
+uint8_t btsocket_set_mask(uint16_t cid, uint32_t mask);
+/*
+ * Selecting the command parameters encoding of a client; a newly
+ * connected client starts with 0
+ *
+ * @cid: client identifier
+ * @version: encoding version
+ */
+uint8_t btsocket_set_param_version(uint16_t cid, uint8_t version);
+/*
+ * Reading the command parameters encoding of a client, 0 if unknown
+ *
+ * @cid: client identifier
+ */
+uint8_t btsocket_get_param_version(uint16_t cid);
 /*
  * Closing IPC socket
  *
@@ -22,36 +22,150 @@
 enum cmds {
 	CMD_MGMT_GET_DEVICE_INFO = 0,	/* [devid] */
 	CMD_MGMT_RESET,					/* [devid] */
-	CMD_MGMT_POWER,					/* [devid] (mode(u8)=0:off, 1:on) */
-	CMD_MGMT_SET_LOCAL_NAME,		/* [devid | len(u8) < 31bytes | data] */
-	CMD_MGMT_SET_CONNECTION_PARAM, 	/* [devid | addr | addrtype | min(u8) | max(u8)| interval(u8) | timeout(u16)] */
-	CMD_MGMT_SCAN,					/* [devid | (mode(u8)=0:stop, 1:start) | timeout_ms(u16)] */
+	CMD_MGMT_POWER,					/* [devid | struct cmd_param_power] */
+	CMD_MGMT_SET_LOCAL_NAME,		/* [devid | struct cmd_param_local_name] */
+	CMD_MGMT_SET_CONNECTION_PARAM, 	/* [devid | struct cmd_param_conn_param] */
+	CMD_MGMT_SCAN,					/* [devid | (mode(u8)=0:stop, 1:start) | timeout_ms(u16) | options] cf scan.h */
 	CMD_MGMT_READ_CONTROLLER_INFO,	/* [devid] */
-	CMD_MGMT_CONNECT, 				/* [devid] | addr | addr_type */
+	CMD_MGMT_CONNECT, 				/* [devid | struct cmd_param_connect] response: [conn(le16)] */
 
-	CMD_GATTC_WRITE_CMD,			/* [devid | handle(u16) | data ] */
-	CMD_GATTC_WRITE_REQ,			/* [devid | handle(u16) | data ] */
-	CMD_GATTC_READ_REQ,				/* [devid | handle(u16)] */
-	CMD_GATTC_SUBSCRIBE_REQ,		/* [devid | handle(u16)] | value*/
-	CMD_GATTC_UNSUBSCRIBE_REQ,		/* [devid | handle(u16)] | cccd_id*/
+	CMD_GATTC_WRITE_CMD,			/* [devid | struct cmd_param_write] */
+	CMD_GATTC_WRITE_REQ,			/* [devid | struct cmd_param_write] */
+	CMD_GATTC_READ_REQ,				/* [devid | struct cmd_param_read] */
+	CMD_GATTC_SUBSCRIBE_REQ,		/* [devid | struct cmd_param_subscribe] */
+	CMD_GATTC_UNSUBSCRIBE_REQ,		/* [devid | struct cmd_param_unsubscribe] */
 
 	CMD_GATTS_ADD_SVC,
 	CMD_GATTS_ADD_CHARACTERISTIC,
 	CMD_GATTS_ADD_DESCRIPTOR,
+
+	CMD_SET_EVENT_MASK,				/* [devid | mask(le32)] bit n: event_type n */
+	CMD_SET_LOG_LEVEL,				/* [devid | level(u8)] 0:err 1:warning 2:info 3:debug */
+	CMD_SCAN_SET_PROGRAM,			/* [devid | insn(8 bytes)...] none: cleared, cf advprog.h */
+	CMD_DEVREG_SNAPSHOT,			/* [devid] response: [count(le16) | entry...] cf devreg.h */
+	CMD_DEVREG_SET_LOST_TIMEOUT,	/* [devid | lost_ms(le32)] 0: default */
+	CMD_SET_PARAM_VERSION,			/* [devid | version(u8)] response: [version(u8)] latest */
+	CMD_GATTC_CONNECT_CANCEL,		/* [devid | struct cmd_param_conn] */
+	CMD_GATTC_SET_CONNECT_TIMEOUT,	/* [devid | timeout_ms(le32)] 0: default */
+	CMD_GATTC_DB_DUMP,				/* [devid | struct cmd_param_db_dump] response: [next(le16) | record...] cf gattc.h */
+	CMD_GATTC_READ_MULTIPLE,		/* [devid | struct cmd_param_read_multiple] response: [count(u8) | value...] cf gattc.h */
 	CMD_MAX, /* must be last element */
 };
 
+/*
+ * Parameters encoding, selected per client with CMD_SET_PARAM_VERSION
+ *
+ * CMD_PARAM_VERSION_TEXT: addresses as "XX:XX:XX:XX:XX:XX" strings,
+ * handles big endian; what a client gets until it selects another one.
+ * The daemon converts such parameters to the binary layouts below.
+ * CMD_PARAM_VERSION_BINARY: struct cmd_param_* layouts, addresses
+ * (6 bytes) and integers little endian. The layouts are part of the
+ * protocol: their size is checked at build time, cf cmd_table.
+ * CMD_PARAM_VERSION_CONN: binary, GATT commands starting with the
+ * connection handle. Clients of the previous versions, which do not give
+ * it, address CMD_CONN_ANY.
+ * CMD_PARAM_VERSION_MTU: CMD_MGMT_CONNECT ends with the ATT MTU requested,
+ * the default one for clients of the previous versions.
+ */
+#define CMD_PARAM_VERSION_TEXT		0
+#define CMD_PARAM_VERSION_BINARY	1
+#define CMD_PARAM_VERSION_CONN		2
+#define CMD_PARAM_VERSION_MTU		3
+#define CMD_PARAM_VERSION		CMD_PARAM_VERSION_MTU /* latest */
+
+/*
+ * Connection handles, returned by CMD_MGMT_CONNECT and carried by the
+ * GATT commands and events; unique per adapter while connected
+ */
+#define CMD_CONN_MAX	16	/* connections per adapter */
+#define CMD_CONN_ANY	0	/* the first established connection */
+
+struct cmd_param_power {
+	uint8_t mode;		/* 0: off, 1: on */
+} __attribute__((packed));
+
+#define CMD_LOCAL_NAME_MAX	30
+
+/* followed by exactly @len bytes of name, up to CMD_LOCAL_NAME_MAX */
+struct cmd_param_local_name {
+	uint8_t len;
+	uint8_t name[0];
+} __attribute__((packed));
+
+struct cmd_param_connect {
+	uint8_t addr[6];
+	uint8_t addr_type;
+	uint8_t sec_level;	/* 0: default */
+	uint16_t mtu;		/* le16, ATT MTU requested, 23..517, 0: 23 */
+} __attribute__((packed));
+
+struct cmd_param_conn_param {
+	uint8_t addr[6];
+	uint8_t addr_type;
+	uint16_t min_interval;	/* le16 */
+	uint16_t max_interval;	/* le16 */
+	uint16_t latency;	/* le16 */
+	uint16_t timeout;	/* le16 */
+} __attribute__((packed));
+
+struct cmd_param_conn {
+	uint16_t conn;		/* le16 */
+} __attribute__((packed));
+
+struct cmd_param_read {
+	uint16_t conn;		/* le16 */
+	uint16_t handle;	/* le16 */
+} __attribute__((packed));
+
+/* followed by exactly @len bytes of value */
+struct cmd_param_write {
+	uint16_t conn;		/* le16 */
+	uint16_t handle;	/* le16 */
+	uint16_t len;		/* le16 */
+	uint8_t value[0];
+} __attribute__((packed));
+
+struct cmd_param_subscribe {
+	uint16_t conn;		/* le16 */
+	uint16_t handle;	/* le16, characteristic value handle */
+	uint8_t value;		/* GATT_NOTIFICATION... */
+} __attribute__((packed));
+
+struct cmd_param_unsubscribe {
+	uint16_t conn;		/* le16 */
+	uint8_t cccd_id;
+} __attribute__((packed));
+
+/* followed by exactly @count handles (le16) */
+struct cmd_param_read_multiple {
+	uint16_t conn;		/* le16 */
+	uint8_t mode;		/* GATTC_READ_SINGLE... */
+	uint8_t count;		/* up to GATTC_READ_MULTIPLE_MAX */
+	uint16_t handles[0];
+} __attribute__((packed));
+
+struct cmd_param_db_dump {
+	uint16_t conn;		/* le16 */
+	uint16_t start;		/* le16, first handle, 1: whole database */
+} __attribute__((packed));
+
 enum event_type {
 	EVENT_CONNECTED = 0,
-	EVENT_DISCONNECTED,
+	EVENT_DISCONNECTED,		/* [conn(le16) | reason str] */
 	EVENT_SCAN_STATUS,
 	EVENT_SCAN_RESULT,
 	EVENT_NEW_CONN_PARAM,
-	EVENT_GATTC_NOTIFICATION,
+	EVENT_GATTC_NOTIFICATION,	/* [conn(le16) | value_handle | len | cccd_id | value] */
 	EVENT_GATTC_INDICATION,
-	EVENT_GATTC_DISC_PRIMARY,
-	EVENT_GATTC_DISC_CHAR,
-	EVENT_GATTC_DISC_DESC,
+	EVENT_GATTC_DISC_PRIMARY,	/* [conn(le16) | service], [conn(le16)]: done */
+	EVENT_GATTC_DISC_CHAR,		/* [conn(le16) | characteristic] */
+	EVENT_GATTC_DISC_DESC,		/* [conn(le16) | descriptor] */
+	EVENT_SCAN_SUMMARY,		/* [last(u8) | count(u8) | dropped(le32), first frame only | device...] end of a timed scan */
+	EVENT_DEVICE_APPEARED,	/* [addr | addr_type | rssi] cf devreg.h */
+	EVENT_DEVICE_LOST,		/* [addr | addr_type | rssi] */
+	EVENT_SCAN_BATCH,		/* [count(u8) | (len(le16) | EVENT_SCAN_RESULT data)...] */
+	EVENT_GATTC_CONNECT_COMPLETE,	/* [status | conn(le16) | addr | addr_type | mtu(le16)] cf gattc.h */
+	EVENT_MAX, /* must be last element */
 };
 
 enum state {
@@ -61,34 +175,74 @@ enum state {
 	STATE_SCANNING,
 };
 
-struct client {
-	int fd;
-	struct bt_att *att;
-	struct gatt_db *db;
-	struct bt_gatt_client *gatt;
-
-	uint8_t cccd_id;
-};
+struct client;
 
 struct cmd_adaper {
 	enum state st;
 	uint8_t devId;
-	struct client * cli;
+	struct client *cli[CMD_CONN_MAX]; /* NULL: free, cf gattc.c */
+	uint16_t conn_last; /* last connection handle given */
+	int scan_timer; /* mainloop timeout stopping a timed scan, 0: none */
+	uint16_t scan_timeout_ms; /* scan being started, armed once it runs */
 };
 
-struct cmd_adaper * cmd_get_adapter_by_id(uint8_t devId);
+/*
+ * In flight command context, drawn from a pool by the dispatcher and
+ * released once the command has been answered
+ *
+ * @next: free list link
+ * @cid: client which issued the command
+ * @id: client chosen request identifier, echoed in the response
+ * @devId: adapter index
+ * @cmd: command type
+ * @param_len: parameters length
+ * @t_rx: receipt time (us)
+ * @t_backend: time the mgmt/ATT request was issued (us), 0 if none
+ */
+struct cmd_req {
+	struct cmd_req *next;
+	uint16_t cid;
+	uint16_t id;
+	uint8_t devId;
+	uint8_t cmd;
+	uint16_t param_len;
+	uint64_t t_rx;
+	uint64_t t_backend;
+};
 
-uint8_t cmd_strtou16(uint8_t *in, uint16_t *out);
+struct iovec;
 
-void cmd_send_status(uint8_t devId, uint8_t cmd, uint8_t ret);
+struct cmd_adaper * cmd_get_adapter_by_id(uint8_t devId);
 
-void cmd_send_status_msg(uint8_t devId, uint8_t cmd, uint8_t ret,
-						void *data, uint8_t data_len);
+/*
+ * Answering a command; @req goes back to the pool and must not be used
+ * afterwards. A handler returning an error must not answer: the
+ * dispatcher does it.
+ */
+void cmd_send_status(struct cmd_req *req, uint8_t ret);
+/*
+ * Stamping @req right before handing it to mgmt or ATT; the round trip
+ * is accounted once answered
+ */
+void cmd_req_backend(struct cmd_req *req);
+void cmd_send_status_msg(struct cmd_req *req, uint8_t ret, void *data,
+			 uint16_t data_len);
 void cmd_send_event(uint8_t devId, uint8_t evt_type);
 void cmd_send_event_msg(uint8_t devId, uint8_t evt_type,
-						void *data, uint8_t data_len);
+						void *data, uint16_t data_len);
+/* event payload gathered from up to IPC_IOV_MAX - 1 buffers */
+void cmd_send_event_msgv(uint8_t devId, uint8_t evt_type,
+			 const struct iovec *iov, int iovcnt);
+
+/*
+ * Handing a mgmt event to the daemon as if read from the kernel; used
+ * to replay captures
+ */
+void cmd_mgmt_event(uint16_t event, uint16_t index, uint16_t length,
+		    const void *param);
 
-uint8_t cmd_server_handler(uint8_t *data, uint8_t data_len);
+uint8_t cmd_server_handler(uint16_t cid, uint8_t *data, uint16_t data_len);
+uint8_t cmd_info_handler(uint16_t cid, uint8_t *data, uint16_t data_len);
 uint8_t cmd_server_init(void);
 void cmd_server_close(void);
 #endif /* CMD_HEADER_H */
@@ -0,0 +1,93 @@
+/*
+ *  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DEVREG_HEADER_H
+#define DEVREG_HEADER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DEVREG_MAX		256	/* devices remembered, all adapters */
+#define DEVREG_ADV_MAX		62	/* advertising data + scan response */
+#define DEVREG_LOST_MS		10000	/* default time before a device is lost */
+
+/*
+ * Snapshot entry, as sent in the CMD_DEVREG_SNAPSHOT response after a
+ * [count(le16)] header; most recently seen first. Ages are in ms.
+ */
+struct devreg_entry {
+	uint8_t addr[6];
+	uint8_t addr_type;
+	int8_t rssi;
+	int8_t best_rssi;
+	uint8_t present;
+	uint32_t first_seen;	/* le32, age */
+	uint32_t last_seen;	/* le32, age */
+	uint32_t count;		/* le32, reports */
+	uint8_t adv_len;
+	uint8_t adv[0];
+} __attribute__((packed));
+
+/*
+ * Presence event, EVENT_DEVICE_APPEARED and EVENT_DEVICE_LOST
+ */
+struct devreg_presence {
+	uint8_t addr[6];
+	uint8_t addr_type;
+	int8_t rssi;		/* last RSSI */
+} __attribute__((packed));
+
+/*
+ * Recording an advertising report; a device not seen so far is added,
+ * evicting the least recently seen one already lost when the table is
+ * full, and reported as appeared. It is reported as lost when not seen for
+ * the lost timeout. While every device is present, new ones are dropped.
+ *
+ * @devId: adapter index
+ * @addr: device address (little endian)
+ * @addr_type: address type
+ * @rssi: report RSSI
+ * @eir: advertising data, truncated to DEVREG_ADV_MAX bytes
+ * @eir_len: advertising data length
+ */
+void devreg_seen(uint8_t devId, const uint8_t *addr, uint8_t addr_type,
+		 int8_t rssi, const uint8_t *eir, uint16_t eir_len);
+/*
+ * Setting the time after which a device not seen is lost
+ *
+ * @lost_ms: timeout, 0: DEVREG_LOST_MS; 250ms at least
+ */
+void devreg_set_lost_timeout(uint32_t lost_ms);
+/*
+ * Writing the devices of an adapter, cf struct devreg_entry
+ *
+ * @devId: adapter index
+ * @buf: [count(le16) | entry...]; NULL to get the length needed
+ * @size: @buf size
+ *
+ * Returns the snapshot length
+ */
+uint16_t devreg_snapshot(uint8_t devId, uint8_t *buf, uint16_t size);
+/*
+ * Initializing the registry
+ */
+void devreg_init(void);
+/*
+ * Forgetting every device
+ */
+void devreg_close(void);
+
+#endif /* DEVREG_HEADER_H */
@@ -0,0 +1,122 @@
+/*
+ *  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DEVTAB_HEADER_H
+#define DEVTAB_HEADER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* circular doubly linked list, the head being a sentinel */
+struct devtab_link {
+	struct devtab_link *prev;
+	struct devtab_link *next;
+};
+
+#define devtab_entry_of(link, type, member) \
+	((type *)((uint8_t *)(link) - offsetof(type, member)))
+
+/*
+ * Initializing an empty list
+ */
+void devtab_link_init(struct devtab_link *head);
+/*
+ * Inserting @link after @head, at the front of the list
+ */
+void devtab_link_add(struct devtab_link *head, struct devtab_link *link);
+/*
+ * Unlinking @link; it is left as an empty list
+ */
+void devtab_link_del(struct devtab_link *link);
+
+/*
+ * Device entry, embedded in the structures a table holds
+ *
+ * @hnext: hash chain
+ * @lru: least recently used list link, most recent first
+ */
+struct devtab_dev {
+	struct devtab_dev *hnext;
+	struct devtab_link lru;
+	uint8_t addr[6];
+	uint8_t addr_type;
+	uint8_t devId;
+};
+
+/*
+ * Devices keyed by adapter, address and address type
+ *
+ * @bucket: hash buckets, @mask + 1 of them
+ * @mask: number of buckets - 1
+ * @lru: entries, most recently used first
+ * @count: number of entries
+ */
+struct devtab {
+	struct devtab_dev **bucket;
+	uint32_t mask;
+	struct devtab_link lru;
+	uint16_t count;
+};
+
+typedef bool (*devtab_match_func)(const struct devtab_dev *dev,
+				  void *user_data);
+
+/*
+ * Initializing an empty table
+ *
+ * @tab: table
+ * @bucket: hash buckets, owned by the caller
+ * @size: number of buckets, power of 2
+ */
+void devtab_init(struct devtab *tab, struct devtab_dev **bucket,
+		 uint32_t size);
+/*
+ * Hash key of a device, computed once for a lookup and an insertion
+ */
+uint32_t devtab_key(uint8_t devId, const uint8_t *addr, uint8_t addr_type);
+/*
+ * Looking a device up; NULL if not in the table
+ *
+ * @key: devtab_key() of the device
+ */
+struct devtab_dev *devtab_lookup(struct devtab *tab, uint32_t key,
+				 uint8_t devId, const uint8_t *addr,
+				 uint8_t addr_type);
+/*
+ * Adding a device, as the most recently used; @dev is not in a table
+ *
+ * @key: devtab_key() of the device
+ */
+void devtab_insert(struct devtab *tab, struct devtab_dev *dev, uint32_t key,
+		   uint8_t devId, const uint8_t *addr, uint8_t addr_type);
+/*
+ * Removing a device from the table
+ */
+void devtab_remove(struct devtab *tab, struct devtab_dev *dev);
+/*
+ * Marking a device as the most recently used
+ */
+void devtab_touch(struct devtab *tab, struct devtab_dev *dev);
+/*
+ * Least recently used device @match accepts; NULL if none
+ *
+ * @match: NULL for any device
+ */
+struct devtab_dev *devtab_oldest(struct devtab *tab, devtab_match_func match,
+				 void *user_data);
+
+#endif /* DEVTAB_HEADER_H */
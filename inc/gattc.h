@@ -17,10 +17,129 @@
 #ifndef GATTC_HEADER_H
 #define GATTC_HEADER_H
 
-uint8_t gattc_write_req(uint8_t devId, uint8_t *data, uint8_t data_len);
-uint8_t gattc_write_cmd(uint8_t devId, uint8_t *data, uint8_t data_len);
-uint8_t gattc_read_req(uint8_t devId, uint8_t *data, uint8_t data_len);
-uint8_t gattc_connect(uint8_t devId, uint8_t *data, uint8_t data_len);
-uint8_t gattc_subscribe_req(uint8_t devId, uint8_t *data, uint8_t data_len);
-uint8_t gattc_unsubscribe_req(uint8_t devId, uint8_t *data, uint8_t data_len);
+#include <stdbool.h>
+
+#define GATTC_CONNECT_TIMEOUT_MS	10000	/* default connection timeout */
+
+struct cmd_req;
+
+/*
+ * EVENT_GATTC_CONNECT_COMPLETE, ending a CMD_MGMT_CONNECT accepted
+ *
+ * @status: BTLE_SUCCESS, BTLE_ERROR_TIMEOUT, BTLE_ERROR_CANCELED...
+ * @conn: connection handle given by CMD_MGMT_CONNECT, released unless
+ *        @status is BTLE_SUCCESS
+ * @mtu: ATT MTU negotiated, 0 on failure
+ */
+struct gattc_connect_complete {
+	uint8_t status;
+	uint16_t conn;		/* le16 */
+	uint8_t addr[6];
+	uint8_t addr_type;
+	uint16_t mtu;		/* le16 */
+} __attribute__((packed));
+
+/*
+ * CMD_GATTC_DB_DUMP response: [next(le16) | record...], the services
+ * from the start handle requested on, whole ones only. @next is the
+ * start handle of the following request, 0 once the database is
+ * complete.
+ *
+ * Records, integers le16; uuids are 16 bits (le16), or 128 bits (16
+ * bytes, in the order of their string form) when GATTC_DB_UUID128 is set
+ * in the record type:
+ * [GATTC_DB_PRIMARY or GATTC_DB_SECONDARY | start | end | uuid]
+ * [GATTC_DB_CHRC | handle | value_handle | properties(u8) | ext_prop |
+ *  uuid]
+ * [GATTC_DB_DESC | handle | uuid]
+ * a service is followed by its characteristics, a characteristic by its
+ * descriptors.
+ */
+#define GATTC_DB_PRIMARY	0x01
+#define GATTC_DB_SECONDARY	0x02
+#define GATTC_DB_CHRC		0x03
+#define GATTC_DB_DESC		0x04
+#define GATTC_DB_UUID128	0x80
+
+/*
+ * CMD_GATTC_READ_MULTIPLE modes
+ *
+ * GATTC_READ_SINGLE: one ATT Read Request per handle, all queued at once
+ * on the bearer; each value comes with its own outcome.
+ * GATTC_READ_MULTIPLE: a single ATT Read Multiple Request; the peer
+ * concatenates the values without their lengths, which the caller knows
+ * (fixed length values only, all but the last), and fails them all
+ * together. At least 2 handles, as many as the ATT MTU allows.
+ *
+ * Response: [count(u8) | (handle | att_ecode(u8) | len | value)...],
+ * integers le16, in the order of the handles requested; att_ecode 0 on
+ * success. GATTC_READ_MULTIPLE answers with one value, handle 0.
+ */
+#define GATTC_READ_SINGLE		0
+#define GATTC_READ_MULTIPLE		1
+#define GATTC_READ_MULTIPLE_MAX		32	/* handles per command */
+
+uint8_t gattc_write_req(struct cmd_req *req, uint8_t *data,
+		uint16_t data_len);
+uint8_t gattc_write_cmd(struct cmd_req *req, uint8_t *data,
+		uint16_t data_len);
+uint8_t gattc_read_req(struct cmd_req *req, uint8_t *data,
+		uint16_t data_len);
+/*
+ * Reading several values in one command, cf GATTC_READ_SINGLE...;
+ * answered once all of them are
+ */
+uint8_t gattc_read_multiple(struct cmd_req *req, uint8_t *data,
+		uint16_t data_len);
+/*
+ * Starting a connection; answered with its handle once started, the
+ * outcome is reported by EVENT_GATTC_CONNECT_COMPLETE once the ATT MTU
+ * is exchanged
+ */
+uint8_t gattc_connect(struct cmd_req *req, uint8_t *data,
+		uint16_t data_len);
+/*
+ * Giving up the connection being established, reported as
+ * BTLE_ERROR_CANCELED
+ */
+uint8_t gattc_connect_cancel(struct cmd_req *req, uint8_t *data,
+		uint16_t data_len);
+/*
+ * Setting the time given to connections: [timeout_ms(le32)], 0: default
+ */
+uint8_t gattc_set_connect_timeout(struct cmd_req *req, uint8_t *data,
+		uint16_t data_len);
+/*
+ * Dumping the database discovered on a connection, cf GATTC_DB_*;
+ * BTLE_ERROR_BUSY until its discovery is done
+ */
+uint8_t gattc_db_dump(struct cmd_req *req, uint8_t *data,
+		uint16_t data_len);
+uint8_t gattc_subscribe_req(struct cmd_req *req, uint8_t *data,
+		uint16_t data_len);
+uint8_t gattc_unsubscribe_req(struct cmd_req *req, uint8_t *data,
+		uint16_t data_len);
+/*
+ * Sending EVENT_GATTC_NOTIFICATION
+ *
+ * @devId: adapter index
+ * @conn: connection handle
+ * @cccd_id: subscription identifier
+ * @value_handle: characteristic value handle
+ * @value: value notified
+ * @length: value length
+ */
+void gattc_send_notification(uint8_t devId, uint16_t conn,
+		uint8_t cccd_id, uint16_t value_handle,
+		const uint8_t *value, uint16_t length);
+/*
+ * Keys distributed by pairing with a peer, telling whether it is bonded
+ *
+ * @devId: adapter index
+ * @addr: peer address (little endian)
+ * @addr_type: peer address type
+ * @bond: keys stored, the peer is bonded
+ */
+void gattc_new_key(uint8_t devId, const uint8_t *addr, uint8_t addr_type,
+		bool bond);
 #endif /* GATTC_HEADER_H */
@@ -0,0 +1,66 @@
+/*
+ *  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef GATTCACHE_HEADER_H
+#define GATTCACHE_HEADER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "lib/bluetooth.h"
+
+#define GATTCACHE_HASH_LEN	16	/* GATT Database Hash */
+#define GATTCACHE_HASH_UUID	0x2b2a	/* Database Hash characteristic */
+
+struct gatt_db;
+
+/*
+ * Caching the GATT databases discovered, one file per peer in @dir
+ * (created if needed); disabled until called. Peers using resolvable
+ * private addresses are not cached.
+ *
+ * @dir: cache directory
+ */
+uint8_t gattcache_init(const char *dir);
+bool gattcache_enabled(void);
+/*
+ * Filling @db with the attributes cached for a peer; services loaded are
+ * active, so that bt_gatt_client only checks the primary services of
+ * the peer instead of discovering them. An entry whose database hash
+ * differs from @hash is stale and removed. Without a hash, only Service
+ * Changed tells a database changed, and it is only guaranteed to reach
+ * bonded clients: the entry of a peer not bonded is removed.
+ *
+ * @dst: peer address
+ * @dst_type: peer address type
+ * @hash: database hash read from the peer, NULL: it has none
+ * @bonded: the peer is bonded
+ * @db: empty database
+ * @return: true if @db was filled
+ */
+bool gattcache_load(const bdaddr_t *dst, uint8_t dst_type,
+		const uint8_t *hash, bool bonded, struct gatt_db *db);
+/*
+ * Storing the database of a peer once discovered; without a hash, only
+ * when the peer is bonded, cf gattcache_load()
+ *
+ * @hash: database hash read from the peer, NULL: it has none
+ * @bonded: the peer is bonded
+ */
+void gattcache_store(const bdaddr_t *dst, uint8_t dst_type,
+		const uint8_t *hash, bool bonded, struct gatt_db *db);
+
+#endif /* GATTCACHE_HEADER_H */
@@ -17,7 +17,18 @@
 #ifndef IPC_HEADER_H
 #define IPC_HEADER_H
 
-#define IPC_DATA_LEN_MAX	100
+#define IPC_DATA_LEN_MAX	1024
+/*
+ * command responses may be longer; beyond IPC_RSP_PAGE_MAX, they only fit
+ * the client tx ring while few events are queued
+ */
+#define IPC_RSP_DATA_LEN_MAX	(32 * 1024)
+/* paginated responses, always fitting the room events leave in the ring */
+#define IPC_RSP_PAGE_MAX	(16 * 1024)
+/* biggest number of buffers a frame payload can be gathered from */
+#define IPC_IOV_MAX		4
+
+struct iovec;
 
 enum ipc_msg {
 	msg_command_req = 0,
@@ -25,18 +36,29 @@ enum ipc_msg {
 	msg_event,
 	msg_info,
 	msg_command_loopback,
+	msg_shm,		/* events over a shared memory ring */
 	msg_unknown,
 };
 
-uint8_t ipc_send(enum ipc_msg type, void *data, uint8_t data_len);
+uint8_t ipc_send(uint16_t cid, enum ipc_msg type, void *data,
+		 uint16_t data_len);
 
-uint8_t ipc_send_event(void *data, uint8_t data_len);
-uint8_t ipc_send_cmd(void *data, uint8_t data_len);
-uint8_t ipc_send_rsp(void *data, uint8_t data_len);
-uint8_t ipc_send_info(void *data, uint8_t data_len);
+uint8_t ipc_sendv(uint16_t cid, enum ipc_msg type, const struct iovec *iov,
+		  int iovcnt);
 
-typedef uint8_t (*msg_cmd_cb)(uint8_t *data, uint8_t data_len);
+uint8_t ipc_send_event(uint32_t mask, void *data, uint16_t data_len);
+uint8_t ipc_send_eventv(uint32_t mask, const struct iovec *iov, int iovcnt);
+uint8_t ipc_send_cmd(uint16_t cid, void *data, uint16_t data_len);
+uint8_t ipc_send_rsp(uint16_t cid, void *data, uint16_t data_len);
+uint8_t ipc_send_info(uint16_t cid, void *data, uint16_t data_len);
 
-uint8_t ipc_init(msg_cmd_cb req_cb);
+typedef uint8_t (*msg_cmd_cb)(uint16_t cid, uint8_t *data,
+			      uint16_t data_len);
+
+/*
+ * @req_cb: msg_command_req handler
+ * @info_cb: msg_info handler (optional)
+ */
+uint8_t ipc_init(msg_cmd_cb req_cb, msg_cmd_cb info_cb);
 
 #endif /* IPC_HEADER_H */
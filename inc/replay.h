@@ -0,0 +1,41 @@
+/*
+ *  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef REPLAY_HEADER_H
+#define REPLAY_HEADER_H
+
+#include <stdint.h>
+
+/*
+ * Replaying a btsnoop capture, as written by btmon -w (monitor format)
+ * or by HCI H4 loggers, as the daemon event source.
+ *
+ * Kernel mgmt events recorded by btmon (device found, connected,
+ * disconnected, connection parameters, discovering) are handed to the
+ * mgmt handlers. LE advertising reports are turned into device found
+ * events as long as the capture holds no mgmt device found event, and
+ * ATT notifications/indications into EVENT_GATTC_NOTIFICATION.
+ *
+ * @path: btsnoop file
+ * @speed: 1: original pace, n: n times faster, 0: as fast as possible
+ */
+uint8_t replay_start(const char *path, uint16_t speed);
+/*
+ * Stopping a replay in progress
+ */
+void replay_stop(void);
+
+#endif /* REPLAY_HEADER_H */
@@ -0,0 +1,173 @@
+/*
+ *  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SCAN_HEADER_H
+#define SCAN_HEADER_H
+
+#include <stdbool.h>
+
+#include "adv.h"
+
+/*
+ * scan options, TLV encoded after [mode | timeout_ms] in CMD_MGMT_SCAN:
+ * [type(u8) | len(u8) | value]; unknown types are skipped
+ */
+enum scan_opt {
+	SCAN_OPT_DEDUP = 1,	/* [rssi_delta(u8) | min_interval_ms(le16)] */
+	SCAN_OPT_RSSI,		/* [rssi(s8)] weakest report forwarded */
+	SCAN_OPT_UUID16,	/* [uuid(le16)]... service UUIDs */
+	SCAN_OPT_UUID128,	/* [uuid(16 bytes, le)]... service UUIDs */
+	SCAN_OPT_BATCH,		/* [interval_ms(le16) | count(u8)] */
+};
+
+#define SCAN_UUID_MAX		64
+#define SCAN_RSSI_NONE		127	/* no RSSI threshold */
+
+/*
+ * Report filter, handed to the kernel (service discovery) when it
+ * supports it, applied by the daemon otherwise
+ *
+ * A report goes through when its RSSI is at least @rssi, and when it
+ * advertises one of @uuids in its service UUID fields.
+ *
+ * @rssi: RSSI threshold, SCAN_RSSI_NONE if none
+ * @uuid_count: number of UUIDs, 0: any
+ * @uuids: 128 bits service UUIDs (little endian)
+ */
+struct scan_filter {
+	int8_t rssi;
+	uint16_t uuid_count;
+	uint8_t uuids[SCAN_UUID_MAX][ADV_UUID128_LEN];
+};
+
+#define scan_filter_active(f) \
+	((f)->rssi != SCAN_RSSI_NONE || (f)->uuid_count)
+
+/*
+ * Batched delivery of scan results: results are gathered in
+ * EVENT_SCAN_BATCH events, sent @interval_ms after the first result they
+ * hold or once they hold @count results, whichever comes first, and
+ * when the scan ends
+ *
+ * @interval_ms: longest time a result waits, 0: no time limit
+ * @count: results per event, 0: as many as fit
+ */
+struct scan_batch {
+	uint16_t interval_ms;
+	uint8_t count;
+};
+
+#define scan_batch_active(b)	((b)->interval_ms || (b)->count)
+
+/*
+ * Duplicate filter of advertising reports
+ *
+ * A device is reported when first seen or when its advertising data
+ * changes; otherwise only when its RSSI moved by @rssi_delta dBm or more
+ * since last reported, and no sooner than @min_interval_ms after it.
+ *
+ * @enabled: filtering reports; every report is forwarded otherwise
+ * @rssi_delta: RSSI change forcing a report, 0: RSSI ignored
+ * @min_interval_ms: minimum time between two reports of a device
+ */
+struct scan_dedup {
+	bool enabled;
+	uint8_t rssi_delta;
+	uint16_t min_interval_ms;
+};
+
+/*
+ * Configuring the duplicate filter of an adapter; forgets the devices
+ * seen so far on it
+ *
+ * @devId: adapter index
+ * @cfg: filter settings
+ */
+uint8_t scan_set_dedup(uint8_t devId, const struct scan_dedup *cfg);
+/*
+ * Setting the report filter of an adapter; applied by the daemon until
+ * scan_set_offloaded() tells the kernel took it over
+ *
+ * @devId: adapter index
+ * @filter: filter settings
+ */
+uint8_t scan_set_filter(uint8_t devId, const struct scan_filter *filter);
+/*
+ * Loading the advertising data matcher of an adapter, run on every
+ * report the filter let through; kept across scans
+ *
+ * @devId: adapter index
+ * @data: program, cf advprog.h; rejected ones leave no program
+ * @data_len: program length, 0: no program
+ */
+uint8_t scan_set_program(uint8_t devId, const uint8_t *data,
+			 uint16_t data_len);
+/*
+ * Telling whether the kernel applies the report filter
+ *
+ * @devId: adapter index
+ * @offloaded: true when started with MGMT_OP_START_SERVICE_DISCOVERY
+ */
+void scan_set_offloaded(uint8_t devId, bool offloaded);
+/*
+ * Deciding whether an advertising report is forwarded; reports passing
+ * the filters are recorded in the device registry, duplicates included
+ *
+ * @devId: adapter index
+ * @addr: device address (little endian)
+ * @addr_type: address type
+ * @rssi: report RSSI
+ * @eir: advertising data
+ * @eir_len: advertising data length
+ */
+bool scan_report(uint8_t devId, const uint8_t *addr, uint8_t addr_type,
+		 int8_t rssi, const uint8_t *eir, uint16_t eir_len);
+/*
+ * Keeping, per device, the number of reports and the best RSSI seen on
+ * an adapter until scan_summary() is called
+ *
+ * @devId: adapter index
+ * @enabled: counting
+ */
+uint8_t scan_set_summary(uint8_t devId, bool enabled);
+
+typedef void (*scan_summary_cb)(const uint8_t *addr, uint8_t addr_type,
+				int8_t best_rssi, uint32_t reports,
+				void *user_data);
+/*
+ * Walking devices counted on an adapter since scan_set_summary(); stops
+ * counting. BTLE_ERROR_INVALID_STATE when not counting.
+ *
+ * @devId: adapter index
+ * @dropped: devices recycled out of the full table meanwhile, hence
+ *	     missing; set before @func is called
+ * @func: called for each device
+ * @user_data: handed to @func
+ */
+uint8_t scan_summary(uint8_t devId, uint32_t *dropped,
+		     scan_summary_cb func, void *user_data);
+/*
+ * Forgetting devices seen on an adapter
+ *
+ * @devId: adapter index
+ */
+void scan_flush(uint8_t devId);
+/*
+ * Releasing every device of every adapter
+ */
+void scan_close(void);
+
+#endif /* SCAN_HEADER_H */
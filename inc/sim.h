@@ -0,0 +1,59 @@
+/*
+ *  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SIM_HEADER_H
+#define SIM_HEADER_H
+
+#include <stdint.h>
+
+#include "backend.h"
+
+#define SIM_INDEX		0	/* single simulated adapter */
+#define SIM_ADV_INTERVAL_MS	100
+#define SIM_NOTIFY_INTERVAL_MS	1000
+
+/*
+ * Simulated peripherals
+ *
+ * Peripherals advertise, while the adapter discovers, every
+ * @adv_interval_ms plus a random 0-10 ms delay, as controllers do.
+ * Their random static addresses are C0:00:00:00:hi:lo, hi:lo being their
+ * number, and their names sim-<number>.
+ *
+ * Connected peripherals stop advertising and expose a GATT database:
+ * GAP, Battery (level readable), Heart Rate (measurement notified every
+ * @notify_interval_ms once its CCC is written).
+ *
+ * @count: number of peripherals
+ * @adv_interval_ms: advertising interval
+ * @notify_interval_ms: notification interval, 0: no notifications
+ */
+struct sim_config {
+	uint16_t count;
+	uint16_t adv_interval_ms;
+	uint16_t notify_interval_ms;
+};
+
+extern const struct backend_ops sim_backend;
+
+/*
+ * Configuring the peripherals, before backend_init()
+ *
+ * @cfg: configuration
+ */
+uint8_t sim_configure(const struct sim_config *cfg);
+
+#endif /* SIM_HEADER_H */
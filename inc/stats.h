@@ -0,0 +1,95 @@
+/*
+ *  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef STATS_HEADER_H
+#define STATS_HEADER_H
+
+/*
+ * latency histograms: bucket 0 holds 0us, bucket n holds
+ * [2^(n-1), 2^n[ us; the last one everything above
+ */
+#define STATS_HIST_BUCKETS	24
+
+enum stats_kind {
+	STATS_CMD = 0,	/* indexed by @cmds */
+	STATS_EVT,	/* indexed by @event_type */
+	STATS_KIND_MAX,
+};
+
+/*
+ * Counters of one command or event type
+ *
+ * @count: commands handled / events sent
+ * @errors: commands answered with an error / events nobody received
+ * @bytes_in: command parameters received
+ * @bytes_out: response or event payload sent
+ * @lat: request receipt to response sent (commands only)
+ * @rtt: mgmt or ATT request to its completion (commands only)
+ */
+struct stats_entry {
+	uint32_t count;
+	uint32_t errors;
+	uint32_t bytes_in;
+	uint32_t bytes_out;
+	uint32_t lat[STATS_HIST_BUCKETS];
+	uint32_t rtt[STATS_HIST_BUCKETS];
+};
+
+/*
+ * Monotonic clock, in micro seconds
+ */
+uint64_t stats_now_us(void);
+/*
+ * Recording a command once answered
+ *
+ * @cmd: command type
+ * @status: response status
+ * @bytes_in: parameters length
+ * @bytes_out: response payload length
+ * @t_rx: stats_now_us() at request receipt
+ * @t_backend: stats_now_us() when mgmt/ATT was requested, 0 if never
+ */
+void stats_cmd(uint8_t cmd, uint8_t status, uint16_t bytes_in,
+	       uint16_t bytes_out, uint64_t t_rx, uint64_t t_backend);
+/*
+ * Recording an event broadcast
+ *
+ * @evt: event type
+ * @status: broadcast status
+ * @bytes_out: event payload length
+ */
+void stats_event(uint8_t evt, uint8_t status, uint16_t bytes_out);
+/*
+ * Reading counters; NULL if @index is out of range
+ *
+ * @kind: command or event counters
+ * @index: command or event type
+ */
+const struct stats_entry *stats_get(enum stats_kind kind, uint8_t index);
+/*
+ * Number of entries of a kind
+ *
+ * @kind: command or event counters
+ */
+uint8_t stats_count(enum stats_kind kind);
+/*
+ * Clearing every counter of a kind
+ *
+ * @kind: command or event counters
+ */
+void stats_reset(enum stats_kind kind);
+
+#endif /* STATS_HEADER_H */
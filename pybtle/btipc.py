@@ -26,30 +26,35 @@ class btipc:
     IPC_MSG_TYPE_REQ    = 0
     IPC_MSG_TYPE_RSP    = 1
     IPC_MSG_TYPE_EVENT  = 2
+    IPC_MSG_TYPE_INFO   = 3
+    IPC_MSG_TYPE_LOOPBACK = 4
 
     def __init__(self, evt_delegate = None):
         self.socket = btsocket.btsocket(delegate = self.ipc_receive)
         self.mtu = self.socket.getmtu()
         self.q_resp = Queue.Queue()
+        self.q_info = Queue.Queue()
         self.evt_delegate = evt_delegate
 
         #print("mtu %d" % self.mtu)
 
     def ipc_receive(self, data):
         '''
-        +--------------------+----------+----------------+
-        |          0         |     1    | 2:data_len + 2 |
-        +--------------------+----------+----------------+
-        |  IPC_MSG_TYPE_RSP  |          |                |
-        |         or         | data len |      data      |
-        | IPC_MSG_TYPE_EVENT |          |                |
-        +--------------------+----------+----------------+
+        +--------------------+-----------------+----------------+
+        |          0         |       1:2       | 3:data_len + 3 |
+        +--------------------+-----------------+----------------+
+        |  IPC_MSG_TYPE_RSP  |                 |                |
+        |         or         | data len (le16) |      data      |
+        | IPC_MSG_TYPE_EVENT |                 |                |
+        +--------------------+-----------------+----------------+
         '''
-        (msg_type, len) = struct.unpack("<BB", data[:2])
-        content = data[2:]
-        msg = { "len" : len, "content": data[2:]}
+        (msg_type, len) = struct.unpack("<BH", data[:3])
+        content = data[3:]
+        msg = { "len" : len, "content": data[3:]}
         if msg_type == self.IPC_MSG_TYPE_RSP:
             self.q_resp.put(msg)
+        elif msg_type == self.IPC_MSG_TYPE_INFO:
+            self.q_info.put(msg)
         elif msg_type == self.IPC_MSG_TYPE_EVENT:
             if self.evt_delegate != None:
                 self.evt_delegate(msg)
@@ -61,7 +66,7 @@ class btipc:
 
     def ipc_loopback_tx(self, SN = 0):
         msg = "TX(%d)" % SN
-        self.ipc_send(5, msg, len(msg))
+        self.ipc_send(self.IPC_MSG_TYPE_LOOPBACK, msg, len(msg))
 
     def ipc_loopback_rx(self, data):
         s = re.search("TX\((.+)\)", data)
@@ -72,20 +77,23 @@ class btipc:
 
     def ipc_send_req(self, data, data_len):
         '''
-        +------------------+----------+----------------+
-        |         0        |     1    | 2:data_len + 2 |
-        +------------------+----------+----------------+
-        | IPC_MSG_TYPE_REQ | data len |      data      |
-        +------------------+----------+----------------+
+        +------------------+-----------------+----------------+
+        |         0        |       1:2       | 3:data_len + 3 |
+        +------------------+-----------------+----------------+
+        | IPC_MSG_TYPE_REQ | data len (le16) |      data      |
+        +------------------+-----------------+----------------+
         '''
-        if (data_len + 2) > self.mtu:
+        return self.ipc_send(self.IPC_MSG_TYPE_REQ, data, data_len)
+
+    def ipc_send(self, msg_type, data, data_len):
+        if (data_len + 3) > self.mtu:
             print "message too long"
             return False
 
-        pkt = struct.pack('<BB', self.IPC_MSG_TYPE_REQ, data_len)
+        pkt = struct.pack('<BH', msg_type, data_len)
         pkt += data
 
-        #print ("ipc_tx type(%d) | len(%d) | %s" % (self.IPC_MSG_TYPE_REQ, data_len, data))
+        #print ("ipc_tx type(%d) | len(%d) | %s" % (msg_type, data_len, data))
         return self.socket.send(pkt, len(pkt))
 
     def getmtu(self):
@@ -21,6 +21,7 @@ import struct
 
 class btsocket:
     socket_addr = "/var/run/btled"
+    HDR_LEN = 3
 
     def __init__(self, delegate = None):
         self.client_sock = None
@@ -43,9 +44,7 @@ class btsocket:
 
         if len(readable) :
             pkt = self.client_sock.recv(2)
-            (h, l) = struct.unpack("<BB", pkt[:2])
-            self.mtu = 0xff & (h << 8)
-            self.mtu += 0xff & l
+            self.mtu = struct.unpack('>H', pkt[:2])[0]
             #print ("mtu = %d" % self.mtu)
 
     def getmtu(self):
@@ -77,10 +76,10 @@ class btsocket:
         if data_len > self.mtu:
             return False
 
-        pkt = data.ljust(self.mtu, '\0')
+        pkt = data[:data_len]
         ret = False
         bytecnt = 0;
-        while bytecnt < self.mtu:
+        while bytecnt < data_len:
             try:
                 
                 sent = self.client_sock.send(pkt[bytecnt:])
@@ -93,7 +92,7 @@ class btsocket:
                 pass
                 break
 
-        if (bytecnt >= self.mtu):
+        if (bytecnt >= data_len):
             ret = True
 
         return ret
@@ -108,11 +107,17 @@ class btsocket:
                 data_rcv = self.client_sock.recv(self.mtu)
                 self.rx += data_rcv
 
-                if len(self.rx) >= self.mtu:
+                # [type(u8) | data_len(le16) | data]
+                while len(self.rx) >= self.HDR_LEN:
+                    data_len = struct.unpack('<H', self.rx[1:self.HDR_LEN])[0]
+                    frame_len = self.HDR_LEN + data_len
+                    if len(self.rx) < frame_len:
+                        break
+
                     if self.delegate:
-                        self.delegate(self.rx[:self.mtu])
+                        self.delegate(self.rx[:frame_len])
 
-                    self.rx = self.rx[self.mtu:]
+                    self.rx = self.rx[frame_len:]
 
     def close(self):
         if self.client_sock :
@@ -24,18 +24,50 @@ import Queue
 
 CMD_MGMT_GET_DEVICE_INFO        = 0     # [devid]
 CMD_MGMT_RESET                  = 1     # [devid]
-CMD_MGMT_POWER                  = 2     # [devid] (mode(u8)=0:off, 1:on)
-CMD_MGMT_SET_LOCAL_NAME         = 3     # [devid | len(u8) < 31bytes | data]
-CMD_MGMT_SET_CONNECTION_PARAM   = 4     # [devid | addr | addrtype | min(u8) | max(u8)| interval(u8) | timeout(u16)]
-CMD_MGMT_SCAN                   = 5     # [devid | (mode(u8)=0:stop, 1:start) | timeout_ms(u16)]
+CMD_MGMT_POWER                  = 2     # [devid | mode(u8)=0:off, 1:on]
+CMD_MGMT_SET_LOCAL_NAME         = 3     # [devid | len(u8) <= 30 | name]
+CMD_MGMT_SET_CONNECTION_PARAM   = 4     # [devid | addr | addrtype | min(le16) | max(le16) | latency(le16) | timeout(le16)]
+CMD_MGMT_SCAN                   = 5     # [devid | (mode(u8)=0:stop, 1:start) | timeout_ms(u16) | options]
 CMD_MGMT_READ_CONTROLLER_INFO   = 6     # [devid
 
-CMD_GATTC_CONNECT_REQ           = 7     # [devid | addr | addrtype | sec_level
-CMD_GATTC_WRITE_CMD             = 8     # [devid | handle(u16) | data ]
-CMD_GATTC_WRITE_REQ             = 9     # [devid | handle(u16) | data ]
-CMD_GATTC_READ_REQ              = 10    # [devid | handle(u16)]
-CMD_GATTC_SUBSCRIBE_REQ         = 11    # [devid | handle(u16) | None(0)|Nty(1)|Ind(2)]
-CMD_GATTC_UNSUBSCRIBE_REQ       = 12    # [devid | cccd_if(u8)
+CMD_GATTC_CONNECT_REQ           = 7     # [devid | addr | addrtype | sec_level | mtu(le16)] response: [conn(le16)]
+CMD_GATTC_WRITE_CMD             = 8     # [devid | conn(le16) | handle(le16) | len(le16) | data]
+CMD_GATTC_WRITE_REQ             = 9     # [devid | conn(le16) | handle(le16) | len(le16) | data]
+CMD_GATTC_READ_REQ              = 10    # [devid | conn(le16) | handle(le16)]
+CMD_GATTC_SUBSCRIBE_REQ         = 11    # [devid | conn(le16) | handle(le16) | None(0)|Nty(1)|Ind(2)]
+CMD_GATTC_UNSUBSCRIBE_REQ       = 12    # [devid | conn(le16) | cccd_if(u8)
+
+CMD_SET_EVENT_MASK              = 16    # [devid | mask(le32)]
+CMD_SET_LOG_LEVEL               = 17    # [devid | level(u8)]
+CMD_SCAN_SET_PROGRAM            = 18    # [devid | insn(8 bytes)...]
+CMD_DEVREG_SNAPSHOT             = 19    # [devid]
+CMD_DEVREG_SET_LOST_TIMEOUT     = 20    # [devid | lost_ms(le32)]
+CMD_SET_PARAM_VERSION           = 21    # [devid | version(u8)]
+CMD_GATTC_CONNECT_CANCEL        = 22    # [devid | conn(le16)]
+CMD_GATTC_SET_CONNECT_TIMEOUT   = 23    # [devid | timeout_ms(le32)]
+CMD_GATTC_DB_DUMP               = 24    # [devid | conn(le16) | start(le16)]
+CMD_GATTC_READ_MULTIPLE         = 25    # [devid | conn(le16) | mode(u8) | count(u8) | handle(le16)...]
+
+# parameters encoding, cf inc/cmd.h; addresses above are 6 bytes little
+# endian with PARAM_VERSION_BINARY, "XX:XX:XX:XX:XX:XX" strings with
+# PARAM_VERSION_TEXT (integers then big endian, no write length). conn is
+# only given from PARAM_VERSION_CONN, CONN_ANY is addressed otherwise; mtu
+# from PARAM_VERSION_MTU, the default one is requested otherwise.
+PARAM_VERSION_TEXT       = 0
+PARAM_VERSION_BINARY     = 1
+PARAM_VERSION_CONN       = 2
+PARAM_VERSION_MTU        = 3
+
+ATT_DEFAULT_LE_MTU       = 23
+ATT_MAX_LE_MTU           = 517
+
+# connection handle: returned by connect, carried by the GATT events
+CONN_ANY                 = 0
+
+LOG_ERR                  = 0
+LOG_WARNING              = 1
+LOG_INFO                 = 2
+LOG_DBG                  = 3
 
 EVT_CONNECTED            = 0
 EVT_DISCONNECTED         = 1
@@ -47,9 +79,69 @@ EVT_GATTC_INDICATION     = 6
 EVT_GATTC_DISC_PRIMARY   = 7
 EVT_GATTC_DISC_CHAR      = 8
 EVT_GATTC_DISC_DESC      = 9
+EVT_SCAN_SUMMARY         = 10
+EVT_DEVICE_APPEARED      = 11
+EVT_DEVICE_LOST          = 12
+EVT_SCAN_BATCH           = 13
+EVT_GATTC_CONNECT_COMPLETE = 14
 
 UUID_STR_MAX_LEN         = 36
 
+# CMD_GATTC_DB_DUMP record types, cf inc/gattc.h
+GATTC_DB_PRIMARY         = 0x01
+GATTC_DB_SECONDARY       = 0x02
+GATTC_DB_CHRC            = 0x03
+GATTC_DB_DESC            = 0x04
+GATTC_DB_UUID128         = 0x80
+
+# CMD_GATTC_READ_MULTIPLE modes, cf inc/gattc.h
+GATTC_READ_SINGLE        = 0
+GATTC_READ_MULTIPLE      = 1
+GATTC_READ_MULTIPLE_MAX  = 32
+
+SCAN_OPT_DEDUP           = 1
+SCAN_OPT_RSSI            = 2
+SCAN_OPT_UUID16          = 3
+SCAN_OPT_UUID128         = 4
+SCAN_OPT_BATCH           = 5
+
+ADVPROG_RET              = 0
+ADVPROG_FIND             = 1
+ADVPROG_FIND_NEXT        = 2
+ADVPROG_LD_B             = 3
+ADVPROG_LD_H             = 4
+ADVPROG_LD_HBE           = 5
+ADVPROG_LD_W             = 6
+ADVPROG_LD_LEN           = 7
+ADVPROG_AND              = 8
+ADVPROG_RSH              = 9
+ADVPROG_JA               = 10
+ADVPROG_JEQ              = 11
+ADVPROG_JGT              = 12
+ADVPROG_JGE              = 13
+ADVPROG_JSET             = 14
+
+ADV_REC_FLAGS            = 0
+ADV_REC_NAME             = 1
+ADV_REC_UUID16           = 2
+ADV_REC_UUID32           = 3
+ADV_REC_UUID128          = 4
+ADV_REC_SVC_DATA16       = 5
+ADV_REC_SVC_DATA32       = 6
+ADV_REC_SVC_DATA128      = 7
+ADV_REC_MANUFACTURER     = 8
+ADV_REC_TX_POWER         = 9
+ADV_REC_APPEARANCE       = 10
+ADV_REC_MULTI            = (ADV_REC_SVC_DATA16, ADV_REC_SVC_DATA32,
+                            ADV_REC_SVC_DATA128, ADV_REC_MANUFACTURER)
+
+STATS_CMD                = 0
+STATS_EVT                = 1
+
+INFO_STATS_GET           = 0
+INFO_STATS_GET_RESET     = 1
+INFO_STATS_RESET         = 2
+
 class cmdException(Exception):
     pass
 
@@ -58,61 +150,245 @@ class cmd :
     """
     def __init__(self):
         self.ipc = btipc.btipc(evt_delegate = self.parse_event)
-        self.cmd = None
+        self.req_id = 0
+        self.pending = {}
         self.delegate = {}
+        self.summary = []
+        self.summary_dropped = None
+        self.dbs = {}
+        self.disc_cb = {}
+        self.ntf_cb = {}
+        self.param_version = PARAM_VERSION_TEXT
+        # latest the daemon knows
+        for version in (PARAM_VERSION_MTU, PARAM_VERSION_CONN,
+                        PARAM_VERSION_BINARY):
+            if self.set_param_version(version) == version:
+                break
+
+    def get_db(self, conn):
+        """Services being discovered on connection conn"""
+        if conn not in self.dbs:
+            self.dbs[conn] = {"attrs": [], "attr": None}
+        return self.dbs[conn]
+
+    def conn_bin(self, conn):
+        """conn parameter, given only with PARAM_VERSION_CONN"""
+        if self.param_version < PARAM_VERSION_CONN:
+            return b''
+        return struct.pack('<H', conn)
+
+    def parse_adv_rec(self, data):
+        """Advertising data parsed by the daemon, cf inc/adv.h
 
-    def reset_db(self):
-        self.attrs = []
-        self.attr = None
+        Returns:
+            dict: ADV_REC_* kind: value; list of values for service and
+                  manufacturer data
+        """
+        ad = {}
+        if len(data) < 2:
+            return ad
+        data = data[2:]
+        while len(data) >= 2:
+            (kind, length) = struct.unpack('<BB', data[:2])
+            value = data[2:2 + length]
+            data = data[2 + length:]
+            if kind in ADV_REC_MULTI:
+                ad.setdefault(kind, []).append(value)
+            elif kind in ad:
+                ad[kind] += value
+            else:
+                ad[kind] = value
+        return ad
 
     def parse_scan_result_evt(self, data):
         dict = {}
-        data_len = struct.unpack('>B', data[:1])[0]
-        data = data[1:]
+        data_len = struct.unpack('<H', data[:2])[0]
+        data = data[2:]
         dict["flags"] = struct.unpack('<L', data[:4])[0]
         data = data[4:]
         litle_addr = ''.join('%02x' % ord(b) for b in data[:6])
         dict["addr"] = ":".join([litle_addr[x:x+2] for x in range(0,len(litle_addr),2)][::-1])
         data = data[6:]
-        (dict["addr_type"], dict["rssi"], dict["adv_data_len"]) = struct.unpack('<BbB', data[:3])
-        data = data[3:]
+        (dict["addr_type"], dict["rssi"], dict["adv_data_len"], rec_len) = struct.unpack('<BbHH', data[:6])
+        data = data[6:]
         dict["adv_data"] = data[: dict["adv_data_len"]]
+        data = data[dict["adv_data_len"]:]
+        dict["ad"] = self.parse_adv_rec(data[:rec_len])
         try:
             self.delegate[EVT_SCAN_RESULT](dict)
         except KeyError:
             pass
 
-    def parse_discover_primary_evt(self, data):
+    def parse_scan_batch_evt(self, data):
+        # [count | (len(le16) | scan result)...], one delegate call each
+        count = struct.unpack('<B', data[2:3])[0]
+        data = data[3:]
+        for i in range(count):
+            rec_len = struct.unpack('<H', data[:2])[0]
+            self.parse_scan_result_evt(data[:2 + rec_len])
+            data = data[2 + rec_len:]
+
+    def parse_scan_summary_evt(self, data):
+        data_len = struct.unpack('<H', data[:2])[0]
+        data = data[2:]
+        (last, count) = struct.unpack('<BB', data[:2])
+        data = data[2:]
+        if self.summary_dropped == None:
+            # first frame: devices missing, recycled out of a full table
+            self.summary_dropped = struct.unpack('<L', data[:4])[0]
+            data = data[4:]
+        for i in range(count):
+            dev = {}
+            litle_addr = ''.join('%02x' % ord(b) for b in data[:6])
+            dev["addr"] = ":".join([litle_addr[x:x+2] for x in range(0,len(litle_addr),2)][::-1])
+            (dev["addr_type"], dev["rssi"], dev["reports"]) = struct.unpack('<BbL', data[6:12])
+            data = data[12:]
+            self.summary.append(dev)
+        if last:
+            summary = self.summary
+            dropped = self.summary_dropped
+            self.summary = []
+            self.summary_dropped = None
+            try:
+                self.delegate[EVT_SCAN_SUMMARY](summary, dropped)
+            except KeyError:
+                pass
+
+    def addr_to_bin(self, addr):
+        """BLE address (00:11:22:33:44:55) in PARAM_VERSION_BINARY order"""
+        return binascii.unhexlify(addr.replace(':', ''))[::-1]
+
+    def parse_addr(self, data):
+        litle_addr = ''.join('%02x' % ord(b) for b in data[:6])
+        return ":".join([litle_addr[x:x+2] for x in range(0,len(litle_addr),2)][::-1])
+
+    def parse_presence_evt(self, evt, data):
+        data = data[2:]
+        dev = {"addr": self.parse_addr(data)}
+        (dev["addr_type"], dev["rssi"]) = struct.unpack('<Bb', data[6:8])
+        try:
+            self.delegate[evt](dev)
+        except KeyError:
+            pass
+
+    def parse_connect_complete_evt(self, data):
+        data = data[2:]
+        (status, conn) = struct.unpack('<BH', data[:3])
+        ret = {"status": status,
+               "conn": conn,
+               "addr": self.parse_addr(data[3:9]),
+               "addr_type": struct.unpack('<B', data[9:10])[0],
+               "mtu": ATT_DEFAULT_LE_MTU}
+        if len(data) >= 12:
+            ret["mtu"] = struct.unpack('<H', data[10:12])[0]
+        try:
+            self.delegate[EVT_GATTC_CONNECT_COMPLETE](ret)
+        except KeyError:
+            pass
+
+    def parse_db_dump_uuid(self, rtype, data):
+        """uuid of a CMD_GATTC_DB_DUMP record, as the discovery events
+        give it, with its length"""
+        if rtype & GATTC_DB_UUID128:
+            h = binascii.hexlify(data[:16])
+            return ("-".join((h[:8], h[8:12], h[12:16], h[16:20], h[20:])),
+                    0, 16)
+        uuid16 = struct.unpack('<H', data[:2])[0]
+        return ("%08x-0000-1000-8000-00805f9b34fb" % uuid16, uuid16, 2)
+
+    def parse_db_dump_rsp(self, data, data_len):
+        """services as given to the discovery callback, along with the
+        start handle of the next CMD_GATTC_DB_DUMP, 0: none"""
+        next = struct.unpack('<H', data[:2])[0]
+        attrs = []
+        pos = 2
+        while pos < data_len:
+            rtype = ord(data[pos])
+            kind = rtype & ~GATTC_DB_UUID128
+            pos += 1
+            if kind in (GATTC_DB_PRIMARY, GATTC_DB_SECONDARY):
+                (start, end) = struct.unpack('<HH', data[pos:pos + 4])
+                (u, u16, ulen) = self.parse_db_dump_uuid(rtype,
+                                                         data[pos + 4:])
+                pos += 4 + ulen
+                attrs.append({"service": {"start": start, "end": end,
+                                          "uuid": u,
+                                          "primary": kind == GATTC_DB_PRIMARY,
+                                          "characteristics": []}})
+            elif kind == GATTC_DB_CHRC:
+                (handle, value_handle, properties,
+                 ext_prop) = struct.unpack('<HHBH', data[pos:pos + 7])
+                (u, u16, ulen) = self.parse_db_dump_uuid(rtype,
+                                                         data[pos + 7:])
+                pos += 7 + ulen
+                attrs[-1]["service"]["characteristics"].append(
+                    {"handle": handle, "value_handle": value_handle,
+                     "properties": properties, "ext_prop": ext_prop,
+                     "uuid": u, "desc": []})
+            elif kind == GATTC_DB_DESC:
+                handle = struct.unpack('<H', data[pos:pos + 2])[0]
+                (u, u16, ulen) = self.parse_db_dump_uuid(rtype,
+                                                         data[pos + 2:])
+                pos += 2 + ulen
+                attrs[-1]["service"]["characteristics"][-1]["desc"].append(
+                    {"handle": handle, "uuid16": u16, "uuid": u})
+            else:
+                break
+        return {"next": next, "attrs": attrs}
+
+    def parse_devreg_snapshot_rsp(self, data, data_len):
+        devs = []
+        count = struct.unpack('<H', data[:2])[0]
+        data = data[2:]
+        for i in range(count):
+            dev = {"addr": self.parse_addr(data)}
+            (dev["addr_type"], dev["rssi"], dev["best_rssi"], dev["present"],
+             dev["first_seen_ms"], dev["last_seen_ms"], dev["count"],
+             adv_len) = struct.unpack('<BbbBLLLB', data[6:23])
+            dev["present"] = dev["present"] != 0
+            dev["adv_data"] = data[23:23 + adv_len]
+            data = data[23 + adv_len:]
+            devs.append(dev)
+        return devs
 
-        if None != self.attr:
-            self.attrs.append(self.attr)
+    def parse_discover_primary_evt(self, data):
 
-        data_len = struct.unpack('>B', data[:1])[0]
-        if data_len == 0:
-            self.delegate[EVT_GATTC_DISC_PRIMARY](self.attrs)
+        (data_len, conn) = struct.unpack('<HH', data[:4])
+        db = self.get_db(conn)
+        if None != db["attr"]:
+            db["attrs"].append(db["attr"])
+            db["attr"] = None
+
+        if data_len == 2:
+            # end of discovery, the next one starts afresh
+            self.dbs.pop(conn)
+            cb = self.disc_cb.get(conn,
+                                  self.delegate.get(EVT_GATTC_DISC_PRIMARY))
+            if cb != None:
+                cb(db["attrs"])
             return
 
-        data = data[1:]
+        data = data[4:]
         (start, end) = struct.unpack('<HH', data[:4])
         data = data[4:]
-        data_len -= 5
+        data_len -= 7
         uuid = data[:UUID_STR_MAX_LEN]
 
-        self.attr = {}
-        self.attr["service"] = {}
-        self.attr["service"]["start"] = start
-        self.attr["service"]["end"] = end
-        self.attr["service"]["uuid"] = uuid
-        self.attr["service"]["characteristics"] = []
+        db["attr"] = {}
+        db["attr"]["service"] = {}
+        db["attr"]["service"]["start"] = start
+        db["attr"]["service"]["end"] = end
+        db["attr"]["service"]["uuid"] = uuid
+        db["attr"]["service"]["characteristics"] = []
         
     def parse_discover_characteristc_evt(self, data):
 
-        if None == self.attr:
+        (data_len, conn) = struct.unpack('<HH', data[:4])
+        attr = self.get_db(conn)["attr"]
+        if None == attr:
             return
 
-        data_len = struct.unpack('>B', data[:1])[0]
-
-        data = data[1:]
+        data = data[4:]
         (handle, value_handle, ext_prop, properties) = struct.unpack('<HHHB', data[:7])
         data = data[7:]
         data_len -= 7
@@ -125,43 +401,56 @@ class cmd :
         chr["ext_prop"] = ext_prop
         chr["uuid"] = uuid
         chr["desc"] = []
-        self.attr["service"]["characteristics"].append(chr)
+        attr["service"]["characteristics"].append(chr)
 
     def parse_discover_descriptor_evt(self, data):
 
-        if self.attr and "characteristics" in self.attr["service"]:
+        (data_len, conn) = struct.unpack('<HH', data[:4])
+        attr = self.get_db(conn)["attr"]
+        if attr and attr["service"]["characteristics"]:
 
             desc = {}
-            data_len = struct.unpack('>B', data[:1])[0]
-            data = data[1:]
+            data = data[4:]
 
             (desc["handle"], desc["uuid16"]) = struct.unpack('<HH', data[:4])
             data = data[4:]
             data_len -= 5
             desc["uuid"] = data[:UUID_STR_MAX_LEN]
 
-            self.attr["service"]["characteristics"][-1]["desc"].append(desc)
+            attr["service"]["characteristics"][-1]["desc"].append(desc)
 
     def parse_notification_evt(self, data):
 
-        data_len = struct.unpack('>B', data[:1])[0]
-        data = data[1:]
+        data_len = struct.unpack('<H', data[:2])[0]
+        data = data[2:]
 
         notif = {}
-        (value_handle, len, cccd_id) = struct.unpack('<HHB', data[:5])
-        data = data[5:]
+        (conn, value_handle, len, cccd_id) = struct.unpack('<HHHB', data[:7])
+        data = data[7:]
 
+        notif["conn"] = conn
         notif["cccd_id"] = cccd_id
         notif["value_handle"] = value_handle
         notif["data_len"] = len
         notif["data"] = data[:len]
-        self.delegate[EVT_GATTC_NOTIFICATION](notif)
+        self.ntf_cb.get(conn, self.delegate[EVT_GATTC_NOTIFICATION])(notif)
+
+    def parse_disconnected_evt(self, data):
+        data_len = struct.unpack('<H', data[:2])[0]
+        if data_len < 2:
+            return
+        conn = struct.unpack('<H', data[2:4])[0]
+        self.dbs.pop(conn, None)
+        self.disc_cb.pop(conn, None)
+        self.ntf_cb.pop(conn, None)
 
     def parse_event(self, evt_dict):
-        (adapter, evt, status) = struct.unpack('>BBB', evt_dict["content"][:3])
-        data = evt_dict["content"][3:]
+        (adapter, evt, status, req_id) = struct.unpack('<BBBH', evt_dict["content"][:5])
+        data = evt_dict["content"][5:]
         if evt == EVT_SCAN_RESULT:
             self.parse_scan_result_evt(data)
+        elif evt == EVT_SCAN_BATCH:
+            self.parse_scan_batch_evt(data)
         elif evt == EVT_GATTC_DISC_PRIMARY:
             self.parse_discover_primary_evt(data)
         elif evt == EVT_GATTC_DISC_CHAR:
@@ -170,6 +459,14 @@ class cmd :
             self.parse_discover_descriptor_evt(data)
         elif evt == EVT_GATTC_NOTIFICATION:
             self.parse_notification_evt(data)
+        elif evt == EVT_SCAN_SUMMARY:
+            self.parse_scan_summary_evt(data)
+        elif evt == EVT_DEVICE_APPEARED or evt == EVT_DEVICE_LOST:
+            self.parse_presence_evt(evt, data)
+        elif evt == EVT_GATTC_CONNECT_COMPLETE:
+            self.parse_connect_complete_evt(data)
+        elif evt == EVT_DISCONNECTED:
+            self.parse_disconnected_evt(data)
 
     def parse_read_controller_info_rsp(self, data, data_len):
         dict = {}
@@ -208,6 +505,19 @@ class cmd :
 
         return dict
 
+    def parse_read_multiple_rsp(self, data, data_len):
+        values = []
+        count = struct.unpack('<B', data[:1])[0]
+        pos = 1
+        for i in range(count):
+            (handle, att_ecode, length) = struct.unpack('<HBH',
+                                                        data[pos:pos + 5])
+            values.append({"handle": handle, "att_ecode": att_ecode,
+                           "length": length,
+                           "value": data[pos + 5:pos + 5 + length]})
+            pos += 5 + length
+        return values
+
     def parse_write_characteristic_rsp(self, data, data_len):
         '''
         nothing to do as status has already been checked
@@ -227,8 +537,8 @@ class cmd :
     def parse_resp(self, adapter, cmd, data):
         ret = {"status": "error", "reason": "unknown command"}
 
-        (status, data_len) = struct.unpack('>BB', data[:2])
-        data = data[2:]
+        (status, req_id, data_len) = struct.unpack('<BHH', data[:5])
+        data = data[5:]
 
         if status == 0:
             ret["status"] = "ok"
@@ -239,44 +549,163 @@ class cmd :
             if cmd == CMD_GATTC_READ_REQ:
                 ret["result"] = self.parse_read_characteristic_rsp(data, data_len)
             if cmd == CMD_GATTC_WRITE_REQ or cmd == CMD_GATTC_WRITE_CMD:
-                ret["result"] = parse_write_characteristic_rsp(data, data_len)
+                ret["result"] = self.parse_write_characteristic_rsp(data, data_len)
             if cmd == CMD_GATTC_SUBSCRIBE_REQ:
                 ret["result"] = self.parse_subscibe_rsp(data, data_len)
             if cmd == CMD_GATTC_UNSUBSCRIBE_REQ:
                 ret["result"] = self.parse_unsubscibe_rsp(data, data_len)
+            if cmd == CMD_DEVREG_SNAPSHOT:
+                ret["result"] = self.parse_devreg_snapshot_rsp(data, data_len)
+            if cmd == CMD_GATTC_READ_MULTIPLE:
+                ret["result"] = self.parse_read_multiple_rsp(data, data_len)
+            if cmd == CMD_GATTC_DB_DUMP:
+                ret["result"] = self.parse_db_dump_rsp(data, data_len)
+            if cmd == CMD_SET_PARAM_VERSION:
+                ret["result"] = struct.unpack('<B', data[:1])[0]
+            if cmd == CMD_GATTC_CONNECT_REQ and data_len >= 2:
+                ret["result"] = {"conn": struct.unpack('<H', data[:2])[0]}
         else:
             ret["err_code"] = status
             ret["reason"] = data[:data_len]
 
         return ret
 
-    def wait_resp(self, timeout = 10):
-        ret = {"status": "error", "reason": "timeout"}
-        try:
-            dict = self.ipc.q_resp.get(True, timeout)
-            (adapter, cmd) = struct.unpack('>BB', dict["content"][:2])
-            if cmd != self.cmd:
-                self.ipc.q_resp.put(dict)
-                ret["reason"] = "wrong response received"
-                return ret
-            else :
-                ret = self.parse_resp(adapter, cmd, dict["content"][2:])
-                return ret
-        except Queue.Empty:
-            raise cmdException("Command response reception timed out")
-        return error
+    def wait_resp(self, req_id, timeout = 10):
+        """Waiting for the response of a request sent by send_req
 
-    def send_cmd(self, adapter, cmd, bin = None, timeout = 5 ):
-        self.cmd = cmd
-        pkt = struct.pack('>BB', adapter, cmd)
+        Responses of other requests received meanwhile are kept until
+        their own wait_resp call.
+        """
+        deadline = time.time() + timeout
+        while req_id not in self.pending:
+            try:
+                dict = self.ipc.q_resp.get(True, max(0, deadline - time.time()))
+            except Queue.Empty:
+                raise cmdException("Command response reception timed out")
+            (adapter, cmd, status, id) = struct.unpack('<BBBH', dict["content"][:5])
+            self.pending[id] = (adapter, cmd, dict["content"][2:])
+
+        (adapter, cmd, content) = self.pending.pop(req_id)
+        return self.parse_resp(adapter, cmd, content)
+
+    def send_req(self, adapter, cmd, bin = None):
+        """Sending a command without waiting for its response
+
+        Returns:
+            request identifier, to be given to wait_resp
+        """
+        self.req_id = (self.req_id % 0xFFFF) + 1
+        pkt = struct.pack('<BBH', adapter, cmd, self.req_id)
         if bin != None :
             pkt += bin
         # print binascii.hexlify(pkt)
         self.ipc.ipc_send_req(pkt, len(pkt))
-        ret = self.wait_resp(timeout)
+        return self.req_id
+
+    def send_cmd(self, adapter, cmd, bin = None, timeout = 5 ):
+        req_id = self.send_req(adapter, cmd, bin)
+        ret = self.wait_resp(req_id, timeout)
         print("cmd(%d) response status [%s]" % (cmd, ret["status"]))
         return ret
 
+    def get_stats(self, kind = STATS_CMD, reset = False, timeout = 5):
+        """Reading daemon counters over msg_info
+
+        Args:
+            kind (int): STATS_CMD (per command) or STATS_EVT (per event)
+            reset (bool): clearing counters once read
+
+        Returns:
+        ::
+            {
+                index: {
+                    'count': int, 'errors': int,
+                    'bytes_in': int, 'bytes_out': int,
+                    'lat': [int], 'rtt': [int]  # log2(us) buckets
+                }
+            }
+        """
+        op = INFO_STATS_GET_RESET if reset else INFO_STATS_GET
+        pkt = struct.pack('<BB', op, kind)
+        self.ipc.ipc_send(self.ipc.IPC_MSG_TYPE_INFO, pkt, len(pkt))
+
+        stats = {}
+        while True:
+            try:
+                msg = self.ipc.q_info.get(True, timeout)
+            except Queue.Empty:
+                raise cmdException("Statistics reception timed out")
+            data = msg["content"]
+            (status, kind, index, last, count, errors, bytes_in, bytes_out,
+             nbuckets) = struct.unpack('<BBBBLLLLB', data[:21])
+            if status != 0:
+                raise cmdException("Statistics error %d" % status)
+            hist = struct.unpack('<%dL' % (2 * nbuckets),
+                                 data[21:21 + 8 * nbuckets])
+            stats[index] = {"count": count, "errors": errors,
+                            "bytes_in": bytes_in, "bytes_out": bytes_out,
+                            "lat": list(hist[:nbuckets]),
+                            "rtt": list(hist[nbuckets:])}
+            if last:
+                return stats
+
+    def set_event_mask(self, events):
+        """Selecting events forwarded to this client by the daemon
+
+        Args:
+            events (list): EVT_* events to receive; all events by default
+
+        Returns:
+        ::
+            {
+                'result': ("ok", "error"),
+                'reason': "failure reason"
+            }
+        """
+        mask = 0
+        for evt in events:
+            mask |= (1 << evt)
+        bin = struct.pack('<L', mask)
+        return self.send_cmd(0, CMD_SET_EVENT_MASK, bin)
+
+    def set_param_version(self, version):
+        """Selecting the command parameters encoding
+
+        Daemons not knowing the command keep PARAM_VERSION_TEXT.
+
+        Args:
+            version (int): PARAM_VERSION_TEXT, PARAM_VERSION_BINARY,
+                PARAM_VERSION_CONN or PARAM_VERSION_MTU
+
+        Returns:
+            int: encoding in use
+        """
+        bin = struct.pack('<B', version)
+        try:
+            ret = self.wait_resp(self.send_req(0, CMD_SET_PARAM_VERSION, bin))
+        except cmdException:
+            ret = {"status": "error"}
+        if ret["status"] == "ok":
+            self.param_version = version
+        return self.param_version
+
+    def set_log_level(self, level):
+        """Changing the daemon log verbosity
+
+        Args:
+            level (int): LOG_ERR, LOG_WARNING, LOG_INFO or LOG_DBG; levels
+                         compiled out of the daemon stay silent
+
+        Returns:
+        ::
+            {
+                'result': ("ok", "error"),
+                'reason': "failure reason"
+            }
+        """
+        bin = struct.pack('<B', level)
+        return self.send_cmd(0, CMD_SET_LOG_LEVEL, bin)
+
     def read_controller_info(self, adapter):
         """Sending reading controller information command
         
@@ -299,7 +728,8 @@ class cmd :
         bin = struct.pack('>B', 0)
         return self.send_cmd(adapter, CMD_MGMT_READ_CONTROLLER_INFO, bin)
 
-    def conn_param(self, adapter, addr, min, max, latency, timeout):
+    def conn_param(self, adapter, addr, min, max, latency, timeout,
+                   addrtype = "public"):
         """Sending set connection parameter command
         
         Args:
@@ -309,6 +739,7 @@ class cmd :
             max (int): Maximum connection interval
             latency (int): latency
             timeout (int): Supervision timeout
+            addrtype (str): "public" or "random"
 
         Returns:
         ::
@@ -317,8 +748,13 @@ class cmd :
                 'reason': "failure reason"
             }
         """
-        bin = addr
-        bin += struct.pack('>HHHH', min, max, latency, timeout)
+        if self.param_version == PARAM_VERSION_TEXT:
+            bin = addr
+            bin += struct.pack('>HHHH', min, max, latency, timeout)
+        else:
+            bin = self.addr_to_bin(addr)
+            bin += struct.pack('<BHHHH', 1 if addrtype == "public" else 2,
+                               min, max, latency, timeout)
         return self.send_cmd(adapter, CMD_MGMT_SET_CONNECTION_PARAM, bin)
 
     def set_local_name(self, adapter, name):
@@ -371,11 +807,32 @@ class cmd :
         bin = struct.pack('>B', 0)
         return self.send_cmd(adapter, CMD_MGMT_POWER, bin)
 
-    def scan_start(self, adapter, scan_delegate):
+    def scan_start(self, adapter, scan_delegate, dedup = None,
+                   rssi = None, uuids = None, timeout_ms = 0,
+                   summary_delegate = None, batch = None):
         """Sending start BLE scan command
         
         Args:
             adapter (int): Adapter index
+            dedup (tuple): (rssi_delta, min_interval_ms) for reporting a
+                           device again only when its advertising data
+                           changes or its RSSI moves by rssi_delta dBm,
+                           at most every min_interval_ms; None: every
+                           report is forwarded
+            rssi (int): drop reports weaker than rssi dBm
+            uuids (list): only report devices advertising one of these
+                          services, 16-bit ints or 128-bit uuid strings
+            timeout_ms (int): stopping the scan after timeout_ms, then
+                              calling summary_delegate with the devices
+                              seen (addr, addr_type, best rssi, reports)
+                              and the number of devices missing, the
+                              table being full; 0: scanning until
+                              scan_stop()
+            batch (tuple): (interval_ms, count) for getting results in
+                           batches, sent interval_ms after the first
+                           result or once holding count results; 0: no
+                           limit. scan_delegate is still called once
+                           per result
 
         Returns:
         ::
@@ -385,9 +842,90 @@ class cmd :
             }
         """
         self.delegate[EVT_SCAN_RESULT] = scan_delegate
+        if summary_delegate != None:
+            self.delegate[EVT_SCAN_SUMMARY] = summary_delegate
+        opts = b''
+        if dedup != None:
+            opts += struct.pack('<BBBH', SCAN_OPT_DEDUP, 3, dedup[0], dedup[1])
+        if rssi != None:
+            opts += struct.pack('<BBb', SCAN_OPT_RSSI, 1, rssi)
+        if batch != None:
+            opts += struct.pack('<BBHB', SCAN_OPT_BATCH, 3, batch[0], batch[1])
+        if uuids:
+            u16 = b''.join(struct.pack('<H', u) for u in uuids
+                           if isinstance(u, int))
+            if u16:
+                opts += struct.pack('<BB', SCAN_OPT_UUID16, len(u16)) + u16
+            for u in uuids:
+                if not isinstance(u, int):
+                    u128 = binascii.unhexlify(u.replace('-', ''))[::-1]
+                    opts += struct.pack('<BB', SCAN_OPT_UUID128, 16) + u128
         bin = struct.pack('>B', 1)
+        if opts or timeout_ms:
+            bin += struct.pack('<H', timeout_ms) + opts
         return self.send_cmd(adapter, CMD_MGMT_SCAN, bin)
 
+    def scan_set_program(self, adapter, insns):
+        """Loading the advertising data matcher run by the daemon on every
+        scan report, cf inc/advprog.h
+
+        Args:
+            adapter (int): Adapter index
+            insns (list): (op, jt, jf, k) tuples, ADVPROG_* operations;
+                          empty: no program
+
+        Example, iBeacon with major in [100, 200]:
+        ::
+            [(ADVPROG_FIND,   0, 6, 0xff),
+             (ADVPROG_LD_W,   0, 0, 0),
+             (ADVPROG_JEQ,    0, 4, 0x1502004c),
+             (ADVPROG_LD_HBE, 0, 0, 20),
+             (ADVPROG_JGE,    0, 2, 100),
+             (ADVPROG_JGT,    1, 0, 200),
+             (ADVPROG_RET,    0, 0, 1),
+             (ADVPROG_RET,    0, 0, 0)]
+
+        Returns:
+        ::
+            {
+                'result': ("ok", "error"),
+                'reason': "failure reason"
+            }
+        """
+        bin = b''.join(struct.pack('<BBBxI', op, jt, jf, k)
+                       for (op, jt, jf, k) in insns)
+        return self.send_cmd(adapter, CMD_SCAN_SET_PROGRAM, bin)
+
+    def devreg_snapshot(self, adapter):
+        """Reading the devices the daemon remembers for an adapter, most
+        recently seen first
+
+        Returns:
+        ::
+            {
+                'result': [{'addr', 'addr_type', 'rssi', 'best_rssi',
+                            'present', 'first_seen_ms', 'last_seen_ms',
+                            'count', 'adv_data'}, ...],
+                'reason': "failure reason"
+            }
+        """
+        return self.send_cmd(adapter, CMD_DEVREG_SNAPSHOT)
+
+    def devreg_presence(self, appeared_delegate, lost_delegate,
+                        lost_ms = 0):
+        """Following devices appearing and getting lost
+
+        Args:
+            appeared_delegate: called with {'addr', 'addr_type', 'rssi'}
+                               when a device is seen again
+            lost_delegate: same, once not seen for lost_ms
+            lost_ms (int): 0: daemon default (10s)
+        """
+        self.delegate[EVT_DEVICE_APPEARED] = appeared_delegate
+        self.delegate[EVT_DEVICE_LOST] = lost_delegate
+        bin = struct.pack('<L', lost_ms)
+        return self.send_cmd(0, CMD_DEVREG_SET_LOST_TIMEOUT, bin)
+
     def scan_stop(self, adapter):
         """Sending stop BLE scan command
         
@@ -404,21 +942,32 @@ class cmd :
         bin = struct.pack('>B', 0)
         return self.send_cmd(adapter, CMD_MGMT_SCAN, bin)
 
-    def connect(self, adapter, addr, addrtype, sec_level, service_discovery_cb):
+    def connect(self, adapter, addr, addrtype, sec_level, service_discovery_cb,
+                complete_cb = None, mtu = 0):
         """Sending create connection command
-        
+
+        The response comes as soon as the connection is started, with
+        the connection handle the other GATT commands take; its outcome
+        is given to complete_cb.
+
         Args:
             adapter (int): Adapter index.
             addr (str): BLE address to connect (00:11:22:33:44:55).
             addrtype (str): "public" or "random"
             sec_level(str): security level from ("low", "medium", "high")
             discovery_cb (callback) function called on_service_discovery
+            complete_cb (callback) function called with
+                {'status': 0 on success, 'conn': int, 'addr': str,
+                 'addr_type': int, 'mtu': ATT MTU negotiated}
+            mtu (int): ATT MTU to request, up to ATT_MAX_LE_MTU; 0: the
+                default one. Needs PARAM_VERSION_MTU.
 
         Returns:
         ::
             {
                 'result': ("ok", "error"),
                 'reason': "failure reason"
+                'result': {'conn': int}
             }
 
         """
@@ -433,13 +982,55 @@ class cmd :
             return ret
 
         self.delegate[EVT_GATTC_DISC_PRIMARY] = service_discovery_cb
-        bin = addr
-        bin = ":".join([addr[x:x+2] for x in range(0,len(addr),3)][::-1])
+        if complete_cb != None:
+            self.delegate[EVT_GATTC_CONNECT_COMPLETE] = complete_cb
+        if self.param_version == PARAM_VERSION_TEXT:
+            bin = ":".join([addr[x:x+2] for x in range(0,len(addr),3)][::-1])
+        else:
+            bin = self.addr_to_bin(addr)
         bin += struct.pack('>BB', addrtype, sec_level)
-        self.reset_db()
-        return self.send_cmd(adapter, CMD_GATTC_CONNECT_REQ, bin, timeout = 15)
+        if self.param_version >= PARAM_VERSION_MTU:
+            bin += struct.pack('<H', mtu)
+        ret = self.send_cmd(adapter, CMD_GATTC_CONNECT_REQ, bin)
+        if ret["status"] == "ok" and "result" in ret:
+            self.disc_cb[ret["result"]["conn"]] = service_discovery_cb
+        return ret
+
+    def connect_cancel(self, adapter, conn = CONN_ANY):
+        """Giving up a connection being established
+
+        Args:
+            adapter (int): Adapter index.
+            conn (int): connection handle, CONN_ANY: the first one
+
+        Returns:
+        ::
+            {
+                'result': ("ok", "error"),
+                'reason': "failure reason"
+            }
+        """
+        return self.send_cmd(adapter, CMD_GATTC_CONNECT_CANCEL,
+                             self.conn_bin(conn))
+
+    def set_connect_timeout(self, timeout_ms):
+        """Setting the time given to a connection to be established
+
+        Args:
+            timeout_ms (int): 0 for the daemon default
 
-    def subscribe(self, adapter, value_handle, value, notification_cb):
+        Returns:
+        ::
+            {
+                'result': ("ok", "error"),
+                'reason': "failure reason"
+            }
+        """
+        bin = struct.pack('<L', timeout_ms)
+        return self.send_cmd(0, CMD_GATTC_SET_CONNECT_TIMEOUT, bin)
+
+    def subscribe(self, adapter, value_handle, value, notification_cb,
+                  conn = CONN_ANY):
         """Sending Notification / Indication subscription command
 
         Args:
@@ -447,6 +1038,7 @@ class cmd :
             value_handle (int): characteristic value handle
             value (int): 1 for Notification; 2 for Indication
             notification_cb (func): Notification callback.
+            conn (int): connection handle, CONN_ANY: the first one
 
         Returns:
         ::
@@ -456,17 +1048,151 @@ class cmd :
             }
 
         """
-        if value != 0:
+        if value != 0 and conn != CONN_ANY:
+            self.ntf_cb[conn] = notification_cb
+        elif value != 0:
             self.delegate[EVT_GATTC_NOTIFICATION] = notification_cb
-        bin = struct.pack('>BH', value, value_handle)
+        if self.param_version == PARAM_VERSION_TEXT:
+            bin = struct.pack('>BH', value, value_handle)
+        else:
+            bin = self.conn_bin(conn) + struct.pack('<HB', value_handle,
+                                                    value)
         return self.send_cmd(adapter, CMD_GATTC_SUBSCRIBE_REQ, bin)
 
-    def unsubscribe(self, adapter, cccd_id):
+    def read(self, adapter, chr, handle, conn = CONN_ANY):
+        """Sending GATT read command
+
+        Args:
+            adapter (int): adapter index.
+            chr (str): characteristic uuid.
+            handle (int): characteristic value handle.
+            conn (int): connection handle, CONN_ANY: the first one
+
+        Returns:
+        ::
+            {
+                'result': ("ok", "error"),
+                'reason': "failure reason"
+                'result': {'length': int, 'value': "read value"}
+            }
+        """
+        if self.param_version == PARAM_VERSION_TEXT:
+            bin = struct.pack('>H', handle)
+        else:
+            bin = self.conn_bin(conn) + struct.pack('<H', handle)
+        return self.send_cmd(adapter, CMD_GATTC_READ_REQ, bin)
+
+    def read_multiple(self, adapter, handles, mode = GATTC_READ_SINGLE,
+                      conn = CONN_ANY):
+        """Reading several values in one command
+
+        Args:
+            adapter (int): adapter index.
+            handles (list): value handles, up to GATTC_READ_MULTIPLE_MAX
+            mode (int): GATTC_READ_SINGLE: one read per handle, each
+                value with its outcome; GATTC_READ_MULTIPLE: one ATT
+                Read Multiple, the values concatenated as one (fixed
+                length values, all but the last)
+            conn (int): connection handle, CONN_ANY: the first one
+
+        Returns:
+        ::
+            {
+                'result': ("ok", "error"),
+                'reason': "failure reason"
+                'result': [{'handle': int, 'att_ecode': 0 on success,
+                            'length': int, 'value': "read value"}, ...]
+            }
+        """
+        bin = self.conn_bin(conn) + struct.pack('<BB', mode, len(handles))
+        for handle in handles:
+            bin += struct.pack('<H', handle)
+        return self.send_cmd(adapter, CMD_GATTC_READ_MULTIPLE, bin)
+
+    def write(self, adapter, cmd, handle, value, conn = CONN_ANY):
+        if self.param_version == PARAM_VERSION_TEXT:
+            bin = struct.pack('>H', handle)
+        else:
+            bin = self.conn_bin(conn) + struct.pack('<HH', handle,
+                                                    len(value))
+        return self.send_cmd(adapter, cmd, bin + value)
+
+    def write_cmd(self, adapter, chr, handle, value, conn = CONN_ANY):
+        """Sending GATT write without response command
+
+        Args:
+            adapter (int): adapter index.
+            chr (str): characteristic uuid.
+            handle (int): characteristic value handle.
+            value (str): data to write.
+            conn (int): connection handle, CONN_ANY: the first one
+
+        Returns:
+        ::
+            {
+                'result': ("ok", "error"),
+                'reason': "failure reason"
+            }
+        """
+        return self.write(adapter, CMD_GATTC_WRITE_CMD, handle, value, conn)
+
+    def write_req(self, adapter, chr, handle, value, conn = CONN_ANY):
+        """Sending GATT write with response command
+
+        Args:
+            adapter (int): adapter index.
+            chr (str): characteristic uuid.
+            handle (int): characteristic value handle.
+            value (str): data to write.
+            conn (int): connection handle, CONN_ANY: the first one
+
+        Returns:
+        ::
+            {
+                'result': ("ok", "error"),
+                'reason': "failure reason"
+            }
+        """
+        return self.write(adapter, CMD_GATTC_WRITE_REQ, handle, value, conn)
+
+    def db_dump(self, adapter, conn = CONN_ANY):
+        """Getting the database discovered on a connection at once
+
+        Instead of the EVT_GATTC_DISC_* events, which may then be masked
+        out; the database comes in as few responses as its size needs.
+
+        Args:
+            adapter (int): Adapter index
+            conn (int): connection handle, CONN_ANY: the first one
+
+        Returns:
+        ::
+            {
+                'result': ("ok", "error"),
+                'reason': "failure reason"
+                'result': [{'service': {...}}, ...] as given to the
+                          discovery callback
+            }
+        """
+        attrs = []
+        start = 1
+        while start:
+            bin = self.conn_bin(conn) + struct.pack('<H', start)
+            ret = self.send_cmd(adapter, CMD_GATTC_DB_DUMP, bin)
+            if ret["status"] != "ok":
+                return ret
+            attrs += ret["result"]["attrs"]
+            start = ret["result"]["next"]
+        ret["result"] = attrs
+        return ret
+
+    def unsubscribe(self, adapter, cccd_id, conn = CONN_ANY):
         """Sending stop BLE scan command
         
         Args:
             adapter (int): Adapter index
             cccd_id (int): Subscription ID
+            conn (int): connection handle, CONN_ANY: the first one
 
         Returns:
         ::
@@ -475,5 +1201,5 @@ class cmd :
                 'reason': "failure reason"
             }
         """
-        bin = struct.pack('>B', cccd_id)
+        bin = self.conn_bin(conn) + struct.pack('>B', cccd_id)
         return self.send_cmd(adapter, CMD_GATTC_UNSUBSCRIBE_REQ, bin)
@@ -42,8 +42,10 @@ class gattc():
     def __init__(self, cmd):
         self.cmd = cmd
         self.attrs = None
+        self.conn = None
 
-    def connect(self, devId, addr, addrtype, sec_level):
+    def connect(self, devId, addr, addrtype, sec_level, complete_cb = None,
+                mtu = 0):
         """Create a connection
         
         Args:
@@ -51,17 +53,30 @@ class gattc():
             addr (str): BLE address to connect (00:11:22:33:44:55).
             addrtype (str): "public" or "random"
             sec_level(str): security level from ("low", "medium", "high")
+            complete_cb (callback): called once the connection is
+                established or has failed, cf cmd.connect
+            mtu (int): ATT MTU to request (23..517), 0: default
 
         Returns:
         ::
             {
                 'result': ("ok", "error"),
                 'reason': "failure reason"
+                'result': {'conn': int}
             }
         """
-        ret = self.cmd.connect(devId, addr, addrtype, sec_level, self.service_discovery)
+        ret = self.cmd.connect(devId, addr, addrtype, sec_level,
+                               self.service_discovery, complete_cb, mtu)
+        if ret["status"] == "ok" and "result" in ret:
+            self.conn = ret["result"]["conn"]
         return ret
 
+    def get_conn(self):
+        """Connection handle the GATT commands below address"""
+        if self.conn == None:
+            return cmd.CONN_ANY
+        return self.conn
+
     def service_discovery(self, result):
         self.attrs = result
 
@@ -78,6 +93,22 @@ class gattc():
         """
         return self.attrs
 
+    def dump_db(self, devId):
+        """Retrieve the GATT database in one go once discovered, cf
+        cmd.db_dump; get_db returns it afterwards
+
+        Returns:
+        ::
+            {
+                'result': ("ok", "error"),
+                'reason': "failure reason"
+            }
+        """
+        ret = self.cmd.db_dump(devId, self.get_conn())
+        if ret["status"] == "ok":
+            self.attrs = ret["result"]
+        return ret
+
     def write_cmd(self, devId, chr, handle, value):
         """Perform a write without response
     
@@ -95,7 +126,7 @@ class gattc():
             }
     
         """
-        ret = self.cmd.write_cmd(devId, chr, handle, value)
+        ret = self.cmd.write_cmd(devId, chr, handle, value, self.get_conn())
         return ret
 
     def write_req(self, devId, chr, handle, value):
@@ -115,7 +146,7 @@ class gattc():
             }
     
         """
-        ret = self.cmd.write_req(devId, chr, handle, value)
+        ret = self.cmd.write_req(devId, chr, handle, value, self.get_conn())
         return ret
 
     def read(self, devId, chr, handle):
@@ -135,9 +166,30 @@ class gattc():
             }
     
         """
-        ret = self.cmd.read(devId, chr, handle)
+        ret = self.cmd.read(devId, chr, handle, self.get_conn())
         return ret
 
+    def read_multiple(self, devId, handles):
+        """Read several characteristic or descriptor values at once,
+        cf cmd.read_multiple
+
+        Args:
+            devId (int): adapter index.
+            handles (list): value handles.
+
+        Returns:
+        ::
+            {
+                'result': ("ok", "error"),
+                'reason': "failure reason"
+                'result': [{'handle': int, 'att_ecode': int,
+                            'length': int, 'value': "read value"}, ...]
+            }
+        """
+        return self.cmd.read_multiple(devId, handles,
+                                      cmd.GATTC_READ_SINGLE,
+                                      self.get_conn())
+
     def get_characteristic_by_uuid(self, struuid):
         if self.attrs == None:
             return None
@@ -193,7 +245,7 @@ class gattc():
 
         ret = self.cmd.subscribe(devId, chr["value_handle"],
                                  GATT_NOTIFICATION,
-                                 self.notif_ind_handler)
+                                 self.notif_ind_handler, self.get_conn())
         if ret["status"] == "ok":
             info = {}
             info["value_handle"] = chr["value_handle"]
@@ -232,7 +284,8 @@ class gattc():
         for idx in self.ntf_ind_cb:
             elt = self.ntf_ind_cb[idx]
             if elt["value_handle"] == chr["value_handle"]:
-                ret = self.cmd.unsubscribe(devId, elt["cccd_id"])
+                ret = self.cmd.unsubscribe(devId, elt["cccd_id"],
+                                           self.get_conn())
                 if ret["status"] == "ok":
                     self.ntf_ind_cb.pop(elt["cccd_id"])
                     break
@@ -0,0 +1,252 @@
+/*
+ *  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "btle_error.h"
+#include "adv.h"
+
+/* 00000000-0000-1000-8000-00805F9B34FB, little endian */
+static const uint8_t adv_base_uuid[ADV_UUID128_LEN] = {
+	0xfb, 0x34, 0x9b, 0x5f, 0x80, 0x00, 0x00, 0x80,
+	0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+uint8_t adv_uuid_to128(const uint8_t *uuid, uint8_t len,
+		       uint8_t out[ADV_UUID128_LEN])
+{
+	if (!uuid || !out)
+		return BTLE_ERROR_NULL_ARG;
+
+	switch (len) {
+	case 2:
+	case 4:
+		memcpy(out, adv_base_uuid, ADV_UUID128_LEN);
+		memcpy(&out[12], uuid, len);
+		break;
+	case ADV_UUID128_LEN:
+		memcpy(out, uuid, ADV_UUID128_LEN);
+		break;
+	default:
+		return BTLE_ERROR_INVALID_ARG;
+	}
+
+	return BTLE_SUCCESS;
+}
+
+static bool adv_match_uuid(const uint8_t *uuid, uint8_t len,
+			   const uint8_t (*uuids)[ADV_UUID128_LEN],
+			   uint16_t uuid_count)
+{
+	uint8_t uuid128[ADV_UUID128_LEN];
+	uint16_t idx;
+
+	if (adv_uuid_to128(uuid, len, uuid128))
+		return false;
+
+	for (idx = 0; idx < uuid_count; idx++) {
+		if (!memcmp(uuid128, uuids[idx], ADV_UUID128_LEN))
+			return true;
+	}
+
+	return false;
+}
+
+bool adv_has_uuid(const uint8_t *eir, uint16_t eir_len,
+		  const uint8_t (*uuids)[ADV_UUID128_LEN],
+		  uint16_t uuid_count)
+{
+	uint16_t off = 0;
+
+	/* [len | type | data(len - 1)] ... ; len 0 ends the data */
+	while (off + 1 < eir_len && eir[off]) {
+		uint8_t field_len = eir[off];
+		uint8_t type = eir[off + 1];
+		const uint8_t *data = &eir[off + 2];
+		uint8_t data_len = field_len - 1;
+		uint8_t uuid_len = 0;
+		uint8_t idx;
+
+		if (off + 1 + field_len > eir_len)
+			break;
+
+		switch (type) {
+		case ADV_TYPE_UUID16_SOME:
+		case ADV_TYPE_UUID16_ALL:
+			uuid_len = 2;
+			break;
+		case ADV_TYPE_UUID32_SOME:
+		case ADV_TYPE_UUID32_ALL:
+			uuid_len = 4;
+			break;
+		case ADV_TYPE_UUID128_SOME:
+		case ADV_TYPE_UUID128_ALL:
+			uuid_len = ADV_UUID128_LEN;
+			break;
+		}
+
+		for (idx = 0; uuid_len && idx + uuid_len <= data_len;
+		     idx += uuid_len) {
+			if (adv_match_uuid(&data[idx], uuid_len, uuids,
+					   uuid_count))
+				return true;
+		}
+
+		off += 1 + field_len;
+	}
+
+	return false;
+}
+
+static uint8_t adv_rec_kind(uint8_t type)
+{
+	switch (type) {
+	case ADV_TYPE_FLAGS:
+		return ADV_REC_FLAGS;
+	case ADV_TYPE_NAME_SHORT:
+	case ADV_TYPE_NAME_COMPLETE:
+		return ADV_REC_NAME;
+	case ADV_TYPE_UUID16_SOME:
+	case ADV_TYPE_UUID16_ALL:
+		return ADV_REC_UUID16;
+	case ADV_TYPE_UUID32_SOME:
+	case ADV_TYPE_UUID32_ALL:
+		return ADV_REC_UUID32;
+	case ADV_TYPE_UUID128_SOME:
+	case ADV_TYPE_UUID128_ALL:
+		return ADV_REC_UUID128;
+	case ADV_TYPE_SVC_DATA16:
+		return ADV_REC_SVC_DATA16;
+	case ADV_TYPE_SVC_DATA32:
+		return ADV_REC_SVC_DATA32;
+	case ADV_TYPE_SVC_DATA128:
+		return ADV_REC_SVC_DATA128;
+	case ADV_TYPE_MANUFACTURER:
+		return ADV_REC_MANUFACTURER;
+	case ADV_TYPE_TX_POWER:
+		return ADV_REC_TX_POWER;
+	case ADV_TYPE_APPEARANCE:
+		return ADV_REC_APPEARANCE;
+	default:
+		return ADV_REC_MAX;
+	}
+}
+
+static uint16_t adv_rec_put(uint8_t *rec, uint16_t rec_size, uint16_t len,
+			    uint8_t kind, const uint8_t *val, uint8_t val_len)
+{
+	if (len + 2 + val_len > rec_size)
+		return len;
+
+	rec[len] = kind;
+	rec[len + 1] = val_len;
+	memcpy(&rec[len + 2], val, val_len);
+
+	return len + 2 + val_len;
+}
+
+/*
+ * Appending every entry of @kind found in the first @eir_len bytes,
+ * known to be well formed
+ */
+static uint16_t adv_rec_add(const uint8_t *eir, uint16_t eir_len,
+			    uint8_t kind, uint8_t *rec, uint16_t rec_size,
+			    uint16_t len)
+{
+	const uint8_t *name = NULL;
+	uint8_t name_len = 0;
+	uint16_t entry = 0;
+	uint16_t off;
+
+	for (off = 0; off < eir_len; off += 1 + eir[off]) {
+		uint8_t type = eir[off + 1];
+		const uint8_t *data = &eir[off + 2];
+		uint8_t data_len = eir[off] - 1;
+
+		if (adv_rec_kind(type) != kind)
+			continue;
+
+		switch (kind) {
+		case ADV_REC_NAME:
+			if (!name || type == ADV_TYPE_NAME_COMPLETE) {
+				name = data;
+				name_len = data_len;
+			}
+			continue;
+		case ADV_REC_UUID16:
+		case ADV_REC_UUID32:
+		case ADV_REC_UUID128:
+			/* growing the list entry while it can */
+			if (entry && rec[entry + 1] + data_len <= UINT8_MAX &&
+			    len + data_len <= rec_size) {
+				memcpy(&rec[len], data, data_len);
+				rec[entry + 1] += data_len;
+				len += data_len;
+				continue;
+			}
+			entry = len;
+			break;
+		}
+
+		len = adv_rec_put(rec, rec_size, len, kind, data, data_len);
+		if (entry == len)
+			entry = 0;
+	}
+
+	if (name)
+		len = adv_rec_put(rec, rec_size, len, kind, name, name_len);
+
+	return len;
+}
+
+uint16_t adv_parse(const uint8_t *eir, uint16_t eir_len, uint8_t *rec,
+		   uint16_t rec_size)
+{
+	uint16_t present = 0;
+	uint16_t len = ADV_REC_HDR_LEN;
+	uint16_t off;
+	uint8_t kind;
+
+	if (!eir || !rec || rec_size < ADV_REC_HDR_LEN)
+		return 0;
+
+	/* kinds present, and end of the well formed part */
+	for (off = 0; off + 1 < eir_len && eir[off] &&
+	     off + 1 + eir[off] <= eir_len; off += 1 + eir[off]) {
+		kind = adv_rec_kind(eir[off + 1]);
+		if (kind < ADV_REC_MAX)
+			present |= 1 << kind;
+	}
+	eir_len = off;
+
+	for (kind = 0; kind < ADV_REC_MAX; kind++) {
+		uint16_t start = len;
+
+		if (!(present & (1 << kind)))
+			continue;
+
+		len = adv_rec_add(eir, eir_len, kind, rec, rec_size, len);
+		if (len == start)
+			present &= ~(1 << kind);
+	}
+
+	rec[0] = present & 0xff;
+	rec[1] = present >> 8;
+
+	return len;
+}
@@ -0,0 +1,202 @@
+/*
+ *  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#define MODULE "advprog"
+#include "btprint.h"
+
+#include "btle_error.h"
+#include "advprog.h"
+
+/*
+ * Looking for the next AD structure of @type starting at offset @pos
+ *
+ * Returns the offset of the structure, or eir_len when none
+ */
+static uint16_t advprog_find(const uint8_t *eir, uint16_t eir_len,
+			     uint16_t pos, uint8_t type)
+{
+	while (pos + 1 < eir_len) {
+		uint8_t field_len = eir[pos];
+
+		/* zero length: early end of the significant part */
+		if (!field_len || pos + 1 + field_len > eir_len)
+			break;
+
+		if (eir[pos + 1] == type)
+			return pos;
+
+		pos += 1 + field_len;
+	}
+
+	return eir_len;
+}
+
+uint8_t advprog_load(const uint8_t *data, uint16_t data_len,
+		     struct advprog *prog)
+{
+	uint16_t len = data_len / ADVPROG_INSN_LEN;
+	uint16_t pc;
+
+	if (!data || !prog)
+		return BTLE_ERROR_NULL_ARG;
+
+	prog->len = 0;
+
+	if (!len || len > ADVPROG_INSN_MAX || data_len % ADVPROG_INSN_LEN)
+		return BTLE_ERROR_INVALID_ARG;
+
+	for (pc = 0; pc < len; pc++, data += ADVPROG_INSN_LEN) {
+		struct advprog_insn *insn = &prog->insn[pc];
+
+		insn->op = data[0];
+		insn->jt = data[1];
+		insn->jf = data[2];
+		insn->k = data[4] | data[5] << 8 | data[6] << 16 |
+			  (uint32_t)data[7] << 24;
+
+		switch (insn->op) {
+		case ADVPROG_RSH:
+			if (insn->k >= 32)
+				goto reject;
+			break;
+		case ADVPROG_JA:
+			if (insn->k >= len - pc - 1)
+				goto reject;
+			break;
+		case ADVPROG_FIND:
+		case ADVPROG_FIND_NEXT:
+		case ADVPROG_JEQ:
+		case ADVPROG_JGT:
+		case ADVPROG_JGE:
+		case ADVPROG_JSET:
+			if (insn->jt >= len - pc - 1 ||
+			    insn->jf >= len - pc - 1)
+				goto reject;
+			break;
+		default:
+			if (insn->op >= ADVPROG_OP_MAX)
+				goto reject;
+			break;
+		}
+	}
+
+	if (prog->insn[len - 1].op != ADVPROG_RET) {
+		pc = len - 1;
+		goto reject;
+	}
+
+	prog->len = len;
+
+	return BTLE_SUCCESS;
+
+reject:
+	ERR("program rejected at instruction %d (op %d)\n", pc,
+	    prog->insn[pc].op);
+
+	return BTLE_ERROR_INVALID_ARG;
+}
+
+bool advprog_run(const struct advprog *prog, const uint8_t *eir,
+		 uint16_t eir_len)
+{
+	/* current field: structure offset, data offset and length */
+	uint16_t field = eir_len;
+	uint16_t x = 0;
+	uint16_t l = eir_len;
+	uint32_t a = 0;
+	uint16_t pc;
+
+	for (pc = 0; pc < prog->len; pc++) {
+		const struct advprog_insn *insn = &prog->insn[pc];
+		bool cond;
+
+		switch (insn->op) {
+		case ADVPROG_RET:
+			return !!insn->k;
+		case ADVPROG_FIND:
+		case ADVPROG_FIND_NEXT:
+			if (insn->op == ADVPROG_FIND || field >= eir_len)
+				field = 0;
+			else
+				field += 1 + eir[field];
+
+			field = advprog_find(eir, eir_len, field, insn->k);
+			cond = field < eir_len;
+			x = cond ? field + 2 : 0;
+			l = cond ? eir[field] - 1 : eir_len;
+			pc += cond ? insn->jt : insn->jf;
+			break;
+		case ADVPROG_LD_B:
+			if (insn->k >= l)
+				return false;
+			a = eir[x + insn->k];
+			break;
+		case ADVPROG_LD_H:
+		case ADVPROG_LD_HBE:
+			if (l < 2 || insn->k > l - 2u)
+				return false;
+			if (insn->op == ADVPROG_LD_H)
+				a = eir[x + insn->k] |
+				    eir[x + insn->k + 1] << 8;
+			else
+				a = eir[x + insn->k] << 8 |
+				    eir[x + insn->k + 1];
+			break;
+		case ADVPROG_LD_W:
+			if (l < 4 || insn->k > l - 4u)
+				return false;
+			a = eir[x + insn->k] | eir[x + insn->k + 1] << 8 |
+			    eir[x + insn->k + 2] << 16 |
+			    (uint32_t)eir[x + insn->k + 3] << 24;
+			break;
+		case ADVPROG_LD_LEN:
+			a = l;
+			break;
+		case ADVPROG_AND:
+			a &= insn->k;
+			break;
+		case ADVPROG_RSH:
+			a >>= insn->k;
+			break;
+		case ADVPROG_JA:
+			pc += insn->k;
+			break;
+		case ADVPROG_JEQ:
+		case ADVPROG_JGT:
+		case ADVPROG_JGE:
+		case ADVPROG_JSET:
+			if (insn->op == ADVPROG_JEQ)
+				cond = a == insn->k;
+			else if (insn->op == ADVPROG_JGT)
+				cond = a > insn->k;
+			else if (insn->op == ADVPROG_JGE)
+				cond = a >= insn->k;
+			else
+				cond = a & insn->k;
+			pc += cond ? insn->jt : insn->jf;
+			break;
+		default:
+			/* not reached on a verified program */
+			return false;
+		}
+	}
+
+	return false;
+}
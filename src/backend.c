@@ -0,0 +1,242 @@
+/*
+ *  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdbool.h>
+
+#include <unistd.h>
+
+#include "lib/bluetooth.h"
+#include "lib/l2cap.h"
+#include "lib/hci.h"
+#include "lib/hci_lib.h"
+#include "lib/mgmt.h"
+#include "src/shared/mgmt.h"
+#include "src/shared/util.h"
+
+#define MODULE "backend"
+#include "btprint.h"
+
+#include "btle_error.h"
+#include "cmd.h"
+#include "backend.h"
+
+#define ATT_CID 4
+
+static const struct backend_ops *backend = &backend_hci;
+
+static struct mgmt *hci_mgmt;
+
+static void backend_hci_mgmt_dbg(const char *str, void *user_data)
+{
+	/* DBG("mgmt: %s\n", str); */
+}
+
+static uint8_t backend_hci_init(void)
+{
+	hci_mgmt = mgmt_new_default();
+	if (!hci_mgmt) {
+		ERR("new mgmt\n");
+		return BTLE_ERROR_INTERNAL;
+	}
+
+	mgmt_set_debug(hci_mgmt, backend_hci_mgmt_dbg, NULL, NULL);
+
+	return BTLE_SUCCESS;
+}
+
+static void backend_hci_close(void)
+{
+	mgmt_unref(hci_mgmt);
+	hci_mgmt = NULL;
+}
+
+static void backend_hci_mgmt_event(uint16_t index, uint16_t length,
+				   const void *param, void *user_data)
+{
+	cmd_mgmt_event(PTR_TO_UINT(user_data), index, length, param);
+}
+
+static bool backend_hci_mgmt_register(uint16_t event, uint16_t index)
+{
+	return mgmt_register(hci_mgmt, event, index, backend_hci_mgmt_event,
+			     UINT_TO_PTR(event), NULL) != 0;
+}
+
+static void backend_hci_mgmt_unregister_index(uint16_t index)
+{
+	mgmt_unregister_index(hci_mgmt, index);
+}
+
+static void backend_hci_mgmt_cancel_index(uint16_t index)
+{
+	mgmt_cancel_index(hci_mgmt, index);
+}
+
+static unsigned int backend_hci_mgmt_send(uint16_t opcode,
+					  uint16_t index, uint16_t length,
+					  const void *param,
+					  backend_rsp_cb cb, void *user_data)
+{
+	/* controller information is not held behind pending commands */
+	if (opcode == MGMT_OP_READ_INFO)
+		return mgmt_send_nowait(hci_mgmt, opcode, index, length,
+					param, cb, user_data, NULL);
+
+	return mgmt_send(hci_mgmt, opcode, index, length, param, cb,
+			 user_data, NULL);
+}
+
+static int backend_hci_devba(uint16_t index, bdaddr_t *ba)
+{
+	return hci_devba(index, ba);
+}
+
+static int backend_hci_att_connect(uint16_t index, const bdaddr_t *dst,
+				   uint8_t dst_type, int sec)
+{
+	int sock;
+	struct sockaddr_l2 srcaddr, dstaddr;
+	struct bt_security btsec;
+	bdaddr_t src;
+
+	if (hci_devba(index, &src) < 0)
+		return -1;
+
+	sock = socket(PF_BLUETOOTH,
+		      SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		      BTPROTO_L2CAP);
+	if (sock < 0) {
+		ERR("Failed to create L2CAP socket");
+		return -1;
+	}
+
+	/* Set up source address */
+	memset(&srcaddr, 0, sizeof(srcaddr));
+	srcaddr.l2_family = AF_BLUETOOTH;
+	srcaddr.l2_cid = htobs(ATT_CID);
+	srcaddr.l2_bdaddr_type = 0;
+	bacpy(&srcaddr.l2_bdaddr, &src);
+
+	if (bind(sock, (struct sockaddr *)&srcaddr, sizeof(srcaddr)) < 0) {
+		ERR("Failed to bind L2CAP socket");
+		close(sock);
+		return -1;
+	}
+
+	/* Set the security level */
+	memset(&btsec, 0, sizeof(btsec));
+	btsec.level = sec;
+	if (setsockopt(sock, SOL_BLUETOOTH, BT_SECURITY, &btsec,
+		       sizeof(btsec)) != 0) {
+		ERR("Failed to set L2CAP security level\n");
+		close(sock);
+		return -1;
+	}
+
+	/* Set up destination address */
+	memset(&dstaddr, 0, sizeof(dstaddr));
+	dstaddr.l2_family = AF_BLUETOOTH;
+	dstaddr.l2_cid = htobs(ATT_CID);
+	dstaddr.l2_bdaddr_type = dst_type;
+	bacpy(&dstaddr.l2_bdaddr, dst);
+
+	INFO("Connecting to device...type(%d)\n", dst_type);
+
+	/* completion is signaled by the socket becoming writable */
+	if (connect(sock, (struct sockaddr *)&dstaddr, sizeof(dstaddr)) < 0 &&
+	    errno != EINPROGRESS) {
+		ERR("Failed to connect %s\n", strerror(errno));
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+const struct backend_ops backend_hci = {
+	.name = "hci",
+	.init = backend_hci_init,
+	.close = backend_hci_close,
+	.mgmt_register = backend_hci_mgmt_register,
+	.mgmt_unregister_index = backend_hci_mgmt_unregister_index,
+	.mgmt_cancel_index = backend_hci_mgmt_cancel_index,
+	.mgmt_send = backend_hci_mgmt_send,
+	.devba = backend_hci_devba,
+	.att_connect = backend_hci_att_connect,
+};
+
+uint8_t backend_select(const struct backend_ops *ops)
+{
+	if (!ops)
+		return BTLE_ERROR_NULL_ARG;
+
+	backend = ops;
+	INFO("%s backend\n", backend->name);
+
+	return BTLE_SUCCESS;
+}
+
+uint8_t backend_init(void)
+{
+	return backend->init();
+}
+
+void backend_close(void)
+{
+	backend->close();
+}
+
+bool backend_mgmt_register(uint16_t event, uint16_t index)
+{
+	return backend->mgmt_register(event, index);
+}
+
+void backend_mgmt_unregister_index(uint16_t index)
+{
+	backend->mgmt_unregister_index(index);
+}
+
+void backend_mgmt_cancel_index(uint16_t index)
+{
+	backend->mgmt_cancel_index(index);
+}
+
+unsigned int backend_mgmt_send(uint16_t opcode, uint16_t index,
+			       uint16_t length, const void *param,
+			       backend_rsp_cb cb, void *user_data)
+{
+	return backend->mgmt_send(opcode, index, length, param, cb,
+				  user_data);
+}
+
+int backend_devba(uint16_t index, bdaddr_t *ba)
+{
+	return backend->devba(index, ba);
+}
+
+int backend_att_connect(uint16_t index, const bdaddr_t *dst,
+			uint8_t dst_type, int sec)
+{
+	return backend->att_connect(index, dst, dst_type, sec);
+}
@@ -0,0 +1,377 @@
+/*
+ *  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * IPC loopback benchmark
+ *
+ * Opens @conns connections to the daemon and keeps @window
+ * msg_command_loopback frames in flight on each of them, optionally
+ * paced to @rate frames per second overall. Every frame carries its
+ * send time; round trip latencies are reported as percentiles along
+ * with the sustained throughput.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <endian.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ipc.h"
+
+#define BENCH_SOCKET_ADDRESS	"/var/run/btled"
+#define BENCH_HDR_LEN		3	/* type | data_len (le16) */
+#define BENCH_CONN_MAX		256
+
+struct bench_payload {
+	uint64_t t_tx;		/* send time (ns) */
+	uint32_t seq;
+} __attribute__((packed));
+
+struct bench_conn {
+	int fd;
+	uint32_t inflight;
+	uint16_t rx_len;
+	uint8_t rx_buf[BENCH_HDR_LEN + IPC_DATA_LEN_MAX];
+};
+
+static struct {
+	const char *path;
+	uint16_t size;
+	uint16_t conns;
+	uint32_t window;
+	uint32_t rate;
+	uint32_t duration;
+	uint32_t warmup;
+} opt = {
+	.path = BENCH_SOCKET_ADDRESS,
+	.size = 64,
+	.conns = 1,
+	.window = 1,
+	.rate = 0,
+	.duration = 10,
+	.warmup = 1,
+};
+
+static struct {
+	uint64_t *lat;		/* ns */
+	size_t count;
+	size_t size;
+	uint64_t sent;
+	uint64_t errors;
+	uint32_t seq;
+} result;
+
+static uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	uint8_t mtu[2];
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    recv(fd, mtu, sizeof(mtu), MSG_WAITALL) != sizeof(mtu)) {
+		close(fd);
+		return -1;
+	}
+
+	if (((mtu[0] << 8) | mtu[1]) < BENCH_HDR_LEN + opt.size) {
+		fprintf(stderr, "frame size %d above daemon mtu %d\n",
+			BENCH_HDR_LEN + opt.size, (mtu[0] << 8) | mtu[1]);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static bool bench_send(struct bench_conn *conn)
+{
+	uint8_t frame[BENCH_HDR_LEN + IPC_DATA_LEN_MAX];
+	struct bench_payload payload = {
+		.t_tx = bench_now_ns(),
+		.seq = result.seq++,
+	};
+	uint16_t len = BENCH_HDR_LEN + opt.size;
+
+	frame[0] = msg_command_loopback;
+	frame[1] = opt.size & 0xff;
+	frame[2] = opt.size >> 8;
+	memset(&frame[BENCH_HDR_LEN], 0x5a, opt.size);
+	memcpy(&frame[BENCH_HDR_LEN], &payload, sizeof(payload));
+
+	/* blocking socket: a short write only happens on error */
+	if (send(conn->fd, frame, len, MSG_NOSIGNAL) != len) {
+		result.errors++;
+		return false;
+	}
+
+	conn->inflight++;
+	result.sent++;
+
+	return true;
+}
+
+static void bench_record(uint64_t lat)
+{
+	if (result.count == result.size) {
+		size_t size = result.size ? 2 * result.size : 1 << 16;
+		uint64_t *lat_buf = realloc(result.lat, size * sizeof(*lat_buf));
+
+		if (!lat_buf)
+			return;
+		result.lat = lat_buf;
+		result.size = size;
+	}
+	result.lat[result.count++] = lat;
+}
+
+static int bench_recv(struct bench_conn *conn, bool record)
+{
+	uint16_t off = 0;
+	ssize_t len;
+	int done = 0;
+
+	len = recv(conn->fd, &conn->rx_buf[conn->rx_len],
+		   sizeof(conn->rx_buf) - conn->rx_len, MSG_DONTWAIT);
+	if (len <= 0)
+		return (len < 0 && errno == EAGAIN) ? 0 : -1;
+	conn->rx_len += len;
+
+	while (conn->rx_len - off >= BENCH_HDR_LEN) {
+		uint8_t *frame = &conn->rx_buf[off];
+		uint16_t data_len = frame[1] | (frame[2] << 8);
+		struct bench_payload payload;
+
+		if (conn->rx_len - off < BENCH_HDR_LEN + data_len)
+			break;
+		off += BENCH_HDR_LEN + data_len;
+
+		if (frame[0] != msg_command_loopback ||
+		    data_len < sizeof(payload))
+			continue;
+
+		memcpy(&payload, &frame[BENCH_HDR_LEN], sizeof(payload));
+		if (record)
+			bench_record(bench_now_ns() - payload.t_tx);
+		conn->inflight--;
+		done++;
+	}
+
+	memmove(conn->rx_buf, &conn->rx_buf[off], conn->rx_len - off);
+	conn->rx_len -= off;
+
+	return done;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double bench_pct(double pct)
+{
+	size_t idx = (size_t)(pct / 100.0 * (result.count - 1) + 0.5);
+
+	return result.lat[idx] / 1000.0;
+}
+
+static void bench_report(uint64_t elapsed)
+{
+	double secs = elapsed / 1e9;
+
+	printf("size %u conns %u window %u rate %u/s duration %.2fs\n",
+	       opt.size, opt.conns, opt.window, opt.rate, secs);
+	printf("sent %llu measured %zu errors %llu\n",
+	       (unsigned long long)result.sent, result.count,
+	       (unsigned long long)result.errors);
+
+	if (!result.count)
+		return;
+
+	qsort(result.lat, result.count, sizeof(*result.lat), bench_cmp);
+
+	printf("throughput %.0f msg/s %.2f MB/s\n", result.count / secs,
+	       result.count * (double)(BENCH_HDR_LEN + opt.size) / secs / 1e6);
+	printf("rtt us: min %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f "
+	       "max %.1f\n",
+	       result.lat[0] / 1000.0, bench_pct(50), bench_pct(90),
+	       bench_pct(99), bench_pct(99.9),
+	       result.lat[result.count - 1] / 1000.0);
+}
+
+static void bench_usage(const char *name)
+{
+	printf("usage: %s [options]\n"
+	       "  -s size      loopback payload size (default %u, max %u)\n"
+	       "  -c conns     parallel connections (default %u)\n"
+	       "  -w window    frames in flight per connection (default %u)\n"
+	       "  -r rate      frames per second overall, 0: unpaced "
+	       "(default %u)\n"
+	       "  -d seconds   measurement duration (default %u)\n"
+	       "  -W seconds   warm up, not recorded (default %u)\n"
+	       "  -p path      daemon socket (default %s)\n",
+	       name, opt.size, IPC_DATA_LEN_MAX, opt.conns, opt.window,
+	       opt.rate, opt.duration, opt.warmup, opt.path);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_conn *conns;
+	struct epoll_event ev;
+	uint64_t start, end, measure, next_tx, period = 0;
+	uint16_t idx, rr = 0;
+	int epfd, c;
+
+	while ((c = getopt(argc, argv, "s:c:w:r:d:W:p:h")) != -1) {
+		switch (c) {
+		case 's':
+			opt.size = atoi(optarg);
+			break;
+		case 'c':
+			opt.conns = atoi(optarg);
+			break;
+		case 'w':
+			opt.window = atoi(optarg);
+			break;
+		case 'r':
+			opt.rate = atoi(optarg);
+			break;
+		case 'd':
+			opt.duration = atoi(optarg);
+			break;
+		case 'W':
+			opt.warmup = atoi(optarg);
+			break;
+		case 'p':
+			opt.path = optarg;
+			break;
+		default:
+			bench_usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (opt.size < sizeof(struct bench_payload) ||
+	    opt.size > IPC_DATA_LEN_MAX || !opt.conns ||
+	    opt.conns > BENCH_CONN_MAX || !opt.window || !opt.duration) {
+		bench_usage(argv[0]);
+		return 1;
+	}
+
+	conns = calloc(opt.conns, sizeof(*conns));
+	epfd = epoll_create1(0);
+	if (!conns || epfd < 0)
+		return 1;
+
+	for (idx = 0; idx < opt.conns; idx++) {
+		conns[idx].fd = bench_connect(opt.path);
+		if (conns[idx].fd < 0) {
+			fprintf(stderr, "connecting %s: %s\n", opt.path,
+				strerror(errno));
+			return 1;
+		}
+		ev.events = EPOLLIN;
+		ev.data.u32 = idx;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, conns[idx].fd, &ev);
+	}
+
+	if (opt.rate)
+		period = 1000000000ULL / opt.rate;
+
+	start = bench_now_ns();
+	measure = start + opt.warmup * 1000000000ULL;
+	end = measure + opt.duration * 1000000000ULL;
+	next_tx = start;
+
+	for (;;) {
+		struct epoll_event events[BENCH_CONN_MAX];
+		uint64_t now = bench_now_ns();
+		int timeout = -1, n, i;
+		uint16_t tries;
+
+		if (now >= end)
+			break;
+
+		/* filling windows, round robin over connections */
+		for (tries = 0; tries < opt.conns; rr = (rr + 1) % opt.conns) {
+			struct bench_conn *conn = &conns[rr];
+
+			if (period && now < next_tx) {
+				timeout = (next_tx - now) / 1000000;
+				break;
+			}
+			if (conn->inflight >= opt.window) {
+				tries++;
+				continue;
+			}
+			if (!bench_send(conn))
+				goto out;
+			tries = 0;
+			next_tx += period;
+		}
+
+		/* never sleeping past the end of the run */
+		if (timeout < 0 || (uint64_t)timeout > (end - now) / 1000000)
+			timeout = (end - now) / 1000000 + 1;
+
+		n = epoll_wait(epfd, events, BENCH_CONN_MAX, timeout);
+		for (i = 0; i < n; i++) {
+			struct bench_conn *conn = &conns[events[i].data.u32];
+
+			if (bench_recv(conn, bench_now_ns() >= measure) < 0) {
+				fprintf(stderr, "connection closed\n");
+				goto out;
+			}
+		}
+	}
+
+out:
+	bench_report(bench_now_ns() - measure);
+
+	for (idx = 0; idx < opt.conns; idx++)
+		close(conns[idx].fd);
+	close(epfd);
+	free(conns);
+	free(result.lat);
+
+	return 0;
+}
@@ -0,0 +1,265 @@
+/*
+ *  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "btle_error.h"
+
+#define MODULE "log"
+#include "btlog.h"
+
+/*
+ * Single producer (main loop) / single consumer (flusher) ring of fixed
+ * size records. The producer only formats the message; timestamps are
+ * rendered, lines written and stdout flushed by the flusher, in batches.
+ */
+#define BTLOG_RING_SLOTS	1024	/* power of 2 */
+#define BTLOG_TEXT_LEN		104
+#define BTLOG_LINE_LEN		(BTLOG_TEXT_LEN + 32)
+
+struct btlog_rec {
+	struct timespec ts;
+	const char *module;
+	uint8_t level;
+	uint8_t len;
+	char text[BTLOG_TEXT_LEN];
+};
+
+static struct {
+	struct btlog_rec rec[BTLOG_RING_SLOTS];
+	uint32_t head;		/* written by the producer */
+	uint32_t tail;		/* written by the flusher */
+	uint32_t dropped;	/* ring full */
+	uint32_t sleeping;	/* flusher waiting on @evtfd */
+	bool running;
+	bool stop;
+	int evtfd;
+	pthread_t thread;
+} btlog = {
+	.evtfd = -1,
+};
+
+uint8_t bt_log_level = BTLOG_LEVEL;
+
+static const char *const btlog_tag[] = {
+	[BTLOG_ERR] = "[E]",
+	[BTLOG_WARNING] = "[W]",
+	[BTLOG_INFO] = "[I]",
+	[BTLOG_DBG] = "[D]",
+};
+
+static uint16_t btlog_render(char *line, const struct btlog_rec *rec)
+{
+	static time_t last_sec = -1;
+	static char hms[12];
+	int len;
+
+	/* localtime() once per second at most */
+	if (rec->ts.tv_sec != last_sec) {
+		struct tm tm;
+
+		localtime_r(&rec->ts.tv_sec, &tm);
+		snprintf(hms, sizeof(hms), "%02d:%02d:%02d", tm.tm_hour,
+			 tm.tm_min, tm.tm_sec);
+		last_sec = rec->ts.tv_sec;
+	}
+
+	len = snprintf(line, BTLOG_LINE_LEN, "%s %s %s %.*s", hms,
+		       rec->module, btlog_tag[rec->level], rec->len,
+		       rec->text);
+
+	return (len < BTLOG_LINE_LEN) ? len : BTLOG_LINE_LEN - 1;
+}
+
+static void btlog_format(struct btlog_rec *rec, uint8_t level,
+			 const char *module, const char *format, va_list args)
+{
+	int len;
+
+	clock_gettime(CLOCK_REALTIME, &rec->ts);
+	rec->module = module;
+	rec->level = level;
+
+	len = vsnprintf(rec->text, sizeof(rec->text), format, args);
+	if (len < 0)
+		len = 0;
+	rec->len = (len < BTLOG_TEXT_LEN) ? len : BTLOG_TEXT_LEN - 1;
+}
+
+static void btlog_write_sync(const struct btlog_rec *rec)
+{
+	char line[BTLOG_LINE_LEN];
+
+	fwrite(line, 1, btlog_render(line, rec), stdout);
+	fflush(stdout);
+}
+
+static void btlog_drain(void)
+{
+	uint32_t tail = btlog.tail;
+	uint32_t head = __atomic_load_n(&btlog.head, __ATOMIC_ACQUIRE);
+	uint32_t dropped;
+	char line[BTLOG_LINE_LEN];
+
+	if (tail == head)
+		return;
+
+	for (; tail != head; tail++) {
+		struct btlog_rec *rec = &btlog.rec[tail & (BTLOG_RING_SLOTS - 1)];
+
+		fwrite(line, 1, btlog_render(line, rec), stdout);
+	}
+	__atomic_store_n(&btlog.tail, tail, __ATOMIC_RELEASE);
+
+	dropped = __atomic_exchange_n(&btlog.dropped, 0, __ATOMIC_RELAXED);
+	if (dropped)
+		fprintf(stdout, "log: %u lines lost\n", dropped);
+
+	fflush(stdout);
+}
+
+static void *btlog_flusher(void *arg)
+{
+	uint64_t val;
+
+	for (;;) {
+		btlog_drain();
+
+		if (__atomic_load_n(&btlog.stop, __ATOMIC_ACQUIRE))
+			break;
+
+		/* pairs with the producer barrier in bt_log() */
+		__atomic_store_n(&btlog.sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&btlog.head, __ATOMIC_RELAXED) ==
+		    btlog.tail && !__atomic_load_n(&btlog.stop,
+						    __ATOMIC_RELAXED)) {
+			if (read(btlog.evtfd, &val, sizeof(val)) < 0)
+				usleep(10000);
+		}
+		__atomic_store_n(&btlog.sleeping, 0, __ATOMIC_RELAXED);
+	}
+
+	btlog_drain();
+
+	return NULL;
+}
+
+static void btlog_wakeup(void)
+{
+	uint64_t one = 1;
+
+	if (write(btlog.evtfd, &one, sizeof(one)) < 0)
+		return;
+}
+
+void bt_log(uint8_t level, const char *module, const char *format, ...)
+{
+	struct btlog_rec *rec;
+	uint32_t head, tail;
+	va_list args;
+
+	if (level > BTLOG_DBG)
+		level = BTLOG_DBG;
+
+	va_start(args, format);
+
+	if (!btlog.running) {
+		struct btlog_rec sync_rec;
+
+		btlog_format(&sync_rec, level, module, format, args);
+		btlog_write_sync(&sync_rec);
+		va_end(args);
+		return;
+	}
+
+	head = btlog.head;
+	tail = __atomic_load_n(&btlog.tail, __ATOMIC_ACQUIRE);
+	if (head - tail == BTLOG_RING_SLOTS) {
+		__atomic_fetch_add(&btlog.dropped, 1, __ATOMIC_RELAXED);
+		va_end(args);
+		return;
+	}
+
+	rec = &btlog.rec[head & (BTLOG_RING_SLOTS - 1)];
+	btlog_format(rec, level, module, format, args);
+	va_end(args);
+
+	__atomic_store_n(&btlog.head, head + 1, __ATOMIC_RELEASE);
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&btlog.sleeping, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&btlog.sleeping, 0, __ATOMIC_RELAXED);
+		btlog_wakeup();
+	}
+}
+
+uint8_t bt_log_set_level(uint8_t level)
+{
+	if (level > BTLOG_DBG)
+		return BTLE_ERROR_INVALID_ARG;
+
+	bt_log_level = level;
+
+	return BTLE_SUCCESS;
+}
+
+uint8_t bt_log_init(void)
+{
+	if (btlog.running)
+		return BTLE_ERROR_ALREADY;
+
+	btlog.evtfd = eventfd(0, EFD_CLOEXEC);
+	if (btlog.evtfd < 0)
+		return BTLE_ERROR_INTERNAL;
+
+	btlog.head = 0;
+	btlog.tail = 0;
+	btlog.stop = false;
+
+	if (pthread_create(&btlog.thread, NULL, btlog_flusher, NULL)) {
+		close(btlog.evtfd);
+		btlog.evtfd = -1;
+		return BTLE_ERROR_INTERNAL;
+	}
+	btlog.running = true;
+
+	return BTLE_SUCCESS;
+}
+
+uint8_t bt_log_close(void)
+{
+	if (!btlog.running)
+		return BTLE_ERROR_INVALID_STATE;
+
+	__atomic_store_n(&btlog.stop, true, __ATOMIC_RELEASE);
+	btlog_wakeup();
+	pthread_join(btlog.thread, NULL);
+
+	btlog.running = false;
+	close(btlog.evtfd);
+	btlog.evtfd = -1;
+
+	return BTLE_SUCCESS;
+}
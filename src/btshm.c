@@ -0,0 +1,226 @@
+/*
+ *  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+
+#define MODULE "shm"
+#include "btprint.h"
+
+#include "btle_error.h"
+#include "btshm.h"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC     0x0001U
+#endif
+
+#define BTSHM_FRAME_HDR_LEN     3
+#define BTSHM_ALIGN_UP(len)     (((len) + BTSHM_ALIGN - 1) & ~(BTSHM_ALIGN - 1))
+
+/*
+ * @size: data area size, the copy in @hdr is only informative
+ * @head: producer index, published to @hdr; the client can write the
+ *        whole mapping, only @hdr->tail is read back from it
+ * @dead: the consumer gave an impossible tail, nothing is written anymore
+ */
+struct btshm {
+	int memfd;
+	int evtfd;
+	size_t map_len;
+	struct btshm_hdr *hdr;
+	uint8_t *data;
+	uint32_t size;
+	uint32_t head;
+	bool dead;
+};
+
+static int btshm_memfd_create(const char *name)
+{
+	/* no glibc wrapper before 2.27 */
+	return syscall(__NR_memfd_create, name, MFD_CLOEXEC);
+}
+
+uint8_t btshm_new(uint32_t size, struct btshm **shm)
+{
+	struct btshm *ring;
+
+	if (!shm)
+		return BTLE_ERROR_NULL_ARG;
+
+	if (size < BTSHM_SIZE_MIN || size > BTSHM_SIZE_MAX ||
+	    (size & (size - 1)))
+		return BTLE_ERROR_INVALID_ARG;
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return BTLE_ERROR_MEMORY;
+
+	ring->evtfd = -1;
+	ring->size = size;
+	ring->map_len = BTSHM_DATA_OFFSET + size;
+
+	ring->memfd = btshm_memfd_create("btled");
+	if (ring->memfd < 0) {
+		ERR("memfd: %d\n", errno);
+		goto failed;
+	}
+
+	if (ftruncate(ring->memfd, ring->map_len) < 0) {
+		ERR("ftruncate: %d\n", errno);
+		goto failed;
+	}
+
+	ring->hdr = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, ring->memfd, 0);
+	if (ring->hdr == MAP_FAILED) {
+		ERR("mmap: %d\n", errno);
+		ring->hdr = NULL;
+		goto failed;
+	}
+
+	ring->evtfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (ring->evtfd < 0) {
+		ERR("eventfd: %d\n", errno);
+		goto failed;
+	}
+
+	ring->data = (uint8_t *)ring->hdr + BTSHM_DATA_OFFSET;
+	ring->hdr->magic = BTSHM_MAGIC;
+	ring->hdr->size = size;
+
+	*shm = ring;
+
+	return BTLE_SUCCESS;
+
+failed:
+	btshm_free(ring);
+	return BTLE_ERROR_INTERNAL;
+}
+
+void btshm_get_fds(struct btshm *shm, int *memfd, int *evtfd)
+{
+	*memfd = shm->memfd;
+	*evtfd = shm->evtfd;
+}
+
+void btshm_release_memfd(struct btshm *shm)
+{
+	if (shm->memfd >= 0) {
+		close(shm->memfd);
+		shm->memfd = -1;
+	}
+}
+
+static void btshm_put_frame_hdr(uint8_t *dst, uint8_t type, uint16_t len)
+{
+	dst[0] = type;
+	dst[1] = len & 0xff;
+	dst[2] = len >> 8;
+}
+
+uint8_t btshm_writev(struct btshm *shm, const struct iovec *iov, int iovcnt)
+{
+	struct btshm_hdr *hdr = shm->hdr;
+	uint32_t size = shm->size;
+	uint32_t head = shm->head;
+	uint32_t tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+	uint32_t frame_len = 0, rec_len, contig, idx;
+	uint8_t *dst;
+	int i;
+
+	if (shm->dead)
+		return BTLE_ERROR_INVALID_STATE;
+
+	/* never trusting the consumer: a tail ahead of head, or behind it
+	 * by more than the ring, would let frames overwrite unread ones */
+	if (head - tail > size) {
+		ERR("invalid tail %u (head %u)\n", tail, head);
+		shm->dead = true;
+		return BTLE_ERROR_INVALID_STATE;
+	}
+
+	for (i = 0; i < iovcnt; i++)
+		frame_len += iov[i].iov_len;
+
+	if (frame_len < BTSHM_FRAME_HDR_LEN)
+		return BTLE_ERROR_INVALID_ARG;
+
+	rec_len = BTSHM_ALIGN_UP(frame_len);
+	idx = head & (size - 1);
+	contig = size - idx;
+
+	if (size - (head - tail) < ((rec_len > contig) ? contig + rec_len :
+				    rec_len)) {
+		hdr->dropped++;
+		return BTLE_ERROR_MEMORY;
+	}
+
+	if (rec_len > contig) {
+		/* frames never wrap; padding up to the end of the ring */
+		btshm_put_frame_hdr(&shm->data[idx], BTSHM_PAD,
+				    contig - BTSHM_FRAME_HDR_LEN);
+		head += contig;
+		idx = 0;
+	}
+
+	dst = &shm->data[idx];
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+		dst += iov[i].iov_len;
+	}
+	head += rec_len;
+
+	shm->head = head;
+	__atomic_store_n(&hdr->head, head, __ATOMIC_RELEASE);
+
+	/* pairs with the consumer barrier between setting wait and
+	 * re-reading head */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&hdr->wait, __ATOMIC_RELAXED)) {
+		uint64_t one = 1;
+
+		__atomic_store_n(&hdr->wait, 0, __ATOMIC_RELAXED);
+		if (write(shm->evtfd, &one, sizeof(one)) < 0 &&
+		    errno != EAGAIN)
+			ERR("doorbell: %d\n", errno);
+	}
+
+	return BTLE_SUCCESS;
+}
+
+void btshm_free(struct btshm *shm)
+{
+	if (!shm)
+		return;
+
+	if (shm->hdr)
+		munmap(shm->hdr, shm->map_len);
+	if (shm->evtfd >= 0)
+		close(shm->evtfd);
+	btshm_release_memfd(shm);
+	free(shm);
+}
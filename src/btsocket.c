@@ -18,6 +18,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <fcntl.h>
@@ -25,131 +26,550 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <errno.h>
 
 #include <sys/epoll.h>
 #include "src/shared/mainloop.h"
+#include "src/shared/queue.h"
 
 #define MODULE "socket"
 #include "btprint.h"
 
 #include "btle_error.h"
+#include "btshm.h"
 #include "btsocket.h"
 
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 
+#ifndef MIN
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#endif
+
 #define SOCKET_INVALID  (-1)
 #define SOCKET_ADDRESS  "/var/run/btled"
 
 #define SOCKET_CONN_MAX 5
 
-enum btsocket_type {
-	server = 0,
-	client,
+/*
+ * Connected IPC client
+ *
+ * @fd: client socket descriptor (non blocking)
+ * @cid: client identifier, unique among connected clients
+ * @evt_mask: events the client is interested in
+ * @param_version: command parameters encoding, CMD_PARAM_VERSION_*
+ * @rx_len: number of bytes received but not parsed yet
+ * @rx_buf: reception buffer (param.mtu bytes)
+ * @tx_ring: bytes waiting for the socket to become writable
+ *           (param.tx_size bytes)
+ * @tx_head: ring write index (free running)
+ * @tx_tail: ring read index (free running)
+ * @congested: set above param.tx_high_wm, cleared below param.tx_low_wm
+ * @overflow: frames dropped because the ring was full
+ * @dropped: events dropped while congested
+ * @shm: shared memory ring events are written to, if negotiated
+ */
+struct btsocket_client {
+	int fd;
+	uint16_t cid;
+	uint32_t evt_mask;
+	uint8_t param_version;
+	uint16_t rx_len;
+	uint8_t *rx_buf;
+	uint8_t *tx_ring;
+	uint32_t tx_head;
+	uint32_t tx_tail;
+	bool congested;
+	uint32_t overflow;
+	uint32_t dropped;
+	struct btshm *shm;
 };
 
 static struct {
-	int8_t desc[client + 1];
+	int server;
+	uint16_t next_cid;
+	struct queue *clients;
 	struct btsocket_param param;
-	socket_rx_notifier rx_cb;
 } socket_mgmt = {
-	.desc = { SOCKET_INVALID, SOCKET_INVALID },
+	.server = SOCKET_INVALID,
+	.next_cid = BTSOCKET_CID_INVALID,
+	.clients = NULL,
 	.param = { 0, NULL },
 };
 
-uint8_t btsocket_send(uint8_t *data, uint8_t data_len)
+static bool btsocket_match_cid(const void *data, const void *match_data)
 {
-	if (socket_mgmt.desc[client] == SOCKET_INVALID ||
-	    socket_mgmt.desc[server] == SOCKET_INVALID) {
-		return BTLE_ERROR_INVALID_STATE;
+	const struct btsocket_client *cli = data;
+
+	return cli->cid == *(const uint16_t *)match_data;
+}
+
+static struct btsocket_client *btsocket_find_client(uint16_t cid)
+{
+	if (!socket_mgmt.clients)
+		return NULL;
+
+	return queue_find(socket_mgmt.clients, btsocket_match_cid, &cid);
+}
+
+static uint32_t btsocket_ring_used(struct btsocket_client *cli)
+{
+	return cli->tx_head - cli->tx_tail;
+}
+
+static void btsocket_ring_push(struct btsocket_client *cli,
+			       const uint8_t *data, uint32_t data_len)
+{
+	uint32_t idx = cli->tx_head & (socket_mgmt.param.tx_size - 1);
+	uint32_t chunk = MIN(data_len, socket_mgmt.param.tx_size - idx);
+
+	memcpy(&cli->tx_ring[idx], data, chunk);
+	memcpy(&cli->tx_ring[0], &data[chunk], data_len - chunk);
+	cli->tx_head += data_len;
+}
+
+static size_t btsocket_iov_len(const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	return len;
+}
+
+static uint8_t btsocket_client_write(struct btsocket_client *cli,
+				     const struct iovec *iov, int iovcnt,
+				     bool is_event)
+{
+	uint32_t used = btsocket_ring_used(cli);
+	size_t data_len = btsocket_iov_len(iov, iovcnt);
+	ssize_t sent = 0;
+	int i;
+
+	if (is_event && cli->shm) {
+		uint8_t ret = btshm_writev(cli->shm, iov, iovcnt);
+
+		if (ret == BTLE_ERROR_INVALID_STATE) {
+			/* dead consumer; closed by btsocket_read on hangup,
+			 * the client may not be freed while broadcasting */
+			ERR("[%d] shm ring corrupted, dropping connection\n",
+			    cli->cid);
+			shutdown(cli->fd, SHUT_RDWR);
+			return ret;
+		} else if (ret) {
+			cli->overflow++;
+			return BTLE_ERROR_MEMORY;
+		}
+		return BTLE_SUCCESS;
 	}
 
-	if (!data || !data_len) {
-		return BTLE_ERROR_INVALID_ARG;
-	} else {
-		int8_t ret;
-		ret = send(socket_mgmt.desc[client], data, data_len, 0);
-		if (ret == -1) {
-			ERR("tx: %d\n", errno);
-			return BTLE_ERROR_INTERNAL;
+	if (is_event && cli->congested) {
+		/* slow reader; sparing room for command responses */
+		cli->dropped++;
+		return BTLE_ERROR_BUSY;
+	}
+
+	if (socket_mgmt.param.tx_size - used < data_len) {
+		/* frames are never truncated */
+		cli->overflow++;
+		return BTLE_ERROR_MEMORY;
+	}
+
+	if (!used) {
+		struct msghdr msg = {
+			.msg_iov = (struct iovec *)iov,
+			.msg_iovlen = iovcnt,
+		};
+
+		sent = sendmsg(cli->fd, &msg, MSG_NOSIGNAL);
+		if (sent == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				ERR("[%d] tx: %d\n", cli->cid, errno);
+				return BTLE_ERROR_INTERNAL;
+			}
+			sent = 0;
+		}
+		if ((size_t)sent == data_len)
+			return BTLE_SUCCESS;
+
+		/* socket is full; remaining bytes are sent on EPOLLOUT */
+		mainloop_modify_fd(cli->fd, EPOLLIN | EPOLLOUT);
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		if ((size_t)sent >= iov[i].iov_len) {
+			sent -= iov[i].iov_len;
+			continue;
 		}
+		btsocket_ring_push(cli, (uint8_t *)iov[i].iov_base + sent,
+				   iov[i].iov_len - sent);
+		sent = 0;
+	}
+
+	if (!cli->congested &&
+	    btsocket_ring_used(cli) >= socket_mgmt.param.tx_high_wm) {
+		cli->congested = true;
+		INFO("[%d] tx congested (%u bytes pending)\n", cli->cid,
+		     btsocket_ring_used(cli));
 	}
 
 	return BTLE_SUCCESS;
 }
 
-static uint8_t btsocket_mtu_negociation(void)
+static void btsocket_client_flush(struct btsocket_client *cli)
 {
+	uint32_t used;
+
+	while ((used = btsocket_ring_used(cli))) {
+		uint32_t idx = cli->tx_tail & (socket_mgmt.param.tx_size - 1);
+		uint32_t chunk = MIN(used, socket_mgmt.param.tx_size - idx);
+		struct iovec iov[2] = {
+			{ .iov_base = &cli->tx_ring[idx], .iov_len = chunk },
+			{ .iov_base = &cli->tx_ring[0], .iov_len = used - chunk },
+		};
+		struct msghdr msg = {
+			.msg_iov = iov,
+			.msg_iovlen = (used > chunk) ? 2 : 1,
+		};
+		ssize_t sent;
+
+		sent = sendmsg(cli->fd, &msg, MSG_NOSIGNAL);
+		if (sent == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				ERR("[%d] tx: %d\n", cli->cid, errno);
+			break;
+		}
+
+		cli->tx_tail += sent;
+	}
+
+	if (cli->congested &&
+	    btsocket_ring_used(cli) <= socket_mgmt.param.tx_low_wm) {
+		cli->congested = false;
+		INFO("[%d] tx resumed, %u events dropped, %u overflows\n",
+		     cli->cid, cli->dropped, cli->overflow);
+	}
+
+	if (!btsocket_ring_used(cli))
+		mainloop_modify_fd(cli->fd, EPOLLIN);
+}
+
+uint8_t btsocket_sendv(uint16_t cid, const struct iovec *iov, int iovcnt)
+{
+	struct btsocket_client *cli;
+
+	if (socket_mgmt.server == SOCKET_INVALID)
+		return BTLE_ERROR_INVALID_STATE;
+
+	if (!iov || !iovcnt)
+		return BTLE_ERROR_INVALID_ARG;
+
+	cli = btsocket_find_client(cid);
+	if (!cli)
+		return BTLE_ERROR_INVALID_STATE;
+
+	return btsocket_client_write(cli, iov, iovcnt, false);
+}
+
+uint8_t btsocket_send(uint16_t cid, uint8_t *data, uint16_t data_len)
+{
+	struct iovec iov = { .iov_base = data, .iov_len = data_len };
+
+	if (!data || !data_len)
+		return BTLE_ERROR_INVALID_ARG;
+
+	return btsocket_sendv(cid, &iov, 1);
+}
+
+uint8_t btsocket_broadcastv(uint32_t mask, const struct iovec *iov,
+			    int iovcnt)
+{
+	const struct queue_entry *entry;
+	uint8_t ret = BTLE_ERROR_INVALID_STATE;
+
+	if (socket_mgmt.server == SOCKET_INVALID)
+		return BTLE_ERROR_INVALID_STATE;
+
+	if (!iov || !iovcnt)
+		return BTLE_ERROR_INVALID_ARG;
+
+	for (entry = queue_get_entries(socket_mgmt.clients); entry;
+	     entry = entry->next) {
+		struct btsocket_client *cli = entry->data;
+
+		if (!(cli->evt_mask & mask))
+			continue;
+
+		ret = btsocket_client_write(cli, iov, iovcnt, true);
+	}
+
+	return ret;
+}
+
+uint8_t btsocket_shm_attach(uint16_t cid, uint32_t size, uint8_t *data,
+			    uint16_t data_len)
+{
+	struct btsocket_client *cli;
+	struct btshm *shm;
+	struct iovec iov = { .iov_base = data, .iov_len = data_len };
+	union {
+		struct cmsghdr align;
+		uint8_t buf[CMSG_SPACE(2 * sizeof(int))];
+	} ctrl;
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = ctrl.buf,
+		.msg_controllen = sizeof(ctrl.buf),
+	};
+	struct cmsghdr *cmsg;
+	int fds[2];
 	uint8_t ret;
+
+	cli = btsocket_find_client(cid);
+	if (!cli)
+		return BTLE_ERROR_INVALID_ARG;
+
+	if (cli->shm)
+		return BTLE_ERROR_ALREADY;
+
+	/* descriptors must not overtake pending bytes */
+	if (btsocket_ring_used(cli))
+		return BTLE_ERROR_BUSY;
+
+	ret = btshm_new(size, &shm);
+	if (ret)
+		return ret;
+
+	btshm_get_fds(shm, &fds[0], &fds[1]);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(cli->fd, &msg, MSG_NOSIGNAL) != data_len) {
+		ERR("[%d] shm handover: %d\n", cli->cid, errno);
+		btshm_free(shm);
+		return BTLE_ERROR_INTERNAL;
+	}
+
+	/* client owns its copy now; mapping stays valid */
+	btshm_release_memfd(shm);
+	cli->shm = shm;
+
+	INFO("[%d] events over shared memory (%u bytes)\n", cli->cid, size);
+
+	return BTLE_SUCCESS;
+}
+
+uint8_t btsocket_get_stats(uint16_t cid, struct btsocket_stats *stats)
+{
+	struct btsocket_client *cli;
+
+	if (!stats)
+		return BTLE_ERROR_NULL_ARG;
+
+	cli = btsocket_find_client(cid);
+	if (!cli)
+		return BTLE_ERROR_INVALID_ARG;
+
+	stats->pending = btsocket_ring_used(cli);
+	stats->overflow = cli->overflow;
+	stats->dropped = cli->dropped;
+
+	return BTLE_SUCCESS;
+}
+
+uint8_t btsocket_set_mask(uint16_t cid, uint32_t mask)
+{
+	struct btsocket_client *cli;
+
+	cli = btsocket_find_client(cid);
+	if (!cli)
+		return BTLE_ERROR_INVALID_ARG;
+
+	cli->evt_mask = mask;
+
+	return BTLE_SUCCESS;
+}
+
+uint8_t btsocket_set_param_version(uint16_t cid, uint8_t version)
+{
+	struct btsocket_client *cli;
+
+	cli = btsocket_find_client(cid);
+	if (!cli)
+		return BTLE_ERROR_INVALID_ARG;
+
+	cli->param_version = version;
+
+	return BTLE_SUCCESS;
+}
+
+uint8_t btsocket_get_param_version(uint16_t cid)
+{
+	struct btsocket_client *cli;
+
+	cli = btsocket_find_client(cid);
+
+	return cli ? cli->param_version : 0;
+}
+
+static uint8_t btsocket_mtu_negociation(struct btsocket_client *cli)
+{
 	uint8_t data[2];
+	struct iovec iov = { .iov_base = data, .iov_len = sizeof(data) };
 
 	data[0] = 0xff & (socket_mgmt.param.mtu >> 8);
 	data[1] = 0xff & socket_mgmt.param.mtu;
 
-	ret = btsocket_send(data, sizeof(data));
+	return btsocket_client_write(cli, &iov, 1, false);
+}
 
-	return ret;
+static void btsocket_client_destroy(void *user_data)
+{
+	struct btsocket_client *cli = user_data;
+
+	INFO("[%d] connection closed\n", cli->cid);
+
+	if (cli->overflow || cli->dropped)
+		INFO("[%d] %u events dropped, %u overflows\n", cli->cid,
+		     cli->dropped, cli->overflow);
+
+	queue_remove(socket_mgmt.clients, cli);
+	close(cli->fd);
+	free(cli->rx_buf);
+	free(cli->tx_ring);
+	btshm_free(cli->shm);
+	free(cli);
 }
 
 static void btsocket_read(int fd, uint32_t events, void *user_data)
 {
+	struct btsocket_client *cli = user_data;
+	uint16_t consumed;
+	ssize_t rx_len;
+
 	if (events & (EPOLLERR | EPOLLHUP)) {
-		mainloop_remove_fd(socket_mgmt.desc[client]);
+		mainloop_remove_fd(cli->fd);
 		return;
 	}
 
-	if (socket_mgmt.desc[client] == SOCKET_INVALID ||
-	    socket_mgmt.desc[server] == SOCKET_INVALID) {
+	if (events & EPOLLOUT)
+		btsocket_client_flush(cli);
+
+	if (!(events & EPOLLIN))
 		return;
-	} else {
-		int rx_len;
-		uint8_t data[socket_mgmt.param.mtu];
 
-		rx_len = recv(socket_mgmt.desc[client], data, sizeof(data), MSG_PEEK);
-		if (rx_len != sizeof(data)) {
-			return;
-		}
+	rx_len = recv(cli->fd, &cli->rx_buf[cli->rx_len],
+		      socket_mgmt.param.mtu - cli->rx_len, MSG_DONTWAIT);
+	if (rx_len == 0 || (rx_len == -1 && errno != EAGAIN)) {
+		mainloop_remove_fd(cli->fd);
+		return;
+	} else if (rx_len == -1) {
+		return;
+	}
 
-		rx_len = recv(socket_mgmt.desc[client], data, sizeof(data), 0);
-		if (rx_len != sizeof(data)) {
-			return;
-		}
-		/* notify */
-		socket_mgmt.param.rx_cb(data, rx_len);
+	cli->rx_len += rx_len;
+
+	/* notify; upper layer reports how many bytes it has parsed */
+	consumed = socket_mgmt.param.rx_cb(cli->cid, cli->rx_buf, cli->rx_len);
+	if (consumed == BTSOCKET_RX_INVALID) {
+		ERR("[%d] invalid frame, dropping connection\n", cli->cid);
+		mainloop_remove_fd(cli->fd);
+		return;
+	} else if (consumed > cli->rx_len) {
+		consumed = cli->rx_len;
+	}
+
+	if (!consumed && cli->rx_len == socket_mgmt.param.mtu) {
+		ERR("[%d] frame bigger than mtu, dropping connection\n",
+		    cli->cid);
+		mainloop_remove_fd(cli->fd);
+		return;
 	}
+
+	cli->rx_len -= consumed;
+	memmove(cli->rx_buf, &cli->rx_buf[consumed], cli->rx_len);
+}
+
+static uint16_t btsocket_new_cid(void)
+{
+	do {
+		socket_mgmt.next_cid++;
+	} while (socket_mgmt.next_cid == BTSOCKET_CID_INVALID ||
+		 btsocket_find_client(socket_mgmt.next_cid));
+
+	return socket_mgmt.next_cid;
 }
 
 static void btsocket_accept_conn(int fd, uint32_t events, void *user_data)
 {
+	struct btsocket_client *cli;
+	struct sockaddr_un client_sockaddr;
+	socklen_t addrlen = sizeof(client_sockaddr);
+	int client_fd;
+
 	if (events & (EPOLLERR | EPOLLHUP)) {
-		mainloop_remove_fd(socket_mgmt.desc[server]);
+		mainloop_remove_fd(socket_mgmt.server);
 		return;
-	} else {
-		socklen_t addrlen;
-		struct sockaddr_un client_sockaddr;
-		addrlen = sizeof(client_sockaddr);
-
-		socket_mgmt.desc[client] = accept(
-			socket_mgmt.desc[server],
-			(struct sockaddr *)&
-			client_sockaddr,
-			&addrlen);
-		if (socket_mgmt.desc[client] == SOCKET_INVALID) {
-			ERR("Failed to accept: %d\n", errno);
-			return;
-		}
-		INFO("connection established: %d\n", socket_mgmt.desc[client]);
-		btsocket_mtu_negociation();
+	}
 
-		if (mainloop_add_fd(socket_mgmt.desc[client], EPOLLIN,
-				    btsocket_read,
-				    NULL, btsocket_close) < 0) {
-			btsocket_close(NULL);
+	client_fd = accept(socket_mgmt.server,
+			   (struct sockaddr *)&client_sockaddr, &addrlen);
+	if (client_fd == SOCKET_INVALID) {
+		ERR("Failed to accept: %d\n", errno);
+		return;
+	}
+
+	if (fcntl(client_fd, F_SETFL,
+		  fcntl(client_fd, F_GETFL) | O_NONBLOCK) < 0) {
+		ERR("Failed to set non blocking mode: %d\n", errno);
+		close(client_fd);
+		return;
+	}
+
+	cli = calloc(1, sizeof(*cli));
+	if (cli) {
+		cli->rx_buf = malloc(socket_mgmt.param.mtu);
+		cli->tx_ring = malloc(socket_mgmt.param.tx_size);
+	}
+	if (!cli || !cli->rx_buf || !cli->tx_ring) {
+		ERR("Failed to allocate client\n");
+		if (cli) {
+			free(cli->rx_buf);
+			free(cli->tx_ring);
 		}
+		free(cli);
+		close(client_fd);
+		return;
+	}
+
+	cli->fd = client_fd;
+	cli->cid = btsocket_new_cid();
+	cli->evt_mask = BTSOCKET_MASK_ALL;
+	queue_push_tail(socket_mgmt.clients, cli);
+
+	if (mainloop_add_fd(cli->fd, EPOLLIN, btsocket_read, cli,
+			    btsocket_client_destroy) < 0) {
+		ERR("Failed to watch client %d\n", cli->cid);
+		btsocket_client_destroy(cli);
+		return;
 	}
 
-	INFO("connection established: %d\n", socket_mgmt.desc[client]);
+	INFO("[%d] connection established: %d\n", cli->cid, cli->fd);
+	btsocket_mtu_negociation(cli);
+}
+
+static void btsocket_server_destroy(void *user_data)
+{
+	close(socket_mgmt.server);
+	socket_mgmt.server = SOCKET_INVALID;
 }
 
 uint8_t btsocket_server_setup(void)
@@ -159,27 +579,27 @@ uint8_t btsocket_server_setup(void)
 	};
 
 	memcpy(&server_socket.sun_path[0], SOCKET_ADDRESS,
-	       sizeof(server_socket.sun_path));
+	       sizeof(SOCKET_ADDRESS));
 
 	unlink(SOCKET_ADDRESS);
 	/* gets a unique name for the socket*/
-	if (bind(socket_mgmt.desc[server], (struct sockaddr *)&server_socket,
+	if (bind(socket_mgmt.server, (struct sockaddr *)&server_socket,
 		 sizeof(server_socket)) == -1) {
 		ERR("Failed to bind server socket err: %d\n", errno);
-		btsocket_close(NULL);
+		btsocket_close();
 		return BTLE_ERROR_INTERNAL;
 	}
 	/* ready to accept incoming connections */
-	if (listen(socket_mgmt.desc[server], SOCKET_CONN_MAX) == -1) {
+	if (listen(socket_mgmt.server, SOCKET_CONN_MAX) == -1) {
 		ERR("Failed to listen server socket err: %d\n", errno);
-		btsocket_close(NULL);
+		btsocket_close();
 		return BTLE_ERROR_INTERNAL;
 	}
 
-	if (mainloop_add_fd(socket_mgmt.desc[server], EPOLLIN,
+	if (mainloop_add_fd(socket_mgmt.server, EPOLLIN,
 			    btsocket_accept_conn,
-			    NULL, btsocket_close) < 0) {
-		btsocket_close(NULL);
+			    NULL, btsocket_server_destroy) < 0) {
+		btsocket_close();
 		return BTLE_ERROR_INTERNAL;
 	}
 
@@ -188,7 +608,7 @@ uint8_t btsocket_server_setup(void)
 
 uint8_t btsocket_init(struct btsocket_param *param)
 {
-	if (socket_mgmt.desc[server] != SOCKET_INVALID)
+	if (socket_mgmt.server != SOCKET_INVALID)
 		return BTLE_ERROR_ALREADY;
 
 	if (!param)
@@ -198,16 +618,25 @@ uint8_t btsocket_init(struct btsocket_param *param)
 		return BTLE_ERROR_INVALID_ARG;
 	}
 
+	/* ring indexes are masked: size must be a power of 2 */
+	if (param->tx_size < param->mtu ||
+	    (param->tx_size & (param->tx_size - 1)) ||
+	    param->tx_low_wm >= param->tx_high_wm ||
+	    param->tx_high_wm > param->tx_size) {
+		return BTLE_ERROR_INVALID_ARG;
+	}
+
 	socket_mgmt.param = *param;
+	socket_mgmt.clients = queue_new();
 
 	/* unix stream socket */
-	socket_mgmt.desc[server] = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (socket_mgmt.desc[server] == SOCKET_INVALID) {
+	socket_mgmt.server = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (socket_mgmt.server == SOCKET_INVALID) {
 		return BTLE_ERROR_INTERNAL;
 	}
 
-	INFO("creating socket %d\n", socket_mgmt.desc[server]);
-	if (setsockopt(socket_mgmt.desc[server], SOL_SOCKET, SO_REUSEADDR,
+	INFO("creating socket %d\n", socket_mgmt.server);
+	if (setsockopt(socket_mgmt.server, SOL_SOCKET, SO_REUSEADDR,
 		       &(int){1 }, sizeof(int)) < 0) {
 		ERR("allow reuse of local addresse failed\n");
 		return BTLE_ERROR_INTERNAL;
@@ -227,12 +656,19 @@ uint8_t btsocket_init(struct btsocket_param *param)
 
 void btsocket_close()
 {
-	uint8_t idx;
+	struct btsocket_client *cli;
 
-	for (idx = 0; idx < sizeof(socket_mgmt.desc); idx++) {
-		if (socket_mgmt.desc[idx] != SOCKET_INVALID) {
-			close(socket_mgmt.desc[idx]);
-			socket_mgmt.desc[idx] = SOCKET_INVALID;
-		}
+	if (socket_mgmt.clients) {
+		/* destroy callback unlinks the client from the queue */
+		while ((cli = queue_peek_head(socket_mgmt.clients)))
+			mainloop_remove_fd(cli->fd);
+
+		queue_destroy(socket_mgmt.clients, NULL);
+		socket_mgmt.clients = NULL;
+	}
+
+	if (socket_mgmt.server != SOCKET_INVALID) {
+		if (mainloop_remove_fd(socket_mgmt.server) < 0)
+			btsocket_server_destroy(NULL);
 	}
 }
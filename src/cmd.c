@@ -25,11 +25,15 @@
 #include <errno.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <endian.h>
+#include <sys/uio.h>
 
 
 #include "lib/bluetooth.h"
 
 #include "lib/mgmt.h"
+#include "src/shared/mainloop.h"
 #include "src/shared/mgmt.h"
 #include "src/shared/util.h"
 
@@ -40,6 +44,11 @@
 #include "btsocket.h"
 #include "ipc.h"
 #include "gattc.h"
+#include "stats.h"
+#include "adv.h"
+#include "scan.h"
+#include "devreg.h"
+#include "backend.h"
 #include "cmd.h"
 
 #ifndef BUILD_BUG_ON_ZERO
@@ -55,7 +64,19 @@
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 #endif
 
-#define LE_ADV_DATA_LEN         31
+/* msg_info requests: [op(u8) | kind(u8)], kind is one of @stats_kind */
+enum info_op {
+	INFO_STATS_GET = 0,	/* one msg_info frame per entry of kind */
+	INFO_STATS_GET_RESET,	/* same, then clearing */
+	INFO_STATS_RESET,	/* clearing only, single frame */
+};
+
+/* devices per EVENT_SCAN_SUMMARY frame */
+#define SCAN_SUMMARY_CHUNK	64
+
+/* requests added to the pool each time it runs dry */
+#define CMD_REQ_POOL_GROW	16
+
 #define LE_NAME                         31
 
 #define CMD_ADAPTER_MAX 16
@@ -77,61 +98,136 @@ struct msg {
 		uint8_t devId;
 		uint8_t msg_type;  /* cf @event_type for event or @cmds for response */
 		uint8_t status;
+		uint16_t req_id; /* little endian; 0 for events */
 	} header;
-	uint8_t data_len;
+	uint16_t data_len; /* little endian */
 	uint8_t data[0];
-};
-
-static uint8_t cmd_get_device_info(uint8_t devId, uint8_t *data,
-				   uint8_t data_len);
-static uint8_t cmd_reset(uint8_t devId, uint8_t *data, uint8_t data_len);
-static uint8_t cmd_power(uint8_t devId, uint8_t *data, uint8_t data_len);
-static uint8_t cmd_set_local_name(uint8_t devId, uint8_t *data,
-				  uint8_t data_len);
-static uint8_t cmd_set_conn_param(uint8_t devId, uint8_t *data,
-				  uint8_t data_len);
-static uint8_t cmd_scan(uint8_t devId, uint8_t *data, uint8_t data_len);
-static uint8_t cmd_read_controller_info(uint8_t devId, uint8_t *data,
-					uint8_t data_len);
+} __attribute__((packed));
+
+static uint8_t cmd_get_device_info(struct cmd_req *req, uint8_t *data,
+				   uint16_t data_len);
+static uint8_t cmd_reset(struct cmd_req *req, uint8_t *data,
+			 uint16_t data_len);
+static uint8_t cmd_power(struct cmd_req *req, uint8_t *data,
+			 uint16_t data_len);
+static uint8_t cmd_set_local_name(struct cmd_req *req, uint8_t *data,
+				  uint16_t data_len);
+static uint8_t cmd_set_conn_param(struct cmd_req *req, uint8_t *data,
+				  uint16_t data_len);
+static uint8_t cmd_scan(struct cmd_req *req, uint8_t *data,
+			uint16_t data_len);
+static uint8_t cmd_read_controller_info(struct cmd_req *req, uint8_t *data,
+					uint16_t data_len);
+static uint8_t cmd_set_event_mask(struct cmd_req *req, uint8_t *data,
+				  uint16_t data_len);
+static uint8_t cmd_set_log_level(struct cmd_req *req, uint8_t *data,
+				 uint16_t data_len);
+static uint8_t cmd_scan_set_program(struct cmd_req *req, uint8_t *data,
+				    uint16_t data_len);
+static uint8_t cmd_devreg_snapshot(struct cmd_req *req, uint8_t *data,
+				   uint16_t data_len);
+static uint8_t cmd_devreg_set_lost_timeout(struct cmd_req *req,
+					   uint8_t *data, uint16_t data_len);
+static uint8_t cmd_set_param_version(struct cmd_req *req, uint8_t *data,
+				     uint16_t data_len);
+
+/* fixed parameters layout length, failing the build if not @len */
+#define CMD_PARAM(name, len) \
+	(sizeof(struct name) + BUILD_BUG_ON_ZERO(sizeof(struct name) != (len)))
+
+/* "XX:XX:XX:XX:XX:XX", CMD_PARAM_VERSION_TEXT */
+#define CMD_PARAM_ADDR_STR_LEN	17
 
+/*
+ * @cmd_fct: handler
+ * @param_len: fixed parameters length, checked before calling @cmd_fct;
+ *             0: left to the handler
+ * @param_var: a variable length part follows the fixed one
+ * @param_conn: starts with the connection handle since
+ *              CMD_PARAM_VERSION_CONN
+ */
 static const struct {
-	uint8_t (*cmd_fct)(uint8_t devId, uint8_t *data, uint8_t data_len);
+	uint8_t (*cmd_fct)(struct cmd_req *req, uint8_t *data,
+			   uint16_t data_len);
+	uint16_t param_len;
+	bool param_var;
+	bool param_conn;
 } cmd_table[] = {
 	[CMD_MGMT_GET_DEVICE_INFO] = { cmd_get_device_info },
 	[CMD_MGMT_RESET] = { cmd_reset },
-	[CMD_MGMT_POWER] = { cmd_power },
-	[CMD_MGMT_SET_LOCAL_NAME] = { cmd_set_local_name },
-	[CMD_MGMT_SET_CONNECTION_PARAM] = { cmd_set_conn_param },
+	[CMD_MGMT_POWER] = { cmd_power, CMD_PARAM(cmd_param_power, 1) },
+	[CMD_MGMT_SET_LOCAL_NAME] = {
+		cmd_set_local_name, CMD_PARAM(cmd_param_local_name, 1), true },
+	[CMD_MGMT_SET_CONNECTION_PARAM] = {
+		cmd_set_conn_param, CMD_PARAM(cmd_param_conn_param, 15) },
 	[CMD_MGMT_SCAN] = { cmd_scan },
 	[CMD_MGMT_READ_CONTROLLER_INFO] = { cmd_read_controller_info },
-	[CMD_MGMT_CONNECT] = { gattc_connect },
-
-	[CMD_GATTC_WRITE_CMD] = { gattc_write_cmd },
-	[CMD_GATTC_WRITE_REQ] = { gattc_write_req },
-	[CMD_GATTC_READ_REQ] = { gattc_read_req },
-	[CMD_GATTC_SUBSCRIBE_REQ] = { gattc_subscribe_req },
-	[CMD_GATTC_UNSUBSCRIBE_REQ] = { gattc_unsubscribe_req },
+	[CMD_MGMT_CONNECT] = {
+		gattc_connect, CMD_PARAM(cmd_param_connect, 10) },
+
+	[CMD_GATTC_WRITE_CMD] = {
+		gattc_write_cmd, CMD_PARAM(cmd_param_write, 6), true, true },
+	[CMD_GATTC_WRITE_REQ] = {
+		gattc_write_req, CMD_PARAM(cmd_param_write, 6), true, true },
+	[CMD_GATTC_READ_REQ] = {
+		gattc_read_req, CMD_PARAM(cmd_param_read, 4), false, true },
+	[CMD_GATTC_SUBSCRIBE_REQ] = {
+		gattc_subscribe_req, CMD_PARAM(cmd_param_subscribe, 5),
+		false, true },
+	[CMD_GATTC_UNSUBSCRIBE_REQ] = {
+		gattc_unsubscribe_req, CMD_PARAM(cmd_param_unsubscribe, 3),
+		false, true },
+
+	[CMD_SET_EVENT_MASK] = { cmd_set_event_mask },
+	[CMD_SET_LOG_LEVEL] = { cmd_set_log_level },
+	[CMD_SCAN_SET_PROGRAM] = { cmd_scan_set_program },
+	[CMD_DEVREG_SNAPSHOT] = { cmd_devreg_snapshot },
+	[CMD_DEVREG_SET_LOST_TIMEOUT] = { cmd_devreg_set_lost_timeout },
+	[CMD_SET_PARAM_VERSION] = { cmd_set_param_version, 1 },
+	[CMD_GATTC_CONNECT_CANCEL] = {
+		gattc_connect_cancel, CMD_PARAM(cmd_param_conn, 2),
+		false, true },
+	[CMD_GATTC_SET_CONNECT_TIMEOUT] = { gattc_set_connect_timeout },
+	[CMD_GATTC_DB_DUMP] = {
+		gattc_db_dump, CMD_PARAM(cmd_param_db_dump, 4), false, true },
+	[CMD_GATTC_READ_MULTIPLE] = {
+		gattc_read_multiple, CMD_PARAM(cmd_param_read_multiple, 4),
+		true, true },
 
 	[CMD_MAX] = { NULL },
 };
 
-struct cmd_param {
-	uint8_t devId;
-	enum cmds cmd;
+struct cmd_req_chunk {
+	struct cmd_req_chunk *next;
+	struct cmd_req req[CMD_REQ_POOL_GROW];
 };
 
-struct cmd_param param;
+/*
+ * Scan results waiting to be sent in an EVENT_SCAN_BATCH
+ *
+ * @cfg: limits, batching when active
+ * @count: results held
+ * @len: @buf length, count byte included
+ * @timer: mainloop timeout flushing the batch, 0: none
+ * @buf: [count | (len(le16) | result)...]
+ */
+struct cmd_scan_batch {
+	struct scan_batch cfg;
+	uint8_t count;
+	uint16_t len;
+	int timer;
+	uint8_t buf[IPC_DATA_LEN_MAX - sizeof(struct msg)];
+};
 
 static struct {
-	struct mgmt *desc;
 	uint16_t reg_flag; /* up to 16 adapters */
-	struct {
-		uint8_t devId;
-	} cmd_param;
+
+	struct cmd_req *req_free; /* pool of request contexts */
+	struct cmd_req_chunk *req_chunks;
 
 	struct cmd_adaper adapter[CMD_MAX_ADAPTER];
+	struct cmd_scan_batch batch[CMD_MAX_ADAPTER];
 } btmgmt = {
-	.desc = NULL,
 	.reg_flag = 0,
 };
 
@@ -139,38 +235,98 @@ static struct {
 #define set_flag(idx)           (btmgmt.reg_flag |= BIT(idx))
 #define unset_flag(idx)         (btmgmt.reg_flag &= ~BIT(idx))
 
-void cmd_send_status(uint8_t devId, uint8_t cmd, uint8_t ret)
+static struct cmd_req *cmd_req_get(void)
+{
+	struct cmd_req *req;
+
+	if (!btmgmt.req_free) {
+		struct cmd_req_chunk *chunk;
+		uint8_t idx;
+
+		chunk = malloc(sizeof(*chunk));
+		if (!chunk)
+			return NULL;
+
+		for (idx = 0; idx < CMD_REQ_POOL_GROW; idx++) {
+			chunk->req[idx].next = btmgmt.req_free;
+			btmgmt.req_free = &chunk->req[idx];
+		}
+		chunk->next = btmgmt.req_chunks;
+		btmgmt.req_chunks = chunk;
+	}
+
+	req = btmgmt.req_free;
+	btmgmt.req_free = req->next;
+	req->next = NULL;
+
+	return req;
+}
+
+static void cmd_req_put(struct cmd_req *req)
+{
+	req->next = btmgmt.req_free;
+	btmgmt.req_free = req;
+}
+
+static void cmd_req_pool_free(void)
+{
+	while (btmgmt.req_chunks) {
+		struct cmd_req_chunk *chunk = btmgmt.req_chunks;
+
+		btmgmt.req_chunks = chunk->next;
+		free(chunk);
+	}
+	btmgmt.req_free = NULL;
+}
+
+static void cmd_send_rsp(uint16_t cid, uint16_t req_id, uint8_t devId,
+			 uint8_t cmd, uint8_t ret, void *data,
+			 uint16_t data_len)
 {
 	struct msg resp = {
 		.header = {
 			.devId = devId,
 			.msg_type = cmd,
 			.status = ret,
+			.req_id = htole16(req_id),
 		},
+		.data_len = htole16(data_len),
+	};
+	struct iovec iov[2] = {
+		{ .iov_base = &resp, .iov_len = sizeof(resp) },
+		{ .iov_base = data, .iov_len = data_len },
 	};
 
-	ipc_send_rsp(&resp, sizeof(resp));
+	ipc_sendv(cid, msg_command_resp, iov, data_len ? 2 : 1);
 }
 
-void cmd_send_status_msg(uint8_t devId, uint8_t cmd, uint8_t ret,
-			 void *data, uint8_t data_len)
+void cmd_send_status(struct cmd_req *req, uint8_t ret)
 {
-	struct msg *resp;
-	uint8_t container[sizeof(*resp) + data_len];
-
-	resp = (void *)&container[0];
+	cmd_send_status_msg(req, ret, NULL, 0);
+}
 
-	resp->header.devId = devId;
-	resp->header.msg_type = cmd;
-	resp->header.status = ret;
-	resp->data_len = data_len;
-	if (resp->data_len)
-		memcpy(resp->data, data, resp->data_len);
+void cmd_send_status_msg(struct cmd_req *req, uint8_t ret, void *data,
+			 uint16_t data_len)
+{
+	cmd_send_rsp(req->cid, req->id, req->devId, req->cmd, ret, data,
+		     data_len);
+	stats_cmd(req->cmd, ret, req->param_len, data_len, req->t_rx,
+		  req->t_backend);
+	cmd_req_put(req);
+}
 
-	ipc_send_rsp(&container[0], sizeof(container));
+void cmd_req_backend(struct cmd_req *req)
+{
+	req->t_backend = stats_now_us();
 }
 
 void cmd_send_event(uint8_t devId, uint8_t evt_type)
+{
+	cmd_send_event_msgv(devId, evt_type, NULL, 0);
+}
+
+void cmd_send_event_msgv(uint8_t devId, uint8_t evt_type,
+			 const struct iovec *iov, int iovcnt)
 {
 	struct msg resp = {
 		.header = {
@@ -178,24 +334,32 @@ void cmd_send_event(uint8_t devId, uint8_t evt_type)
 			.msg_type = evt_type,
 		},
 	};
+	struct iovec frame[IPC_IOV_MAX];
+	size_t data_len = 0;
+	uint8_t ret;
+	int i;
+
+	if (iovcnt >= IPC_IOV_MAX)
+		return;
 
-	ipc_send_event(&resp, sizeof(resp));
+	frame[0].iov_base = &resp;
+	frame[0].iov_len = sizeof(resp);
+	for (i = 0; i < iovcnt; i++) {
+		frame[i + 1] = iov[i];
+		data_len += iov[i].iov_len;
+	}
+	resp.data_len = htole16(data_len);
+
+	ret = ipc_send_eventv(BIT(evt_type), frame, iovcnt + 1);
+	stats_event(evt_type, ret, data_len);
 }
 
 void cmd_send_event_msg(uint8_t devId, uint8_t evt_type,
-			void *data, uint8_t data_len)
+			void *data, uint16_t data_len)
 {
-	struct msg *resp;
-	uint8_t container[sizeof(*resp) + data_len];
-
-	resp = (void *)&container[0];
+	struct iovec iov = { .iov_base = data, .iov_len = data_len };
 
-	resp->header.devId = devId;
-	resp->header.msg_type = evt_type;
-	resp->data_len = data_len;
-	memcpy(resp->data, data, resp->data_len);
-
-	ipc_send_event(&container[0], sizeof(container));
+	cmd_send_event_msgv(devId, evt_type, &iov, 1);
 }
 
 
@@ -206,47 +370,159 @@ static void cmd_event_connected(uint16_t index, uint16_t length,
 	cmd_send_event(index, EVENT_CONNECTED);
 }
 
+/* EVENT_DISCONNECTED is sent by gattc, with the connection handle */
 static void cmd_event_disconnected(uint16_t index, uint16_t length,
 				   const void *param, void *user_data)
 {
-	INFO("%s\n", __FUNCTION__);
-	cmd_send_event(index, EVENT_DISCONNECTED);
+	const struct mgmt_ev_device_disconnected *evt = param;
+	const uint8_t *addr = evt->addr.bdaddr.b;
+
+	INFO("[%d] %02X:%02X:%02X:%02X:%02X:%02X disconnected (%d)\n", index,
+	     addr[5], addr[4], addr[3], addr[2], addr[1], addr[0],
+	     evt->reason);
 }
 
-static void cmd_event_dev_found(uint16_t index, uint16_t length,
-				const void *param, void *user_data)
+/* pairing over: the peer is bonded when its keys are to be stored */
+static void cmd_event_new_ltk(uint16_t index, uint16_t length,
+			      const void *param, void *user_data)
 {
-	const struct mgmt_ev_device_found *ev_device_found = param;
-	uint8_t le_adv_len = MIN(ev_device_found->eir_len, LE_ADV_DATA_LEN);
+	const struct mgmt_ev_new_long_term_key *evt = param;
+
+	gattc_new_key(index, evt->key.addr.bdaddr.b, evt->key.addr.type,
+		      evt->store_hint);
+}
+
+static void cmd_scan_batch_flush(uint8_t devId)
+{
+	struct cmd_scan_batch *batch = &btmgmt.batch[devId];
+
+	if (batch->timer > 0) {
+		mainloop_remove_timeout(batch->timer);
+		batch->timer = 0;
+	}
+
+	if (!batch->count)
+		return;
+
+	batch->buf[0] = batch->count;
+	cmd_send_event_msg(devId, EVENT_SCAN_BATCH, batch->buf, batch->len);
+	batch->count = 0;
+	batch->len = 0;
+}
+
+static void cmd_scan_batch_timeout(int id, void *user_data)
+{
+	/* one shot, removed by the flush */
+	cmd_scan_batch_flush(PTR_TO_UINT(user_data));
+}
+
+/* false when the result can not be batched */
+static bool cmd_scan_batch_add(uint8_t devId, const struct iovec *iov,
+			       int iovcnt)
+{
+	struct cmd_scan_batch *batch = &btmgmt.batch[devId];
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if (1 + 2 + len > sizeof(batch->buf))
+		return false;
+
+	if (batch->len + 2 + len > sizeof(batch->buf))
+		cmd_scan_batch_flush(devId);
+
+	if (!batch->len)
+		batch->len = 1;
+
+	batch->buf[batch->len++] = len & 0xff;
+	batch->buf[batch->len++] = len >> 8;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(&batch->buf[batch->len], iov[i].iov_base,
+		       iov[i].iov_len);
+		batch->len += iov[i].iov_len;
+	}
+	batch->count++;
+
+	if (batch->count == batch->cfg.count) {
+		cmd_scan_batch_flush(devId);
+	} else if (batch->cfg.interval_ms && !batch->timer) {
+		batch->timer = mainloop_add_timeout(batch->cfg.interval_ms,
+						    cmd_scan_batch_timeout,
+						    UINT_TO_PTR(devId), NULL);
+		if (batch->timer < 0)
+			batch->timer = 0;
+	}
+
+	return true;
+}
+
+static void cmd_send_scan_result(uint16_t index,
+				 const struct mgmt_ev_device_found *ev,
+				 uint16_t eir_len)
+{
+	uint8_t rec[ADV_REC_LEN(eir_len)];
 
 	struct {
-		/* must be naturally packed */
 		uint32_t flags;
 		uint8_t addr[6];
 		uint8_t addr_type;
 		int8_t rssi;
-		uint8_t le_adv_data_len;
-		uint8_t le_adv_data[le_adv_len];
-	} device;
-
-	memcpy(&device.addr[0], &ev_device_found->addr.bdaddr,
-	       sizeof(device.addr));
-	device.addr_type = ev_device_found->addr.type;
-	device.flags = ev_device_found->flags;
-	device.rssi = ev_device_found->rssi;
-	device.le_adv_data_len = le_adv_len;
+		uint16_t eir_len;
+		uint16_t rec_len;
+	} __attribute__((packed)) device;
+	struct iovec iov[3] = {
+		{ .iov_base = &device, .iov_len = sizeof(device) },
+		/* advertising data is sent straight from the mgmt event */
+		{ .iov_base = (void *)&ev->eir[0], .iov_len = eir_len },
+		{ .iov_base = rec,
+		  .iov_len = adv_parse(ev->eir, eir_len, rec, sizeof(rec)) },
+	};
 
-	memcpy(&device.le_adv_data[0], &ev_device_found->eir[0],
-	       device.le_adv_data_len);
+	memcpy(&device.addr[0], &ev->addr.bdaddr, sizeof(device.addr));
+	device.addr_type = ev->addr.type;
+	device.flags = ev->flags;
+	device.rssi = ev->rssi;
+	device.eir_len = cpu_to_le16(eir_len);
+	device.rec_len = cpu_to_le16(iov[2].iov_len);
 
-	INFO("dev[%d] found %02X:%02X:%02X:%02X:%02X:%02X flag(%d) rssi(%d)\n",
+	DBG("dev[%d] found %02X:%02X:%02X:%02X:%02X:%02X flag(%d) rssi(%d)\n",
 	     index,
 	     device.addr[0], device.addr[1],
 	     device.addr[2], device.addr[3],
 	     device.addr[4], device.addr[5],
-	     ev_device_found->flags, ev_device_found->rssi);
+	     ev->flags, ev->rssi);
+
+	if (scan_batch_active(&btmgmt.batch[index].cfg)) {
+		if (cmd_scan_batch_add(index, iov, 3))
+			return;
+		/* too long for a batch, keeping results in order */
+		cmd_scan_batch_flush(index);
+	}
+
+	cmd_send_event_msgv(index, EVENT_SCAN_RESULT, iov, 3);
+}
+
+static void cmd_event_dev_found(uint16_t index, uint16_t length,
+				const void *param, void *user_data)
+{
+	const struct mgmt_ev_device_found *ev_device_found = param;
+	uint16_t eir_len;
 
-	cmd_send_event_msg(index, EVENT_SCAN_RESULT, &device, sizeof(device));
+	if (length < sizeof(*ev_device_found))
+		return;
+
+	/* advertising data and scan response, as long as the kernel has it */
+	eir_len = MIN(le16_to_cpu(ev_device_found->eir_len),
+		      length - sizeof(*ev_device_found));
+
+	if (!scan_report(index, ev_device_found->addr.bdaddr.b,
+			 ev_device_found->addr.type, ev_device_found->rssi,
+			 ev_device_found->eir, eir_len))
+		return;
+
+	cmd_send_scan_result(index, ev_device_found, eir_len);
 }
 
 static void cmd_event_new_conn_param(uint16_t index, uint16_t length,
@@ -277,6 +553,82 @@ static void cmd_event_new_conn_param(uint16_t index, uint16_t length,
 			   &conn_params, sizeof(conn_params));
 }
 
+struct cmd_scan_summary {
+	uint8_t devId;
+	bool sent;		/* first frame sent */
+	uint32_t dropped;
+	uint8_t count;
+	struct {
+		uint8_t addr[6];
+		uint8_t addr_type;
+		int8_t best_rssi;
+		uint32_t reports;
+	} __attribute__((packed)) dev[SCAN_SUMMARY_CHUNK];
+};
+
+static void cmd_scan_summary_send(struct cmd_scan_summary *sum, bool last)
+{
+	struct {
+		uint8_t last;
+		uint8_t count;
+		uint32_t dropped;	/* first frame only */
+	} __attribute__((packed)) hdr = {
+		.last = last,
+		.count = sum->count,
+		.dropped = htole32(sum->dropped),
+	};
+	struct iovec iov[2] = {
+		{ .iov_base = &hdr,
+		  .iov_len = sum->sent ? sizeof(hdr) - sizeof(hdr.dropped) :
+				       sizeof(hdr) },
+		{ .iov_base = sum->dev,
+		  .iov_len = sum->count * sizeof(sum->dev[0]) },
+	};
+
+	cmd_send_event_msgv(sum->devId, EVENT_SCAN_SUMMARY, iov,
+			    sum->count ? 2 : 1);
+	sum->sent = true;
+	sum->count = 0;
+}
+
+static void cmd_scan_summary_dev(const uint8_t *addr, uint8_t addr_type,
+				 int8_t best_rssi, uint32_t reports,
+				 void *user_data)
+{
+	struct cmd_scan_summary *sum = user_data;
+
+	if (sum->count == SCAN_SUMMARY_CHUNK)
+		cmd_scan_summary_send(sum, false);
+
+	memcpy(sum->dev[sum->count].addr, addr, 6);
+	sum->dev[sum->count].addr_type = addr_type;
+	sum->dev[sum->count].best_rssi = best_rssi;
+	sum->dev[sum->count].reports = htole32(reports);
+	sum->count++;
+}
+
+/* discovery stopped, by the timer, a client or the kernel */
+static void cmd_scan_end(uint8_t devId)
+{
+	struct cmd_adaper *adapter = cmd_get_adapter_by_id(devId);
+	struct cmd_scan_summary sum = {
+		.devId = devId,
+	};
+
+	if (!adapter)
+		return;
+
+	if (adapter->scan_timer > 0) {
+		mainloop_remove_timeout(adapter->scan_timer);
+		adapter->scan_timer = 0;
+	}
+
+	cmd_scan_batch_flush(devId);
+
+	if (!scan_summary(devId, &sum.dropped, cmd_scan_summary_dev, &sum))
+		cmd_scan_summary_send(&sum, true);
+}
+
 static void cmd_event_scan(uint16_t index, uint16_t length,
 			   const void *param, void *user_data)
 {
@@ -289,41 +641,63 @@ static void cmd_event_scan(uint16_t index, uint16_t length,
 	msg = evt_disc->discovering ? SCAN_START : SCAN_STOP;
 
 	cmd_send_event_msg(index, EVENT_SCAN_STATUS, &msg, 1);
+
+	if (!evt_disc->discovering)
+		cmd_scan_end(index);
 }
 
-static uint8_t cmd_mgmt_event_registration(uint8_t devId)
+static const struct {
+	uint16_t event;
+	uint16_t min_len;
+	mgmt_notify_func_t func;
+} cmd_mgmt_events[] = {
+	{ MGMT_EV_DEVICE_CONNECTED, sizeof(struct mgmt_ev_device_connected),
+	  cmd_event_connected },
+	{ MGMT_EV_DEVICE_DISCONNECTED,
+	  sizeof(struct mgmt_ev_device_disconnected), cmd_event_disconnected },
+	{ MGMT_EV_DEVICE_FOUND, sizeof(struct mgmt_ev_device_found),
+	  cmd_event_dev_found },
+	{ MGMT_EV_NEW_LONG_TERM_KEY,
+	  sizeof(struct mgmt_ev_new_long_term_key), cmd_event_new_ltk },
+	{ MGMT_EV_NEW_CONN_PARAM, sizeof(struct mgmt_ev_new_conn_param),
+	  cmd_event_new_conn_param },
+	{ MGMT_EV_DISCOVERING, sizeof(struct mgmt_ev_discovering),
+	  cmd_event_scan },
+};
+
+void cmd_mgmt_event(uint16_t event, uint16_t index, uint16_t length,
+		    const void *param)
 {
-	if (!is_flag_set(devId)) {
-		set_flag(devId);
+	uint8_t idx;
 
-		if (!mgmt_register(btmgmt.desc, MGMT_EV_DEVICE_CONNECTED, devId,
-				   cmd_event_connected, NULL, NULL)) {
-			ERR("registering MGMT_EV_DEVICE_CONNECTED event");
-			return BTLE_ERROR_INTERNAL;
-		}
+	if (index >= CMD_MAX_ADAPTER)
+		return;
 
-		if (!mgmt_register(btmgmt.desc, MGMT_EV_DEVICE_DISCONNECTED,
-				   devId,
-				   cmd_event_disconnected, NULL, NULL)) {
-			ERR("registering MGMT_EV_DEVICE_DISCONNECTED event");
-			return BTLE_ERROR_INTERNAL;
-		}
+	for (idx = 0; idx < sizeof(cmd_mgmt_events) /
+			    sizeof(cmd_mgmt_events[0]); idx++) {
+		if (cmd_mgmt_events[idx].event != event)
+			continue;
+		if (length >= cmd_mgmt_events[idx].min_len)
+			cmd_mgmt_events[idx].func(index, length, param, NULL);
+		return;
+	}
+}
 
-		if (!mgmt_register(btmgmt.desc, MGMT_EV_DEVICE_FOUND, devId,
-				   cmd_event_dev_found, NULL, NULL)) {
-			ERR("registering MGMT_EV_DEVICE_FOUND event");
-			return BTLE_ERROR_INTERNAL;
-		}
+static uint8_t cmd_mgmt_event_registration(uint8_t devId)
+{
+	uint8_t idx;
 
-		if (!mgmt_register(btmgmt.desc, MGMT_EV_NEW_CONN_PARAM, devId,
-				   cmd_event_new_conn_param, NULL, NULL)) {
-			ERR("registering MGMT_EV_NEW_CONN_PARAM event");
-			return BTLE_ERROR_INTERNAL;
-		}
+	if (is_flag_set(devId))
+		return BTLE_SUCCESS;
+
+	set_flag(devId);
 
-		if (!mgmt_register(btmgmt.desc, MGMT_EV_DISCOVERING, devId,
-				   cmd_event_scan, NULL, NULL)) {
-			ERR("registering MGMT_EV_DISCOVERING event");
+	for (idx = 0; idx < sizeof(cmd_mgmt_events) /
+			    sizeof(cmd_mgmt_events[0]); idx++) {
+		if (!backend_mgmt_register(cmd_mgmt_events[idx].event,
+					   devId)) {
+			ERR("registering mgmt event 0x%04x\n",
+			    cmd_mgmt_events[idx].event);
 			return BTLE_ERROR_INTERNAL;
 		}
 	}
@@ -331,119 +705,85 @@ static uint8_t cmd_mgmt_event_registration(uint8_t devId)
 	return BTLE_SUCCESS;
 }
 
-static void cmd_mgmt_dbg(const char *str, void *user_data)
-{
-	/* DBG("mgmt: %s\n", str); */
-}
-
 static uint8_t cmd_mgmt_init(uint8_t devId)
 {
-	uint8_t ret;
-
-	if (!btmgmt.desc) {
-		btmgmt.desc = mgmt_new_default();
-		if (!btmgmt.desc) {
-			ERR("new mgmt\n");
-			return BTLE_ERROR_INTERNAL;
-		}
-
-		ret = mgmt_set_debug(btmgmt.desc, cmd_mgmt_dbg, NULL, NULL);
-	}
-	ret = cmd_mgmt_event_registration(devId);
-
-	return ret;
+	return cmd_mgmt_event_registration(devId);
 }
 
-static uint8_t cmd_get_device_info(uint8_t devId, uint8_t *data,
-				   uint8_t data_len)
+static uint8_t cmd_get_device_info(struct cmd_req *req, uint8_t *data,
+				   uint16_t data_len)
 {
-	cmd_send_status(devId, CMD_MGMT_GET_DEVICE_INFO,
-			BTLE_ERROR_NOT_IMPLEMENTED);
 	return BTLE_ERROR_NOT_IMPLEMENTED;
 }
 
-static uint8_t cmd_reset(uint8_t devId, uint8_t *data, uint8_t data_len)
+static uint8_t cmd_reset(struct cmd_req *req, uint8_t *data,
+			 uint16_t data_len)
 {
-	cmd_send_status(devId, CMD_MGMT_RESET, BTLE_ERROR_NOT_IMPLEMENTED);
 	return BTLE_ERROR_NOT_IMPLEMENTED;
 }
 
 static void cmd_power_complete(uint8_t status, uint16_t length,
 			       const void *param, void *user_data)
 {
-	uint8_t *devId = user_data;
+	struct cmd_req *req = user_data;
 
-	INFO("[%d] cmd power complete (%d)\n", *devId, status);
-	cmd_send_status(*devId, CMD_MGMT_POWER, status);
+	INFO("[%d] cmd power complete (%d)\n", req->devId, status);
+	cmd_send_status(req, status);
 }
 
-static uint8_t cmd_power(uint8_t devId, uint8_t *data, uint8_t data_len)
+static uint8_t cmd_power(struct cmd_req *req, uint8_t *data,
+			 uint16_t data_len)
 {
+	struct cmd_param_power *param = (void *)data;
 	uint8_t val;
 
 	INFO("%s mode(%s)\n", __FUNCTION__,
-	     (data[0] == POWER_ON) ? "on" : "off");
+	     (param->mode == POWER_ON) ? "on" : "off");
 
-	if (data[0] == POWER_ON) {
+	if (param->mode == POWER_ON) {
 		val = 0x01;
-	} else if (data[0] == POWER_OFF) {
+	} else if (param->mode == POWER_OFF) {
 		val = 0x00;
 	} else {
-		cmd_send_status(devId, CMD_MGMT_POWER, BTLE_ERROR_INVALID_ARG);
 		return BTLE_ERROR_INVALID_ARG;
 	}
 
-	btmgmt.cmd_param.devId = devId;
-	mgmt_send(btmgmt.desc, MGMT_OP_SET_POWERED, devId, 1, &val,
-		  cmd_power_complete, &btmgmt.cmd_param.devId, NULL);
+	cmd_req_backend(req);
+	if (!backend_mgmt_send(MGMT_OP_SET_POWERED, req->devId, 1, &val,
+			       cmd_power_complete, req))
+		return BTLE_ERROR_INTERNAL;
 
 	return BTLE_SUCCESS;
 }
 
-static uint8_t cmd_set_local_name(uint8_t devId, uint8_t *data,
-				  uint8_t data_len)
+static uint8_t cmd_set_local_name(struct cmd_req *req, uint8_t *data,
+				  uint16_t data_len)
 {
-	struct {
-		uint8_t name_len;
-		uint8_t name[data[0]];
-	} param;
+	struct cmd_param_local_name *param = (void *)data;
 
-	param.name_len = data[0];
-	memcpy(param.name, &data[1], param.name_len);
-
-	INFO("set local name: len(%d) name(%s)\n",
-	     param.name_len, param.name);
-
-	return BTLE_SUCCESS;
-}
-
-uint8_t cmd_strtou16(uint8_t *in, uint16_t *out)
-{
-	if (!in || !out)
-		return BTLE_ERROR_NULL_ARG;
+	if (param->len > CMD_LOCAL_NAME_MAX ||
+	    data_len != sizeof(*param) + param->len)
+		return BTLE_ERROR_INVALID_ARG;
 
-	*out = (in[0] & 0x00FF) << 8;
-	*out += in[1];
+	INFO("set local name: len(%d) name(%.*s)\n",
+	     param->len, param->len, param->name);
 
+	cmd_send_status(req, BTLE_SUCCESS);
 	return BTLE_SUCCESS;
 }
 
-static uint8_t cmd_set_conn_param(uint8_t devId, uint8_t *data,
-				  uint8_t data_len)
+static uint8_t cmd_set_conn_param(struct cmd_req *req, uint8_t *data,
+				  uint16_t data_len)
 {
+	struct cmd_param_conn_param *param = (void *)data;
 	struct mgmt_conn_param conn_param;
-	uint8_t *p_data = &data[0];
-	uint8_t idx;
-
-	for (idx = 0; idx < 6; idx++, p_data += 3) {
-		conn_param.addr.bdaddr.b[idx] = strtol((char *)p_data, NULL, 16);
-	}
-	p_data = &data[17];
 
-	cmd_strtou16(&p_data[0], &conn_param.min_interval);
-	cmd_strtou16(&p_data[2], &conn_param.max_interval);
-	cmd_strtou16(&p_data[4], &conn_param.latency);
-	cmd_strtou16(&p_data[6], &conn_param.timeout);
+	memcpy(conn_param.addr.bdaddr.b, param->addr, sizeof(param->addr));
+	conn_param.addr.type = param->addr_type;
+	conn_param.min_interval = param->min_interval;
+	conn_param.max_interval = param->max_interval;
+	conn_param.latency = param->latency;
+	conn_param.timeout = param->timeout;
 
 	INFO("%02X:%02X:%02X:%02X:%02X:%02X\n",
 	     conn_param.addr.bdaddr.b[0], conn_param.addr.bdaddr.b[1],
@@ -451,22 +791,181 @@ static uint8_t cmd_set_conn_param(uint8_t devId, uint8_t *data,
 	     conn_param.addr.bdaddr.b[4], conn_param.addr.bdaddr.b[5]);
 
 	INFO("[%d] conn param min:%d max:%d latency:%d timeout:%d\n",
-	     devId, conn_param.min_interval, conn_param.max_interval,
-	     conn_param.latency, conn_param.timeout);
+	     req->devId, le16toh(conn_param.min_interval),
+	     le16toh(conn_param.max_interval), le16toh(conn_param.latency),
+	     le16toh(conn_param.timeout));
 
+	cmd_send_status(req, BTLE_SUCCESS);
 	return BTLE_SUCCESS;
 }
 
 static void cmd_scan_complete(uint8_t status, uint16_t length,
 			      const void *param, void *user_data)
 {
-	uint8_t *devId = user_data;
+	struct cmd_req *req = user_data;
+
+	INFO("[%d] scan complete (%d)\n", req->devId, status);
+	cmd_send_status(req, status);
+}
+
+static void cmd_scan_timeout_complete(uint8_t status, uint16_t length,
+				      const void *param, void *user_data)
+{
+	uint8_t devId = PTR_TO_UINT(user_data);
 
-	INFO("[%d] scan complete (%d)\n", *devId, status);
-	cmd_send_status(*devId, CMD_MGMT_SCAN, status);
+	if (status)
+		ERR("[%d] stopping timed scan failed (%d)\n", devId, status);
 }
 
-static uint8_t cmd_scan(uint8_t devId, uint8_t *data, uint8_t data_len)
+static void cmd_scan_timeout(int id, void *user_data)
+{
+	struct cmd_adaper *adapter = user_data;
+	uint8_t devId = adapter - btmgmt.adapter;
+	struct mgmt_cp_stop_discovery cp = {
+		.type = (1 << BDADDR_LE_PUBLIC) | (1 << BDADDR_LE_RANDOM),
+	};
+
+	/* one shot */
+	mainloop_remove_timeout(id);
+	adapter->scan_timer = 0;
+
+	INFO("[%d] scan timeout\n", devId);
+
+	if (!backend_mgmt_send(MGMT_OP_STOP_DISCOVERY, devId, sizeof(cp), &cp,
+			       cmd_scan_timeout_complete, UINT_TO_PTR(devId)))
+		ERR("[%d] cmd MGMT_OP_STOP_DISCOVERY failed\n", devId);
+}
+
+static void cmd_scan_start_complete(uint8_t status, uint16_t length,
+				    const void *param, void *user_data)
+{
+	struct cmd_req *req = user_data;
+	struct cmd_adaper *adapter = &btmgmt.adapter[req->devId];
+	uint16_t timeout_ms = adapter->scan_timeout_ms;
+
+	adapter->scan_timeout_ms = 0;
+
+	if (!status && timeout_ms) {
+		if (adapter->scan_timer > 0)
+			mainloop_remove_timeout(adapter->scan_timer);
+
+		adapter->scan_timer = mainloop_add_timeout(timeout_ms,
+							   cmd_scan_timeout,
+							   adapter, NULL);
+		if (adapter->scan_timer < 0) {
+			ERR("[%d] scan timer\n", req->devId);
+			adapter->scan_timer = 0;
+		}
+	}
+
+	cmd_scan_complete(status, length, param, user_data);
+}
+
+static void cmd_scan_svc_complete(uint8_t status, uint16_t length,
+				  const void *param, void *user_data)
+{
+	struct cmd_req *req = user_data;
+	struct mgmt_cp_start_discovery cp;
+
+	if (status != MGMT_STATUS_UNKNOWN_COMMAND &&
+	    status != MGMT_STATUS_NOT_SUPPORTED) {
+		/* filtered by the kernel from now on */
+		scan_set_offloaded(req->devId, !status);
+		cmd_scan_start_complete(status, length, param, user_data);
+		return;
+	}
+
+	INFO("[%d] no service discovery; filtering in daemon\n", req->devId);
+
+	cp.type = (1 << BDADDR_LE_PUBLIC) | (1 << BDADDR_LE_RANDOM);
+	if (!backend_mgmt_send(MGMT_OP_START_DISCOVERY, req->devId,
+			       sizeof(cp), &cp, cmd_scan_start_complete, req))
+		cmd_send_status(req, BTLE_ERROR_INTERNAL);
+}
+
+static uint8_t cmd_scan_options(uint8_t *data, uint16_t data_len,
+				struct scan_dedup *dedup,
+				struct scan_filter *filter,
+				struct scan_batch *batch)
+{
+	while (data_len >= 2) {
+		uint8_t type = data[0];
+		uint8_t len = data[1];
+		uint8_t *val = &data[2];
+		uint8_t idx;
+
+		if (data_len < 2 + len)
+			return BTLE_ERROR_INVALID_ARG;
+
+		switch (type) {
+		case SCAN_OPT_DEDUP:
+			if (len < 3)
+				return BTLE_ERROR_INVALID_ARG;
+			dedup->enabled = true;
+			dedup->rssi_delta = val[0];
+			dedup->min_interval_ms = val[1] | val[2] << 8;
+			break;
+		case SCAN_OPT_RSSI:
+			if (len < 1)
+				return BTLE_ERROR_INVALID_ARG;
+			filter->rssi = (int8_t)val[0];
+			break;
+		case SCAN_OPT_UUID16:
+		case SCAN_OPT_UUID128:
+		{
+			uint8_t uuid_len = (type == SCAN_OPT_UUID16) ?
+					   2 : ADV_UUID128_LEN;
+
+			if (len % uuid_len ||
+			    filter->uuid_count + len / uuid_len > SCAN_UUID_MAX)
+				return BTLE_ERROR_INVALID_ARG;
+
+			for (idx = 0; idx < len; idx += uuid_len)
+				adv_uuid_to128(&val[idx], uuid_len,
+					filter->uuids[filter->uuid_count++]);
+			break;
+		}
+		case SCAN_OPT_BATCH:
+			if (len < 3)
+				return BTLE_ERROR_INVALID_ARG;
+			batch->interval_ms = val[0] | val[1] << 8;
+			batch->count = val[2];
+			break;
+		default:
+			break;
+		}
+
+		data += 2 + len;
+		data_len -= 2 + len;
+	}
+
+	return BTLE_SUCCESS;
+}
+
+static uint8_t cmd_scan_start_svc(struct cmd_req *req,
+				  const struct scan_filter *filter)
+{
+	struct mgmt_cp_start_service_discovery *cp;
+	uint16_t cp_len = sizeof(*cp) + filter->uuid_count * ADV_UUID128_LEN;
+	uint8_t buf[cp_len];
+
+	cp = (void *)buf;
+	cp->type = (1 << BDADDR_LE_PUBLIC) | (1 << BDADDR_LE_RANDOM);
+	cp->rssi = filter->rssi;
+	cp->uuid_count = cpu_to_le16(filter->uuid_count);
+	memcpy(cp->uuids, filter->uuids, filter->uuid_count * ADV_UUID128_LEN);
+
+	if (!backend_mgmt_send(MGMT_OP_START_SERVICE_DISCOVERY, req->devId,
+			       cp_len, cp, cmd_scan_svc_complete, req)) {
+		ERR("cmd MGMT_OP_START_SERVICE_DISCOVERY failed\n");
+		return BTLE_ERROR_INTERNAL;
+	}
+
+	return BTLE_SUCCESS;
+}
+
+static uint8_t cmd_scan(struct cmd_req *req, uint8_t *data,
+			uint16_t data_len)
 {
 	struct mgmt_cp_start_discovery cp;
 	uint16_t opcode = MGMT_OP_START_DISCOVERY;
@@ -474,30 +973,64 @@ static uint8_t cmd_scan(uint8_t devId, uint8_t *data, uint8_t data_len)
 
 	struct {
 		uint8_t mode;
-	} scan_param;
+		uint16_t timeout_ms;
+		struct scan_dedup dedup;
+		struct scan_filter filter;
+		struct scan_batch batch;
+	} scan_param = {
+		.filter.rssi = SCAN_RSSI_NONE,
+	};
+
+	if (data_len < 1)
+		return BTLE_ERROR_INVALID_ARG;
 
 	cp.type = (1 << BDADDR_LE_PUBLIC) | (1 << BDADDR_LE_RANDOM);
 	scan_param.mode = data[0];
 
 	if (scan_param.mode == SCAN_START) {
-		INFO("[%d] starting scan\n", devId);
+		INFO("[%d] starting scan\n", req->devId);
 		opcode = MGMT_OP_START_DISCOVERY;
+
+		/* [mode | timeout_ms(le16) | options] */
+		if (data_len >= 3)
+			scan_param.timeout_ms = data[1] | data[2] << 8;
+		if (data_len > 3) {
+			ret = cmd_scan_options(&data[3], data_len - 3,
+					       &scan_param.dedup,
+					       &scan_param.filter,
+					       &scan_param.batch);
+			if (ret)
+				return ret;
+		}
+		cmd_scan_batch_flush(req->devId);
+		btmgmt.batch[req->devId].cfg = scan_param.batch;
+		scan_set_dedup(req->devId, &scan_param.dedup);
+		scan_set_filter(req->devId, &scan_param.filter);
+		/* timed scans end with a summary of the devices seen */
+		scan_set_summary(req->devId, !!scan_param.timeout_ms);
+		btmgmt.adapter[req->devId].scan_timeout_ms =
+			scan_param.timeout_ms;
+
+		if (scan_filter_active(&scan_param.filter)) {
+			cmd_req_backend(req);
+			return cmd_scan_start_svc(req, &scan_param.filter);
+		}
 	} else if (scan_param.mode == SCAN_STOP) {
-		INFO("[%d] stopping scan\n", devId);
+		INFO("[%d] stopping scan\n", req->devId);
 		opcode = MGMT_OP_STOP_DISCOVERY;
 	}
 
-	btmgmt.cmd_param.devId = devId;
-	ret = mgmt_send(btmgmt.desc, opcode, devId, sizeof(cp),
-			&cp, cmd_scan_complete, &btmgmt.cmd_param.devId, NULL);
+	cmd_req_backend(req);
+	ret = backend_mgmt_send(opcode, req->devId, sizeof(cp), &cp,
+				(opcode == MGMT_OP_START_DISCOVERY) ?
+				cmd_scan_start_complete : cmd_scan_complete,
+				req);
 	if (!ret) {
 		ERR("cmd %s failed %d",
 		    ((opcode == MGMT_OP_START_DISCOVERY) ?
 		     "MGMT_OP_START_DISCOVERY" :
 		     "MGMT_OP_STOP_DISCOVERY"), ret);
 
-		cmd_send_status(devId, CMD_MGMT_SCAN, BTLE_ERROR_INTERNAL);
-
 		return BTLE_ERROR_INTERNAL;
 	}
 
@@ -519,20 +1052,19 @@ static void cmd_set_settings(uint8_t				devId,
 	}
 	if (current_settings & MGMT_SETTING_POWERED) {
 		val = 0x00;
-		mgmt_send(btmgmt.desc, MGMT_OP_SET_POWERED, devId, 1, &val,
-			  NULL, NULL, NULL);
+		backend_mgmt_send(MGMT_OP_SET_POWERED, devId, 1, &val, NULL,
+				  NULL);
 	}
 
 	if (!(current_settings & MGMT_SETTING_LE)) {
 		val = 0x01;
-		mgmt_send(btmgmt.desc, MGMT_OP_SET_LE, devId, 1, &val,
-			  NULL, NULL, NULL);
+		backend_mgmt_send(MGMT_OP_SET_LE, devId, 1, &val, NULL, NULL);
 	}
 
 	if (current_settings & MGMT_SETTING_BREDR) {
 		val = 0x00;
-		mgmt_send(btmgmt.desc, MGMT_OP_SET_BREDR, devId, 1, &val,
-			  NULL, NULL, NULL);
+		backend_mgmt_send(MGMT_OP_SET_BREDR, devId, 1, &val, NULL,
+				  NULL);
 	}
 }
 static void cmd_read_info_complete(uint8_t status, uint16_t length,
@@ -540,7 +1072,8 @@ static void cmd_read_info_complete(uint8_t status, uint16_t length,
 {
 	uint8_t msg_len = 0;
 	const struct mgmt_rp_read_info *info = param;
-	uint8_t *devId = user_data;
+	struct cmd_req *req = user_data;
+	uint8_t *devId = &req->devId;
 
 	if (!status) {
 		INFO("[%d] read info (%d)\n", *devId, status);
@@ -573,29 +1106,327 @@ static void cmd_read_info_complete(uint8_t status, uint16_t length,
 		cmd_set_settings(*devId, info);
 	}
 
-	cmd_send_status_msg(*devId, CMD_MGMT_READ_CONTROLLER_INFO, status,
-			    (void *)info, msg_len);
+	cmd_send_status_msg(req, status, (void *)info, msg_len);
 }
 
-static uint8_t cmd_read_controller_info(uint8_t devId, uint8_t *data,
-					uint8_t data_len)
+static uint8_t cmd_read_controller_info(struct cmd_req *req, uint8_t *data,
+					uint16_t data_len)
 {
 	uint16_t ret = BTLE_SUCCESS;
 
-	btmgmt.cmd_param.devId = devId;
-	ret = mgmt_send_nowait(btmgmt.desc, MGMT_OP_READ_INFO, devId, 0, NULL,
-			       cmd_read_info_complete, &btmgmt.cmd_param.devId,
-			       NULL);
+	cmd_req_backend(req);
+	ret = backend_mgmt_send(MGMT_OP_READ_INFO, req->devId, 0, NULL,
+				cmd_read_info_complete, req);
 	if (!ret) {
 		ERR("cmd MGMT_OP_READ_INFO failed");
-		cmd_send_status(devId, CMD_MGMT_READ_CONTROLLER_INFO,
-				BTLE_ERROR_INTERNAL);
+		return BTLE_ERROR_INTERNAL;
+	}
+	return BTLE_SUCCESS;
+}
+
+static uint8_t cmd_set_event_mask(struct cmd_req *req, uint8_t *data,
+				  uint16_t data_len)
+{
+	uint8_t ret = BTLE_ERROR_INVALID_ARG;
+	uint32_t mask;
+
+	if (data_len >= sizeof(mask)) {
+		mask = get_le32(data);
+
+		INFO("[%d] event mask (%08X)\n", req->cid, mask);
+		ret = btsocket_set_mask(req->cid, mask);
+	}
+
+	if (!ret)
+		cmd_send_status(req, ret);
+
+	return ret;
+}
 
-		ret = BTLE_ERROR_INTERNAL;
+static uint8_t cmd_set_log_level(struct cmd_req *req, uint8_t *data,
+				 uint16_t data_len)
+{
+	uint8_t ret = BTLE_ERROR_INVALID_ARG;
+
+	if (data_len >= 1) {
+		INFO("log level (%d)\n", data[0]);
+		ret = bt_log_set_level(data[0]);
 	}
+
+	if (!ret)
+		cmd_send_status(req, ret);
+
+	return ret;
+}
+
+static uint8_t cmd_scan_set_program(struct cmd_req *req, uint8_t *data,
+				    uint16_t data_len)
+{
+	uint8_t ret;
+
+	ret = scan_set_program(req->devId, data, data_len);
+	if (!ret)
+		cmd_send_status(req, ret);
+
 	return ret;
 }
 
+static uint8_t cmd_devreg_snapshot(struct cmd_req *req, uint8_t *data,
+				   uint16_t data_len)
+{
+	uint16_t len = devreg_snapshot(req->devId, NULL, 0);
+	uint8_t *buf;
+
+	buf = malloc(len);
+	if (!buf)
+		return BTLE_ERROR_MEMORY;
+
+	len = devreg_snapshot(req->devId, buf, len);
+	cmd_send_status_msg(req, BTLE_SUCCESS, buf, len);
+	free(buf);
+
+	return BTLE_SUCCESS;
+}
+
+static uint8_t cmd_devreg_set_lost_timeout(struct cmd_req *req,
+					   uint8_t *data, uint16_t data_len)
+{
+	if (data_len < 4)
+		return BTLE_ERROR_INVALID_ARG;
+
+	devreg_set_lost_timeout(data[0] | data[1] << 8 | data[2] << 16 |
+				(uint32_t)data[3] << 24);
+	cmd_send_status(req, BTLE_SUCCESS);
+
+	return BTLE_SUCCESS;
+}
+
+static uint8_t cmd_set_param_version(struct cmd_req *req, uint8_t *data,
+				     uint16_t data_len)
+{
+	uint8_t latest = CMD_PARAM_VERSION;
+	uint8_t ret;
+
+	if (data[0] > CMD_PARAM_VERSION)
+		return BTLE_ERROR_INVALID_ARG;
+
+	ret = btsocket_set_param_version(req->cid, data[0]);
+	if (!ret) {
+		INFO("[%d] parameters version %d\n", req->cid, data[0]);
+		cmd_send_status_msg(req, ret, &latest, sizeof(latest));
+	}
+
+	return ret;
+}
+
+static int cmd_param_hex(uint8_t c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* "XX:XX:XX:XX:XX:XX", octets in storage order */
+static bool cmd_param_str2ba(const uint8_t *str, uint8_t *addr)
+{
+	int idx, hi, lo;
+
+	for (idx = 0; idx < 6; idx++, str += 3) {
+		hi = cmd_param_hex(str[0]);
+		lo = cmd_param_hex(str[1]);
+		if (hi < 0 || lo < 0 || (idx < 5 && str[2] != ':'))
+			return false;
+		addr[idx] = hi << 4 | lo;
+	}
+
+	return true;
+}
+
+/* converted parameters, valid until the next command */
+static uint8_t cmd_param_buf[IPC_DATA_LEN_MAX];
+
+/*
+ * Prefixing the parameters of a client predating CMD_PARAM_VERSION_CONN
+ * with CMD_CONN_ANY
+ *
+ * @data: parameters, pointing to the converted ones on return
+ * @data_len: parameters length, updated
+ */
+static uint8_t cmd_param_add_conn(uint8_t **data, uint16_t *data_len)
+{
+	if (*data_len + 2 > sizeof(cmd_param_buf))
+		return BTLE_ERROR_INVALID_ARG;
+
+	memmove(&cmd_param_buf[2], *data, *data_len);
+	put_le16(CMD_CONN_ANY, cmd_param_buf);
+
+	*data = cmd_param_buf;
+	*data_len += 2;
+
+	return BTLE_SUCCESS;
+}
+
+/*
+ * Completing CMD_MGMT_CONNECT parameters of a client predating
+ * CMD_PARAM_VERSION_MTU with the default MTU
+ *
+ * @data: parameters, pointing to the converted ones on return
+ * @data_len: parameters length, updated
+ */
+static uint8_t cmd_param_add_mtu(uint8_t **data, uint16_t *data_len)
+{
+	if (*data_len + 2 > sizeof(cmd_param_buf))
+		return BTLE_ERROR_INVALID_ARG;
+
+	memcpy(cmd_param_buf, *data, *data_len);
+	put_le16(0, &cmd_param_buf[*data_len]);
+
+	*data = cmd_param_buf;
+	*data_len += 2;
+
+	return BTLE_SUCCESS;
+}
+
+/*
+ * Converting CMD_PARAM_VERSION_TEXT parameters to their binary layout;
+ * commands whose parameters are the same in both are left untouched,
+ * but for the connection handle
+ *
+ * @cmd: command type
+ * @data: parameters, pointing to the converted ones on return
+ * @data_len: parameters length, updated
+ */
+static uint8_t cmd_param_from_text(uint8_t cmd, uint8_t **data,
+				   uint16_t *data_len)
+{
+	uint8_t *buf = cmd_param_buf;
+	const uint8_t *in = *data;
+	uint16_t len = *data_len;
+
+	switch (cmd) {
+	case CMD_MGMT_CONNECT: {
+		/* [addr str | addr_type | (sec_level)] */
+		struct cmd_param_connect *param = (void *)buf;
+
+		if (len != CMD_PARAM_ADDR_STR_LEN + 1 &&
+		    len != CMD_PARAM_ADDR_STR_LEN + 2)
+			return BTLE_ERROR_INVALID_ARG;
+		if (!cmd_param_str2ba(in, param->addr))
+			return BTLE_ERROR_INVALID_ARG;
+		param->addr_type = in[CMD_PARAM_ADDR_STR_LEN];
+		param->sec_level = len > CMD_PARAM_ADDR_STR_LEN + 1 ?
+				   in[CMD_PARAM_ADDR_STR_LEN + 1] : 0;
+		param->mtu = 0;
+		len = sizeof(*param);
+		break;
+	}
+	case CMD_MGMT_SET_CONNECTION_PARAM: {
+		/* [addr str | min | max | latency | timeout], be16 */
+		struct cmd_param_conn_param *param = (void *)buf;
+
+		if (len != CMD_PARAM_ADDR_STR_LEN + 8)
+			return BTLE_ERROR_INVALID_ARG;
+		if (!cmd_param_str2ba(in, param->addr))
+			return BTLE_ERROR_INVALID_ARG;
+		in += CMD_PARAM_ADDR_STR_LEN;
+		param->addr_type = BDADDR_LE_PUBLIC;
+		param->min_interval = htole16(get_be16(&in[0]));
+		param->max_interval = htole16(get_be16(&in[2]));
+		param->latency = htole16(get_be16(&in[4]));
+		param->timeout = htole16(get_be16(&in[6]));
+		len = sizeof(*param);
+		break;
+	}
+	case CMD_GATTC_READ_REQ: {
+		/* [handle(be16)] */
+		struct cmd_param_read *param = (void *)buf;
+
+		if (len < 2)
+			return BTLE_ERROR_INVALID_ARG;
+		param->conn = htole16(CMD_CONN_ANY);
+		param->handle = htole16(get_be16(&in[0]));
+		len = sizeof(*param);
+		break;
+	}
+	case CMD_GATTC_WRITE_CMD:
+	case CMD_GATTC_WRITE_REQ: {
+		/* [handle(be16) | value] */
+		struct cmd_param_write *param = (void *)buf;
+
+		if (len < 2 || sizeof(*param) + len - 2 > sizeof(cmd_param_buf))
+			return BTLE_ERROR_INVALID_ARG;
+		param->conn = htole16(CMD_CONN_ANY);
+		param->handle = htole16(get_be16(&in[0]));
+		param->len = htole16(len - 2);
+		memcpy(param->value, &in[2], len - 2);
+		len = sizeof(*param) + len - 2;
+		break;
+	}
+	case CMD_GATTC_SUBSCRIBE_REQ: {
+		/* [value | handle(be16)] */
+		struct cmd_param_subscribe *param = (void *)buf;
+
+		if (len < 3)
+			return BTLE_ERROR_INVALID_ARG;
+		param->conn = htole16(CMD_CONN_ANY);
+		param->value = in[0];
+		param->handle = htole16(get_be16(&in[1]));
+		len = sizeof(*param);
+		break;
+	}
+	default:
+		if (cmd_table[cmd].param_conn)
+			return cmd_param_add_conn(data, data_len);
+		return BTLE_SUCCESS;
+	}
+
+	*data = buf;
+	*data_len = len;
+
+	return BTLE_SUCCESS;
+}
+
+/*
+ * Checking the parameters of @req against the layout of its command,
+ * converting them first if its client uses an older version
+ *
+ * @req: command
+ * @data: parameters, pointing to the converted ones on return
+ * @data_len: parameters length, updated
+ */
+static uint8_t cmd_param_decode(struct cmd_req *req, uint8_t **data,
+				uint16_t *data_len)
+{
+	uint16_t len = cmd_table[req->cmd].param_len;
+	uint8_t version;
+	uint8_t ret = BTLE_SUCCESS;
+
+	if (!len)
+		return BTLE_SUCCESS;
+
+	version = btsocket_get_param_version(req->cid);
+	if (version == CMD_PARAM_VERSION_TEXT)
+		ret = cmd_param_from_text(req->cmd, data, data_len);
+	else if (version < CMD_PARAM_VERSION_CONN &&
+		 cmd_table[req->cmd].param_conn)
+		ret = cmd_param_add_conn(data, data_len);
+	else if (version < CMD_PARAM_VERSION_MTU &&
+		 req->cmd == CMD_MGMT_CONNECT)
+		ret = cmd_param_add_mtu(data, data_len);
+	if (ret)
+		return ret;
+
+	if (*data_len < len ||
+	    (!cmd_table[req->cmd].param_var && *data_len != len))
+		return BTLE_ERROR_INVALID_ARG;
+
+	return BTLE_SUCCESS;
+}
+
 struct cmd_adaper *cmd_get_adapter_by_id(uint8_t devId)
 {
 	struct cmd_adaper *adapter = NULL;
@@ -606,57 +1437,185 @@ struct cmd_adaper *cmd_get_adapter_by_id(uint8_t devId)
 	return adapter;
 }
 
-uint8_t cmd_server_handler(uint8_t *data, uint8_t data_len)
+uint8_t cmd_server_handler(uint16_t cid, uint8_t *data, uint16_t data_len)
 {
-	uint8_t ret = BTLE_ERROR_INVALID_ARG;;
-
-	if (data_len < 2) {
+	/*
+	 +----------+--------------+-------------------+----------------+
+	 |     0    |       1      |        2:3        | 4: data_len -4 |
+	 +----------+--------------+-------------------+----------------+
+	 | DeviceId | Command Type | Request Id (le16) | Parameters     |
+	 +----------+--------------+-------------------+----------------+
+	 */
+	uint8_t ret = BTLE_ERROR_INVALID_ARG;
+	uint64_t t_rx = stats_now_us();
+	struct cmd_req *req;
+	uint8_t devId, cmdtype;
+	uint16_t req_id;
+	uint8_t *param = &data[4];
+	uint16_t param_len = data_len - 4;
+
+	if (data_len < 4)
 		return BTLE_ERROR_INVALID_ARG;
-	} else {
-		/*
-		 +----------+--------------+----------------+
-		 |     0    |       1      | 2: data_len -2 |
-		 +----------+--------------+----------------+
-		 | DeviceId | Command Type | Parameters     |
-		 +----------+--------------+----------------+
-		 */
-		uint8_t devId = data[0];
-		uint8_t cmdtype = data[1];
-
-		if (devId >= CMD_ADAPTER_MAX) {
-			ret = BTLE_ERROR_INVALID_ARG;
-			cmd_send_status(devId, cmdtype, ret);
-			return ret;
-		}
-		if (cmdtype < CMD_MAX) {
-			cmd_mgmt_init(devId);
-			ret = cmd_table[cmdtype].cmd_fct(devId, &data[2],
-							 data_len - 2);
-		}
 
-		if (ret) {
-			cmd_send_status(devId, cmdtype, ret);
-		}
+	devId = data[0];
+	cmdtype = data[1];
+	req_id = data[2] | (uint16_t)data[3] << 8;
+
+	if (devId >= CMD_ADAPTER_MAX) {
+		cmd_send_rsp(cid, req_id, devId, cmdtype, ret, NULL, 0);
+		stats_cmd(cmdtype, ret, data_len - 4, 0, t_rx, 0);
+		return ret;
+	}
+
+	req = cmd_req_get();
+	if (!req) {
+		ret = BTLE_ERROR_MEMORY;
+		cmd_send_rsp(cid, req_id, devId, cmdtype, ret, NULL, 0);
+		stats_cmd(cmdtype, ret, data_len - 4, 0, t_rx, 0);
+		return ret;
+	}
+	req->cid = cid;
+	req->id = req_id;
+	req->devId = devId;
+	req->cmd = cmdtype;
+	req->param_len = data_len - 4;
+	req->t_rx = t_rx;
+	req->t_backend = 0;
+
+	if (cmdtype < CMD_MAX && cmd_table[cmdtype].cmd_fct)
+		ret = cmd_param_decode(req, &param, &param_len);
+
+	if (!ret) {
+		cmd_mgmt_init(devId);
+		/* on success, the handler owns @req until it answers */
+		ret = cmd_table[cmdtype].cmd_fct(req, param, param_len);
 	}
+
+	if (ret)
+		cmd_send_status(req, ret);
+
 	return ret;
 }
 
+static void cmd_send_stats(uint16_t cid, uint8_t status, uint8_t kind,
+			   uint8_t index, bool last,
+			   const struct stats_entry *entry)
+{
+	/*
+	 * counters are le32; histograms (@nbuckets of each) follow, only
+	 * for commands
+	 */
+	struct {
+		uint8_t status;
+		uint8_t kind;
+		uint8_t index;
+		uint8_t last;
+		uint32_t count;
+		uint32_t errors;
+		uint32_t bytes_in;
+		uint32_t bytes_out;
+		uint8_t nbuckets;
+		uint32_t hist[2 * STATS_HIST_BUCKETS];
+	} __attribute__((packed)) rec;
+	uint16_t len = offsetof(typeof(rec), hist);
+	uint8_t idx;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.status = status;
+	rec.kind = kind;
+	rec.index = index;
+	rec.last = last;
+
+	if (entry) {
+		rec.count = htole32(entry->count);
+		rec.errors = htole32(entry->errors);
+		rec.bytes_in = htole32(entry->bytes_in);
+		rec.bytes_out = htole32(entry->bytes_out);
+	}
+
+	if (entry && kind == STATS_CMD) {
+		rec.nbuckets = STATS_HIST_BUCKETS;
+		for (idx = 0; idx < STATS_HIST_BUCKETS; idx++) {
+			rec.hist[idx] = htole32(entry->lat[idx]);
+			rec.hist[STATS_HIST_BUCKETS + idx] =
+				htole32(entry->rtt[idx]);
+		}
+		len = sizeof(rec);
+	}
+
+	ipc_send_info(cid, &rec, len);
+}
+
+uint8_t cmd_info_handler(uint16_t cid, uint8_t *data, uint16_t data_len)
+{
+	uint8_t op, kind, count, idx;
+
+	if (data_len < 2 || data[1] >= STATS_KIND_MAX ||
+	    data[0] > INFO_STATS_RESET) {
+		cmd_send_stats(cid, BTLE_ERROR_INVALID_ARG, 0, 0, true, NULL);
+		return BTLE_ERROR_INVALID_ARG;
+	}
+
+	op = data[0];
+	kind = data[1];
+	count = stats_count(kind);
+
+	if (op != INFO_STATS_RESET) {
+		for (idx = 0; idx < count; idx++)
+			cmd_send_stats(cid, BTLE_SUCCESS, kind, idx,
+				       idx == count - 1,
+				       stats_get(kind, idx));
+	}
+
+	if (op != INFO_STATS_GET) {
+		stats_reset(kind);
+		if (op == INFO_STATS_RESET)
+			cmd_send_stats(cid, BTLE_SUCCESS, kind, 0, true, NULL);
+	}
+
+	return BTLE_SUCCESS;
+}
+
 uint8_t cmd_server_init(void)
 {
-	return ipc_init(cmd_server_handler);
+	uint8_t ret;
+
+	ret = backend_init();
+	if (ret)
+		return ret;
+
+	devreg_init();
+
+	return ipc_init(cmd_server_handler, cmd_info_handler);
 }
 
 void cmd_server_close(void)
 {
+	struct cmd_adaper *adapter;
 	uint8_t devId;
 
 	for (devId = 0; devId < CMD_ADAPTER_MAX; devId++) {
 		if (is_flag_set(devId)) {
 			unset_flag(devId);
 		}
-		mgmt_unregister_index(btmgmt.desc, devId);
-		mgmt_cancel_index(btmgmt.desc, devId);
+		backend_mgmt_unregister_index(devId);
+		backend_mgmt_cancel_index(devId);
+
+		adapter = &btmgmt.adapter[devId];
+		if (adapter->scan_timer > 0) {
+			mainloop_remove_timeout(adapter->scan_timer);
+			adapter->scan_timer = 0;
+		}
+
+		/* pending results are dropped with the clients */
+		if (btmgmt.batch[devId].timer > 0)
+			mainloop_remove_timeout(btmgmt.batch[devId].timer);
+		memset(&btmgmt.batch[devId], 0, sizeof(btmgmt.batch[devId]));
 	}
-	mgmt_unref(btmgmt.desc);
-	btmgmt.desc = NULL;
+	backend_close();
+
+	scan_close();
+	devreg_close();
+
+	cmd_req_pool_free();
 }
@@ -0,0 +1,332 @@
+/*
+ *  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <endian.h>
+
+#include "src/shared/mainloop.h"
+
+#define MODULE "devreg"
+#include "btprint.h"
+
+#include "btle_error.h"
+#include "cmd.h"
+#include "scan.h"
+#include "devtab.h"
+#include "devreg.h"
+
+#define DEVREG_HASH_SIZE	256	/* buckets, power of 2 */
+#define DEVREG_WHEEL_SLOTS	64	/* power of 2 */
+#define DEVREG_TICK_MS		250
+
+/*
+ * Device remembered
+ *
+ * @entry: device table entry, least recently seen last
+ * @wheel: timer wheel slot link, while present
+ * @slot: timer wheel slot
+ * @present: seen within the lost timeout
+ * @first_ms, @last_ms: time first and last seen
+ */
+struct devreg_dev {
+	struct devtab_dev entry;
+	struct devtab_link wheel;
+	uint8_t slot;
+	int8_t rssi;
+	int8_t best_rssi;
+	bool present;
+	uint64_t first_ms;
+	uint64_t last_ms;
+	uint32_t count;
+	uint8_t adv_len;
+	uint8_t adv[DEVREG_ADV_MAX];
+};
+
+static struct {
+	struct devreg_dev pool[DEVREG_MAX];
+	struct devtab_dev *bucket[DEVREG_HASH_SIZE];
+	struct devtab tab;
+	struct devtab_link wheel[DEVREG_WHEEL_SLOTS];
+	uint16_t present;
+	uint32_t dropped;	/* new devices while all present */
+	uint32_t lost_ms;
+	uint64_t tick;		/* last tick processed */
+	int timer;		/* mainloop timeout, 0: none */
+} devreg;
+
+#define devreg_dev_of(link, member) \
+	devtab_entry_of(link, struct devreg_dev, member)
+
+static uint64_t devreg_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void devreg_presence(struct devreg_dev *dev, uint8_t evt_type)
+{
+	const struct devtab_dev *entry = &dev->entry;
+	struct devreg_presence evt = {
+		.addr_type = entry->addr_type,
+		.rssi = dev->rssi,
+	};
+
+	memcpy(evt.addr, entry->addr, sizeof(evt.addr));
+
+	DBG("[%d] %02X:%02X:%02X:%02X:%02X:%02X %s\n", entry->devId,
+	    entry->addr[5], entry->addr[4], entry->addr[3], entry->addr[2],
+	    entry->addr[1], entry->addr[0],
+	    evt_type == EVENT_DEVICE_LOST ? "lost" : "appeared");
+
+	cmd_send_event_msg(entry->devId, evt_type, &evt, sizeof(evt));
+}
+
+static void devreg_lost(struct devreg_dev *dev)
+{
+	devtab_link_del(&dev->wheel);
+	dev->present = false;
+	devreg.present--;
+
+	devreg_presence(dev, EVENT_DEVICE_LOST);
+}
+
+static void devreg_tick(int id, void *user_data)
+{
+	uint64_t now = devreg_now_ms();
+	uint64_t tick = now / DEVREG_TICK_MS;
+	uint16_t turns = 0;
+
+	/* slots due since last time, each at most once */
+	while (devreg.tick < tick && turns++ < DEVREG_WHEEL_SLOTS) {
+		struct devtab_link *head;
+		struct devtab_link *link, *next;
+
+		devreg.tick++;
+		head = &devreg.wheel[devreg.tick & (DEVREG_WHEEL_SLOTS - 1)];
+
+		for (link = head->next; link != head; link = next) {
+			struct devreg_dev *dev = devreg_dev_of(link, wheel);
+
+			next = link->next;
+			/* deadlines a turn ahead or more stay */
+			if (dev->last_ms + devreg.lost_ms <= now)
+				devreg_lost(dev);
+		}
+	}
+	devreg.tick = tick;
+
+	if (devreg.present) {
+		mainloop_modify_timeout(id, DEVREG_TICK_MS);
+	} else {
+		mainloop_remove_timeout(id);
+		devreg.timer = 0;
+	}
+}
+
+static void devreg_arm(struct devreg_dev *dev)
+{
+	uint64_t deadline = dev->last_ms + devreg.lost_ms;
+	uint8_t slot;
+
+	/* first tick at or after the deadline */
+	slot = ((deadline + DEVREG_TICK_MS - 1) / DEVREG_TICK_MS) &
+	       (DEVREG_WHEEL_SLOTS - 1);
+
+	if (dev->wheel.next != &dev->wheel && dev->slot == slot)
+		return;
+
+	devtab_link_del(&dev->wheel);
+	devtab_link_add(&devreg.wheel[slot], &dev->wheel);
+	dev->slot = slot;
+
+	if (devreg.timer > 0)
+		return;
+
+	devreg.tick = dev->last_ms / DEVREG_TICK_MS;
+	devreg.timer = mainloop_add_timeout(DEVREG_TICK_MS, devreg_tick, NULL,
+					    NULL);
+	if (devreg.timer < 0) {
+		ERR("presence timer\n");
+		devreg.timer = 0;
+	}
+}
+
+static void devreg_forget(struct devreg_dev *dev)
+{
+	if (dev->present)
+		devreg_lost(dev);
+
+	devtab_remove(&devreg.tab, &dev->entry);
+}
+
+static bool devreg_absent(const struct devtab_dev *entry, void *user_data)
+{
+	return !devtab_entry_of(entry, struct devreg_dev, entry)->present;
+}
+
+static struct devreg_dev *devreg_add(uint32_t key, uint8_t devId,
+				     const uint8_t *addr, uint8_t addr_type)
+{
+	struct devtab_dev *entry;
+	struct devreg_dev *dev;
+
+	if (devreg.tab.count < DEVREG_MAX) {
+		/* never evicted but on insertion: the pool fills up in order */
+		dev = &devreg.pool[devreg.tab.count];
+	} else {
+		/*
+		 * full: evicting the least recently seen device already
+		 * lost; one still present would be reported lost while in
+		 * range, then appear again
+		 */
+		entry = devtab_oldest(&devreg.tab, devreg_absent, NULL);
+		if (!entry) {
+			if (!devreg.dropped++)
+				INFO("all present, dropping new devices\n");
+			return NULL;
+		}
+		dev = devtab_entry_of(entry, struct devreg_dev, entry);
+		devreg_forget(dev);
+	}
+
+	memset(dev, 0, sizeof(*dev));
+	devtab_link_init(&dev->wheel);
+	devtab_insert(&devreg.tab, &dev->entry, key, devId, addr, addr_type);
+
+	return dev;
+}
+
+void devreg_seen(uint8_t devId, const uint8_t *addr, uint8_t addr_type,
+		 int8_t rssi, const uint8_t *eir, uint16_t eir_len)
+{
+	uint32_t key = devtab_key(devId, addr, addr_type);
+	uint64_t now = devreg_now_ms();
+	struct devtab_dev *entry;
+	struct devreg_dev *dev;
+
+	entry = devtab_lookup(&devreg.tab, key, devId, addr, addr_type);
+	if (entry) {
+		dev = devtab_entry_of(entry, struct devreg_dev, entry);
+		devtab_touch(&devreg.tab, entry);
+	} else {
+		dev = devreg_add(key, devId, addr, addr_type);
+		if (!dev)
+			return;
+		dev->first_ms = now;
+		dev->best_rssi = rssi;
+	}
+
+	dev->rssi = rssi;
+	if (rssi != SCAN_RSSI_NONE &&
+	    (dev->best_rssi == SCAN_RSSI_NONE || rssi > dev->best_rssi))
+		dev->best_rssi = rssi;
+	dev->last_ms = now;
+	dev->count++;
+	dev->adv_len = eir_len < DEVREG_ADV_MAX ? eir_len : DEVREG_ADV_MAX;
+	memcpy(dev->adv, eir, dev->adv_len);
+
+	devreg_arm(dev);
+
+	if (!dev->present) {
+		dev->present = true;
+		devreg.present++;
+		devreg_presence(dev, EVENT_DEVICE_APPEARED);
+	}
+}
+
+void devreg_set_lost_timeout(uint32_t lost_ms)
+{
+	if (!lost_ms)
+		lost_ms = DEVREG_LOST_MS;
+	/* due a tick ahead at least, never in a slot already processed */
+	devreg.lost_ms = lost_ms < DEVREG_TICK_MS ? DEVREG_TICK_MS : lost_ms;
+
+	INFO("lost timeout %ums\n", devreg.lost_ms);
+}
+
+uint16_t devreg_snapshot(uint8_t devId, uint8_t *buf, uint16_t size)
+{
+	uint64_t now = devreg_now_ms();
+	struct devtab_link *link;
+	uint16_t len = 2, count = 0;
+
+	for (link = devreg.tab.lru.next; link != &devreg.tab.lru;
+	     link = link->next) {
+		struct devreg_dev *dev = devreg_dev_of(link, entry.lru);
+		struct devreg_entry *entry;
+
+		if (dev->entry.devId != devId)
+			continue;
+
+		if (!buf) {
+			len += sizeof(*entry) + dev->adv_len;
+			continue;
+		}
+		if (len + sizeof(*entry) + dev->adv_len > size)
+			break;
+
+		entry = (struct devreg_entry *)&buf[len];
+		memcpy(entry->addr, dev->entry.addr, sizeof(entry->addr));
+		entry->addr_type = dev->entry.addr_type;
+		entry->rssi = dev->rssi;
+		entry->best_rssi = dev->best_rssi;
+		entry->present = dev->present;
+		entry->first_seen = htole32(now - dev->first_ms);
+		entry->last_seen = htole32(now - dev->last_ms);
+		entry->count = htole32(dev->count);
+		entry->adv_len = dev->adv_len;
+		memcpy(entry->adv, dev->adv, dev->adv_len);
+
+		len += sizeof(*entry) + dev->adv_len;
+		count++;
+	}
+
+	if (buf && size >= 2) {
+		buf[0] = count & 0xff;
+		buf[1] = count >> 8;
+	}
+
+	return len;
+}
+
+void devreg_init(void)
+{
+	uint16_t idx;
+
+	memset(&devreg, 0, sizeof(devreg));
+	devtab_init(&devreg.tab, devreg.bucket, DEVREG_HASH_SIZE);
+	for (idx = 0; idx < DEVREG_WHEEL_SLOTS; idx++)
+		devtab_link_init(&devreg.wheel[idx]);
+	devreg.lost_ms = DEVREG_LOST_MS;
+}
+
+void devreg_close(void)
+{
+	if (devreg.timer > 0)
+		mainloop_remove_timeout(devreg.timer);
+	if (devreg.dropped)
+		INFO("%u new devices dropped, all present\n", devreg.dropped);
+
+	devreg_init();
+}
@@ -0,0 +1,136 @@
+/*
+ *  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "devtab.h"
+
+#define FNV_OFFSET		2166136261U
+#define FNV_PRIME		16777619U
+
+void devtab_link_init(struct devtab_link *head)
+{
+	head->prev = head;
+	head->next = head;
+}
+
+void devtab_link_add(struct devtab_link *head, struct devtab_link *link)
+{
+	link->prev = head;
+	link->next = head->next;
+	head->next->prev = link;
+	head->next = link;
+}
+
+void devtab_link_del(struct devtab_link *link)
+{
+	link->prev->next = link->next;
+	link->next->prev = link->prev;
+	devtab_link_init(link);
+}
+
+void devtab_init(struct devtab *tab, struct devtab_dev **bucket,
+		 uint32_t size)
+{
+	memset(bucket, 0, size * sizeof(*bucket));
+	tab->bucket = bucket;
+	tab->mask = size - 1;
+	devtab_link_init(&tab->lru);
+	tab->count = 0;
+}
+
+uint32_t devtab_key(uint8_t devId, const uint8_t *addr, uint8_t addr_type)
+{
+	uint32_t hash = FNV_OFFSET;
+	uint8_t idx;
+
+	for (idx = 0; idx < 6; idx++)
+		hash = (hash ^ addr[idx]) * FNV_PRIME;
+	hash = (hash ^ addr_type) * FNV_PRIME;
+
+	return (hash ^ devId) * FNV_PRIME;
+}
+
+struct devtab_dev *devtab_lookup(struct devtab *tab, uint32_t key,
+				 uint8_t devId, const uint8_t *addr,
+				 uint8_t addr_type)
+{
+	struct devtab_dev *dev;
+
+	for (dev = tab->bucket[key & tab->mask]; dev; dev = dev->hnext) {
+		if (dev->devId == devId && dev->addr_type == addr_type &&
+		    !memcmp(dev->addr, addr, sizeof(dev->addr)))
+			return dev;
+	}
+
+	return NULL;
+}
+
+void devtab_insert(struct devtab *tab, struct devtab_dev *dev, uint32_t key,
+		   uint8_t devId, const uint8_t *addr, uint8_t addr_type)
+{
+	struct devtab_dev **head = &tab->bucket[key & tab->mask];
+
+	memcpy(dev->addr, addr, sizeof(dev->addr));
+	dev->addr_type = addr_type;
+	dev->devId = devId;
+	dev->hnext = *head;
+	*head = dev;
+	devtab_link_add(&tab->lru, &dev->lru);
+	tab->count++;
+}
+
+void devtab_remove(struct devtab *tab, struct devtab_dev *dev)
+{
+	struct devtab_dev **link;
+
+	link = &tab->bucket[devtab_key(dev->devId, dev->addr, dev->addr_type) &
+			    tab->mask];
+	while (*link != dev)
+		link = &(*link)->hnext;
+	*link = dev->hnext;
+	dev->hnext = NULL;
+
+	devtab_link_del(&dev->lru);
+	tab->count--;
+}
+
+void devtab_touch(struct devtab *tab, struct devtab_dev *dev)
+{
+	if (tab->lru.next == &dev->lru)
+		return;
+
+	devtab_link_del(&dev->lru);
+	devtab_link_add(&tab->lru, &dev->lru);
+}
+
+struct devtab_dev *devtab_oldest(struct devtab *tab, devtab_match_func match,
+				 void *user_data)
+{
+	struct devtab_link *link;
+
+	for (link = tab->lru.prev; link != &tab->lru; link = link->prev) {
+		struct devtab_dev *dev;
+
+		dev = devtab_entry_of(link, struct devtab_dev, lru);
+		if (!match || match(dev, user_data))
+			return dev;
+	}
+
+	return NULL;
+}
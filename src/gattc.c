@@ -25,191 +25,398 @@
 #include <errno.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <endian.h>
 
 #include <unistd.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 
 #include "lib/bluetooth.h"
 #include "lib/sdp.h"
-#include "lib/l2cap.h"
 #include "lib/uuid.h"
-#include "lib/hci.h"
-#include "lib/hci_lib.h"
 
 #include "lib/mgmt.h"
 #include "src/shared/mgmt.h"
+#include "src/shared/mainloop.h"
 #include "src/shared/util.h"
 #include "src/shared/att.h"
 #include "src/shared/queue.h"
 #include "src/shared/gatt-db.h"
+#include "src/shared/gatt-helpers.h"
 #include "src/shared/gatt-client.h"
 
 #define MODULE "gattc"
 #include "btprint.h"
 
 #include "btle_error.h"
+#include "ipc.h"
 #include "gattc.h"
+#include "backend.h"
 #include "cmd.h"
+#include "gattcache.h"
 
-#define ATT_CID 4
 #define ATT_DEFAULT_LE_MTU 23
 
+/* CMD_GATTC_DB_DUMP records, room left for the response header */
+#define GATTC_DB_DUMP_MAX (IPC_RSP_PAGE_MAX - 16)
+
 #define GATT_INVALID      0x00
 #define GATT_NOTIFICATION 0x01
 #define GATT_INDICATION   0x02
 
+/*
+ * GATT connection, from CMD_MGMT_CONNECT until disconnected; the
+ * bearer is watched for EPOLLOUT while being established
+ *
+ * @adapter: adapter the connection belongs to
+ * @conn: connection handle given to the clients
+ * @st: STATE_CONNECTING, then STATE_CONNECTED
+ * @fd: ATT bearer
+ * @timer: mainloop timeout giving up the connection, 0: none
+ * @dst: peer address
+ * @dst_type: peer address type
+ * @mtu: ATT MTU requested, exchanged once the bearer is connected
+ * @hash: peer Database Hash, read before the GATT client is set up
+ * @hash_valid: @hash was read
+ * @paired: keys distributed on this link, @bond telling whether they are
+ *          stored; the link being encrypted otherwise tells a stored key
+ *          was used
+ * @att: ATT transport, once connected
+ * @db: GATT database, once connected
+ * @gatt: GATT client, once connected
+ */
+struct client {
+	struct cmd_adaper *adapter;
+	uint16_t conn;
+	enum state st;
+	int fd;
+	int timer;
+	bdaddr_t dst;
+	uint8_t dst_type;
+	uint16_t mtu;
+	uint8_t hash[GATTCACHE_HASH_LEN];
+	bool hash_valid;
+	bool paired;
+	bool bond;
+	struct bt_att *att;
+	struct gatt_db *db;
+	struct bt_gatt_client *gatt;
+};
+
+/*
+ * Notification registration; lives until unsubscribed
+ *
+ * @cli: connection the notifications are forwarded from
+ * @req: pending subscribe command, NULL once answered
+ * @id: registration identifier (cccd_id)
+ * @status: registration status, when completed before @id is known
+ * @done: registration completed
+ */
+struct gattc_notify {
+	struct client *cli;
+	struct cmd_req *req;
+	unsigned int id;
+	uint16_t status;
+	bool done;
+};
+
+/*
+ * CMD_GATTC_DB_DUMP response being built
+ *
+ * @buf: [next(le16) | record...]
+ * @len: @buf length
+ * @full: the record being added did not fit
+ * @next: start handle of the first service left out, 0: none
+ */
+struct gattc_db_dump {
+	uint8_t *buf;
+	uint16_t len;
+	bool full;
+	uint16_t next;
+};
+
+/*
+ * CMD_GATTC_READ_MULTIPLE being served; answered and freed once the
+ * last read queued is done, whether completed or canceled
+ *
+ * @req: command answered
+ * @refs: reads queued, plus one while queuing them
+ * @count: values answered
+ * @slot: one per value, in the order requested
+ */
+struct gattc_read_multiple {
+	struct cmd_req *req;
+	int refs;
+	uint8_t count;
+	struct gattc_read_slot {
+		struct gattc_read_multiple *rm;
+		uint16_t handle;
+		uint8_t att_ecode;	/* BT_ATT_ERROR_UNLIKELY until read */
+		uint16_t len;
+		uint8_t value[BT_ATT_MAX_LE_MTU];
+	} slot[0];
+};
+
+static uint32_t gattc_connect_timeout_ms = GATTC_CONNECT_TIMEOUT_MS;
+
+static void gattc_connect_complete(struct client *cli, uint8_t status);
+
+/*
+ * Connection @conn of adapter @devId in state @st
+ *
+ * @devId: adapter index
+ * @conn: connection handle, CMD_CONN_ANY: the first one in state @st
+ * @st: STATE_CONNECTING or STATE_CONNECTED
+ * @ret: BTLE_ERROR_INVALID_ARG: no such adapter,
+ *       BTLE_ERROR_INVALID_STATE: no such connection
+ */
+static struct client *gattc_client(uint8_t devId, uint16_t conn,
+				   enum state st, uint8_t *ret)
+{
+	struct cmd_adaper *adapter;
+	struct client *cli;
+	int idx;
+
+	adapter = cmd_get_adapter_by_id(devId);
+	if (!adapter) {
+		*ret = BTLE_ERROR_INVALID_ARG;
+		return NULL;
+	}
+
+	for (idx = 0; idx < CMD_CONN_MAX; idx++) {
+		cli = adapter->cli[idx];
+		if (cli && cli->st == st &&
+		    (conn == CMD_CONN_ANY || cli->conn == conn))
+			return cli;
+	}
+
+	*ret = BTLE_ERROR_INVALID_STATE;
+	return NULL;
+}
+
+/* handle not given to any connection of @adapter, never CMD_CONN_ANY */
+static uint16_t gattc_conn_alloc(struct cmd_adaper *adapter)
+{
+	int idx;
+
+	do {
+		if (++adapter->conn_last == CMD_CONN_ANY)
+			continue;
+		for (idx = 0; idx < CMD_CONN_MAX; idx++) {
+			if (adapter->cli[idx] &&
+			    adapter->cli[idx]->conn == adapter->conn_last)
+				break;
+		}
+		if (idx == CMD_CONN_MAX)
+			break;
+	} while (1);
+
+	return adapter->conn_last;
+}
+
+/* releasing @cli and its slot; its bearer is closed */
+static void gattc_client_free(struct client *cli)
+{
+	struct cmd_adaper *adapter = cli->adapter;
+	int idx;
+
+	for (idx = 0; idx < CMD_CONN_MAX; idx++) {
+		if (adapter->cli[idx] == cli)
+			adapter->cli[idx] = NULL;
+	}
+
+	if (cli->att) {
+		bt_gatt_client_unref(cli->gatt);
+		bt_att_unref(cli->att);
+	} else {
+		close(cli->fd);
+	}
+
+	free(cli);
+}
+
 static void gattc_write_complete(bool success, uint8_t att_ecode,
 				 void *user_data)
 {
-	struct cmd_adaper *adapter = user_data;
+	struct cmd_req *req = user_data;
 	uint8_t status = (success ? 0 : 1);
 
-	cmd_send_status(adapter->devId, CMD_GATTC_WRITE_REQ, status);
+	cmd_send_status(req, status);
 }
 
-static uint8_t gattc_write(uint8_t cmd, uint8_t devId,
-			   uint8_t *data, uint8_t data_len)
+static uint8_t gattc_write(struct cmd_req *req, uint8_t *data,
+			   uint16_t data_len)
 {
+	struct cmd_param_write *param = (void *)data;
 	uint8_t ret = BTLE_SUCCESS;
-	struct cmd_adaper *adapter;
+	struct client *cli;
 
-	adapter = cmd_get_adapter_by_id(devId);
-	if (!adapter)
+	cli = gattc_client(req->devId, le16toh(param->conn), STATE_CONNECTED,
+			   &ret);
+	if (cli && data_len != sizeof(*param) + le16toh(param->len))
 		ret = BTLE_ERROR_INVALID_ARG;
-	else if (!adapter->cli)
-		ret = BTLE_ERROR_INVALID_STATE;
 
 	if (!ret) {
-		uint16_t handle;
-		uint8_t len;
-		struct bt_gatt_client *gatt = adapter->cli->gatt;
+		uint16_t handle = le16toh(param->handle);
+		uint16_t len = le16toh(param->len);
+		struct bt_gatt_client *gatt = cli->gatt;
 
-		cmd_strtou16(&data[0], &handle);
-		len = data_len - 2;
+		cmd_req_backend(req);
 
-		if (CMD_GATTC_WRITE_CMD == cmd) {
+		if (CMD_GATTC_WRITE_CMD == req->cmd) {
 			bool signed_write = false;
 
 			if (!bt_gatt_client_write_without_response(gatt, handle,
 								   signed_write,
-								   &data[2],
+								   param->value,
 								   len)) {
 				ret = BTLE_ERROR_INTERNAL;
+			} else {
+				cmd_send_status(req, BTLE_SUCCESS);
 			}
-		} else if (cmd == CMD_GATTC_SUBSCRIBE_REQ) {
-			if (!bt_gatt_client_write_value(gatt, handle,
-							&data[2], len,
-							gattc_write_complete,
-							adapter, NULL)) {
-				ret = BTLE_ERROR_INTERNAL;
-			}
+		} else if (!bt_gatt_client_write_value(gatt, handle,
+						       param->value, len,
+						       gattc_write_complete,
+						       req, NULL)) {
+			ret = BTLE_ERROR_INTERNAL;
 		}
 	}
 
-	if (ret || CMD_GATTC_WRITE_CMD == cmd)
-		cmd_send_status(devId, cmd, ret);
-
 	return ret;
 }
 
-uint8_t gattc_write_req(uint8_t devId, uint8_t *data, uint8_t data_len)
+uint8_t gattc_write_req(struct cmd_req *req, uint8_t *data,
+			uint16_t data_len)
 {
-	return gattc_write(CMD_GATTC_WRITE_REQ, devId, data, data_len);
+	return gattc_write(req, data, data_len);
 }
 
-uint8_t gattc_write_cmd(uint8_t devId, uint8_t *data, uint8_t data_len)
+uint8_t gattc_write_cmd(struct cmd_req *req, uint8_t *data,
+			uint16_t data_len)
 {
-	return gattc_write(CMD_GATTC_WRITE_CMD, devId, data, data_len);
+	return gattc_write(req, data, data_len);
 }
 
 static void gattc_subscribe_complete(uint16_t att_ecode, void *user_data)
 {
-	struct cmd_adaper *adapter = user_data;
+	struct gattc_notify *notify = user_data;
+	struct cmd_req *req = notify->req;
+	uint8_t cccd_id = notify->id;
+
+	if (!req)
+		return;
 
-	cmd_send_status_msg(adapter->devId, CMD_GATTC_SUBSCRIBE_REQ, att_ecode,
-			    &adapter->cli->cccd_id, 1);
+	if (!notify->id) {
+		/* completed from within registration; answered once the
+		 * identifier is known */
+		notify->status = att_ecode;
+		notify->done = true;
+		return;
+	}
+
+	notify->req = NULL;
+	cmd_send_status_msg(req, att_ecode, &cccd_id, 1);
 }
 
-void on_gattc_notification(uint16_t value_handle, const uint8_t *value,
-			   uint16_t length, void *user_data)
+static void gattc_notify_free(void *user_data)
 {
-	struct cmd_adaper *adapter = user_data;
+	free(user_data);
+}
 
+void gattc_send_notification(uint8_t devId, uint16_t conn, uint8_t cccd_id,
+			     uint16_t value_handle, const uint8_t *value,
+			     uint16_t length)
+{
 	struct {
+		uint16_t conn;
 		uint16_t value_handle;
 		uint16_t data_len;
 		uint8_t cccd_id;
-		uint8_t data[length];
-	} msg;
-
-	msg.cccd_id = adapter->cli->cccd_id;
+	} __attribute__((packed)) msg;
+	struct iovec iov[2] = {
+		{ .iov_base = &msg, .iov_len = sizeof(msg) },
+		{ .iov_base = (void *)value, .iov_len = length },
+	};
+
+	msg.conn = htole16(conn);
+	msg.cccd_id = cccd_id;
 	msg.value_handle = value_handle;
 	msg.data_len = length;
-	memcpy(&msg.data[0], value, sizeof(msg.data));
 
-	cmd_send_event_msg(adapter->devId, EVENT_GATTC_NOTIFICATION,
-			   &msg, sizeof(msg));
+	cmd_send_event_msgv(devId, EVENT_GATTC_NOTIFICATION, iov,
+			    length ? 2 : 1);
 }
 
-uint8_t gattc_subscribe_req(uint8_t devId, uint8_t *data, uint8_t data_len)
+void on_gattc_notification(uint16_t value_handle, const uint8_t *value,
+			   uint16_t length, void *user_data)
 {
+	struct gattc_notify *notify = user_data;
+
+	gattc_send_notification(notify->cli->adapter->devId, notify->cli->conn,
+				notify->id, value_handle, value, length);
+}
+
+uint8_t gattc_subscribe_req(struct cmd_req *req, uint8_t *data,
+			    uint16_t data_len)
+{
+	struct cmd_param_subscribe *param = (void *)data;
 	uint8_t ret = BTLE_ERROR_INTERNAL;
-	struct cmd_adaper *adapter;
+	struct client *cli;
 
-	adapter = cmd_get_adapter_by_id(devId);
-	if (!adapter) {
-		ret = BTLE_ERROR_INVALID_ARG;
-	} else if (!adapter->cli) {
-		ret = BTLE_ERROR_INVALID_STATE;
-	} else {
-		if (data[0] == GATT_NOTIFICATION) {
-			uint16_t chrc_value_handle;
-			uint8_t cccd_id;
-			struct bt_gatt_client *gatt;
-
-			gatt = adapter->cli->gatt;
-			cmd_strtou16(&data[1], &chrc_value_handle);
-
-			cccd_id = bt_gatt_client_register_notify(
-				gatt,
-				chrc_value_handle,
-				gattc_subscribe_complete,
-				on_gattc_notification,
-				adapter, NULL);
-			if (cccd_id) {
-				adapter->cli->cccd_id = cccd_id;
-				ret = BTLE_SUCCESS;
+	cli = gattc_client(req->devId, le16toh(param->conn), STATE_CONNECTED,
+			   &ret);
+	if (cli && param->value == GATT_NOTIFICATION) {
+		uint16_t chrc_value_handle = le16toh(param->handle);
+		struct gattc_notify *notify;
+		unsigned int id;
+
+		notify = calloc(1, sizeof(*notify));
+		if (!notify)
+			return BTLE_ERROR_MEMORY;
+
+		notify->cli = cli;
+		notify->req = req;
+		cmd_req_backend(req);
+
+		id = bt_gatt_client_register_notify(cli->gatt,
+						    chrc_value_handle,
+						    gattc_subscribe_complete,
+						    on_gattc_notification,
+						    notify, gattc_notify_free);
+		if (id) {
+			notify->id = id;
+			if (notify->done) {
+				notify->done = false;
+				gattc_subscribe_complete(notify->status,
+							 notify);
 			}
+			ret = BTLE_SUCCESS;
+		} else {
+			free(notify);
 		}
 	}
 
-	if (ret)
-		cmd_send_status(devId, CMD_GATTC_SUBSCRIBE_REQ, ret);
-
 	return ret;
 }
 
-uint8_t gattc_unsubscribe_req(uint8_t devId, uint8_t *data, uint8_t data_len)
+uint8_t gattc_unsubscribe_req(struct cmd_req *req, uint8_t *data,
+			      uint16_t data_len)
 {
+	struct cmd_param_unsubscribe *param = (void *)data;
 	uint8_t ret = BTLE_ERROR_INTERNAL;
-	struct cmd_adaper *adapter;
-
-	adapter = cmd_get_adapter_by_id(devId);
-	if (!adapter) {
-		ret = BTLE_ERROR_INVALID_ARG;
-	} else if (!adapter->cli) {
-		ret = BTLE_ERROR_INVALID_STATE;
-	} else {
-		uint8_t cccd_id;
-
-		cccd_id = data[0];
+	struct client *cli;
 
-		if (bt_gatt_client_unregister_notify(adapter->cli->gatt,
-						     cccd_id)) {
-			ret = BTLE_SUCCESS;
-		}
+	cli = gattc_client(req->devId, le16toh(param->conn), STATE_CONNECTED,
+			   &ret);
+	if (cli && bt_gatt_client_unregister_notify(cli->gatt,
+						    param->cccd_id)) {
+		ret = BTLE_SUCCESS;
 	}
 
-	cmd_send_status(devId, CMD_GATTC_UNSUBSCRIBE_REQ, ret);
+	if (!ret)
+		cmd_send_status(req, ret);
 
 	return ret;
 }
@@ -218,61 +425,336 @@ static void gattc_read_complete(bool success, uint8_t att_ecode,
 				const uint8_t *value, uint16_t length,
 				void *user_data)
 {
-	struct cmd_adaper *adapter = user_data;
+	struct cmd_req *req = user_data;
 	uint8_t status = (success ? 0 : 1);
 
-	cmd_send_status_msg(adapter->devId, CMD_GATTC_READ_REQ, status,
-			    (void *)value, length);
+	cmd_send_status_msg(req, status, (void *)value, length);
 }
 
-uint8_t gattc_read_req(uint8_t devId, uint8_t *data, uint8_t data_len)
+uint8_t gattc_read_req(struct cmd_req *req, uint8_t *data,
+		       uint16_t data_len)
 {
+	struct cmd_param_read *param = (void *)data;
 	uint8_t ret = BTLE_SUCCESS;
-	struct cmd_adaper *adapter;
+	struct client *cli;
 
-	adapter = cmd_get_adapter_by_id(devId);
-	if (!adapter)
-		ret = BTLE_ERROR_INVALID_ARG;
-	else if (!adapter->cli)
-		ret = BTLE_ERROR_INVALID_STATE;
+	cli = gattc_client(req->devId, le16toh(param->conn), STATE_CONNECTED,
+			   &ret);
 
 	if (!ret) {
-		uint16_t handle;
+		uint16_t handle = le16toh(param->handle);
 
-		cmd_strtou16(&data[0], &handle);
+		cmd_req_backend(req);
 
-		if (!bt_gatt_client_read_value(adapter->cli->gatt, handle,
-					       gattc_read_complete, adapter,
+		if (!bt_gatt_client_read_value(cli->gatt, handle,
+					       gattc_read_complete, req,
 					       NULL)) {
 			ret = BTLE_ERROR_INTERNAL;
 		}
 	}
 
-	if (ret)
-		cmd_send_status(devId, CMD_GATTC_READ_REQ, ret);
-
 	return ret;
 }
 
+/* [type | head | uuid] appended to @dump, uuids 32 bits as 128 bits */
+static void gattc_db_put(struct gattc_db_dump *dump, uint8_t type,
+			 const uint8_t *head, uint16_t head_len,
+			 const bt_uuid_t *uuid)
+{
+	uint16_t len = 1 + head_len;
+	uint8_t *rec = &dump->buf[dump->len];
+	bt_uuid_t u128;
+
+	if (uuid->type != BT_UUID16) {
+		bt_uuid_to_uuid128(uuid, &u128);
+		type |= GATTC_DB_UUID128;
+	}
+
+	if (dump->full || dump->len + len +
+	    (type & GATTC_DB_UUID128 ? 16 : 2) > GATTC_DB_DUMP_MAX) {
+		dump->full = true;
+		return;
+	}
+
+	rec[0] = type;
+	memcpy(&rec[1], head, head_len);
+	if (type & GATTC_DB_UUID128) {
+		memcpy(&rec[len], &u128.value.u128, 16);
+		len += 16;
+	} else {
+		put_le16(uuid->value.u16, &rec[len]);
+		len += 2;
+	}
+
+	dump->len += len;
+}
+
+static void gattc_db_dump_desc(struct gatt_db_attribute *attr,
+			       void *user_data)
+{
+	struct gattc_db_dump *dump = user_data;
+	uint8_t head[2];
+
+	put_le16(gatt_db_attribute_get_handle(attr), head);
+	gattc_db_put(dump, GATTC_DB_DESC, head, sizeof(head),
+		     gatt_db_attribute_get_type(attr));
+}
+
+static void gattc_db_dump_chrc(struct gatt_db_attribute *attr,
+			       void *user_data)
+{
+	struct gattc_db_dump *dump = user_data;
+	uint16_t handle, value_handle, ext_prop;
+	uint8_t head[7];
+	bt_uuid_t uuid;
+
+	if (!gatt_db_attribute_get_char_data(attr, &handle, &value_handle,
+					     &head[4], &ext_prop, &uuid))
+		return;
+
+	put_le16(handle, &head[0]);
+	put_le16(value_handle, &head[2]);
+	put_le16(ext_prop, &head[5]);
+	gattc_db_put(dump, GATTC_DB_CHRC, head, sizeof(head), &uuid);
+
+	gatt_db_service_foreach_desc(attr, gattc_db_dump_desc, dump);
+}
+
+/* whole services only: one not fitting ends the response */
+static void gattc_db_dump_svc(struct gatt_db_attribute *attr,
+			      void *user_data)
+{
+	struct gattc_db_dump *dump = user_data;
+	uint16_t start, end, len = dump->len;
+	bool primary;
+	uint8_t head[4];
+	bt_uuid_t uuid;
+
+	if (dump->full ||
+	    !gatt_db_attribute_get_service_data(attr, &start, &end, &primary,
+						&uuid))
+		return;
+
+	put_le16(start, &head[0]);
+	put_le16(end, &head[2]);
+	gattc_db_put(dump, primary ? GATTC_DB_PRIMARY : GATTC_DB_SECONDARY,
+		     head, sizeof(head), &uuid);
+
+	gatt_db_service_foreach_char(attr, gattc_db_dump_chrc, dump);
+
+	if (dump->full) {
+		dump->len = len;
+		dump->next = start;
+	}
+}
+
+uint8_t gattc_db_dump(struct cmd_req *req, uint8_t *data, uint16_t data_len)
+{
+	struct cmd_param_db_dump *param = (void *)data;
+	struct gattc_db_dump dump = { .len = 2 };
+	uint8_t ret = BTLE_SUCCESS;
+	uint16_t start = le16toh(param->start);
+	struct client *cli;
+
+	cli = gattc_client(req->devId, le16toh(param->conn), STATE_CONNECTED,
+			   &ret);
+	if (!cli)
+		return ret;
+	else if (!start)
+		return BTLE_ERROR_INVALID_ARG;
+	else if (!bt_gatt_client_is_ready(cli->gatt))
+		return BTLE_ERROR_BUSY;
+
+	dump.buf = malloc(GATTC_DB_DUMP_MAX);
+	if (!dump.buf)
+		return BTLE_ERROR_MEMORY;
+
+	gatt_db_foreach_service_in_range(cli->db, NULL, gattc_db_dump_svc,
+					 &dump, start, 0xffff);
+
+	/* a single service bigger than a response */
+	if (dump.next && dump.len == 2) {
+		free(dump.buf);
+		return BTLE_ERROR_MEMORY;
+	}
+
+	put_le16(dump.next, dump.buf);
+	cmd_send_status_msg(req, BTLE_SUCCESS, dump.buf, dump.len);
+	free(dump.buf);
+
+	return BTLE_SUCCESS;
+}
+
+static void gattc_read_multiple_put(void *user_data)
+{
+	struct gattc_read_slot *slot = user_data;
+	struct gattc_read_multiple *rm = slot->rm;
+	uint8_t *buf;
+	uint16_t len = 1;
+	int i;
+
+	if (--rm->refs)
+		return;
+
+	for (i = 0; i < rm->count; i++)
+		len += 5 + rm->slot[i].len;
+
+	buf = malloc(len);
+	if (!buf) {
+		cmd_send_status(rm->req, BTLE_ERROR_MEMORY);
+		free(rm);
+		return;
+	}
+
+	buf[0] = rm->count;
+	for (i = 0, len = 1; i < rm->count; i++) {
+		slot = &rm->slot[i];
+		put_le16(slot->handle, &buf[len]);
+		buf[len + 2] = slot->att_ecode;
+		put_le16(slot->len, &buf[len + 3]);
+		memcpy(&buf[len + 5], slot->value, slot->len);
+		len += 5 + slot->len;
+	}
+
+	cmd_send_status_msg(rm->req, BTLE_SUCCESS, buf, len);
+	free(buf);
+	free(rm);
+}
+
+static void gattc_read_multiple_cb(bool success, uint8_t att_ecode,
+				   const uint8_t *value, uint16_t length,
+				   void *user_data)
+{
+	struct gattc_read_slot *slot = user_data;
+
+	/* link lost: no ATT error to give */
+	if (!success) {
+		slot->att_ecode = att_ecode ? att_ecode : BT_ATT_ERROR_UNLIKELY;
+		return;
+	}
+
+	slot->att_ecode = 0;
+	slot->len = length < sizeof(slot->value) ? length :
+						     sizeof(slot->value);
+	memcpy(slot->value, value, slot->len);
+}
+
+uint8_t gattc_read_multiple(struct cmd_req *req, uint8_t *data,
+			    uint16_t data_len)
+{
+	struct cmd_param_read_multiple *param = (void *)data;
+	uint16_t handles[GATTC_READ_MULTIPLE_MAX];
+	struct gattc_read_multiple *rm;
+	uint8_t ret = BTLE_SUCCESS;
+	struct client *cli;
+	int i;
+
+	cli = gattc_client(req->devId, le16toh(param->conn), STATE_CONNECTED,
+			   &ret);
+	if (!cli)
+		return ret;
+
+	if (!param->count || param->count > GATTC_READ_MULTIPLE_MAX ||
+	    data_len != sizeof(*param) + param->count * 2)
+		return BTLE_ERROR_INVALID_ARG;
+
+	for (i = 0; i < param->count; i++)
+		handles[i] = get_le16(&param->handles[i]);
+
+	switch (param->mode) {
+	case GATTC_READ_SINGLE:
+		break;
+	case GATTC_READ_MULTIPLE:
+		/* the request holds the handles, after its opcode */
+		if (param->count < 2 ||
+		    1 + param->count * 2 > bt_att_get_mtu(cli->att))
+			return BTLE_ERROR_INVALID_ARG;
+		break;
+	default:
+		return BTLE_ERROR_INVALID_ARG;
+	}
+
+	rm = calloc(1, sizeof(*rm) + param->count * sizeof(rm->slot[0]));
+	if (!rm)
+		return BTLE_ERROR_MEMORY;
+
+	rm->req = req;
+	rm->refs = 1;
+	rm->count = param->mode == GATTC_READ_SINGLE ? param->count : 1;
+	for (i = 0; i < rm->count; i++) {
+		rm->slot[i].rm = rm;
+		rm->slot[i].handle = handles[i];
+		rm->slot[i].att_ecode = BT_ATT_ERROR_UNLIKELY;
+	}
+
+	cmd_req_backend(req);
+
+	if (param->mode == GATTC_READ_MULTIPLE) {
+		rm->slot[0].handle = 0;
+		if (bt_gatt_client_read_multiple(cli->gatt, handles,
+						 param->count,
+						 gattc_read_multiple_cb,
+						 &rm->slot[0],
+						 gattc_read_multiple_put))
+			rm->refs++;
+	} else {
+		/* bt_att sends them back to back, without waiting for the
+		 * client between two values */
+		for (i = 0; i < rm->count; i++) {
+			if (bt_gatt_client_read_value(cli->gatt, handles[i],
+						      gattc_read_multiple_cb,
+						      &rm->slot[i],
+						      gattc_read_multiple_put))
+				rm->refs++;
+		}
+	}
+
+	if (rm->refs == 1) {
+		free(rm);
+		return BTLE_ERROR_INTERNAL;
+	}
+
+	gattc_read_multiple_put(&rm->slot[0]);
+
+	return BTLE_SUCCESS;
+}
+
 static void gattc_disconnect_cb(int err, void *user_data)
 {
-	struct cmd_adaper *adapter = user_data;
+	struct client *cli = user_data;
+	const char *reason = strerror(err);
+	struct iovec iov[2];
+	uint16_t conn;
+
+	/* lost while exchanging the MTU */
+	if (cli->st == STATE_CONNECTING) {
+		gattc_connect_complete(cli, BTLE_ERROR_INTERNAL);
+		return;
+	}
 
-	INFO("[%d] Device disconnected: %s\n", adapter->devId, strerror(err));
-	cmd_send_event_msg(adapter->devId, EVENT_DISCONNECTED,
-			   strerror(err), strlen(strerror(err)));
+	INFO("[%d] Device disconnected (conn %d): %s\n", cli->adapter->devId,
+	     cli->conn, reason);
 
-	memset(adapter, 0, sizeof(*adapter));
+	conn = htole16(cli->conn);
+	iov[0].iov_base = &conn;
+	iov[0].iov_len = sizeof(conn);
+	iov[1].iov_base = (void *)reason;
+	iov[1].iov_len = strlen(reason);
+	cmd_send_event_msgv(cli->adapter->devId, EVENT_DISCONNECTED, iov, 2);
+
+	/* pending requests were answered by bt_att before */
+	gattc_client_free(cli);
 }
 
 static void service_added_cb(struct gatt_db_attribute *attr, void *user_data)
 {
-	struct cmd_adaper *adapter = user_data;
+	struct client *cli = user_data;
 	bt_uuid_t uuid;
 
 	return;
 	struct {
 		/* must be naturally packed */
+		uint16_t conn;
 		uint16_t start;
 		uint16_t end;
 		char uuid_str[MAX_LEN_UUID_STR + 1];
@@ -281,8 +763,9 @@ static void service_added_cb(struct gatt_db_attribute *attr, void *user_data)
 	gatt_db_attribute_get_service_uuid(attr, &uuid);
 	bt_uuid_to_string(&uuid, msg.uuid_str, sizeof(msg.uuid_str));
 	gatt_db_attribute_get_service_handles(attr, &msg.start, &msg.end);
+	msg.conn = htole16(cli->conn);
 
-	cmd_send_event_msg(adapter->devId, EVENT_GATTC_DISC_PRIMARY,
+	cmd_send_event_msg(cli->adapter->devId, EVENT_GATTC_DISC_PRIMARY,
 			   &msg, sizeof(msg));
 }
 
@@ -293,49 +776,52 @@ static void service_removed_cb(struct gatt_db_attribute *attr, void *user_data)
 static void att_debug_cb(const char *str, void *user_data)
 {
 	return;
-	struct cmd_adaper *adapter = user_data;
+	struct client *cli = user_data;
 
-	DBG("[%d] att:%s\n", adapter->devId, str);
+	DBG("[%d] att:%s\n", cli->adapter->devId, str);
 }
 
 static void gatt_debug_cb(const char *str, void *user_data)
 {
 	return;
-	struct cmd_adaper *adapter = user_data;
+	struct client *cli = user_data;
 
-	DBG("[%d] gatt:%s\n", adapter->devId, str);
+	DBG("[%d] gatt:%s\n", cli->adapter->devId, str);
 }
 
 static void gattc_disc_desc_complete(struct gatt_db_attribute * attr,
 				     void *user_data)
 {
-	struct cmd_adaper *adapter = user_data;
+	struct client *cli = user_data;
 	const bt_uuid_t *uuid;
 
 	struct {
 		/* must be naturally packed */
+		uint16_t conn;
 		uint16_t handle;
 		uint16_t uuid16;
 		uint8_t uuid_str[MAX_LEN_UUID_STR + 1];
 	} msg;
 
+	msg.conn = htole16(cli->conn);
 	msg.handle = gatt_db_attribute_get_handle(attr);
 	uuid = gatt_db_attribute_get_type(attr);
 	msg.uuid16 = uuid->value.u16;
 	bt_uuid_to_string(uuid, (char *)msg.uuid_str, sizeof(msg.uuid_str));
 
-	cmd_send_event_msg(adapter->devId, EVENT_GATTC_DISC_DESC,
+	cmd_send_event_msg(cli->adapter->devId, EVENT_GATTC_DISC_DESC,
 			   &msg, sizeof(msg));
 }
 
 static void gattc_disc_char_complete(struct gatt_db_attribute * attr,
 				     void *			user_data)
 {
-	struct cmd_adaper *adapter = user_data;
+	struct client *cli = user_data;
 	bt_uuid_t uuid;
 
 	struct {
 		/* must be naturally packed */
+		uint16_t conn;
 		uint16_t handle;
 		uint16_t value_handle;
 		uint16_t ext_prop;
@@ -351,22 +837,24 @@ static void gattc_disc_char_complete(struct gatt_db_attribute * attr,
 	}
 	bt_uuid_to_string((const bt_uuid_t *)&uuid, (char *)msg.uuid_str,
 			  sizeof(msg.uuid_str));
+	msg.conn = htole16(cli->conn);
 
-	cmd_send_event_msg(adapter->devId, EVENT_GATTC_DISC_CHAR,
+	cmd_send_event_msg(cli->adapter->devId, EVENT_GATTC_DISC_CHAR,
 			   &msg, sizeof(msg));
 
-	gatt_db_service_foreach_char(attr, gattc_disc_desc_complete, adapter);
+	gatt_db_service_foreach_char(attr, gattc_disc_desc_complete, cli);
 }
 
 static void gattc_disc_prim_complete(struct gatt_db_attribute * attr,
 				     void *			user_data)
 {
-	struct cmd_adaper *adapter = user_data;
+	struct client *cli = user_data;
 	bool is_primary;
 	bt_uuid_t uuid;
 
 	struct {
 		/* must be naturally packed */
+		uint16_t conn;
 		uint16_t start;
 		uint16_t end;
 		char uuid_str[MAX_LEN_UUID_STR + 1];
@@ -377,226 +865,404 @@ static void gattc_disc_prim_complete(struct gatt_db_attribute * attr,
 		return;
 	}
 	bt_uuid_to_string(&uuid, msg.uuid_str, sizeof(msg.uuid_str));
+	msg.conn = htole16(cli->conn);
 
 	if (is_primary) {
-		cmd_send_event_msg(adapter->devId, EVENT_GATTC_DISC_PRIMARY,
-				   &msg, sizeof(msg));
+		cmd_send_event_msg(cli->adapter->devId,
+				   EVENT_GATTC_DISC_PRIMARY, &msg, sizeof(msg));
 	}
-	/* gatt_db_service_foreach_incl(attr, gattc_disc_inclu_complete, adapter); */
-	gatt_db_service_foreach_char(attr, gattc_disc_char_complete, adapter);
+	/* gatt_db_service_foreach_incl(attr, gattc_disc_inclu_complete, cli); */
+	gatt_db_service_foreach_char(attr, gattc_disc_char_complete, cli);
 }
 
-static void dicovery_done(bool success, uint8_t att_ecode, void *user_data)
+/* Service Changed is only guaranteed to reach bonded clients */
+static bool gattc_bonded(struct client *cli)
 {
-	struct cmd_adaper *adapter = user_data;
+	if (cli->paired)
+		return cli->bond;
 
-	if (!success) {
-		cmd_send_event_msg(adapter->devId, EVENT_GATTC_DISC_PRIMARY,
-				   NULL,
-				   0);
-		return;
-	}
+	return bt_att_get_security(cli->att) >= BT_ATT_SECURITY_MEDIUM;
+}
 
-	gatt_db_foreach_service(adapter->cli->db, NULL,
-				gattc_disc_prim_complete, adapter);
+static void dicovery_done(bool success, uint8_t att_ecode, void *user_data)
+{
+	struct client *cli = user_data;
+	uint16_t conn = htole16(cli->conn);
+
+	if (success) {
+		gatt_db_foreach_service(cli->db, NULL,
+					gattc_disc_prim_complete, cli);
+		gattcache_store(&cli->dst, cli->dst_type,
+				cli->hash_valid ? cli->hash : NULL,
+				gattc_bonded(cli), cli->db);
+	}
 
-	cmd_send_event_msg(adapter->devId, EVENT_GATTC_DISC_PRIMARY, NULL, 0);
+	/* end of discovery: the connection handle alone */
+	cmd_send_event_msg(cli->adapter->devId, EVENT_GATTC_DISC_PRIMARY,
+			   &conn, sizeof(conn));
 }
 
 static void gattc_service_changed_cb(uint16_t start_handle, uint16_t end_handle,
 				     void *user_data)
 {
-	struct cmd_adaper *adapter = user_data;
+	struct client *cli = user_data;
 
 	DBG("\nService Changed handled - start: 0x%04x end: 0x%04x\n",
 	    start_handle, end_handle);
 
-	gatt_db_foreach_service_in_range(adapter->cli->db, NULL,
-					 gattc_disc_prim_complete, adapter,
+	gatt_db_foreach_service_in_range(cli->db, NULL,
+					 gattc_disc_prim_complete, cli,
 					 start_handle, end_handle);
+
+	/* the hash read at connection no longer describes the database */
+	cli->hash_valid = false;
+	gattcache_store(&cli->dst, cli->dst_type, NULL, gattc_bonded(cli),
+			cli->db);
 }
 
-static struct client *client_create(struct cmd_adaper *adapter, int fd,
-				    uint16_t mtu)
+/*
+ * Setting up the ATT transport of @cli once its bearer is connected;
+ * the bearer is left open on failure, closed with the transport otherwise
+ */
+static bool client_att_attach(struct client *cli)
 {
-	struct client *cli;
-
-	cli = new0(struct client, 1);
-	if (!cli) {
-		ERR("Failed to allocate memory for client\n");
-		return NULL;
-	}
-
-	cli->att = bt_att_new(fd, false);
+	cli->att = bt_att_new(cli->fd, false);
 	if (!cli->att) {
 		ERR("Failed to initialze ATT transport layer\n");
-		bt_att_unref(cli->att);
-		free(cli);
-		return NULL;
+		return false;
 	}
 
-	if (!bt_att_set_close_on_unref(cli->att, true)) {
+	if (!bt_att_register_disconnect(cli->att, gattc_disconnect_cb,
+					cli, NULL) ||
+	    !bt_att_set_close_on_unref(cli->att, true)) {
 		ERR("Failed to set up ATT transport layer\n");
 		bt_att_unref(cli->att);
-		free(cli);
-		return NULL;
+		cli->att = NULL;
+		return false;
 	}
 
-	if (!bt_att_register_disconnect(cli->att, gattc_disconnect_cb,
-					adapter, NULL)) {
-		ERR("Failed to set ATT disconnect handler\n");
-		bt_att_unref(cli->att);
-		free(cli);
-		return NULL;
-	}
+	bt_att_set_debug(cli->att, att_debug_cb, cli, NULL);
 
-	cli->fd = fd;
+	return true;
+}
+
+/* GATT client of @cli, on top of its ATT transport */
+static bool client_gatt_attach(struct client *cli)
+{
 	cli->db = gatt_db_new();
 	if (!cli->db) {
 		ERR("Failed to create GATT database\n");
-		bt_att_unref(cli->att);
-		free(cli);
-		return NULL;
+		return false;
 	}
 
-	cli->gatt = bt_gatt_client_new(cli->db, cli->att, mtu);
+	/* characteristics and descriptors of cached services are not
+	 * discovered again */
+	if (gattcache_load(&cli->dst, cli->dst_type,
+			   cli->hash_valid ? cli->hash : NULL,
+			   gattc_bonded(cli), cli->db))
+		INFO("[%d] connection %d: cached database loaded\n",
+		     cli->adapter->devId, cli->conn);
+
+	/* the MTU is already exchanged, cf gattc_connect_cb */
+	cli->gatt = bt_gatt_client_new(cli->db, cli->att, ATT_DEFAULT_LE_MTU);
 	if (!cli->gatt) {
 		ERR("Failed to create GATT client\n");
 		gatt_db_unref(cli->db);
-		bt_att_unref(cli->att);
-		free(cli);
-		return NULL;
+		return false;
 	}
 
-	adapter->cli = cli;
-
 	gatt_db_register(cli->db, service_added_cb, service_removed_cb,
-			 adapter, NULL);
+			 cli, NULL);
 
-	bt_att_set_debug(cli->att, att_debug_cb, adapter, NULL);
-	bt_gatt_client_set_debug(cli->gatt, gatt_debug_cb, adapter, NULL);
+	bt_gatt_client_set_debug(cli->gatt, gatt_debug_cb, cli, NULL);
 
-	bt_gatt_client_ready_register(cli->gatt, dicovery_done, adapter, NULL);
+	bt_gatt_client_ready_register(cli->gatt, dicovery_done, cli, NULL);
 	bt_gatt_client_set_service_changed(cli->gatt, gattc_service_changed_cb,
-					   adapter, NULL);
+					   cli, NULL);
 
 	/* bt_gatt_client already holds a reference */
 	gatt_db_unref(cli->db);
 
-	return cli;
+	return true;
+}
+
+/*
+ * Ending a pending connection: the GATT client is set up on success,
+ * the bearer closed and the handle released otherwise.
+ * EVENT_GATTC_CONNECT_COMPLETE reports it.
+ */
+static void gattc_connect_complete(struct client *cli, uint8_t status)
+{
+	struct cmd_adaper *adapter = cli->adapter;
+	struct gattc_connect_complete ev;
+
+	/* watched for EPOLLOUT until the ATT transport takes the bearer */
+	if (!cli->att)
+		mainloop_remove_fd(cli->fd);
+	if (cli->timer)
+		mainloop_remove_timeout(cli->timer);
+	cli->timer = 0;
+
+	if (!status && !client_gatt_attach(cli))
+		status = BTLE_ERROR_INTERNAL;
+
+	ev.status = status;
+	ev.conn = htole16(cli->conn);
+	memcpy(ev.addr, cli->dst.b, sizeof(ev.addr));
+	ev.addr_type = cli->dst_type;
+	ev.mtu = htole16(status ? 0 : bt_att_get_mtu(cli->att));
+
+	INFO("[%d] connection %d complete (%d), mtu %d\n", adapter->devId,
+	     cli->conn, status, le16toh(ev.mtu));
+
+	cmd_send_event_msg(adapter->devId, EVENT_GATTC_CONNECT_COMPLETE,
+			   &ev, sizeof(ev));
+
+	if (status)
+		gattc_client_free(cli);
+	else
+		cli->st = STATE_CONNECTED;
 }
 
-static int l2cap_le_att_connect(bdaddr_t *src, bdaddr_t *dst,
-				uint8_t dst_type, int sec)
+static void gattc_hash_read(bool success, uint8_t att_ecode,
+			    struct bt_gatt_result *result, void *user_data)
 {
-	int sock;
-	struct sockaddr_l2 srcaddr, dstaddr;
-	struct bt_security btsec;
+	struct client *cli = user_data;
+	struct bt_gatt_iter iter;
+	const uint8_t *value;
+	uint16_t handle, length;
 
-	sock = socket(PF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
-	if (sock < 0) {
-		ERR("Failed to create L2CAP socket");
-		return -1;
+	/* link lost, reported by gattc_disconnect_cb */
+	if (!success && !att_ecode)
+		return;
+
+	if (success && bt_gatt_iter_init(&iter, result) &&
+	    bt_gatt_iter_next_read_by_type(&iter, &handle, &length, &value) &&
+	    length == GATTCACHE_HASH_LEN) {
+		memcpy(cli->hash, value, GATTCACHE_HASH_LEN);
+		cli->hash_valid = true;
 	}
 
-	/* Set up source address */
-	memset(&srcaddr, 0, sizeof(srcaddr));
-	srcaddr.l2_family = AF_BLUETOOTH;
-	srcaddr.l2_cid = htobs(ATT_CID);
-	srcaddr.l2_bdaddr_type = 0;
-	bacpy(&srcaddr.l2_bdaddr, src);
+	gattc_connect_complete(cli, BTLE_SUCCESS);
+}
 
-	if (bind(sock, (struct sockaddr *)&srcaddr, sizeof(srcaddr)) < 0) {
-		ERR("Failed to bind L2CAP socket");
-		close(sock);
-		return -1;
+/*
+ * ATT transport of @cli ready, MTU exchanged: the Database Hash the
+ * cache is validated with is read before the GATT client is set up
+ */
+static void gattc_att_ready(struct client *cli)
+{
+	struct bt_gatt_request *req;
+	bt_uuid_t uuid;
+
+	if (!gattcache_enabled()) {
+		gattc_connect_complete(cli, BTLE_SUCCESS);
+		return;
 	}
 
-	/* Set the security level */
-	memset(&btsec, 0, sizeof(btsec));
-	btsec.level = sec;
-	if (setsockopt(sock, SOL_BLUETOOTH, BT_SECURITY, &btsec,
-		       sizeof(btsec)) != 0) {
-		ERR("Failed to set L2CAP security level\n");
-		close(sock);
-		return -1;
+	bt_uuid16_create(&uuid, GATTCACHE_HASH_UUID);
+	req = bt_gatt_read_by_type(cli->att, 0x0001, 0xffff, &uuid,
+				   gattc_hash_read, cli, NULL);
+	if (!req) {
+		gattc_connect_complete(cli, BTLE_SUCCESS);
+		return;
 	}
 
-	/* Set up destination address */
-	memset(&dstaddr, 0, sizeof(dstaddr));
-	dstaddr.l2_family = AF_BLUETOOTH;
-	dstaddr.l2_cid = htobs(ATT_CID);
-	dstaddr.l2_bdaddr_type = dst_type;
-	bacpy(&dstaddr.l2_bdaddr, dst);
+	/* the ATT transport holds its own reference until answered */
+	bt_gatt_request_unref(req);
+}
+
+static void gattc_mtu_exchanged(bool success, uint8_t att_ecode,
+				void *user_data)
+{
+	struct client *cli = user_data;
+
+	/* link lost, reported by gattc_disconnect_cb */
+	if (!success && !att_ecode)
+		return;
+
+	/* a peer refusing the exchange keeps the default MTU */
+	if (!success)
+		INFO("[%d] connection %d: mtu exchange failed (0x%02x)\n",
+		     cli->adapter->devId, cli->conn, att_ecode);
 
-	INFO("Connecting to device...type(%d)\n", dst_type);
+	gattc_att_ready(cli);
+}
 
-	if (connect(sock, (struct sockaddr *)&dstaddr, sizeof(dstaddr)) < 0) {
-		ERR("Failed to connect %s\n", strerror(errno));
-		close(sock);
-		return -1;
+static void gattc_connect_cb(int fd, uint32_t events, void *user_data)
+{
+	struct client *cli = user_data;
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+	else if (!err && (events & (EPOLLERR | EPOLLHUP)))
+		err = ECONNREFUSED;
+
+	if (err) {
+		ERR("[%d] connection %d failed: %s\n", cli->adapter->devId,
+		    cli->conn, strerror(err));
+		gattc_connect_complete(cli, BTLE_ERROR_INTERNAL);
+		return;
 	}
 
-	INFO(" Done\n");
+	/* the bearer belongs to the ATT transport from now on */
+	mainloop_remove_fd(fd);
+	if (!client_att_attach(cli)) {
+		gattc_connect_complete(cli, BTLE_ERROR_INTERNAL);
+		return;
+	}
 
-	return sock;
+	/* exchanged before the GATT client starts its discovery, so that
+	 * EVENT_GATTC_CONNECT_COMPLETE gives the MTU in use */
+	if (cli->mtu <= ATT_DEFAULT_LE_MTU)
+		gattc_att_ready(cli);
+	else if (!bt_gatt_exchange_mtu(cli->att, cli->mtu, gattc_mtu_exchanged,
+				       cli, NULL))
+		gattc_connect_complete(cli, BTLE_ERROR_INTERNAL);
 }
 
-uint8_t gattc_connect(uint8_t devId, uint8_t *data, uint8_t data_len)
+static void gattc_connect_timeout(int id, void *user_data)
 {
-	uint8_t ret = BTLE_SUCCESS;
+	struct client *cli = user_data;
+
+	ERR("[%d] connection %d timed out\n", cli->adapter->devId, cli->conn);
+
+	mainloop_remove_timeout(id);
+	cli->timer = 0;
+	gattc_connect_complete(cli, BTLE_ERROR_TIMEOUT);
+}
+
+uint8_t gattc_connect(struct cmd_req *req, uint8_t *data,
+		      uint16_t data_len)
+{
+	struct cmd_param_connect *param = (void *)data;
+	uint8_t devId = req->devId;
 	struct cmd_adaper *adapter;
+	struct client *cli;
+	uint16_t conn;
+	char str[20];
+	int idx, slot = -1;
 
 	adapter = cmd_get_adapter_by_id(devId);
-	if (!adapter) {
-		ret = BTLE_ERROR_INVALID_ARG;
-	} else if (adapter->cli) {
-		ret = BTLE_ERROR_ALREADY;
+	if (!adapter)
+		return BTLE_ERROR_INVALID_ARG;
+	else if (param->mtu && (le16toh(param->mtu) < ATT_DEFAULT_LE_MTU ||
+				le16toh(param->mtu) > BT_ATT_MAX_LE_MTU))
+		return BTLE_ERROR_INVALID_ARG;
+
+	for (idx = CMD_CONN_MAX - 1; idx >= 0; idx--) {
+		cli = adapter->cli[idx];
+		if (!cli)
+			slot = idx;
+		else if (!memcmp(cli->dst.b, param->addr, sizeof(cli->dst.b)) &&
+			 cli->dst_type == param->addr_type)
+			return BTLE_ERROR_ALREADY;
 	}
+	if (slot < 0)
+		return BTLE_ERROR_BUSY;
 
-	if (ret) {
-		cmd_send_status(devId, CMD_MGMT_CONNECT, ret);
-		return ret;
+	cli = new0(struct client, 1);
+	if (!cli)
+		return BTLE_ERROR_MEMORY;
+
+	cli->adapter = adapter;
+	cli->st = STATE_CONNECTING;
+	memcpy(cli->dst.b, param->addr, sizeof(cli->dst.b));
+	cli->dst_type = param->addr_type;
+	cli->mtu = le16toh(param->mtu);
+	ba2str(&cli->dst, str);
+	DBG("dest addr %s\n", str);
+
+	cli->fd = backend_att_connect(devId, &cli->dst, cli->dst_type,
+				      param->sec_level);
+	if (cli->fd < 0) {
+		free(cli);
+		return BTLE_ERROR_INTERNAL;
 	}
 
-	if (data_len < 18) {
-		ret = BTLE_ERROR_INVALID_ARG;
-		cmd_send_status(devId, CMD_MGMT_CONNECT, ret);
-	} else {
-		bdaddr_t src_addr, dst_addr;
-		uint8_t *dst_addr_type;
-		uint8_t mtu = ATT_DEFAULT_LE_MTU;
-		uint8_t sec_level = 0;
-		int fd;
-		uint8_t idx;
-		uint8_t *p_data = &data[0];
-		char str[20];
-		for (idx = 0; idx < 6; idx++, p_data += 3) {
-			dst_addr.b[idx] = strtol((char *)p_data, NULL, 16);
-		}
-		ba2str((const bdaddr_t *)&dst_addr, str);
-		DBG("dest addr %s\n", str);
+	/* writable once connected, or failed */
+	if (mainloop_add_fd(cli->fd, EPOLLOUT, gattc_connect_cb, cli,
+			    NULL) < 0) {
+		close(cli->fd);
+		free(cli);
+		return BTLE_ERROR_INTERNAL;
+	}
 
-		dst_addr_type = (void *)&data[17];
+	cli->timer = mainloop_add_timeout(gattc_connect_timeout_ms,
+					  gattc_connect_timeout, cli, NULL);
+	if (cli->timer <= 0) {
+		mainloop_remove_fd(cli->fd);
+		close(cli->fd);
+		free(cli);
+		return BTLE_ERROR_INTERNAL;
+	}
 
-		if (data_len == 19)
-			sec_level = data[18];
+	adapter->devId = devId;
+	cli->conn = gattc_conn_alloc(adapter);
+	adapter->cli[slot] = cli;
 
-		if (hci_devba(devId, &src_addr) >= 0) {
-			fd = l2cap_le_att_connect(&src_addr, &dst_addr,
-						  *dst_addr_type, sec_level);
-			if (fd > 0) {
-				adapter->devId = devId;
-				adapter->cli = client_create(adapter, fd, mtu);
-			}
+	conn = htole16(cli->conn);
+	cmd_send_status_msg(req, BTLE_SUCCESS, &conn, sizeof(conn));
+	return BTLE_SUCCESS;
+}
 
-			if (!adapter->cli) {
-				cmd_send_status(devId, CMD_MGMT_CONNECT,
-						BTLE_ERROR_INTERNAL);
-				memset(adapter, 0, sizeof(*adapter));
-			}
-		}
-		cmd_send_status(devId, CMD_MGMT_CONNECT, BTLE_SUCCESS);
+uint8_t gattc_connect_cancel(struct cmd_req *req, uint8_t *data,
+			     uint16_t data_len)
+{
+	struct cmd_param_conn *param = (void *)data;
+	uint8_t ret = BTLE_SUCCESS;
+	struct client *cli;
+
+	cli = gattc_client(req->devId, le16toh(param->conn), STATE_CONNECTING,
+			   &ret);
+	if (!cli)
+		return ret;
+
+	/* closing the socket aborts the kernel connection attempt */
+	gattc_connect_complete(cli, BTLE_ERROR_CANCELED);
+
+	cmd_send_status(req, BTLE_SUCCESS);
+	return BTLE_SUCCESS;
+}
+uint8_t gattc_set_connect_timeout(struct cmd_req *req, uint8_t *data,
+				  uint16_t data_len)
+{
+	uint32_t timeout_ms;
+
+	if (data_len < 4)
+		return BTLE_ERROR_INVALID_ARG;
+
+	timeout_ms = get_le32(data);
+	gattc_connect_timeout_ms = timeout_ms ? timeout_ms :
+				   GATTC_CONNECT_TIMEOUT_MS;
+
+	INFO("connection timeout %u ms\n", gattc_connect_timeout_ms);
+
+	cmd_send_status(req, BTLE_SUCCESS);
+	return BTLE_SUCCESS;
+}
+
+void gattc_new_key(uint8_t devId, const uint8_t *addr, uint8_t addr_type,
+		   bool bond)
+{
+	struct cmd_adaper *adapter = cmd_get_adapter_by_id(devId);
+	struct client *cli;
+	int idx;
+
+	if (!adapter)
+		return;
+
+	for (idx = 0; idx < CMD_CONN_MAX; idx++) {
+		cli = adapter->cli[idx];
+		if (!cli || cli->dst_type != addr_type ||
+		    memcmp(cli->dst.b, addr, sizeof(cli->dst.b)))
+			continue;
+
+		INFO("[%d] connection %d: %s\n", devId, cli->conn,
+		     bond ? "bonded" : "paired, not bonded");
+		cli->paired = true;
+		cli->bond = bond;
 	}
-	return ret;
 }
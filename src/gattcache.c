@@ -0,0 +1,394 @@
+/*
+ *  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "lib/bluetooth.h"
+#include "lib/uuid.h"
+
+#include "src/shared/util.h"
+#include "src/shared/att.h"
+#include "src/shared/gatt-db.h"
+
+#define MODULE "gattcache"
+#include "btprint.h"
+
+#include "btle_error.h"
+#include "gattcache.h"
+
+/*
+ * Cache file "<dir>/<addr>-<addr_type>", integers little endian, uuids
+ * as 128 bits bt_uuid_t values:
+ *
+ * [magic "BTGC" | GATTCACHE_VERSION | hash_len(u8) | hash]
+ * followed by records, characteristics and descriptors belonging to the
+ * service before them:
+ * [GATTCACHE_SVC | start | end | primary(u8) | uuid]
+ * [GATTCACHE_CHRC | value_handle | properties(u8) | uuid]
+ * [GATTCACHE_DESC | handle | uuid | len(u8) | value]
+ *
+ * Only the Characteristic Extended Properties descriptor value is kept.
+ */
+#define GATTCACHE_MAGIC		"BTGC"
+#define GATTCACHE_VERSION	1
+
+#define GATTCACHE_SVC		1
+#define GATTCACHE_CHRC		2
+#define GATTCACHE_DESC		3
+
+#define GATTCACHE_CEP_UUID	0x2900
+#define GATTCACHE_VALUE_MAX	2
+
+static struct {
+	char dir[PATH_MAX - 32];
+	bool enabled;
+} gattcache;
+
+/*
+ * Walking a database being stored
+ *
+ * @fp: cache file
+ * @ok: no write error so far
+ */
+struct gattcache_ctx {
+	FILE *fp;
+	bool ok;
+	uint8_t value[GATTCACHE_VALUE_MAX];
+	uint8_t value_len;
+};
+
+uint8_t gattcache_init(const char *dir)
+{
+	if (strlen(dir) >= sizeof(gattcache.dir))
+		return BTLE_ERROR_INVALID_ARG;
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		ERR("unable to create %s: %s\n", dir, strerror(errno));
+		return BTLE_ERROR_INVALID_ARG;
+	}
+
+	strcpy(gattcache.dir, dir);
+	gattcache.enabled = true;
+
+	INFO("caching GATT databases in %s\n", dir);
+
+	return BTLE_SUCCESS;
+}
+
+bool gattcache_enabled(void)
+{
+	return gattcache.enabled;
+}
+
+/* resolvable and non resolvable private addresses change over time */
+static bool gattcache_path(const bdaddr_t *dst, uint8_t dst_type,
+			   char *path, size_t len)
+{
+	char str[18];
+
+	if (!gattcache.enabled ||
+	    (dst_type == BDADDR_LE_RANDOM && (dst->b[5] & 0xc0) != 0xc0))
+		return false;
+
+	ba2str(dst, str);
+	snprintf(path, len, "%s/%s-%u", gattcache.dir, str, dst_type);
+
+	return true;
+}
+
+static bool gattcache_read(FILE *fp, void *data, size_t len)
+{
+	return fread(data, len, 1, fp) == 1;
+}
+
+static bool gattcache_read_uuid(FILE *fp, bt_uuid_t *uuid)
+{
+	uint128_t u128;
+
+	if (!gattcache_read(fp, &u128, sizeof(u128)))
+		return false;
+
+	bt_uuid128_create(uuid, u128);
+
+	return true;
+}
+
+static void gattcache_write(struct gattcache_ctx *ctx, const void *data,
+			    size_t len)
+{
+	if (ctx->ok && len && fwrite(data, len, 1, ctx->fp) != 1)
+		ctx->ok = false;
+}
+
+static void gattcache_write_uuid(struct gattcache_ctx *ctx,
+				 const bt_uuid_t *uuid)
+{
+	bt_uuid_t u128;
+
+	bt_uuid_to_uuid128(uuid, &u128);
+	gattcache_write(ctx, &u128.value.u128, sizeof(u128.value.u128));
+}
+
+static void gattcache_write_le16(struct gattcache_ctx *ctx, uint16_t val)
+{
+	uint8_t buf[2];
+
+	put_le16(val, buf);
+	gattcache_write(ctx, buf, sizeof(buf));
+}
+
+static void gattcache_value_written(struct gatt_db_attribute *attrib,
+				    int err, void *user_data)
+{
+}
+
+/* records of the service cached, up to the end of file */
+static bool gattcache_load_records(FILE *fp, struct gatt_db *db)
+{
+	struct gatt_db_attribute *svc = NULL, *attr;
+	uint8_t type, buf[5], value[GATTCACHE_VALUE_MAX];
+	bt_uuid_t uuid;
+
+	while (gattcache_read(fp, &type, 1)) {
+		switch (type) {
+		case GATTCACHE_SVC:
+			if (svc)
+				gatt_db_service_set_active(svc, true);
+			if (!gattcache_read(fp, buf, 5) ||
+			    !gattcache_read_uuid(fp, &uuid) ||
+			    get_le16(&buf[2]) < get_le16(&buf[0]))
+				return false;
+			svc = gatt_db_insert_service(db, get_le16(&buf[0]),
+						     &uuid, buf[4],
+						     get_le16(&buf[2]) -
+						     get_le16(&buf[0]) + 1);
+			if (!svc)
+				return false;
+			break;
+		case GATTCACHE_CHRC:
+			if (!svc || !gattcache_read(fp, buf, 3) ||
+			    !gattcache_read_uuid(fp, &uuid))
+				return false;
+			if (!gatt_db_service_insert_characteristic(svc,
+							get_le16(&buf[0]),
+							&uuid, 0, buf[2],
+							NULL, NULL, NULL))
+				return false;
+			break;
+		case GATTCACHE_DESC:
+			if (!svc || !gattcache_read(fp, buf, 2) ||
+			    !gattcache_read_uuid(fp, &uuid) ||
+			    !gattcache_read(fp, &buf[2], 1) ||
+			    buf[2] > sizeof(value) ||
+			    (buf[2] && !gattcache_read(fp, value, buf[2])))
+				return false;
+			attr = gatt_db_service_insert_descriptor(svc,
+							get_le16(&buf[0]),
+							&uuid, 0, NULL, NULL,
+							NULL);
+			if (!attr)
+				return false;
+			if (buf[2])
+				gatt_db_attribute_write(attr, 0, value, buf[2],
+							0, NULL,
+							gattcache_value_written,
+							NULL);
+			break;
+		default:
+			return false;
+		}
+	}
+
+	if (svc)
+		gatt_db_service_set_active(svc, true);
+
+	return feof(fp) && svc;
+}
+
+bool gattcache_load(const bdaddr_t *dst, uint8_t dst_type,
+		    const uint8_t *hash, bool bonded, struct gatt_db *db)
+{
+	uint8_t hdr[6], cached[GATTCACHE_HASH_LEN];
+	char path[PATH_MAX];
+	bool loaded = false;
+	FILE *fp;
+
+	if (!gattcache_path(dst, dst_type, path, sizeof(path)))
+		return false;
+
+	fp = fopen(path, "rb");
+	if (!fp)
+		return false;
+
+	if (!gattcache_read(fp, hdr, sizeof(hdr)) ||
+	    memcmp(hdr, GATTCACHE_MAGIC, 4) || hdr[4] != GATTCACHE_VERSION) {
+		ERR("%s: not a cache file\n", path);
+	} else if (hdr[5] != (hash ? GATTCACHE_HASH_LEN : 0) ||
+		   (hash && (!gattcache_read(fp, cached, sizeof(cached)) ||
+			     memcmp(cached, hash, sizeof(cached))))) {
+		INFO("%s: database hash changed\n", path);
+	} else if (!hash && !bonded) {
+		INFO("%s: no database hash, peer not bonded\n", path);
+	} else if (!gattcache_load_records(fp, db)) {
+		ERR("%s: corrupted\n", path);
+		gatt_db_clear(db);
+	} else {
+		loaded = true;
+	}
+
+	fclose(fp);
+
+	if (!loaded)
+		unlink(path);
+	else
+		DBG("%s loaded\n", path);
+
+	return loaded;
+}
+
+static void gattcache_value_read(struct gatt_db_attribute *attrib, int err,
+				 const uint8_t *value, size_t length,
+				 void *user_data)
+{
+	struct gattcache_ctx *ctx = user_data;
+
+	if (!err && length <= sizeof(ctx->value)) {
+		memcpy(ctx->value, value, length);
+		ctx->value_len = length;
+	}
+}
+
+static void gattcache_store_desc(struct gatt_db_attribute *attr,
+				 void *user_data)
+{
+	struct gattcache_ctx *ctx = user_data;
+	const bt_uuid_t *uuid = gatt_db_attribute_get_type(attr);
+	uint8_t type = GATTCACHE_DESC;
+	bt_uuid_t cep;
+
+	/* values stored in the database are read synchronously */
+	ctx->value_len = 0;
+	bt_uuid16_create(&cep, GATTCACHE_CEP_UUID);
+	if (!bt_uuid_cmp(uuid, &cep))
+		gatt_db_attribute_read(attr, 0, 0, NULL, gattcache_value_read,
+				       ctx);
+
+	gattcache_write(ctx, &type, 1);
+	gattcache_write_le16(ctx, gatt_db_attribute_get_handle(attr));
+	gattcache_write_uuid(ctx, uuid);
+	gattcache_write(ctx, &ctx->value_len, 1);
+	gattcache_write(ctx, ctx->value, ctx->value_len);
+}
+
+static void gattcache_store_chrc(struct gatt_db_attribute *attr,
+				 void *user_data)
+{
+	struct gattcache_ctx *ctx = user_data;
+	uint16_t handle, value_handle, ext_prop;
+	uint8_t type = GATTCACHE_CHRC;
+	uint8_t properties;
+	bt_uuid_t uuid;
+
+	if (!gatt_db_attribute_get_char_data(attr, &handle, &value_handle,
+					     &properties, &ext_prop, &uuid))
+		return;
+
+	gattcache_write(ctx, &type, 1);
+	gattcache_write_le16(ctx, value_handle);
+	gattcache_write(ctx, &properties, 1);
+	gattcache_write_uuid(ctx, &uuid);
+
+	gatt_db_service_foreach_desc(attr, gattcache_store_desc, ctx);
+}
+
+static void gattcache_store_svc(struct gatt_db_attribute *attr,
+				void *user_data)
+{
+	struct gattcache_ctx *ctx = user_data;
+	uint8_t type = GATTCACHE_SVC;
+	uint16_t start, end;
+	uint8_t primary;
+	bool is_primary;
+	bt_uuid_t uuid;
+
+	if (!gatt_db_attribute_get_service_data(attr, &start, &end,
+						&is_primary, &uuid))
+		return;
+
+	primary = is_primary;
+	gattcache_write(ctx, &type, 1);
+	gattcache_write_le16(ctx, start);
+	gattcache_write_le16(ctx, end);
+	gattcache_write(ctx, &primary, 1);
+	gattcache_write_uuid(ctx, &uuid);
+
+	gatt_db_service_foreach_char(attr, gattcache_store_chrc, ctx);
+}
+
+void gattcache_store(const bdaddr_t *dst, uint8_t dst_type,
+		     const uint8_t *hash, bool bonded, struct gatt_db *db)
+{
+	struct gattcache_ctx ctx = { .ok = true };
+	char path[PATH_MAX], tmp[PATH_MAX + 4];
+	uint8_t hdr[6] = GATTCACHE_MAGIC;
+
+	if (!gattcache_path(dst, dst_type, path, sizeof(path)))
+		return;
+
+	/* nothing would tell the entry is stale */
+	if (!hash && !bonded) {
+		unlink(path);
+		return;
+	}
+
+	/* written aside then renamed, a reader never sees half a file */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	ctx.fp = fopen(tmp, "wb");
+	if (!ctx.fp) {
+		ERR("unable to create %s: %s\n", tmp, strerror(errno));
+		return;
+	}
+
+	hdr[4] = GATTCACHE_VERSION;
+	hdr[5] = hash ? GATTCACHE_HASH_LEN : 0;
+	gattcache_write(&ctx, hdr, sizeof(hdr));
+	if (hash)
+		gattcache_write(&ctx, hash, GATTCACHE_HASH_LEN);
+
+	gatt_db_foreach_service(db, NULL, gattcache_store_svc, &ctx);
+
+	if (fclose(ctx.fp) || !ctx.ok || rename(tmp, path) < 0) {
+		ERR("unable to write %s\n", path);
+		unlink(tmp);
+		return;
+	}
+
+	DBG("%s stored\n", path);
+}
@@ -111,8 +111,10 @@ static struct gatts_service *gatts_get_last(struct gatts_service *head)
 	return rover;
 }
 
-uint8_t gatts_addService(uint8_t devId, uint8_t *data, uint8_t data_len)
+uint8_t gatts_addService(struct cmd_req *req, uint8_t *data,
+			 uint16_t data_len)
 {
+	uint8_t devId = req->devId;
 	struct gatts_service *svc;
 	uint8_t ret = BTLE_ERROR_MEMORY;
 
@@ -139,12 +141,15 @@ uint8_t gatts_addService(uint8_t devId, uint8_t *data, uint8_t data_len)
 		ret = BTLE_SUCCESS;
 	}
 
-	cmd_send_status(devId, CMD_GATTS_ADD_SVC, ret);
+	if (!ret)
+		cmd_send_status(req, ret);
 	return ret;
 }
 
-uint8_t gatts_addCharacteristic(uint8_t devId, uint8_t *data, uint8_t data_len)
+uint8_t gatts_addCharacteristic(struct cmd_req *req, uint8_t *data,
+				uint16_t data_len)
 {
+	uint8_t devId = req->devId;
 	struct gatts_service *svc;
 	uint8_t ret = BTLE_ERROR_INVALID_STATE;
 
@@ -174,14 +179,14 @@ uint8_t gatts_addCharacteristic(uint8_t devId, uint8_t *data, uint8_t data_len)
 		ret = BTLE_SUCCESS;
 	}
 
-	cmd_send_status(devId, CMD_GATTS_ADD_CHARACTERISTIC, ret);
+	if (!ret)
+		cmd_send_status(req, ret);
 	return ret;
 }
 
-uint8_t gatts_adddescriptor(uint8_t devId, uint8_t *data, uint8_t data_len)
+uint8_t gatts_adddescriptor(struct cmd_req *req, uint8_t *data,
+			    uint16_t data_len)
 {
-	cmd_send_status(devId, CMD_GATTS_ADD_DESCRIPTOR,
-			BTLE_ERROR_NOT_IMPLEMENTED);
 	return BTLE_ERROR_NOT_IMPLEMENTED;
 }
 
@@ -16,6 +16,8 @@
  */
 #include <stdint.h>
 #include <string.h>
+#include <endian.h>
+#include <sys/uio.h>
 
 #include "btle_error.h"
 #include "btsocket.h"
@@ -24,88 +26,226 @@
 #define MODULE "ipc"
 #include "btprint.h"
 
-#define IPC_MTU         (2 + IPC_DATA_LEN_MAX)
+#define IPC_HDR_LEN     (sizeof(struct ipc_pkt))
+#define IPC_MTU         (IPC_HDR_LEN + IPC_DATA_LEN_MAX)
 
-/* has to be naturally packed */
+/* per client transmit ring; half of it is kept for command responses */
+#define IPC_TX_RING_SIZE        (64 * 1024)
+#define IPC_TX_HIGH_WM          (IPC_TX_RING_SIZE / 2)
+#define IPC_TX_LOW_WM           (IPC_TX_RING_SIZE / 8)
+
+/* events stop once past the high watermark, by one frame at most */
+#if IPC_TX_HIGH_WM + 2 * IPC_DATA_LEN_MAX + IPC_RSP_PAGE_MAX > IPC_TX_RING_SIZE
+#error "IPC_RSP_PAGE_MAX does not fit the transmit ring"
+#endif
+
+/*
+ * +------+------------------+--------------+
+ * |   0  |       1:2        | 3:data_len+3 |
+ * +------+------------------+--------------+
+ * | type | data_len (le16)  | data         |
+ * +------+------------------+--------------+
+ */
 struct ipc_pkt {
 	uint8_t type;
-	uint8_t data_len;
+	uint16_t data_len;
 	uint8_t data[0];
-};
+} __attribute__((packed));
+
+/*
+ * msg_shm request / response payloads
+ */
+struct ipc_shm_req {
+	uint32_t size;		/* le32, ring size (power of 2) */
+} __attribute__((packed));
+
+struct ipc_shm_rsp {
+	uint8_t status;
+	uint32_t size;		/* le32 */
+} __attribute__((packed));
 
 static msg_cmd_cb func;
+static msg_cmd_cb info_func;
 
-uint8_t ipc_send(enum ipc_msg type, void *data, uint8_t data_len)
+static uint8_t ipc_pkt_hdr(struct ipc_pkt *pkt, enum ipc_msg type,
+			   const struct iovec *iov, int iovcnt)
 {
-	if (!data) {
+	size_t data_len = 0;
+	int i;
+
+	if (!iov) {
 		return BTLE_ERROR_NULL_ARG;
 	}
-	if (!data_len || data_len > IPC_DATA_LEN_MAX || type >= msg_unknown) {
+	for (i = 0; i < iovcnt; i++)
+		data_len += iov[i].iov_len;
+
+	if (!data_len || type >= msg_unknown ||
+	    data_len > ((type == msg_command_resp) ?
+			IPC_RSP_DATA_LEN_MAX : IPC_DATA_LEN_MAX)) {
 		return BTLE_ERROR_INVALID_ARG;
-	} else {
-		uint8_t ret;
-		uint8_t buf[IPC_MTU];
-		struct ipc_pkt *pkt;
+	}
+
+	pkt->type = type;
+	pkt->data_len = htole16(data_len);
 
-		pkt = (void *)&buf[0];
-		pkt->type = type;
-		pkt->data_len = data_len;
-		memcpy(pkt->data, data, data_len);
+	return BTLE_SUCCESS;
+}
 
-		ret = btsocket_send(buf, sizeof(buf));
+uint8_t ipc_sendv(uint16_t cid, enum ipc_msg type, const struct iovec *iov,
+		  int iovcnt)
+{
+	struct ipc_pkt pkt;
+	struct iovec frame[IPC_IOV_MAX + 1];
+	uint8_t ret;
+
+	if (iovcnt > IPC_IOV_MAX)
+		return BTLE_ERROR_INVALID_ARG;
+
+	ret = ipc_pkt_hdr(&pkt, type, iov, iovcnt);
+	if (ret)
 		return ret;
-	}
+
+	frame[0].iov_base = &pkt;
+	frame[0].iov_len = IPC_HDR_LEN;
+	memcpy(&frame[1], iov, iovcnt * sizeof(*iov));
+
+	return btsocket_sendv(cid, frame, iovcnt + 1);
 }
 
-uint8_t ipc_send_event(void *data, uint8_t data_len)
+uint8_t ipc_send(uint16_t cid, enum ipc_msg type, void *data,
+		 uint16_t data_len)
 {
-	return ipc_send(msg_event, data, data_len);
+	struct iovec iov = { .iov_base = data, .iov_len = data_len };
+
+	if (!data)
+		return BTLE_ERROR_NULL_ARG;
+
+	return ipc_sendv(cid, type, &iov, 1);
 }
 
-uint8_t ipc_send_cmd(void *data, uint8_t data_len)
+uint8_t ipc_send_eventv(uint32_t mask, const struct iovec *iov, int iovcnt)
 {
-	return ipc_send(msg_command_req, data, data_len);
+	struct ipc_pkt pkt;
+	struct iovec frame[IPC_IOV_MAX + 1];
+	uint8_t ret;
+
+	if (iovcnt > IPC_IOV_MAX)
+		return BTLE_ERROR_INVALID_ARG;
+
+	ret = ipc_pkt_hdr(&pkt, msg_event, iov, iovcnt);
+	if (ret)
+		return ret;
+
+	frame[0].iov_base = &pkt;
+	frame[0].iov_len = IPC_HDR_LEN;
+	memcpy(&frame[1], iov, iovcnt * sizeof(*iov));
+
+	return btsocket_broadcastv(mask, frame, iovcnt + 1);
+}
+
+uint8_t ipc_send_event(uint32_t mask, void *data, uint16_t data_len)
+{
+	struct iovec iov = { .iov_base = data, .iov_len = data_len };
+
+	if (!data)
+		return BTLE_ERROR_NULL_ARG;
+
+	return ipc_send_eventv(mask, &iov, 1);
+}
+
+uint8_t ipc_send_cmd(uint16_t cid, void *data, uint16_t data_len)
+{
+	return ipc_send(cid, msg_command_req, data, data_len);
+}
+
+uint8_t ipc_send_rsp(uint16_t cid, void *data, uint16_t data_len)
+{
+	return ipc_send(cid, msg_command_resp, data, data_len);
 }
 
-uint8_t ipc_send_rsp(void *data, uint8_t data_len)
+uint8_t ipc_send_info(uint16_t cid, void *data, uint16_t data_len)
 {
-	return ipc_send(msg_command_resp, data, data_len);
+	return ipc_send(cid, msg_info, data, data_len);
 }
 
-uint8_t ipc_send_info(void *data, uint8_t data_len)
+static void ipc_shm_setup(uint16_t cid, uint8_t *data, uint16_t data_len)
 {
-	return ipc_send(msg_info, data, data_len);
+	struct ipc_shm_req *req = (void *)data;
+	struct {
+		struct ipc_pkt pkt;
+		struct ipc_shm_rsp rsp;
+	} __attribute__((packed)) frame;
+
+	frame.pkt.type = msg_shm;
+	frame.pkt.data_len = htole16(sizeof(frame.rsp));
+	frame.rsp.size = 0;
+
+	if (data_len < sizeof(*req)) {
+		frame.rsp.status = BTLE_ERROR_INVALID_ARG;
+	} else {
+		uint32_t size = le32toh(req->size);
+
+		frame.rsp.size = htole32(size);
+		/* on success, the reply carries the ring descriptors */
+		frame.rsp.status = btsocket_shm_attach(cid, size,
+						       (void *)&frame,
+						       sizeof(frame));
+		if (!frame.rsp.status)
+			return;
+	}
+
+	ERR("[%d] shm setup failed (%d)\n", cid, frame.rsp.status);
+	btsocket_send(cid, (void *)&frame, sizeof(frame));
 }
 
-static void ipc_dispatch(uint8_t type, uint8_t *data, uint8_t data_len)
+static void ipc_dispatch(uint16_t cid, uint8_t type, uint8_t *data,
+			 uint16_t data_len)
 {
 	if (type == msg_command_req && func) {
 		/* command handler */
-		func(data, data_len);
+		func(cid, data, data_len);
 	} else if (type == msg_command_loopback) {
 		/* loopback test */
-		ipc_send(type, data, data_len);
+		ipc_send(cid, type, data, data_len);
+	} else if (type == msg_info && info_func) {
+		/* diagnostics query */
+		info_func(cid, data, data_len);
+	} else if (type == msg_shm) {
+		ipc_shm_setup(cid, data, data_len);
 	}
 }
 
-static void ipc_rx_cb(uint8_t *payload, uint8_t payload_len)
+static uint16_t ipc_rx_cb(uint16_t cid, uint8_t *payload,
+			  uint16_t payload_len)
 {
-	struct ipc_pkt *pkt;
+	uint16_t consumed = 0;
 
-	if (payload_len != IPC_MTU) {
-		/* packet could not be bigger than IPC_MTU */
-		ERR("invalid payload length (%d)\n", payload_len);
-		return;
-	}
-	pkt = (struct ipc_pkt *)&payload[0];
+	/* dispatching every complete frame; partial tail is kept by socket */
+	while (payload_len - consumed >= IPC_HDR_LEN) {
+		struct ipc_pkt *pkt = (void *)&payload[consumed];
+		uint16_t data_len = le16toh(pkt->data_len);
+
+		/* the next header is unknown; resynchronising is not
+		 * possible */
+		if (data_len > IPC_DATA_LEN_MAX) {
+			ERR("[%d] invalid data length (%d)\n", cid, data_len);
+			return BTSOCKET_RX_INVALID;
+		}
 
-	INFO("IPC RCV:type(%d) | len(%d) | %s\n",
-	     pkt->type, pkt->data_len, pkt->data);
+		if (payload_len - consumed < IPC_HDR_LEN + data_len)
+			break;
+
+		DBG("IPC RCV[%d]:type(%d) | len(%d)\n",
+		     cid, pkt->type, data_len);
+
+		ipc_dispatch(cid, pkt->type, pkt->data, data_len);
+		consumed += IPC_HDR_LEN + data_len;
+	}
 
-	ipc_dispatch(pkt->type, pkt->data, pkt->data_len);
+	return consumed;
 }
 
-uint8_t ipc_init(msg_cmd_cb req_cb)
+uint8_t ipc_init(msg_cmd_cb req_cb, msg_cmd_cb info_cb)
 {
 	uint8_t ret = BTLE_ERROR_NULL_ARG;
 
@@ -113,8 +253,12 @@ uint8_t ipc_init(msg_cmd_cb req_cb)
 		struct btsocket_param param = {
 			.mtu = IPC_MTU,
 			.rx_cb = ipc_rx_cb,
+			.tx_size = IPC_TX_RING_SIZE,
+			.tx_high_wm = IPC_TX_HIGH_WM,
+			.tx_low_wm = IPC_TX_LOW_WM,
 		};
 		func = req_cb;
+		info_func = info_cb;
 
 		ret = btsocket_init(&param);
 	}
@@ -126,4 +270,5 @@ void ipc_close(void)
 {
 	btsocket_close();
 	func = NULL;
+	info_func = NULL;
 }
@@ -16,6 +16,7 @@
  */
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #include "src/shared/mainloop.h"
@@ -25,6 +26,10 @@
 
 #include "btle_error.h"
 #include "cmd.h"
+#include "replay.h"
+#include "backend.h"
+#include "sim.h"
+#include "gattcache.h"
 
 #define CHK_RETURN(condition) {	\
 		if (condition) { \
@@ -32,8 +37,23 @@
 		} \
 }
 
+static void usage(const char *name)
+{
+	printf("usage: %s [-r btsnoop_file [-x speed]] "
+	       "[-s count[:adv_ms[:notify_ms]]] [-c cache_dir]\n"
+	       "\t-r: replaying a btsnoop capture instead of live events\n"
+	       "\t-x: 1 original pace (default), n n times faster, "
+	       "0 as fast as possible\n"
+	       "\t-s: simulated controller and peripherals, advertising "
+	       "every adv_ms (%u)\n\t    and notifying every notify_ms "
+	       "(%u, 0: never)\n"
+	       "\t-c: keeping the GATT databases discovered in cache_dir\n",
+	       name, SIM_ADV_INTERVAL_MS, SIM_NOTIFY_INTERVAL_MS);
+}
+
 static void cleaning(void *user_data)
 {
+	replay_stop();
 	cmd_server_close();
 }
 
@@ -49,18 +69,65 @@ static void signal_callback(int signum, void *user_data)
 	}
 }
 
-int main(void)
+int main(int argc, char *argv[])
 {
-	int ret;
+	int ret, opt;
 	sigset_t mask;
+	const char *replay_path = NULL;
+	uint16_t replay_speed = 1;
+	const char *cache_dir = NULL;
+	struct sim_config sim_cfg = {
+		.adv_interval_ms = SIM_ADV_INTERVAL_MS,
+		.notify_interval_ms = SIM_NOTIFY_INTERVAL_MS,
+	};
+
+	while ((opt = getopt(argc, argv, "r:x:s:c:h")) != -1) {
+		switch (opt) {
+		case 'r':
+			replay_path = optarg;
+			break;
+		case 'x':
+			replay_speed = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			sscanf(optarg, "%hu:%hu:%hu", &sim_cfg.count,
+			       &sim_cfg.adv_interval_ms,
+			       &sim_cfg.notify_interval_ms);
+			if (sim_configure(&sim_cfg) ||
+			    backend_select(&sim_backend)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'c':
+			cache_dir = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
 
 	INFO("Starting Bluetooth Low Energy daemon\n");
 
 	mainloop_init();
 
+	ret = bt_log_init();
+	CHK_RETURN(ret)
+
 	ret = cmd_server_init();
 	CHK_RETURN(ret)
 
+	if (cache_dir) {
+		ret = gattcache_init(cache_dir);
+		CHK_RETURN(ret)
+	}
+
+	if (replay_path) {
+		ret = replay_start(replay_path, replay_speed);
+		CHK_RETURN(ret)
+	}
+
 	sigemptyset(&mask);
 	sigaddset(&mask, SIGINT);
 	sigaddset(&mask, SIGTERM);
@@ -69,7 +136,9 @@ int main(void)
 
 	ret = mainloop_run();
 
+	replay_stop();
 	cmd_server_close();
+	bt_log_close();
 
 	return 0;
 }
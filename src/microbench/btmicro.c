@@ -0,0 +1,519 @@
+/*
+ *  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * Microbenchmarks of the daemon per message paths
+ *
+ * The daemon modules are linked with the IPC socket stubbed out: frames
+ * sent are copied to a sink, frames received are handed to the callback
+ * ipc_init() registered. The simulated backend answers mgmt. Each case
+ * runs in a loop sized to @time_ms; the median of @runs runs is reported
+ * in ns/op, along with heap allocations (malloc, calloc and realloc
+ * calls, counted through ld --wrap) and bytes sent per operation.
+ *
+ * Output lines are "<case> <ns/op> <allocs/op> <bytes/op>"; the output
+ * of a previous run, given with -b, is compared against.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <endian.h>
+#include <getopt.h>
+#include <sys/uio.h>
+
+#include "lib/bluetooth.h"
+#include "lib/mgmt.h"
+#include "src/shared/mainloop.h"
+
+#define MODULE "micro"
+#include "btprint.h"
+
+#include "btle_error.h"
+#include "btsocket.h"
+#include "ipc.h"
+#include "adv.h"
+#include "cmd.h"
+#include "backend.h"
+#include "sim.h"
+
+#define MICRO_CID		1
+#define MICRO_RUNS_MAX		64
+#define MICRO_CASE_MAX		32
+#define MICRO_RX_FRAMES		16
+#define MICRO_HDR_LEN		3	/* type | data_len (le16) */
+
+struct micro_case {
+	const char *name;
+	void (*run)(uint32_t iterations);
+};
+
+struct micro_result {
+	char name[32];
+	double ns;
+	double allocs;
+	double bytes;
+};
+
+static struct {
+	uint32_t runs;
+	uint32_t time_ms;
+	const char *filter;
+	const char *baseline;
+} opt = {
+	.runs = 5,
+	.time_ms = 200,
+};
+
+/* stubbed socket */
+static struct {
+	socket_rx_notifier rx_cb;
+	uint64_t bytes;
+	uint8_t sink[MICRO_HDR_LEN + IPC_RSP_DATA_LEN_MAX];
+} sock;
+
+static uint64_t allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	allocs++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	allocs++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	allocs++;
+	return __real_realloc(ptr, size);
+}
+
+static uint8_t micro_sink(const struct iovec *iov, int iovcnt)
+{
+	size_t len = 0;
+	int idx;
+
+	for (idx = 0; idx < iovcnt; idx++) {
+		if (len + iov[idx].iov_len > sizeof(sock.sink))
+			return BTLE_ERROR_INVALID_ARG;
+		memcpy(&sock.sink[len], iov[idx].iov_base, iov[idx].iov_len);
+		len += iov[idx].iov_len;
+	}
+	sock.bytes += len;
+
+	return BTLE_SUCCESS;
+}
+
+uint8_t btsocket_init(struct btsocket_param *param)
+{
+	sock.rx_cb = param->rx_cb;
+	return BTLE_SUCCESS;
+}
+
+uint8_t btsocket_send(uint16_t cid, uint8_t *data, uint16_t data_len)
+{
+	struct iovec iov = { .iov_base = data, .iov_len = data_len };
+
+	return micro_sink(&iov, 1);
+}
+
+uint8_t btsocket_sendv(uint16_t cid, const struct iovec *iov, int iovcnt)
+{
+	return micro_sink(iov, iovcnt);
+}
+
+uint8_t btsocket_broadcastv(uint32_t mask, const struct iovec *iov,
+			    int iovcnt)
+{
+	/* a single client, subscribed to everything */
+	return micro_sink(iov, iovcnt);
+}
+
+uint8_t btsocket_shm_attach(uint16_t cid, uint32_t size, uint8_t *data,
+			    uint16_t data_len)
+{
+	return BTLE_ERROR_NOT_IMPLEMENTED;
+}
+
+uint8_t btsocket_get_stats(uint16_t cid, struct btsocket_stats *stats)
+{
+	return BTLE_ERROR_NOT_IMPLEMENTED;
+}
+
+uint8_t btsocket_set_mask(uint16_t cid, uint32_t mask)
+{
+	return BTLE_SUCCESS;
+}
+
+uint8_t btsocket_set_param_version(uint16_t cid, uint8_t version)
+{
+	return BTLE_SUCCESS;
+}
+
+uint8_t btsocket_get_param_version(uint16_t cid)
+{
+	return CMD_PARAM_VERSION;
+}
+
+void btsocket_close()
+{
+	sock.rx_cb = NULL;
+}
+
+/* inputs, built once */
+static struct {
+	uint8_t payload[64];
+	uint8_t set_log_level[5];
+	uint8_t set_mask_frame[MICRO_HDR_LEN + 8];
+	uint16_t snapshot_len;
+	uint8_t snapshot_frame[MICRO_HDR_LEN + 4];
+	uint16_t loopback_len;
+	uint8_t loopback[MICRO_RX_FRAMES * (MICRO_HDR_LEN + 32)];
+	uint16_t found_len;
+	struct {
+		struct mgmt_ev_device_found ev;
+		uint8_t eir[31];
+	} __attribute__((packed)) found;
+	uint8_t rec[ADV_REC_LEN(31)];
+} in;
+
+static uint16_t micro_frame(uint8_t *buf, uint8_t type, const uint8_t *data,
+			    uint16_t len)
+{
+	buf[0] = type;
+	buf[1] = len & 0xff;
+	buf[2] = len >> 8;
+	memcpy(&buf[MICRO_HDR_LEN], data, len);
+
+	return MICRO_HDR_LEN + len;
+}
+
+static void micro_setup_inputs(void)
+{
+	/* flags, 16 bits UUIDs, name, manufacturer data: 31 bytes */
+	static const uint8_t eir[] = {
+		0x02, 0x01, 0x06,
+		0x05, 0x03, 0x0d, 0x18, 0x0f, 0x18,
+		0x09, 0x09, 's', 'i', 'm', '-', '0', '0', '0', '1',
+		0x0b, 0xff, 0x4c, 0x00, 0x02, 0x15, 1, 2, 3, 4, 5, 6,
+	};
+	uint8_t cmd[8];
+	uint16_t idx;
+
+	for (idx = 0; idx < sizeof(in.payload); idx++)
+		in.payload[idx] = idx;
+
+	in.set_log_level[0] = SIM_INDEX;
+	in.set_log_level[1] = CMD_SET_LOG_LEVEL;
+	in.set_log_level[2] = 1;
+	in.set_log_level[3] = 0;
+	in.set_log_level[4] = BTLOG_ERR;
+
+	cmd[0] = SIM_INDEX;
+	cmd[1] = CMD_SET_EVENT_MASK;
+	cmd[2] = 2;
+	cmd[3] = 0;
+	memset(&cmd[4], 0xff, 4);
+	micro_frame(in.set_mask_frame, msg_command_req, cmd, 8);
+
+	cmd[1] = CMD_DEVREG_SNAPSHOT;
+	in.snapshot_len = micro_frame(in.snapshot_frame, msg_command_req, cmd,
+				      4);
+
+	for (idx = 0; idx < MICRO_RX_FRAMES; idx++)
+		in.loopback_len += micro_frame(&in.loopback[in.loopback_len],
+					       msg_command_loopback,
+					       in.payload, 32);
+
+	memset(&in.found, 0, sizeof(in.found));
+	in.found.ev.addr.bdaddr.b[5] = 0xc0;
+	in.found.ev.addr.type = BDADDR_LE_RANDOM;
+	in.found.ev.rssi = -60;
+	in.found.ev.eir_len = htole16(sizeof(eir));
+	memcpy(in.found.eir, eir, sizeof(eir));
+	in.found_len = sizeof(in.found.ev) + sizeof(eir);
+}
+
+static void micro_ipc_send_rsp(uint32_t iterations)
+{
+	while (iterations--)
+		ipc_send_rsp(MICRO_CID, in.payload, 16);
+}
+
+static void micro_ipc_send_event(uint32_t iterations)
+{
+	while (iterations--)
+		ipc_send_event(~0, in.payload, sizeof(in.payload));
+}
+
+static void micro_ipc_sendv(uint32_t iterations)
+{
+	struct iovec iov[3] = {
+		{ .iov_base = in.payload, .iov_len = 8 },
+		{ .iov_base = &in.payload[8], .iov_len = 24 },
+		{ .iov_base = &in.payload[32], .iov_len = 32 },
+	};
+
+	while (iterations--)
+		ipc_sendv(MICRO_CID, msg_event, iov, 3);
+}
+
+static void micro_cmd_send_event_msg(uint32_t iterations)
+{
+	while (iterations--)
+		cmd_send_event_msg(SIM_INDEX, EVENT_GATTC_NOTIFICATION,
+				   in.payload, 20);
+}
+
+static void micro_cmd_server_handler(uint32_t iterations)
+{
+	while (iterations--)
+		cmd_server_handler(MICRO_CID, in.set_log_level,
+				   sizeof(in.set_log_level));
+}
+
+static void micro_ipc_rx_command(uint32_t iterations)
+{
+	while (iterations--)
+		sock.rx_cb(MICRO_CID, in.set_mask_frame,
+			   sizeof(in.set_mask_frame));
+}
+
+static void micro_ipc_rx_loopback(uint32_t iterations)
+{
+	while (iterations--)
+		sock.rx_cb(MICRO_CID, in.loopback, in.loopback_len);
+}
+
+static void micro_ipc_rx_snapshot(uint32_t iterations)
+{
+	while (iterations--)
+		sock.rx_cb(MICRO_CID, in.snapshot_frame, in.snapshot_len);
+}
+
+static void micro_device_found(uint32_t iterations)
+{
+	while (iterations--)
+		cmd_mgmt_event(MGMT_EV_DEVICE_FOUND, SIM_INDEX, in.found_len,
+			       &in.found);
+}
+
+static void micro_adv_parse(uint32_t iterations)
+{
+	while (iterations--)
+		adv_parse(in.found.eir, sizeof(in.found.eir), in.rec,
+			  sizeof(in.rec));
+}
+
+static const struct micro_case cases[] = {
+	{ "ipc_send_rsp", micro_ipc_send_rsp },
+	{ "ipc_send_event", micro_ipc_send_event },
+	{ "ipc_sendv_3iov", micro_ipc_sendv },
+	{ "cmd_send_event_msg", micro_cmd_send_event_msg },
+	{ "cmd_server_handler", micro_cmd_server_handler },
+	{ "ipc_rx_set_event_mask", micro_ipc_rx_command },
+	{ "ipc_rx_loopback_x16", micro_ipc_rx_loopback },
+	{ "mgmt_device_found", micro_device_found },
+	/* one device registered by mgmt_device_found */
+	{ "ipc_rx_devreg_snapshot", micro_ipc_rx_snapshot },
+	{ "adv_parse", micro_adv_parse },
+};
+
+static uint64_t micro_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int micro_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void micro_run(const struct micro_case *c, struct micro_result *res)
+{
+	double ns[MICRO_RUNS_MAX];
+	uint64_t start, elapsed, target = opt.time_ms * 1000000ULL / opt.runs;
+	uint64_t allocs_start, bytes_start;
+	uint32_t iterations = 1, run;
+
+	/* calibrating: a run lasting about time_ms / runs */
+	for (;;) {
+		start = micro_now_ns();
+		c->run(iterations);
+		elapsed = micro_now_ns() - start;
+		if (elapsed >= target / 4 || iterations >= UINT32_MAX / 8)
+			break;
+		iterations *= 2;
+	}
+	if (elapsed)
+		iterations = (double)iterations * target / elapsed + 1;
+
+	allocs_start = allocs;
+	bytes_start = sock.bytes;
+	for (run = 0; run < opt.runs; run++) {
+		start = micro_now_ns();
+		c->run(iterations);
+		ns[run] = (double)(micro_now_ns() - start) / iterations;
+	}
+
+	qsort(ns, opt.runs, sizeof(ns[0]), micro_cmp);
+
+	snprintf(res->name, sizeof(res->name), "%s", c->name);
+	res->ns = ns[opt.runs / 2];
+	res->allocs = (double)(allocs - allocs_start) /
+		      ((uint64_t)iterations * opt.runs);
+	res->bytes = (double)(sock.bytes - bytes_start) /
+		     ((uint64_t)iterations * opt.runs);
+}
+
+static uint16_t micro_load(const char *path, struct micro_result *base)
+{
+	char line[128];
+	uint16_t count = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		perror(path);
+		return 0;
+	}
+
+	while (count < MICRO_CASE_MAX && fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%31s %lf %lf %lf", base[count].name,
+			   &base[count].ns, &base[count].allocs,
+			   &base[count].bytes) == 4)
+			count++;
+	}
+	fclose(fp);
+
+	return count;
+}
+
+static void micro_report(const struct micro_result *res,
+			 const struct micro_result *base, uint16_t nbase)
+{
+	uint16_t idx;
+
+	printf("%-24s %10.1f %8.2f %8.1f", res->name, res->ns, res->allocs,
+	       res->bytes);
+
+	for (idx = 0; idx < nbase; idx++) {
+		if (strcmp(base[idx].name, res->name) || !base[idx].ns)
+			continue;
+		printf("   # %+6.1f%% ns/op, %+.2f allocs/op",
+		       100.0 * (res->ns - base[idx].ns) / base[idx].ns,
+		       res->allocs - base[idx].allocs);
+		break;
+	}
+	printf("\n");
+}
+
+static void micro_usage(const char *name)
+{
+	printf("usage: %s [-r runs] [-t time_ms] [-f filter] [-b baseline]\n"
+	       "\t-r: runs per case, median reported (%u)\n"
+	       "\t-t: time spent per case (%u ms)\n"
+	       "\t-f: cases whose name contains filter only\n"
+	       "\t-b: output of a previous run, compared against\n",
+	       name, opt.runs, opt.time_ms);
+}
+
+int main(int argc, char *argv[])
+{
+	struct micro_result base[MICRO_CASE_MAX], res;
+	struct sim_config cfg = {
+		.count = 1,
+		.adv_interval_ms = SIM_ADV_INTERVAL_MS,
+	};
+	uint16_t nbase = 0, idx;
+	int c;
+
+	while ((c = getopt(argc, argv, "r:t:f:b:h")) != -1) {
+		switch (c) {
+		case 'r':
+			opt.runs = atoi(optarg);
+			break;
+		case 't':
+			opt.time_ms = atoi(optarg);
+			break;
+		case 'f':
+			opt.filter = optarg;
+			break;
+		case 'b':
+			opt.baseline = optarg;
+			break;
+		default:
+			micro_usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+	}
+
+	if (!opt.runs || opt.runs > MICRO_RUNS_MAX || !opt.time_ms) {
+		micro_usage(argv[0]);
+		return 1;
+	}
+
+	if (opt.baseline) {
+		nbase = micro_load(opt.baseline, base);
+		if (!nbase)
+			return 1;
+	}
+
+	/* logs would be measured otherwise */
+	bt_log_set_level(BTLOG_ERR);
+
+	mainloop_init();
+	sim_configure(&cfg);
+	backend_select(&sim_backend);
+	if (cmd_server_init() || !sock.rx_cb) {
+		fprintf(stderr, "daemon modules initialization failed\n");
+		return 1;
+	}
+
+	micro_setup_inputs();
+
+	printf("# %-22s %10s %8s %8s\n", "case", "ns/op", "allocs", "bytes");
+	for (idx = 0; idx < sizeof(cases) / sizeof(cases[0]); idx++) {
+		if (opt.filter && !strstr(cases[idx].name, opt.filter))
+			continue;
+
+		micro_run(&cases[idx], &res);
+		micro_report(&res, base, nbase);
+	}
+
+	cmd_server_close();
+
+	return 0;
+}
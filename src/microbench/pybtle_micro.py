@@ -0,0 +1,274 @@
+'''
+  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+'''
+'''
+  Microbenchmarks of the pybtle encoders and decoders
+
+  cmd and btipc instances are built without opening the daemon socket:
+  frames sent land in a sink, frames received are fed to
+  btipc.ipc_receive as btsocket would. Each case runs in a loop sized to
+  time_ms; the median of runs runs is reported in ns/op, along with the
+  peak heap bytes allocated by one operation (only when tracemalloc is
+  available, '-' otherwise) and the bytes sent per operation.
+
+  Output lines are "<case> <ns/op> <alloc_bytes/op> <bytes/op>", the
+  output of a previous run, given with -b, is compared against.
+'''
+import imp
+import sys
+import inspect, os
+import socket
+import struct
+import timeit
+import argparse
+
+try:
+    import tracemalloc
+except ImportError:
+    tracemalloc = None
+
+path = os.path.dirname(os.path.abspath(inspect.getfile(inspect.currentframe())))
+sys.path.append(os.path.normpath(path + '/../../pybtle/'))
+cmd = imp.load_source('cmd', os.path.normpath(path + '/../../pybtle/cmd.py'))
+btipc = cmd.btipc
+
+# IPC_HDR_LEN + IPC_DATA_LEN_MAX, src/ipc.c
+IPC_MTU = 1027
+
+class sink(btipc.btsocket.btsocket):
+    """Stands for btsocket, counting the bytes sent; the MTU is negotiated
+    from the bytes the daemon sends on connection"""
+    def __init__(self):
+        self.bytes = 0
+        self.mtu = None
+        (self.client_sock, daemon) = socket.socketpair()
+        daemon.sendall(struct.pack('>H', IPC_MTU))
+        self.mtu_negociation(timeout = 1)
+        daemon.close()
+        self.client_sock.close()
+        self.client_sock = None
+
+    def send(self, data, data_len):
+        self.bytes += data_len
+        return True
+
+class micro_ipc(btipc.btipc):
+    """btipc on top of the sink"""
+    def __init__(self, evt_delegate = None):
+        self.socket = sink()
+        self.mtu = self.socket.getmtu()
+        self.q_resp = btipc.Queue.Queue()
+        self.q_info = btipc.Queue.Queue()
+        self.evt_delegate = evt_delegate
+
+class micro_cmd(cmd.cmd):
+    """cmd on top of micro_ipc, events are decoded then dropped"""
+    def __init__(self):
+        self.ipc = micro_ipc(evt_delegate = self.parse_event)
+        self.req_id = 0
+        self.pending = {}
+        self.delegate = {}
+        self.summary = []
+        self.summary_dropped = None
+        self.dbs = {}
+        self.disc_cb = {}
+        self.ntf_cb = {}
+        self.param_version = cmd.PARAM_VERSION_MTU
+        for evt in (cmd.EVT_SCAN_RESULT, cmd.EVT_GATTC_NOTIFICATION):
+            self.delegate[evt] = lambda arg: None
+
+def frame(msg_type, content):
+    return struct.pack('<BH', msg_type, len(content)) + content
+
+def event(evt, data):
+    content = struct.pack('<BBBH', 0, evt, 0, 0)
+    return frame(btipc.btipc.IPC_MSG_TYPE_EVENT,
+                 content + struct.pack('<H', len(data)) + data)
+
+def scan_result(n = 0):
+    adv = b'\x02\x01\x06\x05\x09sim-\x03\x03\x0f\x18'
+    rec = (struct.pack('<H', 0x7) + b'\x00\x01\x06' +
+           b'\x01\x04sim-' + b'\x04\x02\x0f\x18')
+    return (struct.pack('<L', 0) + struct.pack('<HL', n, 0xc0000000) +
+            struct.pack('<BbHH', 1, -60, len(adv), len(rec)) + adv + rec)
+
+def scan_batch(count):
+    results = b''
+    for i in range(count):
+        r = scan_result(i)
+        results += struct.pack('<H', len(r)) + r
+    return struct.pack('<B', count) + results
+
+def notification():
+    value = b'\x16\x48\x01\x02'
+    return struct.pack('<HHHB', 1, 0x0012, len(value), 0) + value
+
+def resp(adapter, command, req_id, data):
+    content = (struct.pack('<BBBHH', adapter, command, 0, req_id,
+                           len(data)) + data)
+    return frame(btipc.btipc.IPC_MSG_TYPE_RSP, content)
+
+def controller_info():
+    return (b'\x06\x05\x04\x03\x02\x01' + struct.pack('<BH', 9, 2) +
+            struct.pack('<LL', 0x1ffff, 0x0ad1) + b'\x00\x00\x00' +
+            b'btle' + b'\x00' * 245)
+
+def devreg_snapshot(count):
+    data = struct.pack('<H', count)
+    for i in range(count):
+        adv = b'\x02\x01\x06'
+        data += (struct.pack('<HL', i, 0xc0000000) +
+                 struct.pack('<BbbBLLLB', 1, -60, -40, 1, 0, 1000, 10,
+                             len(adv)) + adv)
+    return data
+
+def db_dump(services):
+    data = struct.pack('<H', 0)
+    for i in range(services):
+        start = 1 + i * 8
+        data += struct.pack('<BHHH', cmd.GATTC_DB_PRIMARY, start,
+                            start + 7, 0x180f)
+        for j in (1, 4):
+            data += struct.pack('<BHHBHH', cmd.GATTC_DB_CHRC, start + j,
+                                start + j + 1, 0x12, 0, 0x2a19)
+            data += struct.pack('<BHH', cmd.GATTC_DB_DESC, start + j + 2,
+                                0x2902)
+    return data
+
+def case_ipc_rx_scan_result(c):
+    f = event(cmd.EVT_SCAN_RESULT, scan_result())
+    return lambda: c.ipc.ipc_receive(f)
+
+def case_ipc_rx_scan_batch_x8(c):
+    f = event(cmd.EVT_SCAN_BATCH, scan_batch(8))
+    return lambda: c.ipc.ipc_receive(f)
+
+def case_ipc_rx_notification(c):
+    f = event(cmd.EVT_GATTC_NOTIFICATION, notification())
+    return lambda: c.ipc.ipc_receive(f)
+
+def case_wait_resp_controller_info(c):
+    def op():
+        req_id = c.send_req(0, cmd.CMD_MGMT_READ_CONTROLLER_INFO)
+        c.ipc.ipc_receive(resp(0, cmd.CMD_MGMT_READ_CONTROLLER_INFO,
+                               req_id, controller_info()))
+        c.wait_resp(req_id)
+    return op
+
+def case_parse_devreg_snapshot_x16(c):
+    data = devreg_snapshot(16)
+    return lambda: c.parse_devreg_snapshot_rsp(data, len(data))
+
+def case_parse_db_dump_x60(c):
+    # 12 services, 60 attributes
+    data = db_dump(12)
+    return lambda: c.parse_db_dump_rsp(data, len(data))
+
+def case_send_req_scan_start(c):
+    opts = (struct.pack('<BBBH', cmd.SCAN_OPT_DEDUP, 3, 1, 500) +
+            struct.pack('<BBb', cmd.SCAN_OPT_RSSI, 1, -80))
+    bin = struct.pack('>B', 1) + struct.pack('<H', 0) + opts
+    return lambda: c.send_req(0, cmd.CMD_MGMT_SCAN, bin)
+
+cases = [
+    ("ipc_rx_scan_result", case_ipc_rx_scan_result),
+    ("ipc_rx_scan_batch_x8", case_ipc_rx_scan_batch_x8),
+    ("ipc_rx_notification", case_ipc_rx_notification),
+    ("wait_resp_ctrl_info", case_wait_resp_controller_info),
+    ("parse_devreg_snap_x16", case_parse_devreg_snapshot_x16),
+    ("parse_db_dump_x60", case_parse_db_dump_x60),
+    ("send_req_scan_start", case_send_req_scan_start),
+]
+
+def micro_alloc(op):
+    if tracemalloc == None:
+        return None
+    tracemalloc.start()
+    base = tracemalloc.get_traced_memory()[0]
+    op()
+    peak = tracemalloc.get_traced_memory()[1]
+    tracemalloc.stop()
+    return max(0, peak - base)
+
+def micro_run(name, setup, runs, time_ms):
+    c = micro_cmd()
+    op = setup(c)
+    op()
+
+    # sizing the loop so that one run lasts about time_ms
+    iterations = 1
+    while True:
+        t = timeit.timeit(op, number = iterations)
+        if t >= time_ms / 10000.0 or iterations >= (1 << 24):
+            break
+        iterations *= 2
+    iterations = max(1, int(iterations * (time_ms / 1000.0) / max(t, 1e-9)))
+
+    samples = []
+    for i in range(runs):
+        samples.append(timeit.timeit(op, number = iterations))
+    samples.sort()
+    ns = samples[len(samples) // 2] * 1e9 / iterations
+
+    c.ipc.socket.bytes = 0
+    op()
+    sent = c.ipc.socket.bytes
+    return (name, ns, micro_alloc(op), sent)
+
+def micro_load(filename):
+    base = {}
+    with open(filename) as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) < 2 or fields[0].startswith('#'):
+                continue
+            try:
+                base[fields[0]] = float(fields[1])
+            except ValueError:
+                pass
+    return base
+
+def main():
+    parser = argparse.ArgumentParser(
+        description = 'pybtle encoders and decoders microbenchmarks')
+    parser.add_argument('-r', dest = 'runs', type = int, default = 5,
+                        help = 'runs per case, the median is reported')
+    parser.add_argument('-t', dest = 'time_ms', type = int, default = 200,
+                        help = 'duration of one run in ms')
+    parser.add_argument('-f', dest = 'filter', default = None,
+                        help = 'only run cases containing this string')
+    parser.add_argument('-b', dest = 'baseline', default = None,
+                        help = 'output of a previous run to compare against')
+    args = parser.parse_args()
+
+    base = micro_load(args.baseline) if args.baseline else {}
+
+    print("# %-22s %10s %8s %8s" % ("case", "ns/op", "alloc", "bytes"))
+    for (name, setup) in cases:
+        if args.filter and args.filter not in name:
+            continue
+        (name, ns, alloc, sent) = micro_run(name, setup, max(1, args.runs),
+                                            max(1, args.time_ms))
+        line = "%-24s %10.1f %8s %8d" % (name, ns,
+                                        '-' if alloc == None else alloc,
+                                        sent)
+        if name in base and base[name] > 0:
+            line += "   # %+6.1f%% ns/op" % ((ns - base[name]) * 100.0 /
+                                             base[name])
+        print(line)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,421 @@
+/*
+ *  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <endian.h>
+
+#include "lib/bluetooth.h"
+#include "lib/mgmt.h"
+#include "src/shared/util.h"
+#include "src/shared/mainloop.h"
+
+#define MODULE "replay"
+#include "btprint.h"
+
+#include "btle_error.h"
+#include "cmd.h"
+#include "gattc.h"
+#include "stats.h"
+#include "replay.h"
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+/* btsnoop file: header then records, every field being big endian */
+#define BTSNOOP_MAGIC		"btsnoop\0"
+#define BTSNOOP_VERSION		1
+#define BTSNOOP_FORMAT_HCI	1001	/* flags: bit 0 rx, bit 1 cmd/evt */
+#define BTSNOOP_FORMAT_UART	1002	/* same, H4 packet type first */
+#define BTSNOOP_FORMAT_MONITOR	2001	/* flags: index << 16 | opcode */
+
+#define BTSNOOP_FLAG_RX		0x01
+#define BTSNOOP_FLAG_EVT	0x02
+
+/* btmon opcodes */
+#define BTSNOOP_OPCODE_EVENT_PKT	3
+#define BTSNOOP_OPCODE_ACL_RX_PKT	5
+#define BTSNOOP_OPCODE_CTRL_EVENT	35
+
+#define H4_ACL_PKT		0x02
+#define H4_EVENT_PKT		0x04
+
+#define HCI_EV_LE_META		0x3e
+#define HCI_EV_LE_ADV_REPORT	0x02
+#define HCI_ADV_SCAN_IND	0x02
+#define HCI_ADV_NONCONN_IND	0x03
+#define HCI_ACL_CONT		0x1	/* packet boundary: continuing */
+
+#define L2CAP_CID_ATT		0x0004
+#define ATT_OP_HANDLE_NOTIFY	0x1b
+#define ATT_OP_HANDLE_IND	0x1d
+
+#define REPLAY_RECORD_MAX	2048
+#define REPLAY_BURST		256	/* records per wakeup at most */
+#define REPLAY_DELAY_MAX	3600000	/* ms, longer gaps are shortened */
+
+struct btsnoop_hdr {
+	uint8_t magic[8];
+	uint32_t version;
+	uint32_t format;
+} __attribute__((packed));
+
+struct btsnoop_rec {
+	uint32_t orig_len;
+	uint32_t incl_len;
+	uint32_t flags;
+	uint32_t drops;
+	uint64_t ts;		/* us */
+} __attribute__((packed));
+
+enum replay_kind {
+	REPLAY_OTHER,
+	REPLAY_HCI_EVENT,
+	REPLAY_ACL_RX,
+	REPLAY_MGMT_EVENT,
+};
+
+static struct {
+	FILE *fp;
+	uint32_t format;
+	uint16_t speed;
+	int timer;
+
+	/* next record to inject, read ahead of its time */
+	uint64_t ts;
+	uint8_t kind;
+	uint16_t index;
+	uint16_t len;
+	uint8_t data[REPLAY_RECORD_MAX];
+
+	uint64_t first_ts;
+	uint64_t start_us;
+	bool mgmt_found;	/* capture holds mgmt device found events */
+	uint32_t records;
+	uint32_t injected;
+} replay;
+
+static void replay_adv_report(uint16_t index, const uint8_t *data,
+			      uint16_t len)
+{
+	struct {
+		struct mgmt_ev_device_found ev;
+		uint8_t eir[UINT8_MAX];
+	} __attribute__((packed)) found;
+	uint8_t num, idx, adv_len;
+
+	/* [num | (type | addr_type | addr | len | data | rssi)...] */
+	if (len < 1)
+		return;
+
+	num = data[0];
+	data++;
+	len--;
+
+	for (idx = 0; idx < num && len >= 10; idx++) {
+		adv_len = data[8];
+		if (len < 10 + adv_len)
+			return;
+
+		memcpy(found.ev.addr.bdaddr.b, &data[2], 6);
+		found.ev.addr.type = data[1] ? BDADDR_LE_RANDOM :
+					       BDADDR_LE_PUBLIC;
+		found.ev.rssi = data[9 + adv_len];
+		found.ev.flags = htole32((data[0] == HCI_ADV_SCAN_IND ||
+					  data[0] == HCI_ADV_NONCONN_IND) ?
+					 MGMT_DEV_FOUND_NOT_CONNECTABLE : 0);
+		found.ev.eir_len = htole16(adv_len);
+		memcpy(found.eir, &data[9], adv_len);
+
+		cmd_mgmt_event(MGMT_EV_DEVICE_FOUND, index,
+			       sizeof(found.ev) + adv_len, &found);
+		replay.injected++;
+
+		data += 10 + adv_len;
+		len -= 10 + adv_len;
+	}
+}
+
+static void replay_hci_event(uint16_t index, const uint8_t *data,
+			     uint16_t len)
+{
+	uint16_t plen;
+
+	if (replay.mgmt_found)
+		return;
+
+	/* [code | plen | subevent | params] */
+	if (len < 3 || data[0] != HCI_EV_LE_META ||
+	    data[2] != HCI_EV_LE_ADV_REPORT)
+		return;
+
+	plen = MIN(len - 2, data[1]);
+	if (plen < 1)
+		return;
+
+	replay_adv_report(index, &data[3], plen - 1);
+}
+
+static void replay_acl_rx(uint16_t index, const uint8_t *data, uint16_t len)
+{
+	uint16_t handle, l2_len, cid;
+
+	/* [handle | len | l2cap len | cid | payload], start fragments only */
+	if (len < 8)
+		return;
+
+	handle = get_le16(&data[0]);
+	l2_len = get_le16(&data[4]);
+	cid = get_le16(&data[6]);
+
+	if (((handle >> 12) & 0x3) == HCI_ACL_CONT || cid != L2CAP_CID_ATT ||
+	    l2_len < 3 || len < 8 + l2_len)
+		return;
+
+	data += 8;
+	if (data[0] != ATT_OP_HANDLE_NOTIFY && data[0] != ATT_OP_HANDLE_IND)
+		return;
+
+	/* the captured ACL handle stands for the connection handle */
+	gattc_send_notification(index, handle & 0x0fff, 0, get_le16(&data[1]),
+				&data[3], l2_len - 3);
+	replay.injected++;
+}
+
+static void replay_mgmt_event(uint16_t index, const uint8_t *data,
+			      uint16_t len)
+{
+	uint16_t event;
+
+	/* [cookie(le32) | event(le16) | params] */
+	if (len < 6)
+		return;
+
+	event = get_le16(&data[4]);
+	cmd_mgmt_event(event, index, len - 6, &data[6]);
+	replay.injected++;
+}
+
+static void replay_dispatch(void)
+{
+	switch (replay.kind) {
+	case REPLAY_HCI_EVENT:
+		replay_hci_event(replay.index, replay.data, replay.len);
+		break;
+	case REPLAY_ACL_RX:
+		replay_acl_rx(replay.index, replay.data, replay.len);
+		break;
+	case REPLAY_MGMT_EVENT:
+		replay_mgmt_event(replay.index, replay.data, replay.len);
+		break;
+	}
+}
+
+static uint8_t replay_kind(uint32_t flags)
+{
+	uint8_t h4_type;
+
+	switch (replay.format) {
+	case BTSNOOP_FORMAT_MONITOR:
+		replay.index = flags >> 16;
+		switch (flags & 0xffff) {
+		case BTSNOOP_OPCODE_EVENT_PKT:
+			return REPLAY_HCI_EVENT;
+		case BTSNOOP_OPCODE_ACL_RX_PKT:
+			return REPLAY_ACL_RX;
+		case BTSNOOP_OPCODE_CTRL_EVENT:
+			return REPLAY_MGMT_EVENT;
+		}
+		break;
+
+	case BTSNOOP_FORMAT_UART:
+		if (!replay.len || !(flags & BTSNOOP_FLAG_RX))
+			break;
+
+		h4_type = replay.data[0];
+		memmove(replay.data, &replay.data[1], --replay.len);
+		if (h4_type == H4_EVENT_PKT)
+			return REPLAY_HCI_EVENT;
+		if (h4_type == H4_ACL_PKT)
+			return REPLAY_ACL_RX;
+		break;
+
+	case BTSNOOP_FORMAT_HCI:
+		if (!(flags & BTSNOOP_FLAG_RX))
+			break;
+		return (flags & BTSNOOP_FLAG_EVT) ? REPLAY_HCI_EVENT :
+						    REPLAY_ACL_RX;
+	}
+
+	return REPLAY_OTHER;
+}
+
+/* reading ahead the next record to inject, false at the end of file */
+static bool replay_read(void)
+{
+	struct btsnoop_rec rec;
+	uint32_t incl_len;
+
+	while (fread(&rec, sizeof(rec), 1, replay.fp) == 1) {
+		incl_len = be32toh(rec.incl_len);
+
+		if (incl_len > sizeof(replay.data)) {
+			if (fseek(replay.fp, incl_len, SEEK_CUR))
+				return false;
+			continue;
+		}
+
+		if (fread(replay.data, 1, incl_len, replay.fp) != incl_len)
+			return false;
+
+		replay.records++;
+		replay.ts = be64toh(rec.ts);
+		replay.len = incl_len;
+		replay.index = 0;
+		replay.kind = replay_kind(be32toh(rec.flags));
+
+		if (replay.kind != REPLAY_OTHER)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * btmon records the mgmt device found events next to the HCI reports
+ * they come from: the latter are only converted when the former are
+ * missing from the capture
+ */
+static bool replay_has_mgmt_found(void)
+{
+	long start = ftell(replay.fp);
+	bool found = false;
+
+	while (!found && replay_read())
+		found = replay.kind == REPLAY_MGMT_EVENT && replay.len >= 6 &&
+			get_le16(&replay.data[4]) == MGMT_EV_DEVICE_FOUND;
+
+	replay.records = 0;
+	if (fseek(replay.fp, start, SEEK_SET))
+		return true;
+
+	return found;
+}
+
+/* ms until the pending record is due, 0 if it already is */
+static unsigned int replay_delay(void)
+{
+	uint64_t due, now;
+
+	if (!replay.speed || replay.ts <= replay.first_ts)
+		return 0;
+
+	due = replay.start_us + (replay.ts - replay.first_ts) / replay.speed;
+	now = stats_now_us();
+	if (due <= now)
+		return 0;
+
+	return MIN((due - now + 999) / 1000, REPLAY_DELAY_MAX);
+}
+
+static void replay_timeout(int id, void *user_data)
+{
+	unsigned int burst = 0, delay;
+
+	do {
+		replay_dispatch();
+
+		if (!replay.fp || !replay_read()) {
+			INFO("replay done: %u records, %u events injected "
+			     "in %llu ms\n", replay.records, replay.injected,
+			     (unsigned long long)
+			     (stats_now_us() - replay.start_us) / 1000);
+			replay_stop();
+			return;
+		}
+
+		delay = replay_delay();
+	} while (!delay && ++burst < REPLAY_BURST);
+
+	mainloop_modify_timeout(id, delay ? delay : 1);
+}
+
+uint8_t replay_start(const char *path, uint16_t speed)
+{
+	struct btsnoop_hdr hdr;
+
+	if (replay.fp)
+		return BTLE_ERROR_BUSY;
+
+	replay.fp = fopen(path, "rb");
+	if (!replay.fp) {
+		ERR("unable to open %s\n", path);
+		return BTLE_ERROR_INVALID_ARG;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, replay.fp) != 1 ||
+	    memcmp(hdr.magic, BTSNOOP_MAGIC, sizeof(hdr.magic)) ||
+	    be32toh(hdr.version) != BTSNOOP_VERSION) {
+		ERR("%s is not a btsnoop file\n", path);
+		goto fail;
+	}
+
+	replay.format = be32toh(hdr.format);
+	if (replay.format != BTSNOOP_FORMAT_HCI &&
+	    replay.format != BTSNOOP_FORMAT_UART &&
+	    replay.format != BTSNOOP_FORMAT_MONITOR) {
+		ERR("btsnoop format %u not supported\n", replay.format);
+		goto fail;
+	}
+
+	replay.mgmt_found = replay_has_mgmt_found();
+	if (!replay_read()) {
+		ERR("nothing to replay in %s\n", path);
+		goto fail;
+	}
+
+	replay.speed = speed;
+	replay.first_ts = replay.ts;
+	replay.start_us = stats_now_us();
+	replay.timer = mainloop_add_timeout(1, replay_timeout, NULL, NULL);
+	if (replay.timer < 0) {
+		ERR("replay timer\n");
+		replay.timer = 0;
+		goto fail;
+	}
+
+	INFO("replaying %s (format %u, speed %u)\n", path, replay.format,
+	     speed);
+
+	return BTLE_SUCCESS;
+fail:
+	fclose(replay.fp);
+	memset(&replay, 0, sizeof(replay));
+	return BTLE_ERROR_INVALID_ARG;
+}
+
+void replay_stop(void)
+{
+	if (!replay.fp)
+		return;
+
+	if (replay.timer)
+		mainloop_remove_timeout(replay.timer);
+
+	fclose(replay.fp);
+	memset(&replay, 0, sizeof(replay));
+}
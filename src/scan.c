@@ -0,0 +1,378 @@
+/*
+ *  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define MODULE "scan"
+#include "btprint.h"
+
+#include "btle_error.h"
+#include "cmd.h"
+#include "adv.h"
+#include "advprog.h"
+#include "devtab.h"
+#include "devreg.h"
+#include "scan.h"
+
+#define SCAN_HASH_SIZE		256	/* buckets, power of 2 */
+#define SCAN_DEV_MAX		1024	/* devices tracked, all adapters */
+
+#define FNV_OFFSET		2166136261U
+#define FNV_PRIME		16777619U
+
+/*
+ * Device seen while scanning
+ *
+ * @entry: device table entry
+ * @rssi: RSSI last reported
+ * @adv_hash: hash of the advertising data last reported
+ * @adv_len: length of the advertising data last reported
+ * @last_ms: time of the last report
+ * @best_rssi: strongest RSSI seen, for the scan summary
+ * @reports: number of reports seen, for the scan summary
+ */
+struct scan_dev {
+	struct devtab_dev entry;
+	int8_t rssi;
+	uint32_t adv_hash;
+	uint16_t adv_len;
+	uint64_t last_ms;
+	int8_t best_rssi;
+	uint32_t reports;
+};
+
+static struct {
+	struct devtab_dev *bucket[SCAN_HASH_SIZE];
+	struct devtab tab;
+	struct scan_dedup dedup[CMD_MAX_ADAPTER];
+	uint32_t suppressed[CMD_MAX_ADAPTER];
+
+	struct scan_filter filter[CMD_MAX_ADAPTER];
+	bool filtering[CMD_MAX_ADAPTER];
+	bool offloaded[CMD_MAX_ADAPTER];
+	uint32_t filtered[CMD_MAX_ADAPTER];
+
+	struct advprog prog[CMD_MAX_ADAPTER];
+
+	bool summary[CMD_MAX_ADAPTER];
+	uint32_t dropped[CMD_MAX_ADAPTER];	/* left out of the summary */
+} scan = {
+	.tab = {
+		.bucket = scan.bucket,
+		.mask = SCAN_HASH_SIZE - 1,
+		.lru = { &scan.tab.lru, &scan.tab.lru },
+	},
+};
+
+static uint64_t scan_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t scan_hash(uint32_t hash, const uint8_t *data, uint16_t len)
+{
+	while (len--) {
+		hash ^= *data++;
+		hash *= FNV_PRIME;
+	}
+
+	return hash;
+}
+
+#define scan_dev_of(link) \
+	devtab_entry_of(link, struct scan_dev, entry.lru)
+
+static struct scan_dev *scan_insert(uint32_t key, uint8_t devId,
+				    const uint8_t *addr, uint8_t addr_type)
+{
+	struct scan_dev *dev;
+
+	if (scan.tab.count < SCAN_DEV_MAX) {
+		dev = calloc(1, sizeof(*dev));
+		if (!dev)
+			return NULL;
+	} else {
+		/* full: recycling the least recently reported device */
+		dev = devtab_entry_of(devtab_oldest(&scan.tab, NULL, NULL),
+				      struct scan_dev, entry);
+		if (scan.summary[dev->entry.devId])
+			scan.dropped[dev->entry.devId]++;
+		devtab_remove(&scan.tab, &dev->entry);
+		memset(dev, 0, sizeof(*dev));
+	}
+
+	devtab_insert(&scan.tab, &dev->entry, key, devId, addr, addr_type);
+
+	return dev;
+}
+
+static bool scan_filter_match(const struct scan_filter *filter, int8_t rssi,
+			      const uint8_t *eir, uint16_t eir_len)
+{
+	if (filter->rssi != SCAN_RSSI_NONE &&
+	    (rssi == SCAN_RSSI_NONE || rssi < filter->rssi))
+		return false;
+
+	if (filter->uuid_count &&
+	    !adv_has_uuid(eir, eir_len,
+			  (const uint8_t (*)[ADV_UUID128_LEN])filter->uuids,
+			  filter->uuid_count))
+		return false;
+
+	return true;
+}
+
+bool scan_report(uint8_t devId, const uint8_t *addr, uint8_t addr_type,
+		 int8_t rssi, const uint8_t *eir, uint16_t eir_len)
+{
+	const struct scan_dedup *cfg;
+	struct devtab_dev *entry;
+	struct scan_dev *dev;
+	uint32_t key, adv_hash;
+	uint64_t now;
+	bool report, fresh;
+
+	if (devId >= CMD_MAX_ADAPTER)
+		return true;
+
+	/* kernel without service discovery: filtering here */
+	if (scan.filtering[devId] && !scan.offloaded[devId] &&
+	    !scan_filter_match(&scan.filter[devId], rssi, eir, eir_len)) {
+		scan.filtered[devId]++;
+		return false;
+	}
+
+	if (scan.prog[devId].len &&
+	    !advprog_run(&scan.prog[devId], eir, eir_len)) {
+		scan.filtered[devId]++;
+		return false;
+	}
+
+	devreg_seen(devId, addr, addr_type, rssi, eir, eir_len);
+
+	if (!scan.dedup[devId].enabled && !scan.summary[devId])
+		return true;
+
+	cfg = &scan.dedup[devId];
+	key = devtab_key(devId, addr, addr_type);
+
+	entry = devtab_lookup(&scan.tab, key, devId, addr, addr_type);
+	fresh = !entry;
+	if (entry) {
+		dev = devtab_entry_of(entry, struct scan_dev, entry);
+		devtab_touch(&scan.tab, entry);
+	} else {
+		dev = scan_insert(key, devId, addr, addr_type);
+		if (!dev) {
+			/* out of memory: not filtering rather than losing */
+			if (scan.summary[devId])
+				scan.dropped[devId]++;
+			return true;
+		}
+		dev->best_rssi = rssi;
+	}
+
+	if (scan.summary[devId]) {
+		dev->reports++;
+		if (rssi != SCAN_RSSI_NONE &&
+		    (dev->best_rssi == SCAN_RSSI_NONE ||
+		     rssi > dev->best_rssi))
+			dev->best_rssi = rssi;
+	}
+
+	if (!cfg->enabled)
+		return true;
+
+	adv_hash = scan_hash(FNV_OFFSET, eir, eir_len);
+	now = scan_now_ms();
+
+	if (fresh) {
+		report = true;
+	} else if (dev->adv_hash != adv_hash || dev->adv_len != eir_len) {
+		report = true;
+	} else if (now - dev->last_ms < cfg->min_interval_ms) {
+		report = false;
+	} else {
+		report = cfg->rssi_delta &&
+			 abs(rssi - dev->rssi) >= cfg->rssi_delta;
+	}
+
+	if (!report) {
+		scan.suppressed[devId]++;
+		return false;
+	}
+
+	dev->rssi = rssi;
+	dev->adv_hash = adv_hash;
+	dev->adv_len = eir_len;
+	dev->last_ms = now;
+
+	return true;
+}
+
+void scan_flush(uint8_t devId)
+{
+	struct devtab_link *link, *next;
+
+	if (devId >= CMD_MAX_ADAPTER)
+		return;
+
+	for (link = scan.tab.lru.next; link != &scan.tab.lru; link = next) {
+		struct scan_dev *dev = scan_dev_of(link);
+
+		next = link->next;
+		if (dev->entry.devId != devId)
+			continue;
+		devtab_remove(&scan.tab, &dev->entry);
+		free(dev);
+	}
+
+	if (scan.suppressed[devId])
+		INFO("[%d] %u duplicate reports suppressed\n", devId,
+		     scan.suppressed[devId]);
+	if (scan.filtered[devId])
+		INFO("[%d] %u reports filtered out\n", devId,
+		     scan.filtered[devId]);
+	scan.suppressed[devId] = 0;
+	scan.filtered[devId] = 0;
+}
+
+uint8_t scan_set_filter(uint8_t devId, const struct scan_filter *filter)
+{
+	if (devId >= CMD_MAX_ADAPTER)
+		return BTLE_ERROR_INVALID_ARG;
+	if (!filter)
+		return BTLE_ERROR_NULL_ARG;
+	if (filter->uuid_count > SCAN_UUID_MAX)
+		return BTLE_ERROR_INVALID_ARG;
+
+	scan.filter[devId] = *filter;
+	scan.filtering[devId] = scan_filter_active(filter);
+	scan.offloaded[devId] = false;
+
+	if (scan.filtering[devId])
+		INFO("[%d] filter rssi(%d) uuids(%d)\n", devId, filter->rssi,
+		     filter->uuid_count);
+
+	return BTLE_SUCCESS;
+}
+
+uint8_t scan_set_program(uint8_t devId, const uint8_t *data,
+			 uint16_t data_len)
+{
+	uint8_t ret;
+
+	if (devId >= CMD_MAX_ADAPTER)
+		return BTLE_ERROR_INVALID_ARG;
+
+	if (!data_len) {
+		scan.prog[devId].len = 0;
+		INFO("[%d] program cleared\n", devId);
+		return BTLE_SUCCESS;
+	}
+
+	ret = advprog_load(data, data_len, &scan.prog[devId]);
+	if (!ret)
+		INFO("[%d] program loaded (%d instructions)\n", devId,
+		     scan.prog[devId].len);
+
+	return ret;
+}
+
+void scan_set_offloaded(uint8_t devId, bool offloaded)
+{
+	if (devId < CMD_MAX_ADAPTER)
+		scan.offloaded[devId] = offloaded;
+}
+
+uint8_t scan_set_dedup(uint8_t devId, const struct scan_dedup *cfg)
+{
+	if (devId >= CMD_MAX_ADAPTER)
+		return BTLE_ERROR_INVALID_ARG;
+	if (!cfg)
+		return BTLE_ERROR_NULL_ARG;
+
+	scan_flush(devId);
+	scan.dedup[devId] = *cfg;
+
+	INFO("[%d] dedup %s rssi delta(%d) min interval(%dms)\n", devId,
+	     cfg->enabled ? "on" : "off", cfg->rssi_delta,
+	     cfg->min_interval_ms);
+
+	return BTLE_SUCCESS;
+}
+
+uint8_t scan_set_summary(uint8_t devId, bool enabled)
+{
+	if (devId >= CMD_MAX_ADAPTER)
+		return BTLE_ERROR_INVALID_ARG;
+
+	scan.summary[devId] = enabled;
+	scan.dropped[devId] = 0;
+
+	return BTLE_SUCCESS;
+}
+
+uint8_t scan_summary(uint8_t devId, uint32_t *dropped,
+		     scan_summary_cb func, void *user_data)
+{
+	struct devtab_link *link;
+
+	if (devId >= CMD_MAX_ADAPTER)
+		return BTLE_ERROR_INVALID_ARG;
+	if (!func || !dropped)
+		return BTLE_ERROR_NULL_ARG;
+	if (!scan.summary[devId])
+		return BTLE_ERROR_INVALID_STATE;
+
+	scan.summary[devId] = false;
+	*dropped = scan.dropped[devId];
+	scan.dropped[devId] = 0;
+
+	for (link = scan.tab.lru.next; link != &scan.tab.lru;
+	     link = link->next) {
+		struct scan_dev *dev = scan_dev_of(link);
+
+		if (dev->entry.devId == devId)
+			func(dev->entry.addr, dev->entry.addr_type,
+			     dev->best_rssi, dev->reports, user_data);
+	}
+
+	return BTLE_SUCCESS;
+}
+
+void scan_close(void)
+{
+	uint8_t devId;
+
+	for (devId = 0; devId < CMD_MAX_ADAPTER; devId++) {
+		scan_flush(devId);
+		memset(&scan.dedup[devId], 0, sizeof(scan.dedup[devId]));
+		scan.filtering[devId] = false;
+		scan.offloaded[devId] = false;
+		scan.prog[devId].len = 0;
+		scan.summary[devId] = false;
+		scan.dropped[devId] = 0;
+	}
+}
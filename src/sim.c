@@ -0,0 +1,892 @@
+/*
+ *  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <endian.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "lib/bluetooth.h"
+#include "lib/hci.h"
+#include "lib/uuid.h"
+#include "lib/mgmt.h"
+#include "src/shared/util.h"
+#include "src/shared/mainloop.h"
+#include "src/shared/att.h"
+#include "src/shared/gatt-db.h"
+#include "src/shared/gatt-server.h"
+
+#define MODULE "sim"
+#include "btprint.h"
+
+#include "btle_error.h"
+#include "cmd.h"
+#include "stats.h"
+#include "backend.h"
+#include "sim.h"
+
+#define SIM_TICK_MS		5	/* advertising events resolution */
+#define SIM_ADV_DELAY_MS	10	/* random delay added to intervals */
+#define SIM_ADV_INTERVAL_MIN_MS	20
+#define SIM_SEED		1	/* reproducible runs */
+#define SIM_MANUFACTURER	0x05f1	/* Linux Foundation */
+#define SIM_SUPPORTED_SETTINGS	(MGMT_SETTING_POWERED | MGMT_SETTING_LE)
+#define SIM_NAME_LEN		9	/* "sim-" + 4 digits + '\0' */
+
+#define GAP_SVC_UUID		0x1800
+#define BATTERY_SVC_UUID	0x180f
+#define HEART_RATE_SVC_UUID	0x180d
+#define DEVICE_NAME_UUID	0x2a00
+#define BATTERY_LEVEL_UUID	0x2a19
+#define HEART_RATE_MEAS_UUID	0x2a37
+#define CCC_UUID		0x2902
+
+#define CCC_NOTIFY		0x0001
+
+enum sim_op_kind {
+	SIM_OP_RSP,		/* command completion */
+	SIM_OP_EVT,		/* mgmt event */
+	SIM_OP_RELEASE,		/* connection to free, out of its callbacks */
+};
+
+/*
+ * Deferred work: completions and events are delivered from the
+ * mainloop, as the kernel's are
+ */
+struct sim_op {
+	struct sim_op *next;
+	uint8_t kind;
+	uint8_t status;
+	uint16_t code;		/* opcode or event */
+	uint16_t index;
+	unsigned int id;
+	backend_rsp_cb cb;
+	void *user_data;
+	uint16_t len;
+	uint8_t param[0];
+};
+
+struct sim_conn;
+
+struct sim_periph {
+	uint16_t number;
+	uint64_t next_adv_ms;
+	struct sim_conn *conn;
+};
+
+struct sim_conn {
+	struct sim_periph *periph;
+	struct bt_att *att;
+	unsigned int disconn_id;
+	struct gatt_db *db;
+	struct bt_gatt_server *server;
+	uint16_t hrm_handle;
+	uint16_t hrm_ccc;
+	uint8_t heart_rate;
+	int timer;
+};
+
+static struct {
+	struct sim_config cfg;
+	struct sim_periph *periph;
+	unsigned int seed;
+
+	uint32_t settings;
+	bool registered;	/* events delivered */
+	uint8_t disc_type;	/* 0: not discovering */
+	int adv_timer;
+
+	struct sim_op *op_head;
+	struct sim_op *op_tail;
+	unsigned int op_id;
+	int op_timer;
+} sim = {
+	.cfg = {
+		.count = 1,
+		.adv_interval_ms = SIM_ADV_INTERVAL_MS,
+		.notify_interval_ms = SIM_NOTIFY_INTERVAL_MS,
+	},
+};
+
+static void sim_conn_free(struct sim_conn *conn);
+
+static void sim_addr(uint16_t number, bdaddr_t *addr)
+{
+	/* random static: two most significant bits set */
+	memset(addr, 0, sizeof(*addr));
+	addr->b[0] = number & 0xff;
+	addr->b[1] = number >> 8;
+	addr->b[5] = 0xc0;
+}
+
+static struct sim_periph *sim_periph_by_addr(const bdaddr_t *addr,
+					     uint8_t addr_type)
+{
+	uint16_t number = addr->b[0] | addr->b[1] << 8;
+	bdaddr_t expected;
+
+	if (addr_type != BDADDR_LE_RANDOM || number >= sim.cfg.count)
+		return NULL;
+
+	sim_addr(number, &expected);
+	if (bacmp(addr, &expected))
+		return NULL;
+
+	return &sim.periph[number];
+}
+
+static void sim_op_run(int id, void *user_data)
+{
+	struct sim_op *op = sim.op_head;
+
+	/* operations queued from now on wait for the next run */
+	mainloop_remove_timeout(id);
+	sim.op_timer = 0;
+	sim.op_head = NULL;
+	sim.op_tail = NULL;
+
+	while (op) {
+		struct sim_op *next = op->next;
+
+		switch (op->kind) {
+		case SIM_OP_RSP:
+			if (op->cb)
+				op->cb(op->status, op->len, op->param,
+				       op->user_data);
+			break;
+		case SIM_OP_EVT:
+			if (sim.registered)
+				cmd_mgmt_event(op->code, op->index, op->len,
+					       op->param);
+			break;
+		case SIM_OP_RELEASE:
+			sim_conn_free(op->user_data);
+			break;
+		}
+
+		free(op);
+		op = next;
+	}
+}
+
+static unsigned int sim_op_queue(uint8_t kind, uint16_t code, uint16_t index,
+				 uint8_t status, const void *param,
+				 uint16_t len, backend_rsp_cb cb,
+				 void *user_data)
+{
+	struct sim_op *op;
+
+	op = malloc(sizeof(*op) + len);
+	if (!op)
+		return 0;
+
+	if (!sim.op_timer) {
+		sim.op_timer = mainloop_add_timeout(1, sim_op_run, NULL, NULL);
+		if (sim.op_timer < 0) {
+			ERR("operation timer\n");
+			sim.op_timer = 0;
+			free(op);
+			return 0;
+		}
+	}
+
+	if (!++sim.op_id)
+		sim.op_id++;
+
+	op->next = NULL;
+	op->kind = kind;
+	op->status = status;
+	op->code = code;
+	op->index = index;
+	op->id = sim.op_id;
+	op->cb = cb;
+	op->user_data = user_data;
+	op->len = len;
+	if (len)
+		memcpy(op->param, param, len);
+
+	if (sim.op_tail)
+		sim.op_tail->next = op;
+	else
+		sim.op_head = op;
+	sim.op_tail = op;
+
+	return op->id;
+}
+
+static void sim_event(uint16_t event, const void *param, uint16_t len)
+{
+	if (!sim_op_queue(SIM_OP_EVT, event, SIM_INDEX, 0, param, len, NULL,
+			  NULL))
+		ERR("event 0x%04x dropped\n", event);
+}
+
+static void sim_advertise(struct sim_periph *periph)
+{
+	struct {
+		struct mgmt_ev_device_found ev;
+		uint8_t eir[HCI_MAX_AD_LENGTH];
+	} __attribute__((packed)) found;
+	uint8_t *eir = found.eir;
+	char name[SIM_NAME_LEN];
+	uint8_t name_len;
+
+	sim_addr(periph->number, &found.ev.addr.bdaddr);
+	found.ev.addr.type = BDADDR_LE_RANDOM;
+	found.ev.rssi = -40 - periph->number % 50 + rand_r(&sim.seed) % 7 - 3;
+	found.ev.flags = htole32(0);
+
+	/* flags: LE general discoverable, no BR/EDR */
+	*eir++ = 2;
+	*eir++ = 0x01;
+	*eir++ = 0x06;
+
+	/* complete list of 16 bits service UUIDs */
+	*eir++ = 5;
+	*eir++ = 0x03;
+	put_le16(HEART_RATE_SVC_UUID, eir);
+	put_le16(BATTERY_SVC_UUID, eir + 2);
+	eir += 4;
+
+	/* complete local name */
+	name_len = snprintf(name, sizeof(name), "sim-%04u", periph->number);
+	*eir++ = name_len + 1;
+	*eir++ = 0x09;
+	memcpy(eir, name, name_len);
+	eir += name_len;
+
+	found.ev.eir_len = htole16(eir - found.eir);
+
+	if (sim.registered)
+		cmd_mgmt_event(MGMT_EV_DEVICE_FOUND, SIM_INDEX,
+			       sizeof(found.ev) + (eir - found.eir), &found);
+}
+
+static void sim_adv_tick(int id, void *user_data)
+{
+	uint64_t now_ms = stats_now_us() / 1000;
+	struct sim_periph *periph;
+	uint16_t idx;
+
+	for (idx = 0; idx < sim.cfg.count; idx++) {
+		periph = &sim.periph[idx];
+		if (periph->conn || periph->next_adv_ms > now_ms)
+			continue;
+
+		sim_advertise(periph);
+
+		periph->next_adv_ms += sim.cfg.adv_interval_ms +
+				       rand_r(&sim.seed) %
+				       (SIM_ADV_DELAY_MS + 1);
+		/* late ticks do not catch up */
+		if (periph->next_adv_ms <= now_ms)
+			periph->next_adv_ms = now_ms +
+					      sim.cfg.adv_interval_ms;
+	}
+
+	mainloop_modify_timeout(id, SIM_TICK_MS);
+}
+
+static void sim_discovering(uint8_t type, uint8_t discovering)
+{
+	struct mgmt_ev_discovering ev;
+
+	ev.type = type;
+	ev.discovering = discovering;
+	sim_event(MGMT_EV_DISCOVERING, &ev, sizeof(ev));
+}
+
+/* MGMT_EV_DISCOVERING is up to the caller */
+static uint8_t sim_discovery_start(uint8_t type)
+{
+	uint64_t now_ms = stats_now_us() / 1000;
+	uint16_t idx;
+
+	if (!(sim.settings & MGMT_SETTING_POWERED))
+		return MGMT_STATUS_NOT_POWERED;
+	if (sim.disc_type)
+		return MGMT_STATUS_BUSY;
+	if (!type)
+		return MGMT_STATUS_INVALID_PARAMS;
+
+	sim.adv_timer = mainloop_add_timeout(SIM_TICK_MS, sim_adv_tick, NULL,
+					     NULL);
+	if (sim.adv_timer < 0) {
+		ERR("advertising timer\n");
+		sim.adv_timer = 0;
+		return MGMT_STATUS_FAILED;
+	}
+
+	/* first advertising events spread over an interval */
+	for (idx = 0; idx < sim.cfg.count; idx++)
+		sim.periph[idx].next_adv_ms = now_ms + rand_r(&sim.seed) %
+						       sim.cfg.adv_interval_ms;
+
+	sim.disc_type = type;
+
+	return MGMT_STATUS_SUCCESS;
+}
+
+static uint8_t sim_discovery_stop(void)
+{
+	if (!sim.disc_type)
+		return MGMT_STATUS_REJECTED;
+
+	mainloop_remove_timeout(sim.adv_timer);
+	sim.adv_timer = 0;
+	sim.disc_type = 0;
+
+	return MGMT_STATUS_SUCCESS;
+}
+
+static uint8_t sim_set_setting(uint32_t setting, const uint8_t *param,
+			       uint16_t len)
+{
+	if (len < 1 || param[0] > 1)
+		return MGMT_STATUS_INVALID_PARAMS;
+
+	if (!(setting & SIM_SUPPORTED_SETTINGS))
+		return MGMT_STATUS_NOT_SUPPORTED;
+
+	if (param[0]) {
+		sim.settings |= setting;
+	} else {
+		sim.settings &= ~setting;
+		if (sim.disc_type) {
+			sim_discovering(sim.disc_type, 0);
+			sim_discovery_stop();
+		}
+	}
+
+	return MGMT_STATUS_SUCCESS;
+}
+
+static void sim_adapter_addr(bdaddr_t *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->b[4] = 0x5a;
+	addr->b[5] = 0xc0;
+}
+
+static unsigned int sim_mgmt_send(uint16_t opcode, uint16_t index,
+				  uint16_t length, const void *param,
+				  backend_rsp_cb cb, void *user_data)
+{
+	const uint8_t *data = param;
+	struct mgmt_rp_read_info info;
+	uint8_t status = MGMT_STATUS_SUCCESS;
+	uint32_t settings;
+	uint8_t type = 0;
+	const void *rsp = NULL;
+	uint16_t rsp_len = 0;
+	unsigned int id;
+
+	if (index != SIM_INDEX) {
+		status = MGMT_STATUS_INVALID_INDEX;
+		goto done;
+	}
+
+	switch (opcode) {
+	case MGMT_OP_READ_INFO:
+		memset(&info, 0, sizeof(info));
+		sim_adapter_addr(&info.bdaddr);
+		info.version = 0x09;	/* 5.0 */
+		info.manufacturer = htole16(SIM_MANUFACTURER);
+		info.supported_settings = htole32(SIM_SUPPORTED_SETTINGS);
+		info.current_settings = htole32(sim.settings);
+		strcpy((char *)info.name, "btled simulator");
+		rsp = &info;
+		rsp_len = sizeof(info);
+		break;
+
+	case MGMT_OP_SET_POWERED:
+	case MGMT_OP_SET_LE:
+	case MGMT_OP_SET_BREDR:
+		status = sim_set_setting(opcode == MGMT_OP_SET_POWERED ?
+					 MGMT_SETTING_POWERED :
+					 opcode == MGMT_OP_SET_LE ?
+					 MGMT_SETTING_LE : MGMT_SETTING_BREDR,
+					 data, length);
+		settings = htole32(sim.settings);
+		rsp = &settings;
+		rsp_len = sizeof(settings);
+		break;
+
+	case MGMT_OP_START_DISCOVERY:
+	case MGMT_OP_STOP_DISCOVERY:
+		if (length < 1) {
+			status = MGMT_STATUS_INVALID_PARAMS;
+			break;
+		}
+		type = data[0];
+		status = (opcode == MGMT_OP_START_DISCOVERY) ?
+			 sim_discovery_start(type) : sim_discovery_stop();
+		rsp = &type;
+		rsp_len = sizeof(type);
+		break;
+
+	default:
+		/* service discovery included: RSSI/UUID filtered by cmd */
+		status = MGMT_STATUS_UNKNOWN_COMMAND;
+		break;
+	}
+
+done:
+	id = sim_op_queue(SIM_OP_RSP, opcode, index, status, rsp, rsp_len,
+			  cb, user_data);
+
+	/* the kernel completes the command first */
+	if (!status && (opcode == MGMT_OP_START_DISCOVERY ||
+			opcode == MGMT_OP_STOP_DISCOVERY))
+		sim_discovering(type, opcode == MGMT_OP_START_DISCOVERY);
+
+	return id;
+}
+
+static bool sim_mgmt_register(uint16_t event, uint16_t index)
+{
+	/* every event is delivered; only SIM_INDEX has any */
+	if (index == SIM_INDEX)
+		sim.registered = true;
+
+	return true;
+}
+
+static void sim_mgmt_unregister_index(uint16_t index)
+{
+	if (index == SIM_INDEX)
+		sim.registered = false;
+}
+
+static void sim_mgmt_cancel_index(uint16_t index)
+{
+	struct sim_op **link = &sim.op_head;
+	struct sim_op *op;
+
+	sim.op_tail = NULL;
+
+	while ((op = *link)) {
+		if (op->kind == SIM_OP_RSP && op->index == index) {
+			*link = op->next;
+			free(op);
+			continue;
+		}
+		sim.op_tail = op;
+		link = &op->next;
+	}
+}
+
+static int sim_devba(uint16_t index, bdaddr_t *ba)
+{
+	if (index != SIM_INDEX) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	sim_adapter_addr(ba);
+
+	return 0;
+}
+
+static void sim_read(struct gatt_db_attribute *attrib, unsigned int id,
+		     uint16_t offset, const uint8_t *value, uint16_t len)
+{
+	if (offset > len) {
+		gatt_db_attribute_read_result(attrib, id,
+					      BT_ATT_ERROR_INVALID_OFFSET,
+					      NULL, 0);
+		return;
+	}
+
+	gatt_db_attribute_read_result(attrib, id, 0, &value[offset],
+				      len - offset);
+}
+
+static void sim_name_read(struct gatt_db_attribute *attrib, unsigned int id,
+			  uint16_t offset, uint8_t opcode,
+			  struct bt_att *att, void *user_data)
+{
+	struct sim_conn *conn = user_data;
+	char name[SIM_NAME_LEN];
+	uint8_t len;
+
+	len = snprintf(name, sizeof(name), "sim-%04u", conn->periph->number);
+	sim_read(attrib, id, offset, (uint8_t *)name, len);
+}
+
+static void sim_battery_read(struct gatt_db_attribute *attrib,
+			     unsigned int id, uint16_t offset,
+			     uint8_t opcode, struct bt_att *att,
+			     void *user_data)
+{
+	struct sim_conn *conn = user_data;
+	uint8_t level = 100 - conn->periph->number % 50;
+
+	sim_read(attrib, id, offset, &level, sizeof(level));
+}
+
+static void sim_notify(int id, void *user_data)
+{
+	struct sim_conn *conn = user_data;
+	uint8_t value[2];
+
+	/* drifting between 50 and 180 bpm */
+	conn->heart_rate += rand_r(&sim.seed) % 3 - 1;
+	if (conn->heart_rate < 50)
+		conn->heart_rate = 50;
+	else if (conn->heart_rate > 180)
+		conn->heart_rate = 180;
+
+	value[0] = 0x00;	/* flags: 8 bits value */
+	value[1] = conn->heart_rate;
+	bt_gatt_server_send_notification(conn->server, conn->hrm_handle,
+					 value, sizeof(value));
+
+	mainloop_modify_timeout(id, sim.cfg.notify_interval_ms);
+}
+
+static void sim_ccc_read(struct gatt_db_attribute *attrib, unsigned int id,
+			 uint16_t offset, uint8_t opcode,
+			 struct bt_att *att, void *user_data)
+{
+	struct sim_conn *conn = user_data;
+	uint8_t value[2];
+
+	put_le16(conn->hrm_ccc, value);
+	sim_read(attrib, id, offset, value, sizeof(value));
+}
+
+static void sim_ccc_write(struct gatt_db_attribute *attrib, unsigned int id,
+			  uint16_t offset, const uint8_t *value, size_t len,
+			  uint8_t opcode, struct bt_att *att,
+			  void *user_data)
+{
+	struct sim_conn *conn = user_data;
+
+	if (offset) {
+		gatt_db_attribute_write_result(attrib, id,
+					       BT_ATT_ERROR_INVALID_OFFSET);
+		return;
+	}
+	if (len != 2) {
+		gatt_db_attribute_write_result(attrib, id,
+				BT_ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LEN);
+		return;
+	}
+
+	conn->hrm_ccc = get_le16(value);
+
+	if ((conn->hrm_ccc & CCC_NOTIFY) && !conn->timer &&
+	    sim.cfg.notify_interval_ms) {
+		conn->timer = mainloop_add_timeout(sim.cfg.notify_interval_ms,
+						   sim_notify, conn, NULL);
+		if (conn->timer < 0) {
+			ERR("notification timer\n");
+			conn->timer = 0;
+		}
+	} else if (!(conn->hrm_ccc & CCC_NOTIFY) && conn->timer) {
+		mainloop_remove_timeout(conn->timer);
+		conn->timer = 0;
+	}
+
+	gatt_db_attribute_write_result(attrib, id, 0);
+}
+
+static struct gatt_db_attribute *sim_add_service(struct gatt_db *db,
+						 uint16_t uuid16,
+						 uint16_t num_handles)
+{
+	bt_uuid_t uuid;
+
+	bt_uuid16_create(&uuid, uuid16);
+	return gatt_db_add_service(db, &uuid, true, num_handles);
+}
+
+static struct gatt_db_attribute *sim_add_char(struct gatt_db_attribute *svc,
+					      uint16_t uuid16,
+					      uint32_t permissions,
+					      uint8_t properties,
+					      gatt_db_read_t read_func,
+					      struct sim_conn *conn)
+{
+	bt_uuid_t uuid;
+
+	if (!svc)
+		return NULL;
+
+	bt_uuid16_create(&uuid, uuid16);
+	return gatt_db_service_add_characteristic(svc, &uuid, permissions,
+						  properties, read_func, NULL,
+						  conn);
+}
+
+static struct gatt_db *sim_db_new(struct sim_conn *conn)
+{
+	struct gatt_db *db;
+	struct gatt_db_attribute *gap, *bas, *hrs, *hrm, *ccc = NULL;
+	bt_uuid_t uuid;
+
+	db = gatt_db_new();
+	if (!db)
+		return NULL;
+
+	/* service declaration, then 2 handles per characteristic */
+	gap = sim_add_service(db, GAP_SVC_UUID, 3);
+	bas = sim_add_service(db, BATTERY_SVC_UUID, 3);
+	hrs = sim_add_service(db, HEART_RATE_SVC_UUID, 4);
+
+	hrm = sim_add_char(hrs, HEART_RATE_MEAS_UUID, 0,
+			   BT_GATT_CHRC_PROP_NOTIFY, NULL, conn);
+	if (hrs && hrm) {
+		bt_uuid16_create(&uuid, CCC_UUID);
+		ccc = gatt_db_service_add_descriptor(hrs, &uuid,
+						     BT_ATT_PERM_READ |
+						     BT_ATT_PERM_WRITE,
+						     sim_ccc_read,
+						     sim_ccc_write, conn);
+	}
+
+	if (!sim_add_char(gap, DEVICE_NAME_UUID, BT_ATT_PERM_READ,
+			  BT_GATT_CHRC_PROP_READ, sim_name_read, conn) ||
+	    !sim_add_char(bas, BATTERY_LEVEL_UUID, BT_ATT_PERM_READ,
+			  BT_GATT_CHRC_PROP_READ, sim_battery_read, conn) ||
+	    !ccc) {
+		gatt_db_unref(db);
+		return NULL;
+	}
+
+	conn->hrm_handle = gatt_db_attribute_get_handle(hrm);
+
+	gatt_db_service_set_active(gap, true);
+	gatt_db_service_set_active(bas, true);
+	gatt_db_service_set_active(hrs, true);
+
+	return db;
+}
+
+static void sim_disconnected(int err, void *user_data)
+{
+	struct sim_conn *conn = user_data;
+	struct sim_periph *periph = conn->periph;
+	struct mgmt_ev_device_disconnected ev;
+
+	INFO("sim-%04u disconnected\n", periph->number);
+
+	/* advertising again */
+	periph->conn = NULL;
+	periph->next_adv_ms = stats_now_us() / 1000;
+
+	sim_addr(periph->number, &ev.addr.bdaddr);
+	ev.addr.type = BDADDR_LE_RANDOM;
+	ev.reason = MGMT_DEV_DISCONN_LOCAL_HOST;
+	sim_event(MGMT_EV_DEVICE_DISCONNECTED, &ev, sizeof(ev));
+
+	if (conn->timer) {
+		mainloop_remove_timeout(conn->timer);
+		conn->timer = 0;
+	}
+
+	/* bt_att is still running this callback */
+	if (!sim_op_queue(SIM_OP_RELEASE, 0, SIM_INDEX, 0, NULL, 0, NULL,
+			  conn))
+		ERR("sim-%04u not released\n", periph->number);
+}
+
+static void sim_conn_free(struct sim_conn *conn)
+{
+	if (conn->timer)
+		mainloop_remove_timeout(conn->timer);
+
+	bt_gatt_server_unref(conn->server);
+	gatt_db_unref(conn->db);
+
+	if (conn->disconn_id)
+		bt_att_unregister_disconnect(conn->att, conn->disconn_id);
+	bt_att_unref(conn->att);
+
+	if (conn->periph->conn == conn)
+		conn->periph->conn = NULL;
+
+	free(conn);
+}
+
+static struct sim_conn *sim_conn_new(struct sim_periph *periph, int fd)
+{
+	struct sim_conn *conn;
+
+	conn = new0(struct sim_conn, 1);
+	if (!conn)
+		return NULL;
+
+	conn->periph = periph;
+	conn->heart_rate = 60 + periph->number % 40;
+
+	conn->att = bt_att_new(fd, false);
+	if (!conn->att) {
+		free(conn);
+		return NULL;
+	}
+	bt_att_set_close_on_unref(conn->att, true);
+
+	conn->disconn_id = bt_att_register_disconnect(conn->att,
+						      sim_disconnected, conn,
+						      NULL);
+	conn->db = sim_db_new(conn);
+	if (conn->db)
+		conn->server = bt_gatt_server_new(conn->db, conn->att,
+						  BT_ATT_MAX_LE_MTU);
+
+	if (!conn->disconn_id || !conn->server) {
+		sim_conn_free(conn);
+		return NULL;
+	}
+
+	periph->conn = conn;
+
+	return conn;
+}
+
+static int sim_att_connect(uint16_t index, const bdaddr_t *dst,
+			   uint8_t dst_type, int sec)
+{
+	struct mgmt_ev_device_connected ev;
+	struct sim_periph *periph;
+	int fds[2];
+
+	if (index != SIM_INDEX || !(sim.settings & MGMT_SETTING_POWERED)) {
+		errno = ENETDOWN;
+		return -1;
+	}
+
+	periph = sim_periph_by_addr(dst, dst_type);
+	if (!periph) {
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+	if (periph->conn) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	/* ATT bearer: the peripheral serves the other end */
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0)
+		return -1;
+
+	if (!sim_conn_new(periph, fds[1])) {
+		close(fds[0]);
+		close(fds[1]);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	INFO("sim-%04u connected\n", periph->number);
+
+	bacpy(&ev.addr.bdaddr, dst);
+	ev.addr.type = dst_type;
+	ev.flags = htole32(0);
+	ev.eir_len = htole16(0);
+	sim_event(MGMT_EV_DEVICE_CONNECTED, &ev, sizeof(ev));
+
+	return fds[0];
+}
+
+static uint8_t sim_init(void)
+{
+	uint16_t idx;
+
+	sim.periph = calloc(sim.cfg.count, sizeof(*sim.periph));
+	if (!sim.periph)
+		return BTLE_ERROR_MEMORY;
+
+	for (idx = 0; idx < sim.cfg.count; idx++)
+		sim.periph[idx].number = idx;
+
+	sim.seed = SIM_SEED;
+	sim.settings = MGMT_SETTING_LE;
+
+	INFO("%u peripherals, advertising every %u ms, notifying every %u ms\n",
+	     sim.cfg.count, sim.cfg.adv_interval_ms,
+	     sim.cfg.notify_interval_ms);
+
+	return BTLE_SUCCESS;
+}
+
+static void sim_close(void)
+{
+	struct sim_op *op;
+	uint16_t idx;
+
+	if (sim.adv_timer)
+		mainloop_remove_timeout(sim.adv_timer);
+	sim.adv_timer = 0;
+	sim.disc_type = 0;
+
+	/* connections being released are in the queue */
+	while ((op = sim.op_head)) {
+		sim.op_head = op->next;
+		if (op->kind == SIM_OP_RELEASE)
+			sim_conn_free(op->user_data);
+		free(op);
+	}
+	sim.op_tail = NULL;
+	if (sim.op_timer)
+		mainloop_remove_timeout(sim.op_timer);
+	sim.op_timer = 0;
+
+	for (idx = 0; idx < sim.cfg.count && sim.periph; idx++) {
+		if (sim.periph[idx].conn)
+			sim_conn_free(sim.periph[idx].conn);
+	}
+
+	free(sim.periph);
+	sim.periph = NULL;
+	sim.registered = false;
+}
+
+const struct backend_ops sim_backend = {
+	.name = "sim",
+	.init = sim_init,
+	.close = sim_close,
+	.mgmt_register = sim_mgmt_register,
+	.mgmt_unregister_index = sim_mgmt_unregister_index,
+	.mgmt_cancel_index = sim_mgmt_cancel_index,
+	.mgmt_send = sim_mgmt_send,
+	.devba = sim_devba,
+	.att_connect = sim_att_connect,
+};
+
+uint8_t sim_configure(const struct sim_config *cfg)
+{
+	if (!cfg)
+		return BTLE_ERROR_NULL_ARG;
+
+	if (!cfg->count || cfg->adv_interval_ms < SIM_ADV_INTERVAL_MIN_MS)
+		return BTLE_ERROR_INVALID_ARG;
+
+	sim.cfg = *cfg;
+
+	return BTLE_SUCCESS;
+}
@@ -0,0 +1,113 @@
+/*
+ *  Copyright (C) 2018  Jonathan Gelie <contact@jonathangelie.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "btle_error.h"
+#include "cmd.h"
+#include "stats.h"
+
+static struct stats_entry stats_cmds[CMD_MAX];
+static struct stats_entry stats_evts[EVENT_MAX];
+
+uint64_t stats_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void stats_hist_add(uint32_t *hist, uint64_t us)
+{
+	uint8_t idx = 0;
+
+	if (us)
+		idx = 64 - __builtin_clzll(us);
+	if (idx >= STATS_HIST_BUCKETS)
+		idx = STATS_HIST_BUCKETS - 1;
+
+	hist[idx]++;
+}
+
+void stats_cmd(uint8_t cmd, uint8_t status, uint16_t bytes_in,
+	       uint16_t bytes_out, uint64_t t_rx, uint64_t t_backend)
+{
+	struct stats_entry *entry;
+	uint64_t now;
+
+	if (cmd >= CMD_MAX)
+		return;
+
+	entry = &stats_cmds[cmd];
+	now = stats_now_us();
+
+	entry->count++;
+	if (status)
+		entry->errors++;
+	entry->bytes_in += bytes_in;
+	entry->bytes_out += bytes_out;
+
+	stats_hist_add(entry->lat, now - t_rx);
+	if (t_backend)
+		stats_hist_add(entry->rtt, now - t_backend);
+}
+
+void stats_event(uint8_t evt, uint8_t status, uint16_t bytes_out)
+{
+	struct stats_entry *entry;
+
+	if (evt >= EVENT_MAX)
+		return;
+
+	entry = &stats_evts[evt];
+
+	entry->count++;
+	if (status)
+		entry->errors++;
+	entry->bytes_out += bytes_out;
+}
+
+const struct stats_entry *stats_get(enum stats_kind kind, uint8_t index)
+{
+	if (index >= stats_count(kind))
+		return NULL;
+
+	return (kind == STATS_CMD) ? &stats_cmds[index] : &stats_evts[index];
+}
+
+uint8_t stats_count(enum stats_kind kind)
+{
+	switch (kind) {
+	case STATS_CMD:
+		return CMD_MAX;
+	case STATS_EVT:
+		return EVENT_MAX;
+	default:
+		return 0;
+	}
+}
+
+void stats_reset(enum stats_kind kind)
+{
+	if (kind == STATS_CMD)
+		memset(stats_cmds, 0, sizeof(stats_cmds));
+	else if (kind == STATS_EVT)
+		memset(stats_evts, 0, sizeof(stats_evts));
+}